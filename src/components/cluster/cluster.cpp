@@ -4,6 +4,9 @@
 #include <iostream>
 #include <fstream>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
 
 namespace Hill {
     namespace Cluster {
@@ -21,15 +24,28 @@ namespace Hill {
                 }
             }
 
-            auto buf = new RangeInfo[num_infos + 1];
-            for (size_t i = 0; i < num_infos; i++) {
-                buf[i] = infos[i];
+            RangeInfo info;
+            info.nodes[0] = node_id;
+            info.is_mem[0] = false;
+            info.start = s;
+            insert_at(num_infos, info);
+        }
+
+        auto RangeGroup::insert_at(size_t pos, const RangeInfo &info) -> void {
+            // thousands of ranges are added one by one
+            if (num_infos == capacity) {
+                capacity = std::max(capacity * 2, size_t(8));
+                auto buf = new RangeInfo[capacity];
+                for (size_t i = 0; i < num_infos; i++) {
+                    buf[i] = std::move(infos[i]);
+                }
+                infos.reset(buf);
             }
 
-            infos.reset(buf);
-            infos[num_infos].nodes[0] = node_id;
-            infos[num_infos].is_mem[0] = false;
-            infos[num_infos].start = s;
+            for (auto i = num_infos; i > pos; i--) {
+                infos[i] = std::move(infos[i - 1]);
+            }
+            infos[pos] = info;
             ++num_infos;
         }
 
@@ -71,10 +87,14 @@ namespace Hill {
         /*
          * The protocol buffer if in following format
          * -------  Fixed Field  -------
-         * 8B             |    node_num
-         * sizeof(nodes)  |    nodes
-         * 8B             |    num_infos
-         * ------- Dynamic Field -------
+         * 8B                 |    version
+         * 8B                 |    node_num
+         * sizeof(nodes)      |    nodes
+         * sizeof(migration)  |    migration
+         * ------- Group Field -------
+         * 8B                 |    num_infos
+         * num_infos of
+         * 8B             |  range version
          * 8B             |  string size
          * start.size()   |  string
          * sizeof(is_mem) |  is_mem
@@ -82,12 +102,13 @@ namespace Hill {
          */
         auto ClusterMeta::total_size() const noexcept -> size_t {
             // node_num + nodes
-            auto total_size = sizeof(cluster) + sizeof(version);
-            // num_infos
-            total_size += sizeof(group.num_infos);
-            // dynamic field
+            return sizeof(cluster) + sizeof(version) + sizeof(migration) + group_size();
+        }
+
+        auto ClusterMeta::group_size() const noexcept -> size_t {
+            auto total_size = sizeof(group.num_infos);
             for (size_t i = 0; i < group.num_infos; i++) {
-                total_size += sizeof(version);
+                total_size += sizeof(group.infos[i].version);
                 total_size += sizeof(uint64_t);
                 total_size += group.infos[i].start.size();
                 total_size += sizeof(group.infos[i].is_mem);
@@ -107,6 +128,16 @@ namespace Hill {
             offset += sizeof(cluster.node_num);
             memcpy(buf + offset, &cluster.nodes, sizeof(cluster.nodes));
             offset += sizeof(cluster.nodes);
+            memcpy(buf + offset, &migration, sizeof(migration));
+            offset += sizeof(migration);
+            serialize_group(buf + offset);
+
+            return std::unique_ptr<byte_t[]>(buf);
+            // return buf;
+        }
+
+        auto ClusterMeta::serialize_group(byte_t *buf) const noexcept -> size_t {
+            auto offset = 0UL;
             memcpy(buf + offset, &group.num_infos, sizeof(group.num_infos));
             offset += sizeof(group.num_infos);
             for (size_t i = 0; i < group.num_infos; i++) {
@@ -126,9 +157,7 @@ namespace Hill {
                 memcpy(buf + offset, group.infos[i].nodes, sizeof(group.infos[i].nodes));
                 offset += sizeof(group.infos[i].nodes);
             }
-
-            return std::unique_ptr<byte_t[]>(buf);
-            // return buf;
+            return offset;
         }
 
         auto ClusterMeta::deserialize(const byte_t *buf) -> void {
@@ -139,54 +168,364 @@ namespace Hill {
             offset += sizeof(cluster.node_num);
             memcpy(&cluster.nodes, buf + offset, sizeof(cluster.nodes));
             offset += sizeof(cluster.nodes);
-            memcpy(&group.num_infos, buf + offset, sizeof(group.num_infos));
-            offset += sizeof(group.num_infos);
-            auto infos = new RangeInfo[group.num_infos];
-            for (size_t i = 0; i < group.num_infos; i++) {
-                memcpy(&infos[i].version, buf + offset, sizeof(infos[i].version));
-                buf += sizeof(infos[i].version);
-                auto tmp = 0ULL;
-                memcpy(&tmp, buf + offset, sizeof(tmp));
-                offset += sizeof(tmp);
+            memcpy(&migration, buf + offset, sizeof(migration));
+            offset += sizeof(migration);
+            // buf is trusted to be whole
+            deserialize_group(buf + offset, SIZE_MAX - offset, group);
+
+            std::scoped_lock l(lock);
+            publish_routes();
+        }
+
+        auto ClusterMeta::deserialize_group(const byte_t *buf, size_t size, RangeGroup &group) -> bool {
+            auto offset = 0UL;
+            auto take = [&](void *dst, size_t n) {
+                if (size - offset < n) {
+                    return false;
+                }
+                memcpy(dst, buf + offset, n);
+                offset += n;
+                return true;
+            };
+
+            size_t num_infos = 0;
+            if (!take(&num_infos, sizeof(num_infos))) {
+                return false;
+            }
+            // each range takes at least its fixed fields
+            constexpr auto fixed = sizeof(RangeInfo::version) + sizeof(uint64_t) + sizeof(RangeInfo::is_mem) +
+                sizeof(RangeInfo::nodes);
+            if (num_infos > (size - offset) / fixed) {
+                return false;
+            }
+
+            std::unique_ptr<RangeInfo[]> infos(new RangeInfo[num_infos]);
+            for (size_t i = 0; i < num_infos; i++) {
+                uint64_t tmp = 0;
+                if (!take(&infos[i].version, sizeof(infos[i].version)) || !take(&tmp, sizeof(tmp)) ||
+                    size - offset < tmp) {
+                    return false;
+                }
                 infos[i].start.assign(reinterpret_cast<const char *>(buf + offset), tmp);
                 offset += tmp;
-                memcpy(infos[i].is_mem, buf + offset, sizeof(infos[i].is_mem));
-                offset += sizeof(infos[i].is_mem);
-                memcpy(infos[i].nodes, buf + offset, sizeof(infos[i].nodes));
-                offset += sizeof(infos[i].nodes);
+                if (!take(infos[i].is_mem, sizeof(infos[i].is_mem)) || !take(infos[i].nodes, sizeof(infos[i].nodes))) {
+                    return false;
+                }
+            }
+            group.infos = std::move(infos);
+            group.num_infos = group.capacity = num_infos;
+            return true;
+        }
+
+        auto ClusterMeta::range_version(const RangeGroup &group) noexcept -> uint64_t {
+            uint64_t ret = 0;
+            for (size_t i = 0; i < group.num_infos; i++) {
+                ret = std::max(ret, group.infos[i].version);
             }
-            group.infos.reset(infos);
+            return ret;
         }
 
         auto ClusterMeta::update(const ClusterMeta &newer) -> void {
             {
                 std::scoped_lock l(lock);
-                if (version >= newer.version) {
-                    return;
-                } else {
-                    version = newer.version;
+                /*
+                 * Every entry carries its own version, so a meta is merged entry by entry. A node bumps the
+                 * meta version of its own heartbeats, which says nothing of the entries of others.
+                 */
+                version = std::max(version, newer.version);
+            }
+            merge_nodes(newer.cluster.nodes, Constants::uMAX_NODE);
+            merge_migration(newer.migration);
+            merge_group(newer.group);
+        }
+
+        auto ClusterMeta::merge_nodes(const NodeInfo *infos, size_t num) -> bool {
+            std::scoped_lock l(lock);
+            auto changed = false;
+            for (size_t i = 0; i < num; i++) {
+                // the entry of a node never heard of has node_id 0
+                auto id = size_t(infos[i].node_id);
+                if (id == 0 || id >= Constants::uMAX_NODE) {
+                    continue;
+                }
+
+                if (cluster.nodes[id].version < infos[i].version) {
+                    cluster.nodes[id] = infos[i];
+                    changed = true;
                 }
-                for (size_t i = 0; i < Constants::uMAX_NODE; i++) {
-                    if (cluster.nodes[i].version < newer.cluster.nodes[i].version) {
-                        cluster.nodes[i] = newer.cluster.nodes[i];
+            }
+            return changed;
+        }
+
+        auto ClusterMeta::merge_migration(const MigrationOrder &newer) -> bool {
+            std::scoped_lock l(lock);
+            if (newer.id > migration.id || (newer.id == migration.id && newer.done && !migration.done)) {
+                migration = newer;
+                return true;
+            }
+            return false;
+        }
+
+        auto ClusterMeta::merge_group(const RangeGroup &newer) -> bool {
+            std::scoped_lock l(lock);
+            auto same_layout = group.num_infos == newer.num_infos;
+            for (size_t i = 0; same_layout && i < group.num_infos; i++) {
+                same_layout = group.infos[i].start == newer.infos[i].start;
+            }
+
+            auto changed = false;
+            if (!same_layout) {
+                // ranges are split, the side with the later split has the current layout
+                if (range_version(newer) > range_version(group)) {
+                    auto infos = new RangeInfo[newer.num_infos];
+                    for (size_t i = 0; i < newer.num_infos; i++) {
+                        infos[i] = newer.infos[i];
                     }
+                    group.infos.reset(infos);
+                    group.num_infos = group.capacity = newer.num_infos;
+                    changed = true;
                 }
+            } else {
+                for (size_t i = 0; i < newer.num_infos; i++) {
+                    if (group.infos[i].version < newer.infos[i].version) {
+                        group.infos[i].version = newer.infos[i].version;
+                        memcpy(group.infos[i].nodes, newer.infos[i].nodes, sizeof(group.infos[i].nodes));
+                        memcpy(group.infos[i].is_mem, newer.infos[i].is_mem, sizeof(group.infos[i].is_mem));
+                        changed = true;
+                    }
+                }
+            }
 
-                /*
-                 * This update is not always correct because range group may change, e.g., more partitions are
-                 * created. But currently I don't handle this because for experiment, range group is fixed
-                 *
-                 * To fully update a range group, we can make use RPC.
-                 */
-                for (size_t i = 0; i < newer.group.num_infos; i++) {
-                    // order of RangeInfo never changes in a range group
-                    if (group.infos[i].version < newer.group.infos[i].version) {
-                        group.infos[i].version = newer.group.infos[i].version;
-                        memcpy(group.infos[i].nodes, newer.group.infos[i].nodes, sizeof(group.infos[i].nodes));
-                        memcpy(group.infos[i].is_mem, newer.group.infos[i].is_mem, sizeof(group.infos[i].is_mem));
+            if (changed) {
+                publish_routes();
+            }
+            return changed;
+        }
+
+        auto ClusterMeta::merge_heartbeat(const Heartbeat &beat) -> bool {
+            if (beat.node_id <= 0 || size_t(beat.node_id) >= Constants::uMAX_NODE) {
+                return false;
+            }
+
+            std::scoped_lock l(lock);
+            auto &node = cluster.nodes[beat.node_id];
+            if (node.available_pm == beat.available_pm && node.cpu_usage == beat.cpu_usage) {
+                return false;
+            }
+            node.available_pm = beat.available_pm;
+            node.cpu_usage = beat.cpu_usage;
+            ++node.version;
+            ++version;
+            return true;
+        }
+
+        auto ClusterMeta::apply(const MessageHeader &header, const byte_t *body) -> bool {
+            switch (header.type) {
+            case Enums::MessageType::Snapshot:
+                if (header.size < sizeof(version) + sizeof(cluster) + sizeof(migration)) {
+                    return false;
+                }
+                deserialize(body);
+                return true;
+            case Enums::MessageType::Nodes: {
+                if (header.size % sizeof(NodeInfo) != 0) {
+                    return false;
+                }
+                // body may not be aligned for NodeInfo
+                std::vector<NodeInfo> infos(header.size / sizeof(NodeInfo));
+                memcpy(infos.data(), body, header.size);
+                merge_nodes(infos.data(), infos.size());
+                return true;
+            }
+            case Enums::MessageType::Ranges: {
+                RangeGroup newer;
+                if (!deserialize_group(body, header.size, newer)) {
+                    return false;
+                }
+                merge_group(newer);
+                return true;
+            }
+            case Enums::MessageType::Migration: {
+                if (header.size != sizeof(MigrationOrder)) {
+                    return false;
+                }
+                MigrationOrder newer;
+                memcpy(&newer, body, sizeof(newer));
+                merge_migration(newer);
+                return true;
+            }
+            default:
+                return false;
+            }
+        }
+
+        auto send_message(int socket, Enums::MessageType type, const void *body, size_t size) noexcept -> bool {
+            MessageHeader header{type, size};
+            iovec parts[2] = {{&header, sizeof(header)}, {const_cast<void *>(body), size}};
+            msghdr msg{};
+            msg.msg_iov = parts;
+            msg.msg_iovlen = size == 0 ? 1 : 2;
+            // header and body go in one call unless the socket buffer is full
+            size_t sent = 0, total = sizeof(header) + size;
+            while (sent < total) {
+                auto ret = sendmsg(socket, &msg, MSG_NOSIGNAL);
+                if (ret <= 0) {
+                    return false;
+                }
+                sent += ret;
+                for (size_t r = ret; r != 0;) {
+                    auto n = std::min(r, msg.msg_iov->iov_len);
+                    msg.msg_iov->iov_base = reinterpret_cast<byte_t *>(msg.msg_iov->iov_base) + n;
+                    msg.msg_iov->iov_len -= n;
+                    r -= n;
+                    if (msg.msg_iov->iov_len == 0 && msg.msg_iovlen > 1) {
+                        ++msg.msg_iov;
+                        --msg.msg_iovlen;
                     }
                 }
             }
+            return true;
+        }
+
+        auto recv_message(int socket, MessageHeader &header, std::vector<byte_t> &body) noexcept -> bool {
+            // recv_all spins on a closed socket
+            auto read_all = [socket](void *buf, size_t count) {
+                for (size_t got = 0; got < count;) {
+                    auto ret = read(socket, reinterpret_cast<byte_t *>(buf) + got, count - got);
+                    if (ret <= 0) {
+                        return false;
+                    }
+                    got += ret;
+                }
+                return true;
+            };
+
+            if (!read_all(&header, sizeof(header)) || header.size > Constants::uMAX_MESSAGE_SIZE) {
+                return false;
+            }
+            body.resize(header.size);
+            return read_all(body.data(), header.size);
+        }
+
+        auto ClusterMeta::split_range(const std::string &high, const std::string &at, int node) -> bool {
+            std::scoped_lock l(lock);
+            size_t pos = 0;
+            auto latest = range_version(group);
+
+            // the range of at is the first one starting after it, as in filter_node
+            while (pos < group.num_infos && !(group.infos[pos].start > at)) {
+                ++pos;
+            }
+            if (pos == group.num_infos || group.infos[pos].start != high) {
+                return false;
+            }
+
+            auto lower = group.infos[pos];
+            lower.start = at;
+            lower.version = latest + 1;
+            group.insert_at(pos, lower);
+
+            auto &upper = group.infos[pos + 1];
+            upper.nodes[0] = node;
+            upper.is_mem[0] = false;
+            upper.nodes[node] = 0;
+            upper.version = latest + 1;
+
+            ++version;
+            publish_routes();
+            return true;
+        }
+
+        auto ClusterMeta::fail_node(int node) -> size_t {
+            std::scoped_lock l(lock);
+            auto &info = cluster.nodes[node];
+            info.is_active = false;
+            ++info.version;
+            ++version;
+
+            size_t moved = 0;
+            auto latest = range_version(group);
+            for (size_t i = 0; i < group.num_infos; i++) {
+                auto &range = group.infos[i];
+                if (range.nodes[0] != node) {
+                    continue;
+                }
+
+                // a backup at slot b is node b, see RangeGroup::append_cpu
+                for (size_t b = 1; b < Constants::uMAX_NODE; b++) {
+                    if (range.nodes[b] == 0 || range.is_mem[b] || int(b) == node || !cluster.nodes[b].is_active) {
+                        continue;
+                    }
+                    range.nodes[0] = b;
+                    range.is_mem[0] = false;
+                    range.nodes[b] = 0;
+                    range.version = latest + 1;
+                    ++moved;
+                    break;
+                }
+            }
+
+            if (moved != 0) {
+                publish_routes();
+            }
+            return moved;
+        }
+
+        auto ClusterMeta::publish_routes() -> void {
+            std::shared_ptr<const RouteTable> table = RouteTable::make_route_table(group, version);
+            std::atomic_store_explicit(&routes, std::move(table), std::memory_order_release);
+        }
+
+        auto RouteTable::make_route_table(const RangeGroup &group, uint64_t version) -> std::unique_ptr<RouteTable> {
+            auto ret = std::make_unique<RouteTable>();
+            ret->version = version;
+            for (size_t i = 0; i < group.num_infos; i++) {
+                const auto &info = group.infos[i];
+                // a start not greater than an earlier one is never the first greater than a key
+                if (ret->bounds.empty() || info.start > ret->bounds.back()) {
+                    ret->bounds.push_back(info.start);
+                    ret->nodes.push_back(info.nodes[0]);
+                    ret->ranges.push_back(i);
+
+                    // memory nodes only lend memory to the main server
+                    uint64_t backups = 0;
+                    for (size_t n = 1; n < Constants::uMAX_NODE; n++) {
+                        if (info.nodes[n] != 0 && !info.is_mem[n] && info.nodes[n] != info.nodes[0]) {
+                            backups |= 1UL << info.nodes[n];
+                        }
+                    }
+                    ret->backups.push_back(backups);
+                }
+            }
+
+            const auto &bounds = ret->bounds;
+            if (!bounds.empty()) {
+                // bounds are sorted, the first and the last share what all of them share
+                const auto &first = bounds.front(), &last = bounds.back();
+                auto shared = std::mismatch(first.begin(), first.begin() + std::min(first.size(), last.size()),
+                                            last.begin()).first - first.begin();
+                ret->shared = first.substr(0, shared);
+            }
+
+            ret->slots.resize(Constants::uROUTE_RADIX + 1);
+            std::string probe = ret->shared + std::string(Constants::uROUTE_RADIX_BYTES, '\0');
+            size_t b = 0;
+            for (size_t r = 0; r < Constants::uROUTE_RADIX; r++) {
+                for (size_t i = 0; i < Constants::uROUTE_RADIX_BYTES; i++) {
+                    probe[ret->shared.size() + i] = char(r >> (8 * (Constants::uROUTE_RADIX_BYTES - 1 - i)));
+                }
+                while (b < bounds.size() && bounds[b] < probe) {
+                    ++b;
+                }
+                ret->slots[r] = b;
+            }
+            ret->slots[Constants::uROUTE_RADIX] = bounds.size();
+            return ret;
+        }
+
+        auto RouteTable::locate(std::string_view key) const noexcept -> int {
+            auto i = position(key);
+            return i == bounds.size() ? -1 : ranges[i];
         }
 
         auto ClusterMeta::dump() const noexcept -> void {
@@ -206,6 +545,10 @@ namespace Hill {
                 std::cout << "-->> socket port: " << cluster.nodes[i].port << "\n";
                 std::cout << "-->> erpc port: " << cluster.nodes[i].erpc_port << "\n";
             }
+            if (migration.id != 0) {
+                std::cout << ">> migration " << migration.id << ": node " << int(migration.source) << " to node "
+                          << int(migration.target) << (migration.done ? ", done\n" : "\n");
+            }
             std::cout << ">> range group: \n";
             for (size_t j = 0; j < group.num_infos; j++) {
                 std::cout << "-->> range[" << j << "]: " << group.infos[j].start << "\n";
@@ -239,6 +582,8 @@ namespace Hill {
             rpc_uri = addr.to_string() + ":" + std::to_string(erpc_port);
             monitor_addr = IPV4Addr::make_ipv4_addr(ConfigReader::read_monitor_addr(content).value()).value();
             monitor_port = ConfigReader::read_monitor_port(content).value();
+            heartbeat_interval = std::chrono::milliseconds(
+                ConfigReader::read_heartbeat_interval(content).value_or(Constants::tHEARTBEAT_INTERVAL.count()));
 
             return true;
         }
@@ -261,36 +606,34 @@ namespace Hill {
 #if defined (__HILL__DEBUG) || defined (__HILL_INFO__)
                 std::cout << ">> Monitor connected\n";
 #endif
-                auto total = 0UL;
-#ifdef __HILL_DEBUG__
-                Misc::check_socket_read_write(Misc::recv_all(sock, &total, sizeof(total)));
-                std::cout << ">> Receiving size of " << total << " from monitor\n";
-#else
-                Misc::recv_all(sock, &total, sizeof(total));
-#endif
-                auto buf = std::make_unique<byte_t[]>(total);
-#ifdef __HILL_DEBUG__
-                Misc::check_socket_read_write(Misc::recv_all(sock, buf.get(), total));
-#else
-                Misc::recv_all(sock, buf.get(), total);
-#endif
-
-                cluster_status.deserialize(buf.get());
+                MessageHeader header;
+                std::vector<byte_t> body;
+                if (!recv_message(sock, header, body) || header.type != Enums::MessageType::Snapshot ||
+                    !cluster_status.apply(header, body.data())) {
+                    std::cerr << ">> Error: no cluster meta is received from monitor\n";
+                    shutdown(sock, 0);
+                    return;
+                }
 #ifdef __HILL_DEBUG__
                 std::cout << ">> Receiving following meta from monitor\n";
                 cluster_status.dump();
 #endif
-                cluster_status.cluster.nodes[node_id].version = 1;
-                cluster_status.cluster.nodes[node_id].node_id = node_id;
-                cluster_status.cluster.nodes[node_id].total_pm = total_pm;
-                cluster_status.cluster.nodes[node_id].addr = addr;
-                cluster_status.cluster.nodes[node_id].port = port;
-                cluster_status.cluster.nodes[node_id].erpc_port = erpc_port;
-                cluster_status.cluster.nodes[node_id].erpc_listen_port = erpc_listen_port;
-                cluster_status.cluster.nodes[node_id].is_active = true;
+                auto &self = cluster_status.cluster.nodes[node_id];
+                self.version = 1;
+                self.node_id = node_id;
+                self.total_pm = total_pm;
+                self.available_pm = available_pm;
+                self.cpu_usage = cpu_usage;
+                self.addr = addr;
+                self.port = port;
+                self.erpc_port = erpc_port;
+                self.erpc_listen_port = erpc_listen_port;
+                self.is_active = true;
+                sent_ranges = ClusterMeta::range_version(cluster_status.group);
+                sent_migration = cluster_status.migration;
 
-                while(run) {
-                    keepalive(sock);
+                if (send_message(sock, Enums::MessageType::Join, &self, sizeof(self))) {
+                    while(run && keepalive(sock));
                 }
                 shutdown(sock, 0);
             });
@@ -304,59 +647,64 @@ namespace Hill {
 
         // I need extra infomation to update PM usage and CPU usage
         auto Node::keepalive(int socket) noexcept -> bool {
-#ifdef __HILL_DEBUG__
-            std::cout << "---->> this in keepalive " << this << "\n";
-#endif
-            auto to_size = cluster_status.total_size();
+            auto round = std::chrono::steady_clock::now() + heartbeat_interval;
             // Atomicity is not the first concern, because all these data fields are concurrently atomic
             cluster_status.cluster.nodes[node_id].available_pm = available_pm;
             cluster_status.cluster.nodes[node_id].cpu_usage = cpu_usage;
+            Heartbeat beat{node_id, available_pm, cpu_usage};
+            if (!send_message(socket, Enums::MessageType::Heartbeat, &beat, sizeof(beat))) {
+                return false;
+            }
 
-            ++cluster_status.cluster.nodes[node_id].version;
-            ++cluster_status.version;
-            // all machines are little-endian
-#ifdef __HILL_DEBUG__
-            Misc::check_socket_read_write(Misc::send_all(socket, &to_size, sizeof(to_size)), false);
-            std::cout << ">> Writing size of " << to_size << " to monitor\n";
-#else
-            Misc::send_all(socket, &to_size, sizeof(to_size));
-#endif
+            /*
+             * ranges split and orders carried out here, the monitor takes them as from any peer. Changes heard
+             * from the monitor go back to it once, and it finds nothing new in them.
+             */
+            std::unique_ptr<byte_t[]> group;
+            size_t group_size = 0;
+            cluster_status.atomic_read_begin();
+            auto migration = cluster_status.migration;
+            auto ranges = ClusterMeta::range_version(cluster_status.group);
+            if (ranges > sent_ranges) {
+                group.reset(new byte_t[cluster_status.group_size()]);
+                group_size = cluster_status.serialize_group(group.get());
+            }
+            cluster_status.atomic_read_end();
 
-            auto to_buf = cluster_status.serialize();
-#ifdef __HILL_DEBUG__
-            std::cout << ">> Writnig following meta to monitor\n";
-            Misc::check_socket_read_write(Misc::send_all(socket, to_buf.get(), to_size), false);
-            cluster_status.dump();
-#else
-            Misc::send_all(socket, to_buf.get(), to_size);
-#endif
+            if (group != nullptr) {
+                if (!send_message(socket, Enums::MessageType::Ranges, group.get(), group_size)) {
+                    return false;
+                }
+                sent_ranges = ranges;
+            }
+            if (migration.id != sent_migration.id || migration.done != sent_migration.done) {
+                if (!send_message(socket, Enums::MessageType::Migration, &migration, sizeof(migration))) {
+                    return false;
+                }
+                sent_migration = migration;
+            }
 
-            auto size = 0UL;
-#ifdef __HILL_DEBUG__
-            Misc::recv_all(socket, &size, sizeof(size));
-            std::cout << ">> Receiving size of " << size << " from monitor\n";
-#else
-            Misc::recv_all(socket, &size, sizeof(size));
-#endif
+            // the monitor pushes changes of others as they come
+            MessageHeader header;
+            std::vector<byte_t> body;
+            for (auto now = std::chrono::steady_clock::now(); now < round; now = std::chrono::steady_clock::now()) {
+                pollfd fd{socket, POLLIN, 0};
+                auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(round - now).count();
+                if (auto ret = poll(&fd, 1, wait); ret == 0) {
+                    break;
+                } else if (ret < 0) {
+                    continue;
+                }
 
-            auto buf = std::make_unique<byte_t[]>(size);
-#ifdef __HILL_DEBUG__
-            Misc::check_socket_read_write(Misc::recv_all(socket, buf.get(), size));
-#else
-            Misc::recv_all(socket, buf.get(), size);
-#endif
-            ClusterMeta tmp;
-            tmp.deserialize(buf.get());
-#ifdef __HILL_DEBUG__
-            std::cout << ">> Receiving following meta from monitor\n";
-            cluster_status.dump();
-#endif
-            cluster_status.update(tmp);
+                if (!recv_message(socket, header, body) || !cluster_status.apply(header, body.data())) {
+                    std::cerr << ">> Error: connection to monitor is broken\n";
+                    return false;
+                }
 #ifdef __HILL_DEBUG__
-            cluster_status.dump();
-            std::cout << "\n\n\n";
+                std::cout << ">> Receiving message " << int(header.type) << " of " << header.size << " bytes\n";
+                cluster_status.dump();
 #endif
-            sleep(3);
+            }
             return true;
         }
 
@@ -380,6 +728,7 @@ namespace Hill {
 
             std::regex rnode_num("node_num:\\s*(\\d+)");
             std::regex rranges("range:\\s*((\\S+),\\s*(\\d+))");
+            std::regex rbackups("backup:\\s*((\\S+),\\s*(\\d+))");
             std::regex raddr("addr:\\s*(\\d{1,3}\\.\\d{1,3}\\.\\d{1,3}\\.\\d{1,3}):(\\d+)");
 
             std::smatch vnode_num, vranges, vaddr;
@@ -396,12 +745,23 @@ namespace Hill {
             addr = IPV4Addr::make_ipv4_addr(vaddr[1].str()).value();
             port = atoi(vaddr[2].str().c_str());
             meta.cluster.node_num = atoi(vnode_num[1].str().c_str());
+            heartbeat_interval = std::chrono::milliseconds(
+                ConfigReader::read_heartbeat_interval(content).value_or(Constants::tHEARTBEAT_INTERVAL.count()));
+            suspicion_timeout = std::chrono::milliseconds(
+                ConfigReader::read_suspicion_timeout(content).value_or(Constants::tSUSPICION_TIMEOUT.count()));
 
+            auto rest = content;
             while (std::regex_search(content, vranges, rranges)) {
                 meta.group.add_main(vranges[2].str(), atoi(vranges[3].str().c_str()));
                 content = vranges.suffix();
             }
 
+            // backup: start, node makes node a backup of the range starting at start, see RangeInfo
+            while (std::regex_search(rest, vranges, rbackups)) {
+                meta.group.append_cpu(vranges[2].str(), atoi(vranges[3].str().c_str()));
+                rest = vranges.suffix();
+            }
+
             return true;
         }
 
@@ -412,14 +772,73 @@ namespace Hill {
             if (sock == -1) {
                 return false;
             }
+
+            epoll_fd = epoll_create1(0);
+            epoll_event event{};
+            event.events = EPOLLIN;
+            event.data.fd = sock;
+            if (epoll_fd == -1 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &event) == -1) {
+                std::cerr << ">> Error: can't watch monitor socket\n";
+                return false;
+            }
 #if defined(__HILL_DEBUG__) || defined(__HILL_INFO__)
             std::cout << ">> Monitor running at " << addr.to_string() << ":" << port << "\n";
 #endif
             std::thread work([&, sock]() {
+                epoll_event events[Constants::uMAX_NODE];
+                auto next_push = std::chrono::steady_clock::now() + heartbeat_interval;
                 while(run) {
-                    check_income_connection(sock);
-                    sleep(1);
+                    auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        next_push - std::chrono::steady_clock::now()).count();
+                    auto num = epoll_wait(epoll_fd, events, Constants::uMAX_NODE, std::max(wait, 0L));
+                    for (int i = 0; i < num; i++) {
+                        auto fd = events[i].data.fd;
+                        if (fd == sock) {
+                            check_income_connection(sock);
+                            continue;
+                        }
+
+                        auto peer = peers.find(fd);
+                        if (peer == peers.end()) {
+                            continue;
+                        }
+                        if (((events[i].events & EPOLLOUT) && !flush(peer->second)) ||
+                            ((events[i].events & ~EPOLLOUT) && !receive(peer->second))) {
+                            drop(fd);
+                        }
+                    }
+
+                    if (std::chrono::steady_clock::now() < next_push) {
+                        continue;
+                    }
+                    next_push = std::chrono::steady_clock::now() + heartbeat_interval;
+
+                    // a node taken as failed stays connected, its next heartbeat brings it back
+                    for (auto &[_, peer] : peers) {
+                        if (peer.node_id != 0 && meta.cluster.nodes[peer.node_id].is_active &&
+                            std::chrono::steady_clock::now() - peer.last_heard > suspicion_timeout) {
+                            fail(peer.node_id);
+                        }
+                    }
+                    plan_migration();
+
+                    std::vector<int> gone;
+                    for (auto &[fd, peer] : peers) {
+                        if (!push_changes(peer)) {
+                            gone.push_back(fd);
+                        }
+                    }
+                    for (auto fd : gone) {
+                        drop(fd);
+                    }
+                }
+
+                for (auto &[fd, _] : peers) {
+                    shutdown(fd, 0);
+                    close(fd);
                 }
+                peers.clear();
+                close(epoll_fd);
                 shutdown(sock, 0);
             });
             work.detach();
@@ -431,88 +850,283 @@ namespace Hill {
         }
 
         auto Monitor::check_income_connection(int sock) -> void {
-            // accept should be non-blocking, but read/write should be blocking
-            auto socket = Misc::accept_blocking(sock);
-            if (socket == -1) {
+            // neither reads nor writes of a peer block, a peer not taking its messages is left behind in out
+            for (auto socket = Misc::accept_nonblocking(sock); socket != -1; socket = Misc::accept_nonblocking(sock)) {
 #ifdef __HILL_DEBUG__
-                std::cout << ">> No new connection is detected\n";
+                std::cout << ">> New peer is connected\n";
 #endif
-                return;
+                Peer peer;
+                peer.socket = socket;
+                peer.node_id = 0;
+                peer.in.resize(sizeof(MessageHeader));
+                peer.received = 0;
+                peer.last_heard = std::chrono::steady_clock::now();
+                peer.out_sent = 0;
+                peer.out_watched = false;
+
+                std::unique_ptr<byte_t[]> buf;
+                size_t size;
+                {
+                    std::scoped_lock l(meta.lock);
+                    // a peer takes a meta of version 0 as none
+                    ++meta.version;
+                    size = meta.total_size();
+                    buf = meta.serialize();
+                    for (size_t i = 0; i < Constants::uMAX_NODE; i++) {
+                        peer.node_versions[i] = meta.cluster.nodes[i].version;
+                    }
+                    peer.range_version = ClusterMeta::range_version(meta.group);
+                    peer.migration = meta.migration;
+                }
+
+                epoll_event event{};
+                event.events = EPOLLIN;
+                event.data.fd = socket;
+                if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket, &event) == -1) {
+                    close(socket);
+                    continue;
+                }
+                auto &added = peers.emplace(socket, std::move(peer)).first->second;
+                if (!post(added, Enums::MessageType::Snapshot, buf.get(), size)) {
+                    drop(socket);
+                }
             }
-#ifdef __HILL_DEBUG__
-            std::cout << ">> New node is connected\n";
-            auto flags = fcntl(socket, F_GETFL);
-            std::cout << ">> New socket is in non-blocking mode: " << (flags & O_NONBLOCK) << "\n";
-#endif
+        }
 
-            std::thread heartbeat([&, socket]() {
-                // on first connection
-                auto to_size = meta.total_size();
-#ifdef __HILL_DEBUG__
-                std::cout << ">> Sending size of " << to_size << " to server node\n";
-                Misc::check_socket_read_write(Misc::send_all(socket, &to_size, sizeof(to_size)), false);
-#else
-                Misc::send_all(socket, &to_size, sizeof(to_size));
-#endif
+        auto Monitor::post(Peer &peer, Enums::MessageType type, const void *body, size_t size) -> bool {
+            if (peer.out.size() - peer.out_sent + sizeof(MessageHeader) + size > Constants::uMAX_MESSAGE_SIZE) {
+                std::cerr << ">> Error: node " << peer.node_id << " does not take its messages, it is dropped\n";
+                return false;
+            }
 
-                auto to_buf = meta.serialize();
-#ifdef __HILL_DEBUG__
-                Misc::check_socket_read_write(Misc::send_all(socket, to_buf.get(), to_size), false);
-                std::cout << ">> Sending following meta to server node:\n";
-                meta.dump();
-#else
-                Misc::send_all(socket, to_buf.get(), to_size);
-#endif
+            MessageHeader header{type, size};
+            auto bytes = reinterpret_cast<const byte_t *>(body);
+            peer.out.insert(peer.out.end(), reinterpret_cast<const byte_t *>(&header),
+                            reinterpret_cast<const byte_t *>(&header) + sizeof(header));
+            peer.out.insert(peer.out.end(), bytes, bytes + size);
+            return flush(peer);
+        }
 
-                // keepalive
-                while(run) {
-                    ClusterMeta tmp;
-                    auto size = 0UL;
-#ifdef __HILL_DEBUG__
-                    Misc::check_socket_read_write(Misc::recv_all(socket, &size, sizeof(size)));
-                    std::cout << ">> Receiving size of " << size << " from server node\n";
-#else
-                    Misc::recv_all(socket, &size, sizeof(size));
+        auto Monitor::flush(Peer &peer) -> bool {
+            while (peer.out_sent < peer.out.size()) {
+                auto ret = send(peer.socket, peer.out.data() + peer.out_sent, peer.out.size() - peer.out_sent,
+                                MSG_DONTWAIT | MSG_NOSIGNAL);
+                if (ret < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    break;
+                }
+                if (ret <= 0) {
+                    return false;
+                }
+                peer.out_sent += ret;
+            }
+
+            auto left = peer.out_sent < peer.out.size();
+            if (!left) {
+                peer.out.clear();
+                peer.out_sent = 0;
+            }
+            if (left == peer.out_watched) {
+                return true;
+            }
+            epoll_event event{};
+            event.events = left ? EPOLLIN | EPOLLOUT : EPOLLIN;
+            event.data.fd = peer.socket;
+            peer.out_watched = left;
+            return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, peer.socket, &event) == 0;
+        }
+
+        auto Monitor::receive(Peer &peer) -> bool {
+            while (true) {
+                auto want = sizeof(MessageHeader);
+                if (peer.received >= want) {
+                    want += reinterpret_cast<const MessageHeader *>(peer.in.data())->size;
+                }
+
+                if (peer.received == want) {
+                    MessageHeader header;
+                    memcpy(&header, peer.in.data(), sizeof(header));
+                    if (!handle(peer, header, peer.in.data() + sizeof(header))) {
+                        std::cerr << ">> Error: node " << peer.node_id << " sends a malformed message\n";
+                        return false;
+                    }
+                    peer.received = 0;
+                    continue;
+                }
+
+                if (want - sizeof(MessageHeader) > Constants::uMAX_MESSAGE_SIZE) {
+                    return false;
+                }
+                if (peer.in.size() < want) {
+                    peer.in.resize(want);
+                }
+                auto ret = recv(peer.socket, peer.in.data() + peer.received, want - peer.received, MSG_DONTWAIT);
+                if (ret == 0) {
+                    return false;
+                }
+                if (ret < 0) {
+                    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+                }
+                peer.received += ret;
+                peer.last_heard = std::chrono::steady_clock::now();
+            }
+        }
+
+        auto Monitor::handle(Peer &peer, const MessageHeader &header, const byte_t *body) -> bool {
+            switch (header.type) {
+            case Enums::MessageType::Join: {
+                NodeInfo info;
+                if (header.size != sizeof(info)) {
+                    return false;
+                }
+                memcpy(&info, body, sizeof(info));
+                if (info.node_id <= 0 || size_t(info.node_id) >= Constants::uMAX_NODE) {
+                    return false;
+                }
+
+                // a restarted node starts its versions over, so the monitor numbers its entry on
+                std::scoped_lock l(meta.lock);
+                auto &node = meta.cluster.nodes[info.node_id];
+                info.version = node.version + 1;
+                info.is_active = true;
+                node = info;
+                ++meta.version;
+                peer.node_id = info.node_id;
+#if defined(__HILL_DEBUG__) || defined(__HILL_INFO__)
+                std::cout << ">> Node " << info.node_id << " joins from " << info.addr.to_string() << "\n";
 #endif
-                    auto buf = std::make_unique<byte_t[]>(size);
-#ifdef __HILL_DEBUG__
-                    Misc::check_socket_read_write(Misc::recv_all(socket, buf.get(), size));
-                    std::cout << ">> Receiving following meta from server node\n";
-                    tmp.deserialize(buf.get());
-                    tmp.dump();
-#else
-                    Misc::recv_all(socket, buf.get(), size);
-                    tmp.deserialize(buf.get());
+                return true;
+            }
+            case Enums::MessageType::Heartbeat: {
+                Heartbeat beat;
+                if (header.size != sizeof(beat)) {
+                    return false;
+                }
+                memcpy(&beat, body, sizeof(beat));
+                if (peer.node_id != 0 && !meta.cluster.nodes[peer.node_id].is_active) {
+                    std::scoped_lock l(meta.lock);
+                    auto &node = meta.cluster.nodes[peer.node_id];
+                    node.is_active = true;
+                    ++node.version;
+                    ++meta.version;
+#if defined(__HILL_DEBUG__) || defined(__HILL_INFO__)
+                    std::cout << ">> Node " << peer.node_id << " is heard again\n";
 #endif
+                }
+                meta.merge_heartbeat(beat);
+                return true;
+            }
+            case Enums::MessageType::Snapshot:
+                return false;
+            default:
+                return meta.apply(header, body);
+            }
+        }
 
-                    meta.update(tmp);
-                    return_cluster_meta(socket);
-#ifdef __HILL_DEBUG__
-                    std::cout << "\n\n\n";
-#endif
+        auto Monitor::push_changes(Peer &peer) -> bool {
+            std::vector<NodeInfo> nodes;
+            std::unique_ptr<byte_t[]> group;
+            size_t group_size = 0;
+            bool order = false;
+            MigrationOrder migration;
+            {
+                meta.atomic_read_begin();
+                // a node knows best of its own entry
+                for (size_t i = 1; i < Constants::uMAX_NODE; i++) {
+                    if (meta.cluster.nodes[i].version > peer.node_versions[i] && int(i) != peer.node_id) {
+                        nodes.push_back(meta.cluster.nodes[i]);
+                    }
+                    peer.node_versions[i] = meta.cluster.nodes[i].version;
+                }
 
-                    sleep(1);
+                if (auto ranges = ClusterMeta::range_version(meta.group); ranges > peer.range_version) {
+                    group.reset(new byte_t[meta.group_size()]);
+                    group_size = meta.serialize_group(group.get());
+                    peer.range_version = ranges;
                 }
-            });
-            heartbeat.detach();
+
+                migration = meta.migration;
+                order = migration.id != peer.migration.id || migration.done != peer.migration.done;
+                peer.migration = migration;
+                meta.atomic_read_end();
+            }
+
+            return (nodes.empty() || post(peer, Enums::MessageType::Nodes, nodes.data(), nodes.size() * sizeof(NodeInfo))) &&
+                (group == nullptr || post(peer, Enums::MessageType::Ranges, group.get(), group_size)) &&
+                (!order || post(peer, Enums::MessageType::Migration, &migration, sizeof(migration)));
         }
 
-        auto Monitor::return_cluster_meta(int socket) noexcept -> void {
-            ++meta.version;
-            auto size= meta.total_size();
-#ifdef __HILL_DEBUG__
-            std::cout << ">> Sending size of " << size << " to server node\n";
-            Misc::check_socket_read_write(Misc::send_all(socket, &size, sizeof(size)), false);
-#else
-            Misc::send_all(socket, &size, sizeof(size));
+        auto Monitor::drop(int socket) -> void {
+            if (auto peer = peers.find(socket); peer != peers.end() && peer->second.node_id != 0) {
+#if defined(__HILL_DEBUG__) || defined(__HILL_INFO__)
+                std::cout << ">> Node " << peer->second.node_id << " is disconnected\n";
 #endif
-            auto buf = meta.serialize();
-#ifdef __HILL_DEBUG__
-            std::cout << ">> Sending following meta to server node:\n";
-            meta.dump();
-            Misc::check_socket_read_write(Misc::send_all(socket, buf.get(), size), false);
-#else
-            Misc::send_all(socket, buf.get(), size);
+                // no need to wait for the timeout
+                if (meta.cluster.nodes[peer->second.node_id].is_active) {
+                    fail(peer->second.node_id);
+                }
+            }
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, socket, nullptr);
+            close(socket);
+            peers.erase(socket);
+        }
+
+        auto Monitor::fail(int node) -> void {
+            [[maybe_unused]] auto moved = meta.fail_node(node);
+#if defined(__HILL_DEBUG__) || defined(__HILL_INFO__)
+            std::cout << ">> Node " << node << " is taken as failed, " << moved << " ranges are handed to backups\n";
+#endif
+        }
+
+        auto Monitor::plan_migration() -> void {
+            std::scoped_lock l(meta.lock);
+            auto now = std::chrono::steady_clock::now();
+            if ((meta.migration.id != 0 && !meta.migration.done) || now - last_order < Constants::tSPLIT_INTERVAL) {
+                return;
+            }
+
+            // 1 or more means overloaded
+            auto load = [](const NodeInfo &n) {
+                auto used = n.total_pm == 0 ? 0 : 1 - double(n.available_pm) / n.total_pm;
+                return std::max(used / Constants::dSPLIT_PM_RATIO, n.cpu_usage / Constants::dSPLIT_CPU_USAGE);
+            };
+
+            auto leads_range = [&](int node_id) {
+                for (size_t i = 0; i < meta.group.num_infos; i++) {
+                    if (meta.group.infos[i].nodes[0] == node_id) {
+                        return true;
+                    }
+                }
+                return false;
+            };
+
+            int source = 0, target = 0;
+            for (size_t i = 1; i < Constants::uMAX_NODE; i++) {
+                const auto &n = meta.cluster.nodes[i];
+                if (n.node_id == 0 || !n.is_active) {
+                    continue;
+                }
+
+                if (load(n) >= 1 && leads_range(n.node_id) &&
+                    (source == 0 || load(n) > load(meta.cluster.nodes[source]))) {
+                    source = n.node_id;
+                }
+                if (load(n) < 1 && (target == 0 || load(n) < load(meta.cluster.nodes[target]))) {
+                    target = n.node_id;
+                }
+            }
+
+            if (source == 0 || target == 0) {
+                return;
+            }
+
+            meta.migration = {meta.migration.id + 1, uint8_t(source), uint8_t(target), false};
+            ++meta.version;
+            last_order = now;
+#if defined(__HILL_DEBUG__) || defined(__HILL_INFO__)
+            std::cout << ">> Ordering node " << source << " to move a range to node " << target << "\n";
 #endif
         }
 
@@ -11,7 +11,13 @@
 #include <thread>
 #include <iostream>
 #include <fstream>
+#include <algorithm>
 #include <shared_mutex>
+#include <atomic>
+#include <vector>
+#include <chrono>
+#include <string_view>
+#include <unordered_map>
 
 namespace Hill {
     namespace Cluster {
@@ -20,6 +26,45 @@ namespace Hill {
             // including the monitor
             static constexpr size_t uMAX_NODE = 64;
             static constexpr int iCLIENT_ID = 0xff;
+
+            // a RouteTable indexes bounds by the uROUTE_RADIX_BYTES bytes after the prefix all bounds share
+            static constexpr size_t uROUTE_RADIX_BYTES = 2;
+            static constexpr size_t uROUTE_RADIX = 1UL << (8 * uROUTE_RADIX_BYTES);
+
+            /*
+             * The monitor orders a node using more than dSPLIT_PM_RATIO of its PM or busier than
+             * dSPLIT_CPU_USAGE to hand half of a range to the least loaded node, and gives no new order
+             * within tSPLIT_INTERVAL of the last one
+             */
+            static constexpr double dSPLIT_PM_RATIO = 0.7;
+            static constexpr double dSPLIT_CPU_USAGE = 0.9;
+            static constexpr auto tSPLIT_INTERVAL = std::chrono::seconds(10);
+
+            /*
+             * A node sends a Heartbeat every tHEARTBEAT_INTERVAL, and the monitor pushes whatever changed since
+             * its last push to each peer as often. A node silent for tSUSPICION_TIMEOUT is taken as failed.
+             * Both are defaults of heartbeat_interval and suspicion_timeout in configuration files, in ms.
+             * A message body over uMAX_MESSAGE_SIZE is taken as garbage, and so is a peer the monitor has more
+             * than uMAX_MESSAGE_SIZE bytes queued for.
+             */
+            static constexpr auto tHEARTBEAT_INTERVAL = std::chrono::milliseconds(100);
+            static constexpr auto tSUSPICION_TIMEOUT = std::chrono::milliseconds(500);
+            static constexpr size_t uMAX_MESSAGE_SIZE = 64 * 1024 * 1024;
+        }
+
+        namespace Enums {
+            // no enum class, see MessageHeader
+            enum MessageType : uint8_t {
+                Snapshot,
+                Join,
+                Heartbeat,
+                Nodes,
+                Ranges,
+                Migration,
+
+                // guardian
+                Unknown,
+            };
         }
 
         // just for simplicity, I don't wnat those Linux stuff
@@ -56,6 +101,27 @@ namespace Hill {
             float cpu_usage;
         } __attribute__((packed));
 
+        /*
+         * The monitor and its peers, i.e., nodes and clients, talk in messages of | MessageHeader | body |, body
+         * being size bytes of
+         * 1. Snapshot:  a serialized ClusterMeta, the first message of the monitor to a new peer
+         * 2. Join:      NodeInfo of a node, its first message to the monitor
+         * 3. Heartbeat: Heartbeat, sent by nodes every Constants::tHEARTBEAT_INTERVAL
+         * 4. Nodes:     count * NodeInfo, entries of nodes newer than the receiver has heard of
+         * 5. Ranges:    a serialized RangeGroup, sent once a range changes
+         * 6. Migration: MigrationOrder, sent once an order is given or done
+         * Messages of a peer are only what changed since it was last told, and receivers merge them entry by
+         * entry as in ClusterMeta::update.
+         */
+        struct MessageHeader {
+            Enums::MessageType type;
+            uint64_t size;
+        } __attribute__((packed));
+
+        // false if the socket fails, or if a message is malformed for recv_message
+        auto send_message(int socket, Enums::MessageType type, const void *body, size_t size) noexcept -> bool;
+        auto recv_message(int socket, MessageHeader &header, std::vector<byte_t> &body) noexcept -> bool;
+
         struct NodeInfo {
             // starting from 1, 0 is reserved for the monitor
             uint64_t version;
@@ -72,7 +138,7 @@ namespace Hill {
 
         // serialization required to send over network
         // ranges never overlap
-        // nodes[0] is the main server for this range
+        // nodes[0] is the main server for this range, nodes[i] of a backup or a memory node is i
         struct RangeInfo {
             uint64_t version;
             std::string start;
@@ -94,9 +160,11 @@ namespace Hill {
          */
         struct  RangeGroup {
             size_t num_infos;
+            // infos grows geometrically, capacity is not serialized
+            size_t capacity;
             std::unique_ptr<RangeInfo[]> infos;
 
-            RangeGroup() : num_infos(0), infos(nullptr) {};
+            RangeGroup() : num_infos(0), capacity(0), infos(nullptr) {};
             ~RangeGroup() = default;
             RangeGroup(const RangeGroup &) = delete;
             RangeGroup(RangeGroup &&) = delete;
@@ -108,11 +176,85 @@ namespace Hill {
             }
 
             auto add_main(const std::string &s, int node_id) -> void;
+            // place info before infos[pos], pos == num_infos appends it
+            auto insert_at(size_t pos, const RangeInfo &info) -> void;
             auto append_node(const std::string &s, int node_id, bool is_mem) -> void;
             auto append_cpu(const std::string &s, int node_id) noexcept -> void;
             auto append_mem(const std::string &s, int node_id) noexcept -> void;
         } __attribute__((packed));
 
+        /*
+         * A flat copy of the range boundaries of a RangeGroup, built for routing. A key belongs to the first
+         * range in RangeGroup::infos whose start is greater than the key. Only starts greater than every start
+         * before them can be that range, so bounds keeps just those, ascending.
+         *
+         * Bounds usually share a prefix, e.g., "user", so they are indexed by the uROUTE_RADIX_BYTES bytes
+         * after it. A key with prefix shared and radix bytes r lies between shared + r and shared + (r + 1),
+         * so its range is among bounds[slots[r]] to bounds[slots[r + 1]], which are few unless ranges crowd
+         * into one radix. Keys not long enough for the radix are binary searched over all bounds.
+         *
+         * Building a table takes one pass over the bounds and the radix, which is cheap enough to redo on
+         * every change of ranges. A table is never modified once it is published by ClusterMeta.
+         */
+        struct RouteTable {
+            uint64_t version;
+            std::vector<std::string> bounds;
+            // main server of each bound
+            std::vector<uint8_t> nodes;
+            // index in RangeGroup::infos of each bound
+            std::vector<size_t> ranges;
+            // backups of each bound, bit i is set if node i is one, see RangeInfo::is_mem
+            std::vector<uint64_t> backups;
+            std::string shared;
+            // slots[r] is the first bound not less than shared + r, uROUTE_RADIX + 1 of them
+            std::vector<uint32_t> slots;
+
+            static auto make_route_table(const RangeGroup &group, uint64_t version) -> std::unique_ptr<RouteTable>;
+
+            // index of the range in RangeGroup::infos, -1 if no range holds key
+            auto locate(std::string_view key) const noexcept -> int;
+
+            // main server of key, 0 if no range holds key
+            inline auto node_of(std::string_view key) const noexcept -> int {
+                auto i = position(key);
+                return i == bounds.size() ? 0 : nodes[i];
+            }
+
+            // backups of key as a bitmap of node ids, 0 if there is none or no range holds key
+            inline auto backups_of(std::string_view key) const noexcept -> uint64_t {
+                auto i = position(key);
+                return i == bounds.size() ? 0 : backups[i];
+            }
+
+            // index of the first bound greater than key
+            inline auto position(std::string_view key) const noexcept -> size_t {
+                auto first = bounds.begin(), last = bounds.end();
+                if (key.size() >= shared.size() + Constants::uROUTE_RADIX_BYTES &&
+                    key.compare(0, shared.size(), shared) == 0) {
+                    size_t r = 0;
+                    for (size_t i = 0; i < Constants::uROUTE_RADIX_BYTES; i++) {
+                        r = (r << 8) | uint8_t(key[shared.size() + i]);
+                    }
+                    // bounds[slots[r + 1]] is not less than shared + (r + 1), so it is greater than key
+                    first += slots[r];
+                    last = bounds.begin() + slots[r + 1];
+                }
+                return std::upper_bound(first, last, key) - bounds.begin();
+            }
+        };
+
+        /*
+         * The monitor asks source to move the upper half of one of its ranges to target, one order at a time.
+         * Orders are numbered from 1, id 0 means none was ever given. The source marks an order done once the
+         * range is split or the move is given up, and the monitor hears of it with the next heartbeat.
+         */
+        struct MigrationOrder {
+            uint64_t id;
+            uint8_t source;
+            uint8_t target;
+            bool done;
+        } __attribute__((packed));
+
         struct ClusterMeta {
             uint64_t version;
             struct {
@@ -120,19 +262,32 @@ namespace Hill {
                 // cope with remote pointer, 64 at most
                 NodeInfo nodes[Constants::uMAX_NODE];
             } cluster;
+            MigrationOrder migration;
             RangeGroup group;
 
-            ClusterMeta() : version(0) {
+            ClusterMeta() : version(0), routes(nullptr) {
                 cluster.node_num = 0;
+                // versions of entries never heard of are 0, see merge_nodes
                 for (size_t i = 0; i < Constants::uMAX_NODE; i++) {
-                    cluster.nodes[i].node_id = 0;
+                    cluster.nodes[i] = NodeInfo{};
                 }
+                migration = {0, 0, 0, false};
             }
             ~ClusterMeta() = default;
 
             // this is not serialized
             mutable std::shared_mutex lock;
 
+            /*
+             * Routing reads the latest table without the lock, see get_routes. A replaced table is freed once
+             * the last reader holding it lets go, however long that reader is held up.
+             */
+            std::shared_ptr<const RouteTable> routes;
+
+            inline auto get_routes() const noexcept -> std::shared_ptr<const RouteTable> {
+                return std::atomic_load_explicit(&routes, std::memory_order_acquire);
+            }
+
             auto total_size() const noexcept -> size_t;
             auto serialize() const noexcept -> std::unique_ptr<byte_t[]>;
             // auto serialize() const noexcept -> byte_ptr_t;
@@ -141,6 +296,42 @@ namespace Hill {
             auto update(const ClusterMeta &newer) -> void;
             auto dump() const noexcept -> void;
 
+            // the group part of serialize, returning the bytes taken
+            auto group_size() const noexcept -> size_t;
+            auto serialize_group(byte_t *buf) const noexcept -> size_t;
+            // false if buf of size bytes does not hold a whole group
+            static auto deserialize_group(const byte_t *buf, size_t size, RangeGroup &group) -> bool;
+            // the latest version of any range of group
+            static auto range_version(const RangeGroup &group) noexcept -> uint64_t;
+
+            /*
+             * Parts of update, taking what is newer than this meta. True if anything is taken. A layout of
+             * ranges is taken whole if any of its ranges is the latest.
+             */
+            auto merge_nodes(const NodeInfo *infos, size_t num) -> bool;
+            auto merge_group(const RangeGroup &newer) -> bool;
+            auto merge_migration(const MigrationOrder &newer) -> bool;
+            // take the stats of a heartbeat, the entry of its node gets a new version if they change
+            auto merge_heartbeat(const Heartbeat &beat) -> bool;
+            // take a Snapshot, Nodes, Ranges or Migration message, false if it is none or malformed
+            auto apply(const MessageHeader &header, const byte_t *body) -> bool;
+            // build a RouteTable of the current group and let routing switch to it, called with lock held
+            auto publish_routes() -> void;
+
+            /*
+             * Split the range ending at high so that keys from at on are served by node, which stops being a
+             * backup of them. Both halves get a range version above every other, so peers adopt the new layout
+             * in update. False if no range ends at high or at is not in it.
+             */
+            auto split_range(const std::string &high, const std::string &at, int node) -> bool;
+
+            /*
+             * Take node as failed: its entry turns inactive and each range it serves goes to the first active
+             * PM backup of it, with a range version above every other as in split_range. A range without such
+             * a backup stays with node. Returns the number of ranges handed over.
+             */
+            auto fail_node(int node) -> size_t;
+
             inline auto atomic_read_begin() const noexcept -> const ClusterMeta & {
                 lock.lock_shared();
                 return *this;
@@ -151,7 +342,7 @@ namespace Hill {
             }
 
             // TO BE REFINED
-            auto filter_node_no_lock(const std::string &key) const noexcept -> int {
+            auto filter_node_no_lock(std::string_view key) const noexcept -> int {
                 for (size_t i = 0; i < group.num_infos; i++) {
                     if (group.infos[i].start > key) {
                         return group.infos[i].nodes[0];
@@ -160,7 +351,11 @@ namespace Hill {
                 return 0;
             }
             
-            auto filter_node(const std::string &key) const noexcept -> int {
+            auto filter_node(std::string_view key) const noexcept -> int {
+                if (auto table = get_routes(); table != nullptr) {
+                    return table->node_of(key);
+                }
+
                 atomic_read_begin();
                 auto ret = filter_node_no_lock(key);
                 atomic_read_end();
@@ -193,6 +388,8 @@ namespace Hill {
                 for (size_t i = 0; i < Constants::uMAX_NODE; i++) {
                     ret->cluster_status.cluster.nodes[i].node_id = 0;
                 }
+                ret->sent_ranges = 0;
+                ret->sent_migration = {0, 0, 0, false};
 
                 return ret;
             }
@@ -208,8 +405,9 @@ namespace Hill {
             auto stop() -> void;
 
             /*
-             * Launch a background thread that periodically send heartbeat to the monitor
-             * This thread will also receive an update of current cluster metainfo
+             * One round of the background thread talking to the monitor: send a Heartbeat and the changes of
+             * ranges and migration made on this node, then take what the monitor pushes until the next round.
+             * False once the monitor is gone.
              */
             auto keepalive(int socket) noexcept -> bool;
 
@@ -230,8 +428,13 @@ namespace Hill {
             std::string rpc_uri;
             IPV4Addr monitor_addr;
             int monitor_port;
+            std::chrono::milliseconds heartbeat_interval;
             ClusterMeta cluster_status;
             bool run;
+
+            // the latest range version and order the monitor is told of
+            uint64_t sent_ranges;
+            MigrationOrder sent_migration;
         };
 
 
@@ -252,6 +455,7 @@ namespace Hill {
             static auto make_monitor(const std::string &config) -> std::unique_ptr<Monitor> {
                 auto ret = std::make_unique<Monitor>();
                 ret->prepare(config);
+                ret->epoll_fd = -1;
                 
                 for (size_t i = 0; i < Constants::uMAX_NODE; i++) {
                     ret->meta.cluster.nodes[i].node_id = 0;
@@ -273,20 +477,58 @@ namespace Hill {
              */
             auto launch() -> bool;
             auto stop() -> void;
+            // accept every pending connection and send each a Snapshot
             auto check_income_connection(int sock) -> void;
 
-            /*
-             * Broadcast current cluster status including node liveness, node pm usage, etc. to all active nodes
-             */
-            auto return_cluster_meta(int socket) noexcept -> void;
-
             auto dump() const noexcept -> void;
 
         private:
+            // a node or a client connected to the monitor
+            struct Peer {
+                int socket;
+                // 0 until a node joins, clients never do
+                int node_id;
+                // the message being received, header first, and how much of it is in
+                std::vector<byte_t> in;
+                size_t received;
+                // what the peer is told of, see push_changes
+                uint64_t node_versions[Constants::uMAX_NODE];
+                uint64_t range_version;
+                MigrationOrder migration;
+                // a joined peer silent for suspicion_timeout is taken as failed
+                std::chrono::steady_clock::time_point last_heard;
+                // messages not taken by the socket yet, from out_sent on, EPOLLOUT is watched while any is left
+                std::vector<byte_t> out;
+                size_t out_sent;
+                bool out_watched;
+            };
+
             ClusterMeta meta;
             IPV4Addr addr;
             int port;
             bool run;
+            std::chrono::steady_clock::time_point last_order;
+            std::chrono::milliseconds heartbeat_interval;
+            std::chrono::milliseconds suspicion_timeout;
+            // one epoll loop serves every peer, see launch
+            int epoll_fd;
+            std::unordered_map<int, Peer> peers;
+
+            // take whatever messages of peer are in, false if it is gone or sends garbage
+            auto receive(Peer &peer) -> bool;
+            auto handle(Peer &peer, const MessageHeader &header, const byte_t *body) -> bool;
+            // send peer what changed since it was last told, false if it is gone
+            auto push_changes(Peer &peer) -> bool;
+            // queue a message for peer and send what the socket takes, false if it is gone or too far behind
+            auto post(Peer &peer, Enums::MessageType type, const void *body, size_t size) -> bool;
+            // never blocks, false if peer is gone
+            auto flush(Peer &peer) -> bool;
+            auto drop(int socket) -> void;
+            // see ClusterMeta::fail_node, the node is active again once heard of
+            auto fail(int node) -> void;
+
+            // give a MigrationOrder if a node is overloaded and no order is going on, see Constants
+            auto plan_migration() -> void;
         };
     }
 }
@@ -26,6 +26,22 @@ namespace Hill {
         return vpmem_file[1];
     }
     
+    auto ConfigReader::read_pmem_files(const std::string &content) -> std::optional<std::vector<std::string>> {
+        std::regex rpmem_file("pmem_file:\\s+(\\S+)");
+        std::vector<std::string> files;
+
+        for (auto i = std::sregex_iterator(content.begin(), content.end(), rpmem_file); i != std::sregex_iterator(); i++) {
+            files.push_back((*i)[1].str());
+        }
+
+        if (files.empty()) {
+            std::cerr << ">> Error: invalid or unspecified pmem file\n";
+            return {};
+        }
+
+        return files;
+    }
+
     auto ConfigReader::read_total_pm(const std::string &content) -> std::optional<size_t> {
         std::regex rtotal_pm("total_pm:\\s*(\\d+)");
         std::smatch vtotal_pm;
@@ -114,6 +130,116 @@ namespace Hill {
         return atoi(vmonitor[2].str().c_str());
     }
 
+    auto ConfigReader::read_hugepage(const std::string &content) -> std::optional<size_t> {
+        std::regex rhugepage("hugepage:\\s*(\\d+)([KMG]?)");
+        std::smatch vhugepage;
+        if (!std::regex_search(content, vhugepage, rhugepage)) {
+            // optional, the default page size is taken when it is absent
+            if (content.find("hugepage:") == std::string::npos) {
+#ifdef __HILL_DEBUG__
+                std::cout << ">> No hugepage size specified, using the default\n";
+#endif
+                return {};
+            }
+            std::cerr << ">> Error: invalid hugepage size\n";
+            return {};
+        }
+
+        auto size = size_t(atoll(vhugepage[1].str().c_str()));
+        auto unit = vhugepage[2].str();
+        if (unit == "K") {
+            size <<= 10;
+        } else if (unit == "M") {
+            size <<= 20;
+        } else if (unit == "G") {
+            size <<= 30;
+        }
+        return size;
+    }
+
+    auto ConfigReader::read_wal_batch(const std::string &content) -> std::optional<size_t> {
+        std::regex rwal_batch("wal_batch:\\s*(\\d+)");
+        std::smatch vwal_batch;
+        if (!std::regex_search(content, vwal_batch, rwal_batch)) {
+            std::cerr << ">> Error: invalid or unspecified WAL batch size\n";
+            return {};
+        }
+
+        return atoll(vwal_batch[1].str().c_str());
+    }
+
+    auto ConfigReader::read_wal_timeout(const std::string &content) -> std::optional<size_t> {
+        std::regex rwal_timeout("wal_timeout:\\s*(\\d+)");
+        std::smatch vwal_timeout;
+        if (!std::regex_search(content, vwal_timeout, rwal_timeout)) {
+            std::cerr << ">> Error: invalid or unspecified WAL timeout\n";
+            return {};
+        }
+
+        return atoll(vwal_timeout[1].str().c_str());
+    }
+
+    auto ConfigReader::read_heartbeat_interval(const std::string &content) -> std::optional<size_t> {
+        std::regex rheartbeat_interval("heartbeat_interval:\\s*(\\d+)");
+        std::smatch vheartbeat_interval;
+        if (!std::regex_search(content, vheartbeat_interval, rheartbeat_interval)) {
+            std::cerr << ">> Error: invalid or unspecified heartbeat interval\n";
+            return {};
+        }
+
+        return atoll(vheartbeat_interval[1].str().c_str());
+    }
+
+    auto ConfigReader::read_suspicion_timeout(const std::string &content) -> std::optional<size_t> {
+        std::regex rsuspicion_timeout("suspicion_timeout:\\s*(\\d+)");
+        std::smatch vsuspicion_timeout;
+        if (!std::regex_search(content, vsuspicion_timeout, rsuspicion_timeout)) {
+            std::cerr << ">> Error: invalid or unspecified suspicion timeout\n";
+            return {};
+        }
+
+        return atoll(vsuspicion_timeout[1].str().c_str());
+    }
+
+    auto ConfigReader::read_wal_region(const std::string &content) -> std::optional<size_t> {
+        std::regex rwal_region("wal_region:\\s*(\\d+)");
+        std::smatch vwal_region;
+        if (!std::regex_search(content, vwal_region, rwal_region)) {
+            std::cerr << ">> Error: invalid or unspecified WAL region size\n";
+            return {};
+        }
+
+        return atoll(vwal_region[1].str().c_str());
+    }
+
+    auto ConfigReader::read_numa_nodes(const std::string &content) -> std::optional<std::vector<int>> {
+        std::regex rnuma_nodes("numa_nodes:\\s*(\\d+(\\s*,\\s*\\d+)*)");
+        std::smatch vnuma_nodes;
+        if (!std::regex_search(content, vnuma_nodes, rnuma_nodes)) {
+            std::cerr << ">> Error: invalid or unspecified NUMA nodes\n";
+            return {};
+        }
+
+        std::vector<int> nodes;
+        std::regex rnode("\\d+");
+        auto list = vnuma_nodes[1].str();
+        for (auto i = std::sregex_iterator(list.begin(), list.end(), rnode); i != std::sregex_iterator(); i++) {
+            nodes.push_back(atoi(i->str().c_str()));
+        }
+        return nodes;
+    }
+
+    auto ConfigReader::read_nic_numa_node(const std::string &content) -> std::optional<int> {
+        std::regex rnic_numa_node("nic_numa_node:\\s*(\\d+)");
+        std::smatch vnic_numa_node;
+        if (!std::regex_search(content, vnic_numa_node, rnic_numa_node)) {
+            std::cerr << ">> Error: invalid or unspecified NIC NUMA node\n";
+            return {};
+        }
+
+        return atoi(vnic_numa_node[1].str().c_str());
+    }
+
     // for monitor
     // Monitor loops on regex matching, thus no method is offered here
 
@@ -163,4 +289,16 @@ namespace Hill {
 
         return atoi(vgid_idx[1].str().c_str());
     }
+
+    auto ConfigReader::read_ib_latency(const std::string &content) -> std::optional<size_t> {
+        std::regex rib_latency("ib_latency:\\s*(\\d+)");
+        std::smatch vib_latency;
+
+        if (!std::regex_search(content, vib_latency, rib_latency)) {
+            std::cerr << ">> Error: invalid or unspecified loopback latency\n";
+            return {};
+        }
+
+        return atoll(vib_latency[1].str().c_str());
+    }
 }
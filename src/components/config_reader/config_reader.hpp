@@ -3,6 +3,7 @@
 #include <string>
 #include <regex>
 #include <optional>
+#include <vector>
 namespace Hill {
 
     // all methods return a std::optional and I'll just let it crash if value is invalid
@@ -13,6 +14,8 @@ namespace Hill {
         // for engine
         static auto read_node_id(const std::string &content) -> std::optional<int>;
         static auto read_pmem_file(const std::string &content) -> std::optional<std::string>;
+        // all 'pmem_file:' entries in order, one per NUMA node listed in 'numa_nodes:'
+        static auto read_pmem_files(const std::string &content) -> std::optional<std::vector<std::string>>;
         static auto read_total_pm(const std::string &content) -> std::optional<size_t>;
         static auto read_available_pm(const std::string &content) -> std::optional<size_t>;
         static auto read_ip_addr(const std::string &content) -> std::optional<std::string>;
@@ -21,9 +24,25 @@ namespace Hill {
         static auto read_erpc_listen_port(const std::string &content) -> std::optional<int>;
         static auto read_monitor_addr(const std::string &content) -> std::optional<std::string>;
         static auto read_monitor_port(const std::string &content) -> std::optional<int>;
+        // hugepage size used when the data region falls back to DRAM, e.g., 'hugepage: 2M', 0 disables hugetlbfs
+        static auto read_hugepage(const std::string &content) -> std::optional<size_t>;
+        // group commit of the WAL, batch size in commits and timeout in microseconds
+        static auto read_wal_batch(const std::string &content) -> std::optional<size_t>;
+        static auto read_wal_timeout(const std::string &content) -> std::optional<size_t>;
+        // number of log entries in each thread's WAL ring
+        static auto read_wal_region(const std::string &content) -> std::optional<size_t>;
+        // NUMA nodes owning a data region each, e.g., 'numa_nodes: 0, 1'
+        static auto read_numa_nodes(const std::string &content) -> std::optional<std::vector<int>>;
+        // NUMA node the RDMA NIC is attached to
+        static auto read_nic_numa_node(const std::string &content) -> std::optional<int>;
+
+        // milliseconds between heartbeats of a node, and pushes of the monitor
+        static auto read_heartbeat_interval(const std::string &content) -> std::optional<size_t>;
 
         // for monitor
         // Monitor loops on regex matching, thus no method is offered here
+        // milliseconds of silence after which the monitor takes a node as failed
+        static auto read_suspicion_timeout(const std::string &content) -> std::optional<size_t>;
 
         // for client
         static auto read_rpc_uri(const std::string &content) -> std::optional<std::string>;
@@ -32,6 +51,8 @@ namespace Hill {
         static auto read_ib_dev_name(const std::string &content) -> std::optional<std::string>;
         static auto read_ib_port(const std::string &content) -> std::optional<int>;
         static auto read_gid_idx(const std::string &content) -> std::optional<int>;
+        // completion delay of the loopback device in nanoseconds, e.g., 'ib_latency: 2000'
+        static auto read_ib_latency(const std::string &content) -> std::optional<size_t>;
     };
 }
 #endif
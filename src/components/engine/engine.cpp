@@ -38,7 +38,10 @@ namespace Hill {
 
     auto Engine::unregister_thread(int tid) -> void {
         logger->unregister_thread(tid);
-        allocator->unregister_thread(tid);
+        // a thread only holds the slot tid of its own socket's allocator, others are no-ops
+        for (auto &a : allocators) {
+            a->unregister_thread(tid);
+        }
     }
 
     auto Engine::check_rdma_request(int tid) noexcept -> int {
@@ -60,8 +63,10 @@ namespace Hill {
             std::cout << "Got client\n";
         }
 
-        auto [rdma_ctx, status] = rdma_device->open(base, node->total_pm, 12, RDMADevice::get_default_mr_access(),
-                                                    *RDMADevice::get_default_qp_init_attr());
+        // the server is only the passive end of these connections, so they share the PM region's MR and
+        // a CQ group per server thread instead of allocating both per connection
+        auto [rdma_ctx, status] = rdma_device->open(base, region_size * numa_nodes.size(), 12, RDMADevice::get_default_mr_access(),
+                                                    *RDMADevice::get_default_qp_init_attr(), tid);
         if (!rdma_ctx) {
             std::cerr << "Failed to create RDMA, error code: " << decode_rdma_status(status) << "\n";
             return -1;
@@ -99,7 +104,7 @@ namespace Hill {
         }
 
         auto [rdma, status] = rdma_device->open(bufs[tid][node_id].get(), Constants::uLOCAL_BUF_SIZE,
-                                                12, RDMADevice::get_default_mr_access(),
+                                                RDMAContext::uMAX_SEND_WR, RDMADevice::get_default_mr_access(),
                                                 *RDMADevice::get_default_qp_init_attr());
         if (!rdma) {
             std::cerr << "Failed to create RDMA, error code: " << decode_rdma_status(status) << "\n";
@@ -134,6 +139,8 @@ namespace Hill {
         std::cout << "---->> RDMA device: " << rdma_dev_name << "\n";
         std::cout << "---->> ib port: " << ib_port << "\n";
         std::cout << "---->> gid index: " << gid_idx << "\n";
+        std::cout << "---->> sockets: " << numa_nodes.size() << "\n";
+        std::cout << "---->> NIC NUMA node: " << nic_numa_node << "\n";
     }
 
     auto Engine::parse_ib(const std::string &config) noexcept -> bool {
@@ -146,6 +153,10 @@ namespace Hill {
         rdma_dev_name = ConfigReader::read_ib_dev_name(content).value();
         ib_port = ConfigReader::read_ib_port(content).value();
         gid_idx = ConfigReader::read_gid_idx(content).value();
+        ib_latency = 0;
+        if (rdma_dev_name == RDMADevice::sLOOPBACK_DEVICE) {
+            ib_latency = ConfigReader::read_ib_latency(content).value_or(0);
+        }
         return true;
     }
 
@@ -156,14 +167,354 @@ namespace Hill {
         }
         auto content = content_.value();
 
-        if (auto f = ConfigReader::read_pmem_file(content); f.has_value()) {
-            pmem_file = f.value();
+        if (auto f = ConfigReader::read_pmem_files(content); f.has_value()) {
+            pmem_files = f.value();
+            if (pmem_files.size() < numa_nodes.size()) {
+                std::cerr << ">> Error: " << numa_nodes.size() << " NUMA nodes are given but only "
+                          << pmem_files.size() << " pmem files\n";
+                return false;
+            }
+            pmem_files.resize(numa_nodes.size());
             return true;
         } else {
             return false;
         }
     }
 
+    auto Engine::parse_hugepage(const std::string &config) noexcept -> size_t {
+        auto content_ = Misc::file_as_string(config);
+        if (!content_.has_value()) {
+            return Constants::uHUGEPAGE_2M;
+        }
+
+        return ConfigReader::read_hugepage(content_.value()).value_or(Constants::uHUGEPAGE_2M);
+    }
+
+    auto Engine::map_dram(size_t size, size_t hugepage, const std::vector<int> &nodes) noexcept
+        -> std::pair<byte_ptr_t, size_t>
+    {
+        const std::pair<size_t, int> candidates[] = {
+            {Constants::uHUGEPAGE_1G, 30 << MAP_HUGE_SHIFT},
+            {Constants::uHUGEPAGE_2M, 21 << MAP_HUGE_SHIFT},
+        };
+
+        for (const auto &[page, flag] : candidates) {
+            if (page > hugepage) {
+                continue;
+            }
+
+            auto aligned = (size + page - 1) & ~(page - 1);
+            auto addr = mmap(nullptr, aligned * nodes.size(), PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | flag, -1, 0);
+            if (addr == MAP_FAILED) {
+                std::cout << ">> " << (page >> 20) << "MB hugepages are not available: " << strerror(errno) << "\n";
+                continue;
+            }
+
+            auto region = reinterpret_cast<byte_ptr_t>(addr);
+            for (size_t i = 0; i < nodes.size(); i++) {
+                prefault(region + i * aligned, aligned, page, nodes[i]);
+            }
+            std::cout << ">> " << aligned * nodes.size() / 1024 / 1024 / 1024.0 << "GB DRAM is mapped at " << addr
+                      << " with " << (page >> 20) << "MB hugepages\n";
+            return {region, aligned};
+        }
+
+        // fall back to transparent hugepages, the kernel may still give us 4KB pages
+        auto aligned = (size + Constants::uHUGEPAGE_2M - 1) & ~(Constants::uHUGEPAGE_2M - 1);
+        auto addr = mmap(nullptr, aligned * nodes.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED) {
+            return {nullptr, 0};
+        }
+
+        auto thp = madvise(addr, aligned * nodes.size(), MADV_HUGEPAGE) == 0;
+        auto region = reinterpret_cast<byte_ptr_t>(addr);
+        for (size_t i = 0; i < nodes.size(); i++) {
+            prefault(region + i * aligned, aligned, Memory::Constants::uPAGE_SIZE, nodes[i]);
+        }
+        std::cout << ">> " << aligned * nodes.size() / 1024 / 1024 / 1024.0 << "GB DRAM is mapped at " << addr
+                  << (thp ? " with transparent hugepages\n" : " with normal pages\n");
+        return {region, aligned};
+    }
+
+    auto Engine::prefault(byte_ptr_t region, size_t size, size_t page_size, int numa_node) noexcept -> void {
+        if (numa_available() == -1) {
+            numa_node = -1;
+        } else {
+            if (numa_node == -1) {
+                numa_node = numa_node_of_cpu(sched_getcpu());
+            }
+
+            if (numa_node != -1) {
+                numa_tonode_memory(region, size, numa_node);
+            }
+        }
+
+        auto num_threads = std::min(Constants::iPREFAULT_THREADS, int(std::thread::hardware_concurrency()));
+        num_threads = std::max(num_threads, 1);
+        auto pages = size / page_size;
+        auto pages_per_thread = (pages + num_threads - 1) / num_threads;
+
+        std::vector<std::thread> workers;
+        for (int i = 0; i < num_threads; i++) {
+            workers.emplace_back([=]() {
+                if (numa_node != -1) {
+                    numa_run_on_node(numa_node);
+                }
+
+                auto end = std::min(pages, (i + 1) * pages_per_thread);
+                for (auto p = i * pages_per_thread; p < end; p++) {
+                    *reinterpret_cast<volatile byte_t *>(region + p * page_size) = 0;
+                }
+            });
+        }
+
+        for (auto &w : workers) {
+            w.join();
+        }
+    }
+
+    auto Engine::map_pmem(const std::vector<std::string> &files, size_t size, const byte_ptr_t &hint) noexcept
+        -> byte_ptr_t {
+        // reserve the address range first so that all files are mapped contiguously
+        auto addr = mmap(hint, size * files.size(), PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (addr == MAP_FAILED) {
+            return nullptr;
+        }
+
+        if (hint != nullptr && addr != hint) {
+            std::cout << ">> Unable to map pmem at " << reinterpret_cast<void *>(hint) << " where it was formatted\n";
+            munmap(addr, size * files.size());
+            return nullptr;
+        }
+
+        auto base = reinterpret_cast<byte_ptr_t>(addr);
+        for (size_t i = 0; i < files.size(); i++) {
+            auto fd = open(files[i].c_str(), O_RDWR | O_CREAT, 0666);
+            if (fd == -1) {
+                std::cout << ">> Unable to open pmem file " << files[i] << "\n";
+                munmap(addr, size * files.size());
+                return nullptr;
+            }
+
+            if (ftruncate(fd, size) != 0) {
+                std::cout << ">> Unable to map pmem file " << files[i] << "\n";
+                close(fd);
+                munmap(addr, size * files.size());
+                return nullptr;
+            }
+
+            // flushing caches makes stores durable only if the file's blocks are mapped directly, i.e. DAX
+            if (mmap(base + i * size, size, PROT_READ | PROT_WRITE, MAP_SHARED_VALIDATE | MAP_SYNC | MAP_FIXED, fd, 0)
+                == MAP_FAILED) {
+                if (errno == EOPNOTSUPP) {
+                    std::cerr << ">> Error: " << files[i] << " does not support MAP_SYNC, it is not on a DAX file system\n";
+                } else {
+                    std::cout << ">> Unable to map pmem file " << files[i] << "\n";
+                }
+                close(fd);
+                munmap(addr, size * files.size());
+                return nullptr;
+            }
+            close(fd);
+
+            std::cout << ">> " << size / 1024 / 1024 / 1024.0 << "GB pmem from " << files[i] << " is mapped at "
+                      << reinterpret_cast<void *>(base + i * size) << "\n";
+        }
+        return base;
+    }
+
+    auto Engine::parse_numa(const std::string &config) noexcept -> void {
+        numa_nodes = {-1};
+        nic_numa_node = -1;
+
+        auto content_ = Misc::file_as_string(config);
+        if (!content_.has_value() || numa_available() == -1) {
+            return;
+        }
+        auto content = content_.value();
+
+        if (auto nodes = ConfigReader::read_numa_nodes(content); nodes.has_value() && !nodes.value().empty()) {
+            numa_nodes.clear();
+            for (auto n : nodes.value()) {
+                if (n > numa_max_node()) {
+                    std::cerr << ">> Error: NUMA node " << n << " does not exist\n";
+                    continue;
+                }
+                numa_nodes.push_back(n);
+            }
+
+            if (numa_nodes.empty()) {
+                numa_nodes = {-1};
+            }
+        }
+
+        nic_numa_node = ConfigReader::read_nic_numa_node(content).value_or(numa_nodes[0]);
+    }
+
+    auto Engine::parse_wal(const std::string &config, const byte_ptr_t &base) noexcept -> void {
+        auto content = Misc::file_as_string(config).value_or("");
+        auto capacity = std::max(ConfigReader::read_wal_region(content).value_or(WAL::Constants::uREGION_CAPACITY), 1UL);
+        logger = WAL::Logger::make_unique_logger(base, capacity);
+        std::cout << ">> WAL ring: " << capacity << " entries per thread, "
+                  << logger->regions->size() / 1024 / 1024.0 << "MB in total\n";
+        parse_group_commit(config);
+    }
+
+    auto Engine::parse_group_commit(const std::string &config) noexcept -> void {
+        auto content = Misc::file_as_string(config).value_or("");
+        auto batch = ConfigReader::read_wal_batch(content).value_or(WAL::Constants::uBATCH_SIZE);
+        auto timeout = ConfigReader::read_wal_timeout(content).value_or(WAL::Constants::tGROUP_COMMIT_TIMEOUT.count());
+        logger->set_group_commit(batch, std::chrono::microseconds(timeout));
+        std::cout << ">> WAL group commit: " << batch << " commits or " << timeout << "us\n";
+    }
+
+    auto Engine::format_pmem(const std::string &config) noexcept -> bool {
+        auto sockets = numa_nodes.size();
+        if (sockets > size_t(Constants::iMAX_SOCKETS)) {
+            std::cerr << ">> Error: at most " << Constants::iMAX_SOCKETS << " sockets are supported\n";
+            return false;
+        }
+
+        // an old superblock is invalidated before anything it describes is overwritten
+        superblock = Superblock::make_superblock(base, sockets, region_size);
+        auto offset = sizeof(Superblock);
+        parse_wal(config, base + offset);
+        superblock->wal_capacity = logger->regions->capacity;
+        offset += logger->regions->size();
+        agent_state = Memory::RemoteAgentState::make_state();
+        agent = Memory::RemoteMemoryAgent::make_agent(base + offset, &peer_connections[0], agent_state.get());
+        offset += sizeof(Memory::RemoteMemoryAgent);
+
+        node->available_pm = region_size * sockets - offset;
+        std::cout << ">> " << node->available_pm / 1024 / 1024 / 1024.0 << "GB pmem is available\n";
+        for (size_t i = 0; i < sockets; i++) {
+            auto region = base + i * region_size;
+            auto size = region_size;
+            if (i == 0) {
+                region += offset;
+                size -= offset;
+            }
+            allocators.push_back(Memory::Allocator::make_allocator(region, size));
+            superblock->allocators[i] = allocators.back();
+        }
+
+        superblock->seal();
+        return true;
+    }
+
+    auto Engine::reopen_pmem(const std::string &config) noexcept -> bool {
+        superblock = reinterpret_cast<Superblock *>(base);
+        auto sockets = numa_nodes.size();
+        if (superblock->sockets != sockets) {
+            std::cerr << ">> Error: pmem was formatted for " << superblock->sockets << " sockets, "
+                      << sockets << " are configured\n";
+            return false;
+        }
+
+        // the recorded WAL capacity is used, the layout depends on it
+        auto offset = sizeof(Superblock) + WAL::LogRegions::size_of(superblock->wal_capacity);
+        auto agent_offset = offset;
+        offset += sizeof(Memory::RemoteMemoryAgent);
+
+        node->available_pm = region_size * sockets - offset;
+        for (size_t i = 0; i < sockets; i++) {
+            auto region = base + i * region_size;
+            auto size = region_size;
+            if (i == 0) {
+                region += offset;
+                size -= offset;
+            }
+
+            auto allocator = Memory::Allocator::recover_or_makie_allocator(region, size);
+            if (allocator == nullptr || allocator != superblock->allocators[i]) {
+                std::cerr << ">> Error: allocator of region " << i << " is corrupted\n";
+                return false;
+            }
+            allocators.push_back(allocator);
+        }
+
+        // allocations of uncommitted operations are rolled back, trees must not refer to them any more
+        std::mutex lock;
+        logger = WAL::Logger::recover_unique_logger(base + sizeof(Superblock), [&](WAL::LogEntry &e) {
+            std::scoped_lock<std::mutex> _(lock);
+            rolled_back.insert(e.get_address());
+            return true;
+        }, superblock->wal_capacity, Constants::iRECOVERY_THREADS, allocators);
+        if (logger == nullptr) {
+            std::cerr << ">> Error: WAL recovery fails\n";
+            return false;
+        }
+        parse_group_commit(config);
+
+        // remote regions are reclaimed by their owners, the agent starts over
+        agent_state = Memory::RemoteAgentState::make_state();
+        agent = Memory::RemoteMemoryAgent::make_agent(base + agent_offset, &peer_connections[0], agent_state.get());
+
+        uint64_t consumed = 0;
+        for (const auto &a : allocators) {
+            consumed += a->get_consumed();
+        }
+        std::cout << ">> Pmem formatted at " << reinterpret_cast<void *>(superblock->base) << " is re-opened, "
+                  << rolled_back.size() << " uncommitted operations are rolled back, "
+                  << consumed / 1024 / 1024.0 << "MB in use\n";
+        return true;
+    }
+
+    auto Superblock::peek(const std::string &file, byte_ptr_t &base, size_t &region_size) noexcept -> bool {
+        auto fd = open(file.c_str(), O_RDONLY);
+        if (fd == -1) {
+            return false;
+        }
+
+        alignas(Superblock) byte_t buf[sizeof(Superblock)];
+        auto read = pread(fd, buf, sizeof(buf), 0);
+        close(fd);
+        if (read != sizeof(buf)) {
+            return false;
+        }
+
+        auto superblock = reinterpret_cast<const Superblock *>(buf);
+        if (!superblock->is_valid()) {
+            return false;
+        }
+        base = superblock->base;
+        region_size = superblock->region_size;
+        return true;
+    }
+
+    auto Engine::pin_to_socket(int socket) const noexcept -> void {
+        if (socket < 0 || size_t(socket) >= numa_nodes.size() || numa_nodes[socket] == -1) {
+            return;
+        }
+
+        numa_run_on_node(numa_nodes[socket]);
+        numa_set_preferred(numa_nodes[socket]);
+    }
+
+    auto Engine::pin_to_nic() const noexcept -> void {
+        if (nic_numa_node == -1) {
+            return;
+        }
+
+        numa_run_on_node(nic_numa_node);
+        numa_set_preferred(nic_numa_node);
+    }
+
+    auto Engine::report_topology() const noexcept -> void {
+        if (numa_nodes[0] == -1) {
+            std::cout << ">> NUMA topology is not specified, threads are not pinned\n";
+            return;
+        }
+
+        for (size_t i = 0; i < numa_nodes.size(); i++) {
+            std::cout << ">> Socket " << i << " on NUMA node " << numa_nodes[i] << ": "
+                      << region_size / 1024 / 1024 / 1024.0 << "GB data region at "
+                      << reinterpret_cast<void *>(base + i * region_size) << "\n";
+        }
+        std::cout << ">> NIC is on NUMA node " << nic_numa_node << ", eRPC threads are pinned there\n";
+    }
+
     auto Client::connect_monitor() noexcept -> bool {
         run = true;
         monitor_socket = Misc::socket_connect(false, monitor_port, monitor_addr.to_string().c_str());
@@ -172,30 +523,19 @@ namespace Hill {
         }
 
         std::thread updater([&]() {
-            size_t size = 0UL;
-            Misc::recv_all(monitor_socket, &size, sizeof(size));
-            auto buf = std::make_unique<byte_t[]>(size);
-            Misc::recv_all(monitor_socket, buf.get(), size);
-            meta.deserialize(buf.get());
-
-            while(run) {
-                size = meta.total_size();
-                Misc::send_all(monitor_socket, &size, sizeof(size));
-                buf = meta.serialize();
-                Misc::send_all(monitor_socket, buf.get(), size);
-
-                Misc::recv_all(monitor_socket, &size, sizeof(size));
-                buf = std::make_unique<byte_t[]>(size);
-                Misc::recv_all(monitor_socket, buf.get(), size);
-
-                Cluster::ClusterMeta tmp;
-                tmp.deserialize(buf.get());
-                meta.update(tmp);
+            // a Snapshot first, then whatever changes, see Cluster::MessageHeader
+            Cluster::MessageHeader header;
+            std::vector<byte_t> body;
+            while(run && Cluster::recv_message(monitor_socket, header, body)) {
+                if (!meta.apply(header, body.data())) {
+                    std::cerr << ">> Error: malformed message from monitor\n";
+                    break;
+                }
 #ifdef __HILL_DEBUG__
                 meta.dump();
 #endif
-                sleep(1);
             }
+            shutdown(monitor_socket, 0);
         });
         updater.detach();
 
@@ -228,7 +568,7 @@ namespace Hill {
         }
 
         auto [rdma, status] = rdma_device->open(bufs[tid][node_id].get(), Constants::uLOCAL_BUF_SIZE,
-                                                12, RDMADevice::get_default_mr_access(),
+                                                RDMAContext::uMAX_SEND_WR, RDMADevice::get_default_mr_access(),
                                                 *RDMADevice::get_default_qp_init_attr());
         if (!rdma) {
             std::cerr << "Failed to create RDMA, error code: " << decode_rdma_status(status) << "\n";
@@ -275,12 +615,22 @@ namespace Hill {
         return server_connections[tid][node_id]->post_read(remote_ptr, msg_len);
     }
 
+    auto Client::post_batch_to(int tid, int node_id, const WorkRequest *requests, size_t num) noexcept
+        -> RDMAUtil::StatusPair
+    {
+        if (node_id <= 0 || size_t(node_id) >= Cluster::Constants::uMAX_NODE) {
+            return {RDMAUtil::Status::InvalidArguments, -1};
+        }
+
+        return server_connections[tid][node_id]->post_batch(requests, num);
+    }
+
     auto Client::poll_completion_once(int tid, int node_id) noexcept -> void {
         if (node_id <= 0 || size_t(node_id) >= Cluster::Constants::uMAX_NODE) {
             return;
         }
 
-        server_connections[tid][node_id]->poll_one_completion();
+        server_connections[tid][node_id]->poll_completion_once();
     }
 
     auto Client::parse_ib(const std::string &config) noexcept -> bool {
@@ -293,6 +643,10 @@ namespace Hill {
         rdma_dev_name = ConfigReader::read_ib_dev_name(content).value();
         ib_port = ConfigReader::read_ib_port(content).value();
         gid_idx = ConfigReader::read_gid_idx(content).value();
+        ib_latency = 0;
+        if (rdma_dev_name == RDMADevice::sLOOPBACK_DEVICE) {
+            ib_latency = ConfigReader::read_ib_latency(content).value_or(0);
+        }
         return true;
     }
 }
@@ -11,8 +11,11 @@
 #include <shared_mutex>
 #include <atomic>
 #include <cstring>
+#include <unordered_set>
 
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <numa.h>
 namespace Hill {
     /*
      * This engine manages all RDMA connections, communications with monitor and the whole PM resource on one node
@@ -21,16 +24,18 @@ namespace Hill {
      *
      * PM is divided as follows
      * |----------------------------|
+     * |         Superblock         |
+     * |----------------------------|
      * |                            |
      * |      Thread-local WAL      |
      * |                            |
      * |----------------------------|
+     * |    Remote Memory Agents    |
+     * |----------------------------|
      * |                            |
      * |   Local Memory Allocator   |
      * |                            |
      * |  ------------------------  |
-     * |    Remote Memory Agents    |
-     * |----------------------------|
      * |                            |
      * |        Data Region         |
      * |                            |
@@ -40,14 +45,105 @@ namespace Hill {
      * |                            |
      * |----------------------------|
      *
+     * The superblock records how PM was formatted and the leaf head of each partition. If a valid superblock
+     * is found on startup, PM is mapped at the address it was formatted at, the allocators are recovered, the
+     * WAL rolls back uncommitted operations and the trees are re-opened from their heads instead of formatting.
+     *
      * The read cache is placed in DRAM
+     *
+     * If no pmem file is given, the whole region above is placed in DRAM backed by hugepages (hugetlbfs first,
+     * transparent hugepages otherwise) and pre-faulted by threads running on the local NUMA node so that
+     * warm-up does not suffer from page fault storms.
      */
     using namespace Memory::TypeAliases;
     using namespace RDMAUtil;
 
     namespace Constants {
         constexpr size_t uLOCAL_BUF_SIZE = 16 * 1024;
+        constexpr size_t uHUGEPAGE_2M = 2 * 1024 * 1024;
+        constexpr size_t uHUGEPAGE_1G = 1024 * 1024 * 1024;
+        constexpr int iPREFAULT_THREADS = 8;
+        constexpr int iRECOVERY_THREADS = 8;
+        constexpr int iMAX_SOCKETS = 8;
+        constexpr uint64_t uSUPERBLOCK_MAGIC = 0x48494c4c53555052UL;
+        // bump this whenever the PM layout changes, PM of another version is never re-opened
+        // 2: leaves carry version and tail_version
+        // 3: HillStringHeader grows to 8 bytes with a stamp, leaves carry stamps
+        // 4: log laps skip 0
+        // 5: leaves carry a checksum
+        constexpr uint64_t uSUPERBLOCK_VERSION = 5;
     }
+
+    /*
+     * !!!NEVER INHERIT FROM ANY OTHER STRUCT OR CLASS!!!
+     * The superblock sits at the very beginning of the first PM region. PM holds absolute pointers, so base
+     * is recorded and PM is only re-opened at the same address. magic is written last, a superblock without
+     * it is a half-formatted PM.
+     */
+    struct alignas(64) Superblock {
+        uint64_t magic;
+        uint64_t version;
+        byte_ptr_t base;
+        size_t sockets;
+        size_t region_size;
+        size_t wal_capacity;
+        Memory::Allocator *allocators[Constants::iMAX_SOCKETS];
+        int partitions;
+        byte_ptr_t partition_heads[Memory::Constants::iTHREAD_LIST_NUM];
+
+        Superblock() = delete;
+        ~Superblock() = delete;
+        Superblock(const Superblock &) = delete;
+        Superblock(Superblock &&) = delete;
+        auto operator=(const Superblock &) = delete;
+        auto operator=(Superblock &&) = delete;
+
+        // the superblock is sealed by seal() once everything else is formatted
+        static auto make_superblock(const byte_ptr_t &ptr, size_t sockets, size_t region_size) -> Superblock * {
+            auto tmp = reinterpret_cast<Superblock *>(ptr);
+            tmp->magic = 0;
+            tmp->version = Constants::uSUPERBLOCK_VERSION;
+            tmp->base = ptr;
+            tmp->sockets = sockets;
+            tmp->region_size = region_size;
+            tmp->wal_capacity = 0;
+            for (auto &a : tmp->allocators) {
+                a = nullptr;
+            }
+            tmp->partitions = 0;
+            for (auto &h : tmp->partition_heads) {
+                h = nullptr;
+            }
+            Memory::Util::persist(tmp, sizeof(Superblock));
+            return tmp;
+        }
+
+        /*
+         * Read the superblock of the first pmem file without mapping it, so that the file is mapped at the
+         * recorded base with the recorded size. Returns false if there is no valid superblock.
+         */
+        static auto peek(const std::string &file, byte_ptr_t &base, size_t &region_size) noexcept -> bool;
+
+        inline auto is_valid() const noexcept -> bool {
+            return magic == Constants::uSUPERBLOCK_MAGIC && version == Constants::uSUPERBLOCK_VERSION;
+        }
+
+        inline auto seal() noexcept -> void {
+            Memory::Util::persist(this, sizeof(Superblock));
+            magic = Constants::uSUPERBLOCK_MAGIC;
+            Memory::Util::persist(&magic, sizeof(magic));
+        }
+
+        inline auto set_partitions(int num) noexcept -> void {
+            partitions = num;
+            Memory::Util::persist(&partitions, sizeof(partitions));
+        }
+
+        inline auto set_partition_head(int partition, const byte_ptr_t &head) noexcept -> void {
+            partition_heads[partition] = head;
+            Memory::Util::persist(&partition_heads[partition], sizeof(byte_ptr_t));
+        }
+    };
     
     class Engine {
     public:
@@ -63,44 +159,59 @@ namespace Hill {
          */
         static auto make_engine(const std::string &config) -> std::unique_ptr<Engine> {
             auto ret = std::make_unique<Engine>();
-            auto offset = 0UL;
             ret->node = Cluster::Node::make_node(config);
             if (!ret->parse_ib(config)) {
                 return nullptr;
             }
 
+            ret->parse_numa(config);
+            auto sockets = ret->numa_nodes.size();
             if (!ret->parse_pmem(config)) {
                 std::cout << ">> Pmem is not specified, using DRAM instead\n";
-                ret->base = new byte_t[ret->node->available_pm];
+                auto [region, region_size] = map_dram(ret->node->available_pm / sockets, ret->parse_hugepage(config),
+                                                      ret->numa_nodes);
+                if (region == nullptr) {
+                    std::cout << ">> Unable to map DRAM region\n";
+                    std::cout << ">> Errno is " << errno << ": " << strerror(errno) << "\n";
+                    return nullptr;
+                }
+                ret->base = region;
+                ret->region_size = region_size;
+                // DRAM never survives a restart
+                ret->recovered = false;
             } else {
-                size_t mapped_size;
-                ret->base = reinterpret_cast<byte_ptr_t>(pmem_map_file(ret->pmem_file.c_str(),
-                                                                       ret->node->available_pm,
-                                                                       PMEM_FILE_CREATE, 0666,
-                                                                       &mapped_size, nullptr));
+                ret->region_size = sockets > 1 ? (ret->node->available_pm / sockets) & ~(Constants::uHUGEPAGE_2M - 1)
+                                               : ret->node->available_pm;
+                byte_ptr_t hint = nullptr;
+                size_t recorded_size = 0;
+                if (Superblock::peek(ret->pmem_files[0], hint, recorded_size)) {
+                    if (recorded_size != ret->region_size) {
+                        std::cerr << ">> Error: pmem was formatted with " << recorded_size << " bytes per region, "
+                                  << ret->region_size << " bytes are configured\n";
+                        return nullptr;
+                    }
+                }
+
+                ret->base = map_pmem(ret->pmem_files, ret->region_size, hint);
                 if (ret->base == nullptr) {
-                    std::cout << ">> Unable to map pmem file " << ret->pmem_file << "\n";
+                    std::cout << ">> Unable to map pmem files\n";
                     std::cout << ">> Errno is " << errno << ": " << strerror(errno) << "\n";
                     return nullptr;
-                } else {
-                    std::cout << ">> " << mapped_size / 1024 / 1024 / 1024.0 << "GB pmem is mapped at "
-                              << reinterpret_cast<void *>(ret->base) << "\n";
                 }
+                ret->recovered = hint != nullptr;
             }
 
-            ret->logger = WAL::Logger::make_unique_logger(ret->base);
-            // regions are the data part
-            offset += sizeof(WAL::LogRegions);
-            ret->agent = Memory::RemoteMemoryAgent::make_agent(ret->base + offset, &ret->peer_connections[0]);
-            offset += sizeof(Memory::RemoteMemoryAgent);
-            ret->node->available_pm -= offset;
-            std::cout << ">> " << ret->node->available_pm / 1024 / 1024 / 1024.0 << "GB pmem is available\n";
-            ret->allocator = Memory::Allocator::make_allocator(ret->base + offset, ret->node->available_pm);
+            // superblock, WAL and remote memory agent live at the head of the first region
+            if (!(ret->recovered ? ret->reopen_pmem(config) : ret->format_pmem(config))) {
+                return nullptr;
+            }
+            ret->report_topology();
 
             auto [rdma_device, status] = RDMADevice::make_rdma(ret->rdma_dev_name, ret->ib_port, ret->gid_idx);
             if (status != Status::Ok) {
                 return nullptr;
             }
+            rdma_device->set_injected_latency(std::chrono::nanoseconds(ret->ib_latency));
             
             ret->rdma_device = std::move(rdma_device);
 
@@ -147,10 +258,64 @@ namespace Hill {
             return logger.get();
         }
 
+        // allocator of the first data region, which also hosts the WAL and the remote memory agent
         inline auto get_allocator() noexcept -> Memory::Allocator * {
-            return allocator;
+            return allocators[0];
+        }
+
+        inline auto get_allocator(int socket) noexcept -> Memory::Allocator * {
+            return allocators[socket];
+        }
+
+        // true if PM of a previous run is re-opened instead of formatted
+        inline auto is_recovered() const noexcept -> bool {
+            return recovered;
+        }
+
+        // number of partitions PM was populated with, 0 if the partitions are not set up yet
+        inline auto get_partitions() const noexcept -> int {
+            return superblock->partitions;
+        }
+
+        inline auto set_partitions(int num) noexcept -> void {
+            superblock->set_partitions(num);
+        }
+
+        // first leaf of a partition's tree, nullptr if the partition has no tree yet
+        inline auto get_partition_head(int partition) const noexcept -> byte_ptr_t {
+            return superblock->partition_heads[partition];
+        }
+
+        inline auto set_partition_head(int partition, const byte_ptr_t &head) noexcept -> void {
+            superblock->set_partition_head(partition, head);
         }
 
+        // whether ptr was allocated by an operation the WAL rolled back during recovery
+        inline auto is_rolled_back(const byte_ptr_t &ptr) const noexcept -> bool {
+            return rolled_back.count(ptr) != 0;
+        }
+
+        inline auto get_consumed() const noexcept -> uint64_t {
+            uint64_t consumed = 0;
+            for (const auto &a : allocators) {
+                consumed += a->get_consumed();
+            }
+            return consumed;
+        }
+
+        inline auto get_sockets() const noexcept -> int {
+            return numa_nodes.size();
+        }
+
+        // partitions are assigned to sockets in contiguous blocks
+        inline auto socket_of(int partition, int num_partitions) const noexcept -> int {
+            return partition * int(numa_nodes.size()) / num_partitions;
+        }
+
+        // bind the calling thread to the CPUs of the given socket or to those near the NIC
+        auto pin_to_socket(int socket) const noexcept -> void;
+        auto pin_to_nic() const noexcept -> void;
+
         inline auto get_agent() noexcept -> Memory::RemoteMemoryAgent * {
             return agent;
         }
@@ -164,20 +329,32 @@ namespace Hill {
         }
 
         auto dump() const noexcept -> void;
+        auto report_topology() const noexcept -> void;
 
     private:
         std::unique_ptr<Cluster::Node> node;
 
         // logger has some runtime data, thus is a smart pointer
         std::unique_ptr<WAL::Logger> logger;
-        Memory::Allocator *allocator;
+        // one allocator per socket, each managing the data region placed on that socket
+        std::vector<Memory::Allocator *> allocators;
+        // NUMA node of each data region, {-1} if the topology is not configured
+        std::vector<int> numa_nodes;
+        int nic_numa_node;
+        size_t region_size;
 
         std::unique_ptr<RDMADevice> rdma_device;
         std::string rdma_dev_name;
         int ib_port;
         int gid_idx;
-        std::string pmem_file;
+        // nanoseconds, only for the loopback device
+        size_t ib_latency;
+        std::vector<std::string> pmem_files;
         byte_ptr_t base;
+        Superblock *superblock;
+        bool recovered;
+        // addresses rolled back by WAL recovery, trees drop entries referring to them
+        std::unordered_set<byte_ptr_t> rolled_back;
         bool run;
         std::atomic_int tids;
 
@@ -185,11 +362,39 @@ namespace Hill {
         std::array<std::unique_ptr<RDMAContext>, Cluster::Constants::uMAX_NODE> peer_connections[Memory::Constants::iTHREAD_LIST_NUM];
         std::array<std::unique_ptr<byte_t[]>, Cluster::Constants::uMAX_NODE> bufs[Memory::Constants::iTHREAD_LIST_NUM];
         Memory::RemoteMemoryAgent *agent;
+        // what the agent keeps in DRAM, it is rebuilt on every start
+        std::unique_ptr<Memory::RemoteAgentState> agent_state;
 
         std::vector<std::unique_ptr<RDMAContext>> client_connections[Memory::Constants::iTHREAD_LIST_NUM];
 
         auto parse_ib(const std::string &config) noexcept -> bool;
         auto parse_pmem(const std::string &config) noexcept -> bool;
+        auto parse_numa(const std::string &config) noexcept -> void;
+        // creates the logger at base, rings are sized and group commit is tuned by config
+        auto parse_wal(const std::string &config, const byte_ptr_t &base) noexcept -> void;
+        auto parse_group_commit(const std::string &config) noexcept -> void;
+        // lay out the superblock, WAL, agent and allocators on PM
+        auto format_pmem(const std::string &config) noexcept -> bool;
+        // recover the allocators and the WAL recorded by the superblock
+        auto reopen_pmem(const std::string &config) noexcept -> bool;
+        // returns the requested hugepage size, 2MB if not specified
+        auto parse_hugepage(const std::string &config) noexcept -> size_t;
+
+        /*
+         * Map one anonymous DRAM region of at least size bytes for each NUMA node in nodes. The regions are
+         * contiguous so that a single MR covers all of them. hugetlbfs pages no larger than hugepage are tried
+         * first, then transparent hugepages. Each region is bound to and faulted in on its node. Returns the
+         * base and the (page aligned) size of each region.
+         */
+        static auto map_dram(size_t size, size_t hugepage, const std::vector<int> &nodes) noexcept
+            -> std::pair<byte_ptr_t, size_t>;
+        static auto prefault(byte_ptr_t region, size_t size, size_t page_size, int numa_node) noexcept -> void;
+        /*
+         * Map each pmem file at size bytes apart in one reserved address range. If hint is given, the range
+         * must start exactly at hint, otherwise nothing is mapped.
+         */
+        static auto map_pmem(const std::vector<std::string> &files, size_t size, const byte_ptr_t &hint = nullptr)
+            noexcept -> byte_ptr_t;
     };
 
     class Client {
@@ -222,6 +427,7 @@ namespace Hill {
             if (status != Status::Ok) {
                 return nullptr;
             }
+            rdma_device->set_injected_latency(std::chrono::nanoseconds(ret->ib_latency));
             ret->rdma_device = std::move(rdma_device);
             return ret;
         }
@@ -235,6 +441,8 @@ namespace Hill {
         }
         auto write_to(int tid, int node_id, const byte_ptr_t &remote_ptr, const byte_ptr_t &msg, size_t msg_len) noexcept -> RDMAUtil::StatusPair;
         auto read_from(int tid, int node_id, const byte_ptr_t &remote_ptr, size_t msg_len) noexcept -> RDMAUtil::StatusPair;
+        // post requests to node_id behind one doorbell, their local pieces lie in get_buf(tid, node_id)
+        auto post_batch_to(int tid, int node_id, const WorkRequest *requests, size_t num) noexcept -> RDMAUtil::StatusPair;
         auto poll_completion_once(int tid, int node_id) noexcept -> void;
         inline auto rdma_buf_as_char(int tid, int node_id) -> const char * {
             return server_connections[tid][node_id]->get_char_buf();
@@ -272,6 +480,8 @@ namespace Hill {
         std::string rdma_dev_name;
         int ib_port;
         int gid_idx;
+        // nanoseconds, only for the loopback device
+        size_t ib_latency;
 
         Cluster::IPV4Addr addr;
         int port;
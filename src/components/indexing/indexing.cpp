@@ -4,6 +4,8 @@ namespace Hill {
         auto LeafNode::insert(int tid, WAL::Logger *log,
                               Memory::Allocator *alloc,
                               Memory::RemoteMemoryAgent *agent,
+                              Memory::RemoteWriter *writer,
+                              PendingWrite *pending,
                               const char *k, size_t k_sz,
                               const char *v, size_t v_sz,
                               const hill_key_t *hk,
@@ -35,10 +37,15 @@ namespace Hill {
                 keys[j] = keys[j - 1];
                 values[j] = values[j - 1];
                 value_sizes[j] = value_sizes[j - 1];
+                stamps[j] = stamps[j - 1];
             }
+            values[i] = nullptr;
+            value_sizes[i] = 0;
+            stamps[i] = 0;
 
             auto &ptr = log->make_log(tid, WAL::Enums::Ops::Insert);
             alloc->allocate(tid, sizeof(KVPair::HillStringHeader) + k_sz, ptr);
+            log->seal(tid);
             auto fp = CityHash64(k, k_sz);
             memcpy(ptr, hk, hk->object_size());
             fingerprints[i] = fp;
@@ -52,30 +59,70 @@ namespace Hill {
             auto total = sizeof(KVPair::HillStringHeader) + v_sz;
             if (!agent) {
                 alloc->allocate(tid, total, v_ptr);
+                log->seal(tid);
                 memcpy(v_ptr, hv, hv->object_size());
                 // KVPair::HillString::make_string(v_ptr, v, v_sz);
+                stamps[i] = reinterpret_cast<KVPair::HillString *>(v_ptr)->restamp();
                 values[i] = Memory::PolymorphicPointer::make_polymorphic_pointer(v_ptr);
                 value_sizes[i] = total;
             } else {
                 agent->allocate(tid, total, v_ptr);
+                log->seal(tid);
                 if (v_ptr == nullptr) {
+                    log->commit(tid);
+                    withdraw(tid, log, alloc, i);
                     return {Enums::OpStatus::NoMemory, nullptr};
                 }
-                values[i] = Memory::PolymorphicPointer::make_polymorphic_pointer(v_ptr);
-                value_sizes[i] = total;
-                auto &connection = agent->get_peer_connection(tid, values[i].remote_ptr().get_node());
-                auto buf = std::make_unique<byte_t[]>(total);
 
                 Memory::RemotePointer rp(v_ptr);
-                auto &t = KVPair::HillString::make_string(buf.get(), v, v_sz);
-                connection->post_write(rp.get_as<byte_ptr_t>(), t.raw_bytes(), total);
-                connection->poll_completion_once();
+                auto &connection = agent->get_peer_connection(tid, rp.get_node());
+                // the value is built right in the registered buffer, the write needs no extra copy
+                auto staged = writer->stage(connection.get(), rp.get_node(), total);
+                if (staged == nullptr) {
+                    // e.g., a value larger than the staging buffer, the key must not stay without a value
+                    agent->free(tid, rp);
+                    log->commit(tid);
+                    withdraw(tid, log, alloc, i);
+                    return {Enums::OpStatus::Failed, nullptr};
+                }
+                auto stamp = KVPair::HillString::make_string(staged, v, v_sz).restamp();
+                value_sizes[i] = total;
+                *pending = {keys[i], rp, staged, total, stamp};
+
+                // a crash before the value is published drops the key, just like a crash before the value is
+                // logged, the remote memory is recovered by its owner
+                log->commit(tid);
+                return {Enums::OpStatus::Pending, rp};
             }
             log->commit(tid);
 
             return {Enums::OpStatus::Ok, values[i]};
         }
 
+        auto LeafNode::withdraw(int tid, WAL::Logger *log, Memory::Allocator *alloc, int i) -> void {
+            auto key = keys[i];
+            log->make_log(tid, WAL::Enums::Ops::Delete, reinterpret_cast<byte_ptr_t>(key));
+            log->seal(tid);
+
+            for (int j = i; j < Constants::iNUM_HIGHKEY - 1; j++) {
+                fingerprints[j] = fingerprints[j + 1];
+                keys[j] = keys[j + 1];
+                values[j] = values[j + 1];
+                value_sizes[j] = value_sizes[j + 1];
+                stamps[j] = stamps[j + 1];
+            }
+            fingerprints[Constants::iNUM_HIGHKEY - 1] = 0;
+            keys[Constants::iNUM_HIGHKEY - 1] = nullptr;
+            values[Constants::iNUM_HIGHKEY - 1] = nullptr;
+            value_sizes[Constants::iNUM_HIGHKEY - 1] = 0;
+            stamps[Constants::iNUM_HIGHKEY - 1] = 0;
+
+            key->invalidate();
+            auto kp = reinterpret_cast<byte_ptr_t>(key);
+            alloc->free(tid, kp);
+            log->commit(tid);
+        }
+
         auto LeafNode::dump() const noexcept -> void {
             std::stringstream ss;
             ss << this;
@@ -159,16 +206,33 @@ namespace Hill {
         }
 
         auto OLFIT::insert(int tid, const char *k, size_t k_sz, const char *v, size_t v_sz,
-                           const hill_key_t *hk, const hill_value_t *hv)
+                           const hill_key_t *hk, const hill_value_t *hv, const WriteCallback &done)
             noexcept -> std::pair<Enums::OpStatus, Memory::PolymorphicPointer>
         {
+            // staging never waits inside a leaf, callbacks of retired writes look keys up in the tree
+            auto r_agent = spilling ? agent : nullptr;
+            if (r_agent != nullptr && !writer->has_room(sizeof(KVPair::HillStringHeader) + v_sz)) {
+                writer->drain();
+            }
+
+            PendingWrite pending{nullptr, nullptr, nullptr, 0, 0};
             auto node = traverse_node(k, k_sz);
 
             if (!node->is_full()) {
-                return node->insert(tid, logger, alloc, agent, k, k_sz, v, v_sz, hk, hv);
+                node->begin_write();
+                auto ret = node->insert(tid, logger, alloc, r_agent, writer.get(), &pending, k, k_sz, v, v_sz, hk, hv);
+                node->end_write();
+                if (ret.first == Enums::OpStatus::Pending) {
+                    return submit_write(tid, pending, false, done);
+                }
+                return ret;
             }
 
-            auto [new_leaf, value] = split_leaf(tid, node, k, k_sz, v, v_sz, hk, hv);
+            // the new leaf is not known to clients before this operation returns
+            node->begin_write();
+            auto [new_leaf, status, value] = split_leaf(tid, node, k, k_sz, v, v_sz, hk, hv, &pending);
+            node->end_write();
+            auto ret = Enums::OpStatus::Ok;
             // root is a leaf
             if (!node->parent) {
                 auto new_root = InnerNode::make_inner();
@@ -177,23 +241,95 @@ namespace Hill {
                 new_root->children[1] = new_leaf;
                 node->parent = new_leaf->parent = new_root;
                 root = new_root;
-                return {Enums::OpStatus::Ok, value};
+            } else {
+                ret = push_up(new_leaf);
+            }
+
+            // the split stands even if the key is not inserted, the leaf has taken the key back
+            if (status == Enums::OpStatus::Failed || status == Enums::OpStatus::NoMemory) {
+                return {status, nullptr};
             }
 
-            auto ret = push_up(new_leaf);
+            // the new leaf is reachable now, so the callback is able to find the key
+            if (pending.key != nullptr) {
+                return submit_write(tid, pending, false, done);
+            }
             return {ret, value};
         }
 
+        auto OLFIT::submit_write(int tid, const PendingWrite &w, bool is_update, const WriteCallback &done)
+            -> std::pair<Enums::OpStatus, Memory::PolymorphicPointer>
+        {
+            std::pair<Enums::OpStatus, Memory::PolymorphicPointer> ret{Enums::OpStatus::Pending, nullptr};
+            // without done, the result is reported right here after the write is waited for
+            auto result = done == nullptr ? &ret : nullptr;
+            pending_keys.insert(w.key);
+            writer->submit(w.remote.get_node(), w.staged, w.size, w.remote.get_as<byte_ptr_t>(),
+                           [this, tid, w, is_update, done, result](bool ok) {
+                               pending_keys.erase(w.key);
+                               auto remote = w.remote;
+                               auto [leaf, i] = get_pos_of(w.key->raw_chars(), w.key->size());
+                               Memory::PolymorphicPointer value = nullptr;
+                               auto status = Enums::OpStatus::Failed;
+                               if (!ok || i == -1) {
+                                   // an unpublished key is dropped like a removed one
+                                   if (!is_update) {
+                                       w.key->invalidate();
+                                   }
+                                   agent->free(tid, remote);
+                               } else if (!is_update) {
+                                   leaf->begin_write();
+                                   leaf->values[i] = remote;
+                                   leaf->stamps[i] = w.stamp;
+                                   leaf->end_write();
+                                   value = leaf->values[i];
+                                   status = Enums::OpStatus::Ok;
+                               } else {
+                                   auto r = leaf->values[i];
+                                   leaf->begin_write();
+                                   leaf->values[i] = remote;
+                                   leaf->value_sizes[i] = w.size;
+                                   leaf->stamps[i] = w.stamp;
+                                   leaf->end_write();
+                                   // the swap is committed when the write is submitted
+                                   if (r.is_local()) {
+                                       auto old = r.local_ptr();
+                                       reinterpret_cast<KVPair::HillString *>(old)->invalidate();
+                                       alloc->free(tid, old);
+                                   } else {
+                                       // other writes may be in flight
+                                       retired.emplace_back(tid, r.remote_ptr());
+                                   }
+                                   value = leaf->values[i];
+                                   status = Enums::OpStatus::Ok;
+                               }
+
+                               if (result != nullptr) {
+                                   *result = {status, value};
+                               } else {
+                                   done(status, value);
+                               }
+                           });
+
+            if (result != nullptr) {
+                writer->drain();
+            }
+            return ret;
+        }
+
         auto OLFIT::split_leaf(int tid, LeafNode *l, const char *k, size_t k_sz, const char *v, size_t v_sz,
-                               const hill_key_t *hk, const hill_value_t *hv)
-            -> std::pair<LeafNode *, Memory::PolymorphicPointer> {
+                               const hill_key_t *hk, const hill_value_t *hv, PendingWrite *pending)
+            -> std::tuple<LeafNode *, Enums::OpStatus, Memory::PolymorphicPointer> {
 #ifdef __HILL_PINDEX__
             auto &ptr = logger->make_log(tid, WAL::Enums::Ops::NodeSplit);
             alloc->allocate(tid, sizeof(LeafNode), ptr);
+            logger->seal(tid);
 #else
             auto ptr = new byte_t[sizeof(LeafNode)];
 #endif
             auto n = LeafNode::make_leaf(ptr);
+            // sealed with a checksum before clients learn it, see LeafNode::begin_write
+            n->begin_write();
             n->parent = l->parent;
             n->next = l->next;
             l->next = n;
@@ -215,6 +351,7 @@ namespace Hill {
                 n->keys[k - split] = l->keys[k];
                 n->values[k - split] = l->values[k];
                 n->value_sizes[k - split] = l->value_sizes[k];
+                n->stamps[k - split] = l->stamps[k];
             }
 
             for (int k = split; k < Constants::iNUM_HIGHKEY; k++) {
@@ -222,19 +359,18 @@ namespace Hill {
                 l->keys[k] = nullptr;
                 l->values[k] = nullptr;
                 l->value_sizes[k] = 0;
+                l->stamps[k] = 0;
             }
 
-            Memory::PolymorphicPointer ret_ptr;
-            if (i < Constants::iNUM_HIGHKEY / 2) {
-                ret_ptr = l->insert(tid, logger, alloc, agent, k, k_sz, v, v_sz, hk, hv).second;
-            } else {
-                ret_ptr = n->insert(tid, logger, alloc, agent, k, k_sz, v, v_sz, hk, hv).second;
-            }
+            auto target = i < Constants::iNUM_HIGHKEY / 2 ? l : n;
+            auto [status, ret_ptr] = target->insert(tid, logger, alloc, spilling ? agent : nullptr, writer.get(),
+                                                    pending, k, k_sz, v, v_sz, hk, hv);
 
+            n->end_write();
             // Here node split is done in terms of recovery, because inner nodes are reconstructed from
             // leaf nodes, thus though new node is not added to ancestors, split is still finished.
             logger->commit(tid);
-            return {n, ret_ptr};
+            return {n, status, ret_ptr};
         }
 
         auto OLFIT::split_inner(InnerNode *l, const hill_key_t *splitkey, PolymorphicNodePointer child) -> std::pair<InnerNode *, hill_key_t *> {
@@ -327,18 +463,96 @@ namespace Hill {
             return Enums::OpStatus::Ok;
         }
 
-        auto OLFIT::search(const char *k, size_t k_sz) const noexcept -> std::pair<Memory::PolymorphicPointer, size_t> {
-            auto [leaf, i] = get_pos_of(k, k_sz);
+        auto OLFIT::rebuild(const std::function<bool(const byte_ptr_t &)> &discard) -> size_t {
+            size_t leaves = 0;
+            size_t dropped = 0;
+            LeafNode *last = nullptr;
+            for (auto l = root.get_as<LeafNode *>(); l != nullptr; l = l->next) {
+                ++leaves;
+                // parents of the previous run are gone
+                l->parent = nullptr;
+                // a crash may leave a write open
+                l->version = l->tail_version = 0;
+
+                int j = 0;
+                for (int i = 0; i < Constants::iNUM_HIGHKEY && l->keys[i] != nullptr; i++) {
+                    // a crash between logging the key and the value leaves a key without value
+                    if (l->values[i].is_nullptr() || discard(reinterpret_cast<byte_ptr_t>(l->keys[i])) ||
+                        discard(l->values[i].raw_ptr())) {
+                        ++dropped;
+                        continue;
+                    }
+                    l->fingerprints[j] = l->fingerprints[i];
+                    l->keys[j] = l->keys[i];
+                    l->values[j] = l->values[i];
+                    l->value_sizes[j] = l->value_sizes[i];
+                    l->stamps[j] = l->stamps[i];
+                    ++j;
+                }
+                for (; j < Constants::iNUM_HIGHKEY; j++) {
+                    l->fingerprints[j] = 0;
+                    l->keys[j] = nullptr;
+                    l->values[j] = nullptr;
+                    l->value_sizes[j] = 0;
+                    l->stamps[j] = 0;
+                }
+                l->checksum = l->content_checksum();
+#ifdef __HILL_PMEM__
+                Memory::Util::flush(l, sizeof(LeafNode));
+#endif
+
+                if (last == nullptr) {
+                    last = l;
+                    continue;
+                }
+
+                // an empty leaf stays in the chain but is never routed to, the leaf before it covers its range
+                if (l->keys[0] == nullptr) {
+                    l->parent = last->parent;
+                    continue;
+                }
+
+                // leaves are pushed up in key order, exactly like splits of the rightmost leaf
+                if (last->parent == nullptr) {
+                    auto new_root = InnerNode::make_inner();
+                    new_root->keys[0] = l->keys[0];
+                    new_root->children[0] = last;
+                    new_root->children[1] = l;
+                    last->parent = l->parent = new_root;
+                    root = new_root;
+                } else {
+                    l->parent = last->parent;
+                    push_up(l);
+                }
+                last = l;
+            }
+#ifdef __HILL_PMEM__
+            Memory::Util::sfence();
+#endif
+
+#ifdef __HILL_INFO__
+            std::cout << ">> OLFIT rebuilt from " << leaves << " leaves, " << dropped << " uncommitted entries dropped\n";
+#endif
+            return leaves;
+        }
+
+        auto OLFIT::search(const char *k, size_t k_sz, LeafFence *fence) const noexcept
+            -> std::pair<Memory::PolymorphicPointer, size_t>
+        {
+            auto [leaf, i] = get_pos_of(k, k_sz, fence);
             if (i == -1) {
                 return {nullptr, 0};
             }
             if (leaf->keys[i]->compare(k, k_sz) == 0) {
+                if (fence != nullptr) {
+                    fence->stamp = leaf->stamps[i];
+                }
                 return {leaf->values[i], leaf->value_sizes[i]};
             }
             return {nullptr, 0};
         }
 
-        auto OLFIT::update(int tid, const char *k, size_t k_sz, const char *v, size_t v_sz)
+        auto OLFIT::update(int tid, const char *k, size_t k_sz, const char *v, size_t v_sz, const WriteCallback &done)
             noexcept -> std::pair<Enums::OpStatus, Memory::PolymorphicPointer>
         {
             auto [leaf, i] = get_pos_of(k, k_sz);
@@ -346,95 +560,294 @@ namespace Hill {
                 return {Enums::OpStatus::Failed, nullptr};
             }
 
-            auto &ptr = logger->make_log(tid, WAL::Enums::Ops::Update);
+            // the value in flight has to land before it is replaced
             auto total = sizeof(KVPair::HillStringHeader) + v_sz;
-            if (!agent) {
-                alloc->allocate(tid, total, ptr);
-                if (ptr == nullptr) {
-                    return {Enums::OpStatus::NoMemory, nullptr};
-                }
-
-                KVPair::HillString::make_string(ptr, v, v_sz);
-                auto &old = logger->make_log(tid, WAL::Enums::Ops::Delete);
-                old = leaf->values[i].get_as<byte_ptr_t>();
-                leaf->values[i] = ptr;
-                leaf->value_sizes[i] = v_sz;
-                alloc->free(tid, old);
+            if (pending_keys.count(leaf->keys[i]) != 0 || (spilling && !writer->has_room(total))) {
+                writer->drain();
+            }
 
-                logger->commit(tid);
-            } else {
-                agent->allocate(tid, total, ptr);
+            auto &ptr = logger->make_log(tid, WAL::Enums::Ops::Update);
+            if (!spilling) {
+                alloc->allocate(tid, total, ptr);
                 if (ptr == nullptr) {
+                    logger->commit(tid);
                     return {Enums::OpStatus::NoMemory, nullptr};
                 }
 
-                auto &old = logger->make_log(tid, WAL::Enums::Ops::Delete);
-                old = leaf->values[i].remote_ptr().raw_ptr();
-
+                // both entries are durable with a single fence before the leaf changes
                 auto r = leaf->values[i];
+                auto &old = logger->make_log(tid, WAL::Enums::Ops::Delete, r.raw_ptr());
+                logger->seal(tid);
+                auto stamp = KVPair::HillString::make_string(ptr, v, v_sz).restamp();
+                leaf->begin_write();
                 leaf->values[i] = ptr;
-                leaf->value_sizes[i] = v_sz;
-
-                auto &connection = agent->get_peer_connection(tid, leaf->values[i].remote_ptr().get_node());
-                auto buf = std::make_unique<byte_t[]>(total);
-                auto &t = KVPair::HillString::make_string(buf.get(), v, v_sz);
-
-                Memory::RemotePointer rp(ptr);
-                connection->post_write(rp.get_as<byte_ptr_t>(), t.raw_bytes(), total);
-                connection->poll_completion_once() ;
-
+                leaf->value_sizes[i] = total;
+                leaf->stamps[i] = stamp;
+                leaf->end_write();
+                // the old value may have been spilled before spilling stopped
                 if (r.is_local()) {
+                    reinterpret_cast<KVPair::HillString *>(old)->invalidate();
                     alloc->free(tid, old);
                 } else {
-                    auto remote = r.remote_ptr();
-                    agent->free(tid, remote);
+                    retired.emplace_back(tid, r.remote_ptr());
                 }
 
                 logger->commit(tid);
+                return {Enums::OpStatus::Ok, leaf->values[i]};
+            }
+
+            // remote memory is recovered by its owner, the entries are sealed once the old value is logged too
+            agent->allocate(tid, total, ptr);
+            if (ptr == nullptr) {
+                logger->commit(tid);
+                return {Enums::OpStatus::NoMemory, nullptr};
             }
+
+            Memory::RemotePointer rp(ptr);
+            auto &connection = agent->get_peer_connection(tid, rp.get_node());
+            auto staged = writer->stage(connection.get(), rp.get_node(), total);
+            if (staged == nullptr) {
+                // the operation is closed here as in LeafNode::insert, the next one must not take the freed value in
+                agent->free(tid, rp);
+                logger->commit(tid);
+                return {Enums::OpStatus::Failed, nullptr};
+            }
+            auto stamp = KVPair::HillString::make_string(staged, v, v_sz).restamp();
+
+            // the old value is swapped and freed once the new one is written, see submit_write
+            logger->make_log(tid, WAL::Enums::Ops::Delete, leaf->values[i].raw_ptr());
+            logger->seal(tid);
             logger->commit(tid);
-            return {Enums::OpStatus::Ok, leaf->values[i]};
+            return submit_write(tid, {leaf->keys[i], rp, staged, total, stamp}, true, done);
         }
 
         auto OLFIT::remove(int tid, const char *k, size_t k_sz) noexcept -> Enums::OpStatus {
+            // the registered buffers are about to be used directly
+            drain_writes();
             auto [leaf, i] = get_pos_of(k, k_sz);
             if (i == -1) {
                 return Enums::OpStatus::Failed;
             }
 
-            if (leaf->values[i].is_remote()) {
-                auto &ptr = logger->make_log(tid, WAL::Enums::Ops::Delete);
-                ptr = reinterpret_cast<byte_ptr_t>(leaf->keys[i]);
-                // we only need to remember the key here because leaf node is a natural log recording both key and value
-                leaf->keys[i]->invalidate();
-
-                auto &connection = agent->get_peer_connection(tid, leaf->values[i].remote_ptr().get_node());
-                KVPair::HillStringHeader buf {
-                    .valid = 0,
-                    .length = 0,
-                };
-
-                connection->post_write(leaf->values[i].get_as<byte_ptr_t>(),
-                                       reinterpret_cast<uint8_t *>(&buf),
-                                       sizeof(KVPair::HillStringHeader));
-                connection->poll_completion_once();
-                leaf->keys[i]->invalidate();
-                alloc->free(tid, ptr);
+            // we only need to remember the key here because leaf node is a natural log recording both key and value
+            auto key = leaf->keys[i];
+            auto value = leaf->values[i];
+            auto &ptr = logger->make_log(tid, WAL::Enums::Ops::Delete, reinterpret_cast<byte_ptr_t>(key));
+            logger->seal(tid);
+
+            // later keys move left so that the leaf stays sorted and dense, clients having read it notice
+            leaf->begin_write();
+            for (int j = i; j < Constants::iNUM_HIGHKEY - 1; j++) {
+                leaf->fingerprints[j] = leaf->fingerprints[j + 1];
+                leaf->keys[j] = leaf->keys[j + 1];
+                leaf->values[j] = leaf->values[j + 1];
+                leaf->value_sizes[j] = leaf->value_sizes[j + 1];
+                leaf->stamps[j] = leaf->stamps[j + 1];
+            }
+            leaf->keys[Constants::iNUM_HIGHKEY - 1] = nullptr;
+            leaf->values[Constants::iNUM_HIGHKEY - 1] = nullptr;
+            leaf->value_sizes[Constants::iNUM_HIGHKEY - 1] = 0;
+            leaf->stamps[Constants::iNUM_HIGHKEY - 1] = 0;
+            leaf->end_write();
+
+            key->invalidate();
+            if (value.is_remote()) {
+                auto remote = value.remote_ptr();
+                release_remote(tid, remote);
             } else {
-                auto &ptr = logger->make_log(tid, WAL::Enums::Ops::Delete);
-                ptr = reinterpret_cast<byte_ptr_t>(leaf->keys[i]);
-                auto vp = reinterpret_cast<byte_ptr_t>(leaf->values[i].local_ptr());
-                leaf->values[i].get_as<KVPair::HillString *>()->invalidate();
-                leaf->keys[i]->invalidate();
+                auto vp = value.local_ptr();
+                value.get_as<KVPair::HillString *>()->invalidate();
                 alloc->free(tid, vp);
+            }
+
+            // the first key of a leaf may be a split key of its ancestors, which still compare with it
+            if (i != 0) {
                 alloc->free(tid, ptr);
             }
             logger->commit(tid);
             return Enums::OpStatus::Ok;
         }
 
+        auto OLFIT::for_each_slot(const std::string &from, const std::string &end,
+                                  const std::function<bool(LeafNode *, int)> &f) const -> bool
+        {
+            for (auto leaf = traverse_node(from.c_str(), from.size()); leaf != nullptr; leaf = leaf->next) {
+                for (int i = 0; i < Constants::iNUM_HIGHKEY && leaf->keys[i] != nullptr; i++) {
+                    auto key = leaf->keys[i];
+                    if (!key->is_valid() || leaf->values[i].is_nullptr() || key->compare(from.c_str(), from.size()) < 0) {
+                        continue;
+                    }
+
+                    if (key->compare(end.c_str(), end.size()) >= 0) {
+                        return true;
+                    }
+
+                    if (!f(leaf, i)) {
+                        return false;
+                    }
+                }
+            }
+            return true;
+        }
+
+        auto OLFIT::export_range(int tid, const std::string &from, const std::string &end,
+                                 const std::function<bool(const hill_key_t *, const hill_value_t *)> &f) noexcept
+            -> Enums::OpStatus
+        {
+            // values in flight are not published yet
+            drain_writes();
+            auto status = Enums::OpStatus::Ok;
+            for_each_slot(from, end, [&](LeafNode *leaf, int i) {
+                if (leaf->values[i].is_local()) {
+                    if (!f(leaf->keys[i], leaf->values[i].get_as<hill_value_t *>())) {
+                        status = Enums::OpStatus::Retry;
+                        return false;
+                    }
+                    return true;
+                }
+
+                auto remote = leaf->values[i].remote_ptr();
+                auto size = leaf->value_sizes[i];
+                auto &connection = agent->get_peer_connection(tid, remote.get_node());
+                if (connection == nullptr || size > connection->get_staging_size()) {
+                    status = Enums::OpStatus::Failed;
+                    return false;
+                }
+
+                connection->post_read(remote.get_as<byte_ptr_t>(), size);
+                connection->poll_completion_once();
+                if (!f(leaf->keys[i], reinterpret_cast<const hill_value_t *>(connection->get_staging_buf()))) {
+                    status = Enums::OpStatus::Retry;
+                    return false;
+                }
+                return true;
+            });
+            return status;
+        }
+
+        auto OLFIT::remove_range(int tid, const std::string &from, const std::string &end,
+                                 const std::function<void(const std::string &)> &removed) noexcept -> size_t
+        {
+            // keys are collected first, a removal moves the slots of its leaf
+            std::vector<std::string> batch;
+            auto cursor = from;
+            size_t ret = 0;
+            for (auto done = false; !done;) {
+                batch.clear();
+                done = for_each_slot(cursor, end, [&](LeafNode *leaf, int i) {
+                    batch.push_back(leaf->keys[i]->to_string());
+                    return batch.size() < Constants::uREMOVAL_BATCH;
+                });
+
+                for (const auto &k : batch) {
+                    if (removed != nullptr) {
+                        removed(k);
+                    }
+                    if (remove(tid, k.c_str(), k.size()) == Enums::OpStatus::Ok) {
+                        ++ret;
+                    }
+                }
+
+                if (!batch.empty()) {
+                    // the least string greater than the last key
+                    cursor = batch.back() + '\0';
+                }
+            }
+            return ret;
+        }
+
+        auto OLFIT::migrate_home(int tid, size_t budget) noexcept -> size_t {
+            if (agent == nullptr) {
+                return 0;
+            }
+            drain_writes();
+
+            if (migration_cursor == nullptr) {
+                auto node = root;
+                while (!node.is_leaf()) {
+                    node = node.get_as<InnerNode *>()->children[0];
+                }
+                migration_cursor = node.get_as<LeafNode *>();
+            }
+
+            size_t moved = 0;
+            for (int visited = 0; visited < Constants::iMIGRATION_LEAVES && moved < budget; visited++) {
+                auto leaf = migration_cursor;
+                for (int i = 0; i < Constants::iNUM_HIGHKEY && leaf->keys[i] != nullptr && moved < budget; i++) {
+                    if (!leaf->keys[i]->is_valid() || !leaf->values[i].is_remote()) {
+                        continue;
+                    }
+
+                    auto remote = leaf->values[i].remote_ptr();
+                    auto size = leaf->value_sizes[i];
+                    auto &connection = agent->get_peer_connection(tid, remote.get_node());
+                    if (connection == nullptr || size > connection->get_staging_size()) {
+                        continue;
+                    }
+
+                    auto &ptr = logger->make_log(tid, WAL::Enums::Ops::Insert);
+                    alloc->allocate(tid, size, ptr);
+                    if (ptr == nullptr) {
+                        logger->commit(tid);
+                        return moved;
+                    }
+                    // the remote copy stays intact until the swap is committed
+                    logger->make_log(tid, WAL::Enums::Ops::Delete, remote.raw_ptr());
+                    logger->seal(tid);
+
+                    connection->post_read(remote.get_as<byte_ptr_t>(), size);
+                    connection->poll_completion_once();
+                    memcpy(ptr, connection->get_staging_buf(), size);
+#ifdef __HILL_PMEM__
+                    Memory::Util::persist(ptr, size);
+#endif
+
+                    leaf->begin_write();
+                    leaf->values[i] = ptr;
+                    leaf->end_write();
+                    logger->commit(tid);
+                    release_remote(tid, remote);
+                    ++moved;
+                }
+
+                // the next call starts over from the leftmost leaf once the chain is done
+                migration_cursor = leaf->next;
+                if (migration_cursor == nullptr) {
+                    break;
+                }
+            }
+            return moved;
+        }
+
+        auto OLFIT::release_remote(int tid, Memory::RemotePointer &remote) -> void {
+            auto &connection = agent->get_peer_connection(tid, remote.get_node());
+            KVPair::HillStringHeader buf {
+                .valid = 0,
+                .length = 0,
+                .stamp = 0,
+            };
+
+            connection->post_write(remote.get_as<byte_ptr_t>(), reinterpret_cast<uint8_t *>(&buf),
+                                   sizeof(KVPair::HillStringHeader));
+            connection->poll_completion_once();
+            agent->free(tid, remote);
+        }
+
+        auto OLFIT::release_retired() -> void {
+            for (auto &[tid, remote] : retired) {
+                release_remote(tid, remote);
+            }
+            retired.clear();
+        }
+
         auto OLFIT::scan(const char *k, size_t k_sz, size_t num) -> std::vector<ScanHolder> {
             std::vector<ScanHolder> ret;
+            scan(k, k_sz, num, ret);
+            return ret;
+        }
+
+        auto OLFIT::scan(const char *k, size_t k_sz, size_t num, std::vector<ScanHolder> &ret) -> void {
+            ret.clear();
             ret.reserve(num);
 
             auto leaf = traverse_node(k, k_sz);
@@ -442,6 +855,7 @@ namespace Hill {
             for (; cursor < Constants::iNUM_HIGHKEY; cursor++) {
                 if (leaf->keys[cursor] == nullptr) {
                     leaf = leaf->next;
+                    cursor = 0;
                     break;
                 }
                 if (leaf->keys[cursor]->compare(k, k_sz) >= 0)
@@ -452,6 +866,9 @@ namespace Hill {
                 for (; cursor < Constants::iNUM_HIGHKEY && num > 0; cursor++) {
                     if (leaf->keys[cursor] == nullptr)
                         break;
+                    // the value is still being written
+                    if (leaf->values[cursor].is_nullptr())
+                        continue;
                     ret.emplace_back(leaf->keys[cursor], leaf->values[cursor]);
                     --num;
                 }
@@ -459,8 +876,67 @@ namespace Hill {
                 leaf = leaf->next;
                 cursor = 0;
             }
+        }
 
-            return ret;
+        auto LeafDirectory::find(const char *k, size_t k_sz) const -> LeafNode * {
+            if (partitions.empty()) {
+                return nullptr;
+            }
+
+            auto &ranges = partitions[partition_of(k, k_sz)];
+            std::string key(k, k_sz);
+            auto it = ranges.upper_bound(key);
+            if (it == ranges.begin()) {
+                return nullptr;
+            }
+
+            --it;
+            if (!it->second.high.empty() && key >= it->second.high) {
+                return nullptr;
+            }
+            return it->second.leaf;
+        }
+
+        auto LeafDirectory::learn(size_t num_partitions, const char *k, size_t k_sz, const std::string &low,
+                                  const std::string &high, LeafNode *leaf) -> void
+        {
+            // servers never change their partitioning while running, a new one invalidates everything
+            if (partitions.size() != num_partitions) {
+                partitions.clear();
+                partitions.resize(num_partitions);
+            }
+
+            auto &ranges = partitions[partition_of(k, k_sz)];
+            auto it = ranges.lower_bound(low);
+            if (it != ranges.begin()) {
+                auto prev = std::prev(it);
+                if (prev->second.high.empty() || prev->second.high > low) {
+                    ranges.erase(prev);
+                }
+            }
+
+            while (it != ranges.end() && (high.empty() || it->first < high)) {
+                it = ranges.erase(it);
+            }
+            ranges.emplace(low, Range{high, leaf});
+        }
+
+        auto LeafDirectory::forget(const char *k, size_t k_sz) -> void {
+            if (partitions.empty()) {
+                return;
+            }
+
+            auto &ranges = partitions[partition_of(k, k_sz)];
+            std::string key(k, k_sz);
+            auto it = ranges.upper_bound(key);
+            if (it == ranges.begin()) {
+                return;
+            }
+
+            --it;
+            if (it->second.high.empty() || key < it->second.high) {
+                ranges.erase(it);
+            }
         }
 
         auto OLFIT::dump() const noexcept -> void {
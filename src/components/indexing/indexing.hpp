@@ -12,6 +12,11 @@
 #include <vector>
 #include <atomic>
 #include <cstring>
+#include <functional>
+#include <unordered_set>
+#include <map>
+#include <string>
+#include <tuple>
 
 namespace Hill {
     namespace Indexing {
@@ -26,6 +31,10 @@ namespace Hill {
             static constexpr int iDEGREE = 16;
             static constexpr int iNUM_HIGHKEY = iDEGREE - 1;
 #endif
+            // leaves one migrate_home call looks at, bounds the work of a call finding few remote values
+            static constexpr int iMIGRATION_LEAVES = 64;
+            // keys remove_range collects before removing them, which bounds its DRAM
+            static constexpr size_t uREMOVAL_BATCH = 4096;
         }
 
         namespace Enums {
@@ -36,6 +45,8 @@ namespace Hill {
                 NoMemory,
                 NeedSplit,
                 RepeatInsert,
+                // the value is still being written to remote memory, the result is reported by a callback
+                Pending,
                 Unkown,
             };
 
@@ -46,15 +57,30 @@ namespace Hill {
             };
         }
 
+        // a value staged for Memory::RemoteWriter, its leaf entry is published once the write completes
+        struct PendingWrite {
+            hill_key_t *key;
+            Memory::RemotePointer remote;
+            byte_ptr_t staged;
+            size_t size;
+            uint64_t stamp;
+        };
+
         // these two structure has similar memory layout for runtime polymorphism, change it with caution
         struct InnerNode;
         struct LeafNode {
             InnerNode *parent;
+            // version and tail_version bracket the content of a leaf and checksum covers it, see begin_write
+            uint64_t version;
             uint64_t fingerprints[Constants::iNUM_HIGHKEY];
             hill_key_t *keys[Constants::iNUM_HIGHKEY];
             Memory::PolymorphicPointer values[Constants::iNUM_HIGHKEY];
             size_t value_sizes[Constants::iNUM_HIGHKEY];
+            // copies of the stamps in the value headers, see KVPair::next_stamp
+            uint64_t stamps[Constants::iNUM_HIGHKEY];
             LeafNode *next;
+            uint64_t tail_version;
+            uint64_t checksum;
 
             LeafNode() = delete;
             // All nodes are on PM, not in heap or stack
@@ -70,10 +96,13 @@ namespace Hill {
                     tmp->keys[i] = nullptr;
                     tmp->values[i] = nullptr;
                     tmp->value_sizes[i] = 0;
+                    tmp->stamps[i] = 0;
                     tmp->fingerprints[i] = 0;
                 }
                 tmp->parent = nullptr;
                 tmp->next = nullptr;
+                tmp->version = tmp->tail_version = 0;
+                tmp->checksum = tmp->content_checksum();
                 return tmp;
             }
 
@@ -81,10 +110,59 @@ namespace Hill {
                 return keys[Constants::iNUM_HIGHKEY - 1] != nullptr;
             }
 
+            // from fingerprints up to next, i.e., everything a client reads out of a leaf image
+            inline auto content_checksum() const noexcept -> uint64_t {
+                auto begin = reinterpret_cast<const char *>(fingerprints);
+                return CityHash64(begin, reinterpret_cast<const char *>(&tail_version) - begin);
+            }
+
+            /*
+             * Clients read leaves with one-sided RDMA reads. Neither IB nor PCIe orders the cache lines of a read
+             * spanning many of them, so the versions alone may come from one write and the slots from another.
+             * Every change to a leaf is bracketed by begin_write and end_write, which seals the content with a
+             * checksum. An image is taken only if its versions agree and are even and its content matches the
+             * checksum, a torn image fails the latter whatever order its lines landed in.
+             */
+            inline auto begin_write() noexcept -> void {
+                auto v = version + 1;
+                tail_version = v;
+                Memory::Util::mfence();
+                version = v;
+            }
+
+            inline auto end_write() noexcept -> void {
+                checksum = content_checksum();
+                Memory::Util::mfence();
+                auto v = version + 1;
+                tail_version = v;
+                version = v;
+            }
+
+            inline auto is_stable() const noexcept -> bool {
+                return version == tail_version && (version & 1) == 0 && checksum == content_checksum();
+            }
+
+            // the slot of a published value whose key has fingerprint fp, -1 if none, also for a leaf image
+            inline auto probe(uint64_t fp) const noexcept -> int {
+                for (int i = 0; i < Constants::iNUM_HIGHKEY && keys[i] != nullptr; i++) {
+                    if (fingerprints[i] == fp && !values[i].is_nullptr()) {
+                        return i;
+                    }
+                }
+                return -1;
+            }
+
+            /*
+             * With an agent, the value is allocated remotely and staged in writer, the status is Pending and
+             * pending describes the write. values[i] stays nullptr until the write is published.
+             */
             auto insert(int tid, WAL::Logger *log, Memory::Allocator *alloc, Memory::RemoteMemoryAgent *agent,
+                        Memory::RemoteWriter *writer, PendingWrite *pending,
                         const char *k, size_t k_sz, const char *v, size_t v_sz,
                         const hill_key_t *hk, const hill_value_t *hv)
                 -> std::pair<Enums::OpStatus, Memory::PolymorphicPointer>;
+            // take back the key just inserted at slot i whose value can not be written, later keys move left
+            auto withdraw(int tid, WAL::Logger *log, Memory::Allocator *alloc, int i) -> void;
             auto dump() const noexcept -> void;
         };
 
@@ -204,15 +282,71 @@ namespace Hill {
             auto operator=(ScanHolder &&) -> ScanHolder& = default;
         };
 
+        // a leaf and the bounds [low, high) its parents route to it, nullptr bounds are unbounded
+        struct LeafFence {
+            LeafNode *leaf;
+            const hill_key_t *low;
+            const hill_key_t *high;
+            // stamp of the value found by a search
+            uint64_t stamp;
+        };
+
+        /*
+         * Client side directory of the leaves of remote trees, it stands in for the upper levels of the trees,
+         * which stay in server DRAM. Ranges are learnt from search responses, keys are routed to partitions
+         * the way servers do it. A range may be outdated, e.g., by a split, the leaf image tells.
+         */
+        class LeafDirectory {
+        public:
+            LeafDirectory() = default;
+            ~LeafDirectory() = default;
+            LeafDirectory(const LeafDirectory &) = delete;
+            LeafDirectory(LeafDirectory &&) = delete;
+            auto operator=(const LeafDirectory &) -> LeafDirectory & = delete;
+            auto operator=(LeafDirectory &&) -> LeafDirectory & = delete;
+
+            // the remote leaf covering k, nullptr if unknown
+            auto find(const char *k, size_t k_sz) const -> LeafNode *;
+            // leaf covers [low, high) in the partition of k, an empty bound is unbounded
+            auto learn(size_t num_partitions, const char *k, size_t k_sz, const std::string &low,
+                       const std::string &high, LeafNode *leaf) -> void;
+            auto forget(const char *k, size_t k_sz) -> void;
+
+            inline auto size() const noexcept -> size_t {
+                size_t ret = 0;
+                for (const auto &p : partitions) {
+                    ret += p.size();
+                }
+                return ret;
+            }
+
+        private:
+            struct Range {
+                std::string high;
+                LeafNode *leaf;
+            };
+            // low bound -> range, one map per partition
+            std::vector<std::map<std::string, Range>> partitions;
+
+            inline auto partition_of(const char *k, size_t k_sz) const -> size_t {
+                return CityHash64(k, k_sz) % partitions.size();
+            }
+        };
+
         class OLFIT {
         public:
+            // final status and value of a Pending write
+            using WriteCallback = std::function<void(Enums::OpStatus, Memory::PolymorphicPointer)>;
+
             // for convenience of testing
             OLFIT(int tid, Memory::Allocator *alloc_, WAL::Logger *logger_)
-                : root(nullptr), alloc(alloc_), logger(logger_), agent(nullptr) {
+                : root(nullptr), alloc(alloc_), logger(logger_), agent(nullptr), spilling(false),
+                  migration_cursor(nullptr) {
                 // NodeSplit is also for new root node creation
                 auto &ptr = logger->make_log(tid, WAL::Enums::Ops::NodeSplit);
                 // crashing here is ok, because no memory allocation is done;
                 alloc->allocate(tid, sizeof(LeafNode), ptr);
+                logger->seal(tid);
                 /*
                  * crash here is ok, allocation is done. Crash in the allocation function
                  * is fine because on recovery, the allocator scans memory regions to restore
@@ -221,6 +355,18 @@ namespace Hill {
                 root = LeafNode::make_leaf(ptr);
                 logger->commit(tid);
             }
+
+            /*
+             * Re-open a tree whose leaves survived a restart. Leaves stay where they are, inner nodes are
+             * rebuilt by walking the leaf chain from head. Entries whose key or value is reported by discard,
+             * e.g., rolled back by WAL recovery, are dropped.
+             */
+            OLFIT(LeafNode *head, Memory::Allocator *alloc_, WAL::Logger *logger_,
+                  const std::function<bool(const byte_ptr_t &)> &discard)
+                : root(head), alloc(alloc_), logger(logger_), agent(nullptr), spilling(false),
+                  migration_cursor(nullptr) {
+                rebuild(discard);
+            }
             ~OLFIT() = default;
 
             static auto make_olfit(Memory::Allocator *alloc, WAL::Logger *logger) -> std::unique_ptr<OLFIT> {
@@ -251,23 +397,102 @@ namespace Hill {
 
             // external interfaces use const char * as input
             // hk and hv are for PM write accelaration
+            /*
+             * A value spilled to remote memory is written asynchronously. With done, Pending is returned and done
+             * is called once the write completes, see poll_writes. Without done, the write is waited for.
+             */
             auto insert(int tid, const char *k, size_t k_sz, const char *v, size_t v_sz,
-                        const hill_key_t *hk, const hill_value_t *hv)
+                        const hill_key_t *hk, const hill_value_t *hv, const WriteCallback &done = nullptr)
                 noexcept -> std::pair<Enums::OpStatus, Memory::PolymorphicPointer>;
             
-            auto search(const char *k, size_t k_sz) const noexcept -> std::pair<Memory::PolymorphicPointer, size_t>;
-            auto update(int tid, const char *k, size_t k_sz, const char *v, size_t v_sz)
+            // with fence, the leaf of k and its bounds are reported as well
+            auto search(const char *k, size_t k_sz, LeafFence *fence = nullptr) const noexcept
+                -> std::pair<Memory::PolymorphicPointer, size_t>;
+            auto update(int tid, const char *k, size_t k_sz, const char *v, size_t v_sz,
+                        const WriteCallback &done = nullptr)
                 noexcept -> std::pair<Enums::OpStatus, Memory::PolymorphicPointer>;
             auto remove(int tid, const char *k, size_t k_sz) noexcept -> Enums::OpStatus;
+
+            /*
+             * Hand the keys in [from, end) and their values to f in key order. A remote value is read into the
+             * staging buffer of its connection, so it is only valid during its call. Returns Ok once every key
+             * is handed over, Retry if f returns false and Failed if a remote value can not be read.
+             */
+            auto export_range(int tid, const std::string &from, const std::string &end,
+                              const std::function<bool(const hill_key_t *, const hill_value_t *)> &f) noexcept
+                -> Enums::OpStatus;
+
+            // remove the keys in [from, end), removed is told of each key first, returns the number removed
+            auto remove_range(int tid, const std::string &from, const std::string &end,
+                              const std::function<void(const std::string &)> &removed = nullptr) noexcept -> size_t;
             auto scan(const char *k, size_t k_sz, size_t num) -> std::vector<ScanHolder>;
+            // results replace the content of out, reuse out across scans to avoid allocations
+            auto scan(const char *k, size_t k_sz, size_t num, std::vector<ScanHolder> &out) -> void;
             
             inline auto get_root() const noexcept -> PolymorphicNodePointer {
                 return root;
             }
             
+            // new values are spilled to remote memory from now on
             inline auto enable_agent(Memory::RemoteMemoryAgent *agent_) -> void {
                 agent = agent_;
+                spilling = true;
+                if (writer == nullptr) {
+                    writer = Memory::RemoteWriter::make_writer();
+                }
+            }
+
+            // new values stay local again, the agent is kept for values already spilled
+            inline auto stop_spilling() noexcept -> void {
+                spilling = false;
+            }
+
+            inline auto is_spilling() const noexcept -> bool {
+                return spilling;
             }
+
+            inline auto has_agent() const noexcept -> bool {
+                return agent != nullptr;
+            }
+
+            /*
+             * Copy up to budget remote values back to local PM and free their remote copies, the swap of each
+             * value is a WAL-protected operation. Leaves are walked from where the last call stopped. Returns
+             * the number of values moved.
+             */
+            auto migrate_home(int tid, size_t budget) noexcept -> size_t;
+
+            // run callbacks of completed remote writes, never blocks
+            inline auto poll_writes() -> size_t {
+                if (writer == nullptr) {
+                    return 0;
+                }
+                auto ret = writer->poll();
+                if (!retired.empty() && writer->pending() == 0) {
+                    release_retired();
+                }
+                return ret;
+            }
+
+            // post queued remote writes
+            inline auto flush_writes() -> void {
+                if (writer != nullptr) {
+                    writer->flush();
+                }
+            }
+
+            // wait for every remote write
+            inline auto drain_writes() -> void {
+                if (writer != nullptr && writer->pending() != 0) {
+                    writer->drain();
+                }
+                release_retired();
+            }
+
+            inline auto pending_writes() const noexcept -> size_t {
+                return writer == nullptr ? 0 : writer->pending();
+            }
+
             auto dump() const noexcept -> void;
 
         private:
@@ -275,8 +500,24 @@ namespace Hill {
             Memory::Allocator *alloc;
             WAL::Logger *logger;
             Memory::RemoteMemoryAgent *agent;
+            bool spilling;
+            // next leaf migrate_home looks at, nullptr to start over from the leftmost leaf
+            LeafNode *migration_cursor;
+            // DRAM side, writes of spilled values and keys they are not published for yet
+            std::unique_ptr<Memory::RemoteWriter> writer;
+            std::unordered_set<const hill_key_t *> pending_keys;
+            /*
+             * Replaced remote values, with the tid freeing them. Their headers are invalidated before they are
+             * freed so that clients holding cached pointers notice, which takes the connections while no write
+             * is in flight, see release_retired.
+             */
+            std::vector<std::pair<int, Memory::RemotePointer>> retired;
+
+            auto traverse_node(const char *k, size_t k_sz, LeafFence *fence = nullptr) const noexcept -> LeafNode * {
+                if (fence != nullptr) {
+                    fence->low = fence->high = nullptr;
+                }
 
-            auto traverse_node(const char *k, size_t k_sz) const noexcept -> LeafNode * {
                 if (root.is_leaf()) {
                     return root.get_as<LeafNode *>();
                 }
@@ -286,14 +527,19 @@ namespace Hill {
                 InnerNode *inner;
                 while (!current.is_leaf()) {
                     inner = current.get_as<InnerNode *>();
-                    next = find_next(inner, k, k_sz);
+                    next = find_next(inner, k, k_sz, fence);
                     current = next;
                 }
                 return current.get_as<LeafNode *>();
             }
 
-            auto get_pos_of(const char *k, size_t k_sz) const noexcept -> std::pair<LeafNode *, int> {
-                auto leaf = traverse_node(k, k_sz);
+            auto get_pos_of(const char *k, size_t k_sz, LeafFence *fence = nullptr) const noexcept
+                -> std::pair<LeafNode *, int>
+            {
+                auto leaf = traverse_node(k, k_sz, fence);
+                if (fence != nullptr) {
+                    fence->leaf = leaf;
+                }
                 auto fp = CityHash64(k, k_sz);
                 int i = 0;
                 for (i = 0; i < Constants::iNUM_HIGHKEY; i++) {
@@ -313,28 +559,52 @@ namespace Hill {
             }
 
             // follow the original paper of OLFIT, OT
-            auto find_next(InnerNode *current, const char *k, size_t k_sz) const noexcept -> PolymorphicNodePointer {
+            // children[i] covers [keys[i - 1], keys[i]), fence narrows to it
+            auto find_next(InnerNode *current, const char *k, size_t k_sz, LeafFence *fence = nullptr) const noexcept
+                -> PolymorphicNodePointer
+            {
                 PolymorphicNodePointer ret;
                 hill_key_t *tmp = nullptr;
                 int i;
                 for (i = 0; i < Constants::iNUM_HIGHKEY; i++) {
                     tmp = current->keys[i];
                     if (tmp == nullptr || tmp->compare(k, k_sz) > 0) {
-                            return current->children[i];                                
+                        break;
+                    }
+                }
+
+                if (fence != nullptr) {
+                    if (i > 0) {
+                        fence->low = current->keys[i - 1];
+                    }
+                    if (i < Constants::iNUM_HIGHKEY && current->keys[i] != nullptr) {
+                        fence->high = current->keys[i];
                     }
                 }
                 return current->children[i];
             }
 
-            // split an old node and return a new node with keys migrated
+            // split an old node and return a new node with keys migrated, with the status and value of k
             auto split_leaf(int tid, LeafNode *l, const char *k, size_t k_sz, const char *v, size_t v_sz,
-                            const hill_key_t *hk, const hill_value_t *hv)
-                -> std::pair<LeafNode *, Memory::PolymorphicPointer>;
+                            const hill_key_t *hk, const hill_value_t *hv, PendingWrite *pending)
+                -> std::tuple<LeafNode *, Enums::OpStatus, Memory::PolymorphicPointer>;
+            // submit a staged value, the value replaces the old one of its key on update
+            auto submit_write(int tid, const PendingWrite &w, bool is_update, const WriteCallback &done)
+                -> std::pair<Enums::OpStatus, Memory::PolymorphicPointer>;
+            // invalidate the header of a remote value and free it, no remote write may be in flight
+            auto release_remote(int tid, Memory::RemotePointer &remote) -> void;
+            auto release_retired() -> void;
             // split_inner is seperated from split leaf because they have different memory policies
             auto split_inner(InnerNode *l, const hill_key_t *splitkey, PolymorphicNodePointer child)
                 -> std::pair<InnerNode *, hill_key_t *>;
             // push up split keys to ancestors
             auto push_up(LeafNode *new_leaf) -> Enums::OpStatus;
+            // call f with the leaf and slot of each published key in [from, end) in key order until f returns
+            // false, true if every key is visited
+            auto for_each_slot(const std::string &from, const std::string &end,
+                               const std::function<bool(LeafNode *, int)> &f) const -> bool;
+            // returns the number of leaves in the chain
+            auto rebuild(const std::function<bool(const byte_ptr_t &)> &discard) -> size_t;
         };
     }
 }
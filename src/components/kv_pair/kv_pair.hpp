@@ -2,6 +2,8 @@
 #define __HILL__KV_PAIR__KV_PAIR__
 #include "memory_manager/memory_manager.hpp"
 #include <cstring>
+#include <atomic>
+#include <chrono>
 
 namespace Hill {
     namespace KVPair {
@@ -14,9 +16,27 @@ namespace Hill {
         }
 
         struct HillStringHeader {
-            uint16_t valid : 1;
-            uint16_t length : 15;
+            uint64_t valid : 1;
+            uint64_t length : 15;
+            // only values are stamped, 0 is no stamp, see next_stamp
+            uint64_t stamp : 48;
         };
+
+        /*
+         * Every value written gets a fresh stamp in its header, and its leaf keeps a copy next to the value
+         * pointer. A client reading a value through a cached pointer compares stamps to tell the value it
+         * cached from whatever took the memory later. Stamps start from the clock, so a restarted server
+         * does not reuse stamps clients may still hold.
+         */
+        inline auto next_stamp() noexcept -> uint64_t {
+            static std::atomic_uint64_t stamps(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count());
+            uint64_t stamp;
+            do {
+                stamp = stamps.fetch_add(1) & ((1UL << 48) - 1);
+            } while (stamp == 0);
+            return stamp;
+        }
         
         /*
          * This is a simple compact string implementation
@@ -30,6 +50,7 @@ namespace Hill {
             static auto make_string(const byte_ptr_t &chunk, const_byte_ptr_t bytes, size_t size) -> HillString & {
                 auto ret = reinterpret_cast<HillString *>(chunk);
                 ret->header.length = size;
+                ret->header.stamp = 0;
                 memcpy(&ret->content, bytes, size);
                 ret->header.valid = 1;
                 return *ret;
@@ -132,6 +153,16 @@ namespace Hill {
                 header.valid = 0;
             }
 
+            inline auto stamp() const noexcept -> uint64_t {
+                return header.stamp;
+            }
+
+            // stamp a value just written
+            inline auto restamp() noexcept -> uint64_t {
+                header.stamp = next_stamp();
+                return header.stamp;
+            }
+
             inline auto raw_bytes() const noexcept -> const_byte_ptr_t {
                 return &content[0];
             }
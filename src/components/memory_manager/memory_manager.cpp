@@ -1,8 +1,65 @@
 #include "config/config.hpp"
 #include "memory_manager.hpp"
 
+#include <cpuid.h>
+#include <unordered_set>
 namespace Hill {
     namespace Memory {
+        namespace Util {
+            void (*crash_point)() = nullptr;
+            void (*flush_point)(const void *, size_t) = nullptr;
+
+            enum class FlushInstruction {
+                CLWB,
+                CLFLUSHOPT,
+                CLFLUSH,
+            };
+
+            static auto detect_flush_instruction() noexcept -> FlushInstruction {
+                unsigned int eax, ebx, ecx, edx;
+                if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+                    return FlushInstruction::CLFLUSH;
+                }
+
+                if (ebx & (1U << 24)) {
+                    return FlushInstruction::CLWB;
+                }
+
+                if (ebx & (1U << 23)) {
+                    return FlushInstruction::CLFLUSHOPT;
+                }
+                return FlushInstruction::CLFLUSH;
+            }
+
+            auto flush(const void *addr, size_t len) noexcept -> void {
+                static const auto flush_instruction = detect_flush_instruction();
+                if (flush_point) {
+                    flush_point(addr, len);
+                }
+                auto line = reinterpret_cast<uintptr_t>(addr) & ~(Constants::uCACHELINE_SIZE - 1);
+                auto end = reinterpret_cast<uintptr_t>(addr) + len;
+
+                // encoded by bytes so that no -mclwb or -mclflushopt is required
+                switch(flush_instruction) {
+                case FlushInstruction::CLWB:
+                    for (; line < end; line += Constants::uCACHELINE_SIZE) {
+                        asm volatile(".byte 0x66; xsaveopt %0" : "+m"(*reinterpret_cast<volatile char *>(line)));
+                    }
+                    break;
+                case FlushInstruction::CLFLUSHOPT:
+                    for (; line < end; line += Constants::uCACHELINE_SIZE) {
+                        asm volatile(".byte 0x66; clflush %0" : "+m"(*reinterpret_cast<volatile char *>(line)));
+                    }
+                    break;
+                default:
+                    for (; line < end; line += Constants::uCACHELINE_SIZE) {
+                        asm volatile("clflush %0" : "+m"(*reinterpret_cast<volatile char *>(line)));
+                    }
+                    break;
+                }
+            }
+        }
+
         /*
          * I put a global lock at namespace scope becauseh the memory manager can not own a transient lock
          * when it resides on PM
@@ -23,12 +80,18 @@ namespace Hill {
             ++snapshot.records;
             ++snapshot.valid;
             snapshot.record_cursor -= size;
-            auto record_header = get_headers();
+            auto record_header = reinterpret_cast<RecordHeader *>(tmp_ptr + snapshot.header_cursor);
             record_header->offset = snapshot.record_cursor;
             snapshot.header_cursor += sizeof(RecordHeader);
 
             // atomic write, fence required
             header = snapshot;
+#ifdef __HILL_PMEM__
+            // a record is counted only if its header made it too, a torn pair is a leak at worst
+            Util::flush(record_header, sizeof(RecordHeader));
+            Util::flush(&header, sizeof(PageHeader));
+            Util::sfence();
+#endif
         }
 
         // Delete rarely occurs, we put some heavy work in it
@@ -40,12 +103,18 @@ namespace Hill {
             for (size_t i = 0; i < page_address->header.records; i++) {
                 if (headers[i].offset == offset) {
                     headers[i].offset = 0;
+#ifdef __HILL_PMEM__
+                    Util::flush(&headers[i], sizeof(RecordHeader));
+#endif
                 }
             }
             // Crash here is fine because on recovery, we scan the page
             // atomic write, outside fence required
             Util::mfence();
             --page_address->header.valid;
+#ifdef __HILL_PMEM__
+            Util::persist(&page_address->header, sizeof(PageHeader));
+#endif
         }
 
         auto Allocator::drain(int id) -> void {
@@ -53,7 +122,22 @@ namespace Hill {
             memset(header.write_cache[id], 0, Constants::uPAGE_SIZE);
         }
 
-#ifndef __HILL_LOG_ALLOCATOR__
+#ifdef __HILL_LOG_ALLOCATOR__
+        auto Allocator::reserve(uint64_t end) -> void {
+            if (end <= header.granted.load()) {
+                return;
+            }
+
+            std::scoped_lock<std::mutex> _(allocator_global_lock);
+            if (end <= header.reserved.load()) {
+                return;
+            }
+            auto reserved = (end + Constants::uLOG_RESERVATION - 1) / Constants::uLOG_RESERVATION * Constants::uLOG_RESERVATION;
+            header.reserved = reserved;
+            persist_field(header.reserved);
+            header.granted = reserved;
+        }
+#else
         auto Allocator::preallocate(int id) -> void {
             // the 1 is for current page
             auto to_be_used = header.cursor + Constants::uPREALLOCATION + 1;
@@ -66,31 +150,42 @@ namespace Hill {
                     // check global free list
                     auto begin = header.freelist;
                     auto end = header.freelist;
-                    for (size_t i = 0; i < Constants::uPREALLOCATION; i++) {
-                        if (end) {
-                            end = end->next;
-                        }
+                    // the global free list may hold fewer pages than a preallocation
+                    for (size_t i = 1; i < Constants::uPREALLOCATION && end->next; i++) {
+                        end = end->next;
                     }
 
                     // on recovery, should check
                     header.thread_free_lists[id] = begin;
+                    persist_field(header.thread_free_lists[id]);
                     header.freelist = end->next;
-                    end->next = nullptr;
+                    persist_field(header.freelist);
+                    end->link_next(nullptr);
                 } else {
                     // from global heap
                     auto tmp = header.cursor;
                     for (size_t i = 0; i < Constants::uPREALLOCATION; i++) {
                         // dependent read/write;
                         Page::make_page(reinterpret_cast<byte_ptr_t>(tmp), tmp + 1);
+#ifdef __HILL_PMEM__
+                        Util::flush(&tmp->header, sizeof(tmp->header));
+                        Util::flush(&tmp->next, sizeof(tmp->next));
+#endif
                         tmp = tmp->next;
                     }
                     Page::make_page(reinterpret_cast<byte_ptr_t>(tmp), nullptr);
+#ifdef __HILL_PMEM__
+                    Util::flush(&tmp->header, sizeof(tmp->header));
+                    Util::flush(&tmp->next, sizeof(tmp->next));
+#endif
                     Util::mfence();
                     // on recovery, should check if any thread_free_list
                     // matches cursor, if so, cursor should be incremented
                     header.thread_free_lists[id] =  header.cursor;
+                    persist_field(header.thread_free_lists[id]);
                     Util::mfence();
                     header.cursor += Constants::uPREALLOCATION + 1; // next usable page
+                    persist_field(header.cursor);
                 }
             }
         }
@@ -98,7 +193,12 @@ namespace Hill {
 
         auto Allocator::allocate(int id, size_t size, byte_ptr_t &ptr) -> void {
 #ifdef __HILL_LOG_ALLOCATOR__
-            ptr = header.base + header.offset.fetch_add(size);
+            (void)id;
+            auto offset = header.offset.fetch_add(size);
+            reserve(offset + size);
+            ptr = header.base + offset;
+            // nothing is reused, so consumption only grows
+            header.consumed += size;
 #else
             if (size > Constants::uPAGE_SIZE) {
                 throw std::invalid_argument("Object size too large");
@@ -125,9 +225,11 @@ namespace Hill {
 
             // on recovery
             header.thread_busy_pages[id] = header.thread_free_lists[id];
+            persist_field(header.thread_busy_pages[id]);
             header.thread_free_lists[id] = header.thread_free_lists[id]->next;
+            persist_field(header.thread_free_lists[id]);
             Util::mfence();
-            header.thread_busy_pages[id]->next = nullptr;
+            header.thread_busy_pages[id]->link_next(nullptr);
             Util::mfence();
 
             header.thread_busy_pages[id]->allocate(size, ptr);
@@ -137,7 +239,9 @@ namespace Hill {
 
         auto Allocator::allocate_for_remote(byte_ptr_t &ptr) -> void {
 #ifdef __HILL_LOG_ALLOCATOR__
-            ptr = header.base + header.offset.fetch_add(Constants::uREMOTE_REGION_SIZE);
+            auto offset = header.offset.fetch_add(Constants::uREMOTE_REGION_SIZE);
+            reserve(offset + Constants::uREMOTE_REGION_SIZE);
+            ptr = header.base + offset;
 #else
             {
                 std::scoped_lock<std::mutex> _(allocator_global_lock);
@@ -156,13 +260,40 @@ namespace Hill {
 #endif
         }
 
+        auto Allocator::free_for_remote(const byte_ptr_t &ptr) -> void {
+#ifdef __HILL_LOG_ALLOCATOR__
+            // memory of a log allocator is never reused
+            (void)ptr;
+#else
+            // the region is carved into pages and spliced before the global free list in one pointer update
+            auto first = reinterpret_cast<Page *>(ptr);
+            auto pages = Constants::uREMOTE_REGION_SIZE / Constants::uPAGE_SIZE;
+            std::scoped_lock<std::mutex> _(allocator_global_lock);
+            for (size_t i = 0; i < pages; i++) {
+                auto page = first + i;
+                Page::make_page(reinterpret_cast<byte_ptr_t>(page), i == pages - 1 ? header.freelist : page + 1);
+#ifdef __HILL_PMEM__
+                Util::flush(&page->header, sizeof(page->header));
+                Util::flush(&page->next, sizeof(page->next));
+#endif
+            }
+            Util::sfence();
+            header.freelist = first;
+#ifdef __HILL_PMEM__
+            Util::persist(&header.freelist, sizeof(header.freelist));
+#endif
+#endif
+        }
+
         auto Allocator::register_thread() noexcept -> std::optional<int> {
             std::scoped_lock<std::mutex> _(allocator_global_lock);
             for (int i = 0; i < Constants::iTHREAD_LIST_NUM; i++) {
                 if (header.in_use[i] == false) {
                     if (header.thread_pending_pages[i] != nullptr) {
                         header.thread_busy_pages[i] = header.thread_pending_pages[i];
+                        persist_field(header.thread_busy_pages[i]);
                         header.thread_pending_pages[i] = nullptr;
+                        persist_field(header.thread_pending_pages[i]);
                     }
                     header.in_use[i] = true;
                     return i;
@@ -171,6 +302,26 @@ namespace Hill {
             return {};
         }
 
+        auto Allocator::register_thread(int id) noexcept -> std::optional<int> {
+            if (id < 0 || id >= Constants::iTHREAD_LIST_NUM) {
+                return {};
+            }
+
+            std::scoped_lock<std::mutex> _(allocator_global_lock);
+            if (header.in_use[id]) {
+                return {};
+            }
+
+            if (header.thread_pending_pages[id] != nullptr) {
+                header.thread_busy_pages[id] = header.thread_pending_pages[id];
+                persist_field(header.thread_busy_pages[id]);
+                header.thread_pending_pages[id] = nullptr;
+                persist_field(header.thread_pending_pages[id]);
+            }
+            header.in_use[id] = true;
+            return id;
+        }
+
         auto Allocator::unregister_thread(int id) noexcept -> void {
             if (id < 0 || id > Constants::iTHREAD_LIST_NUM) {
                 return;
@@ -184,11 +335,18 @@ namespace Hill {
             // on recovery, should check if any thread_pending_list matches thread_busy_page
             // if so, free list should be AVAILABLE
             header.thread_pending_pages[id] = header.thread_busy_pages[id];
+            persist_field(header.thread_pending_pages[id]);
             header.thread_busy_pages[id] = nullptr;
+            persist_field(header.thread_busy_pages[id]);
             header.in_use[id] = false;
         }
 
         auto Allocator::free(int id, byte_ptr_t &ptr) -> void {
+#ifdef __HILL_LOG_ALLOCATOR__
+            // memory of a log allocator is never reused, and it has no page to clear a record in
+            (void)id;
+            (void)ptr;
+#else
             if (!ptr)
                 return;
 
@@ -196,19 +354,139 @@ namespace Hill {
             auto page = Page::get_page(ptr);
             // on recovery, should check
             header.to_be_freed[id] = page;
+            persist_field(header.to_be_freed[id]);
             Util::mfence();
-            if (--page->header.valid == 0) {
+            // clears the record header so that recovery counts valid records correctly
+            page->free(ptr);
+            if (page->header.valid == 0) {
                 page->reset_cursor();
                 if (header.thread_busy_pages[id] == page) {
                     header.to_be_freed[id] = nullptr;
+                    persist_field(header.to_be_freed[id]);
                     return;
                 }
 
-                page->next = header.thread_free_lists[id];
+                page->link_next(header.thread_free_lists[id]);
                 header.thread_free_lists[id] = page;
+                persist_field(header.thread_free_lists[id]);
             }
 
             header.to_be_freed[id] = nullptr;
+            persist_field(header.to_be_freed[id]);
+#endif
+        }
+
+        auto Allocator::reclaim(const std::vector<Page *> &pages) -> size_t {
+#ifdef __HILL_LOG_ALLOCATOR__
+            // memory of a log allocator is never reused, only the page allocator merges emptied pages
+            (void)pages;
+            return 0;
+#else
+            std::scoped_lock<std::mutex> _(allocator_global_lock);
+            std::unordered_set<Page *> tracked;
+            auto track = [&](Page *list) {
+                for (; list != nullptr && tracked.insert(list).second; list = list->next);
+            };
+
+            track(header.freelist);
+            for (int i = 0; i < Constants::iTHREAD_LIST_NUM; i++) {
+                tracked.insert(header.thread_busy_pages[i]);
+                tracked.insert(header.thread_pending_pages[i]);
+                tracked.insert(header.to_be_freed[i]);
+                track(header.thread_free_lists[i]);
+            }
+
+            size_t reclaimed = 0;
+            for (auto page : pages) {
+                // pages beyond cursor are never handed out
+                if (page < header.base || page >= header.cursor || !tracked.insert(page).second) {
+                    continue;
+                }
+
+                page->link_next(header.freelist);
+                header.freelist = page;
+                ++reclaimed;
+            }
+#ifdef __HILL_PMEM__
+            Util::persist(&header.freelist, sizeof(header.freelist));
+#endif
+            return reclaimed;
+#endif
+        }
+
+        /*
+         * Regions handed out by allocate_for_remote are not made of pages, so the page checks only hold
+         * for allocators never lending memory to peers
+         */
+        auto Allocator::check_consistency() -> bool {
+#ifdef __HILL_LOG_ALLOCATOR__
+            return true;
+#else
+            auto consistent = true;
+            auto report = [&](const std::string &what, const Page *page) {
+                std::cerr << ">> Error: " << what << " at page " << page << "\n";
+                consistent = false;
+            };
+
+            std::unordered_set<Page *> listed;
+            auto walk = [&](Page *list, const std::string &name) {
+                for (auto p = list; p != nullptr; p = p->next) {
+                    if (p < header.base || p >= header.cursor) {
+                        report(name + " has a page out of range", p);
+                        return;
+                    }
+
+                    // also catches cycles
+                    if (!listed.insert(p).second) {
+                        report(name + " has a page listed twice", p);
+                        return;
+                    }
+
+                    if (p->header.valid != 0) {
+                        report(name + " has a page with valid records", p);
+                    }
+                }
+            };
+
+            walk(header.freelist, "global free list");
+            for (int i = 0; i < Constants::iTHREAD_LIST_NUM; i++) {
+                walk(header.thread_free_lists[i], "free list of thread " + std::to_string(i));
+            }
+
+            for (int i = 0; i < Constants::iTHREAD_LIST_NUM; i++) {
+                if (listed.find(header.thread_busy_pages[i]) != listed.end()) {
+                    report("busy page of thread " + std::to_string(i) + " is free", header.thread_busy_pages[i]);
+                }
+
+                if (listed.find(header.thread_pending_pages[i]) != listed.end()) {
+                    report("pending page of thread " + std::to_string(i) + " is free", header.thread_pending_pages[i]);
+                }
+            }
+
+            for (auto p = header.base; p < header.cursor; p++) {
+                if (p->header.header_cursor != sizeof(p->header) + p->header.records * sizeof(RecordHeader)) {
+                    report("record count disagrees with header cursor", p);
+                }
+
+                auto headers = p->get_headers();
+                size_t valid = 0;
+                for (size_t i = 0; i < p->header.records; i++) {
+                    if (headers[i].offset == 0) {
+                        continue;
+                    }
+
+                    ++valid;
+                    if (headers[i].offset < p->header.record_cursor || headers[i].offset >= Constants::uPAGE_SIZE) {
+                        report("record out of page", p);
+                    }
+                }
+
+                if (valid != p->header.valid) {
+                    report("stale valid count", p);
+                }
+            }
+            return consistent;
+#endif
         }
 
         auto Allocator::recover() -> Enums::AllocatorRecoveryStatus {
@@ -216,11 +494,18 @@ namespace Hill {
                 return Enums::AllocatorRecoveryStatus::NoAllocator;
             }
 
+#ifdef __HILL_LOG_ALLOCATOR__
+            // whatever was handed out lies below the durable reservation
+            header.offset = header.reserved.load();
+            header.granted = header.reserved.load();
+#else
             recover_pending_list();
             recover_global_heap();
+            recover_global_free_list();
             recover_free_lists();
             // recover_pending_list();
             recover_to_be_freed();
+#endif
 
             return Enums::AllocatorRecoveryStatus::Ok;
         }
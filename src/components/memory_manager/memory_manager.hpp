@@ -6,6 +6,7 @@
 #include <cstring>
 #include <mutex>
 #include <atomic>
+#include <vector>
 
 
 #if defined(__HILL_DEBUG__) || defined(__HILL_INFO__)
@@ -37,6 +38,9 @@ namespace Hill {
             static constexpr uint64_t uALLOCATOR_MAGIC = 0xabcddcbaabcddcbaUL;
             static constexpr size_t uPREALLOCATION = 16;
             static constexpr uint64_t uREMOTE_REGION_SIZE = 1UL << 30;
+            // granularity at which a log allocator writes its offset back
+            static constexpr uint64_t uLOG_RESERVATION = 256 * uPAGE_SIZE;
+            static constexpr size_t uCACHELINE_SIZE = 64;
         }
 
         namespace Enums {
@@ -64,8 +68,38 @@ namespace Hill {
         }
 
         namespace Util {
+            /*
+             * If set, called after every fence, i.e., at every point where a crash may leave PM in a state
+             * worth checking. Only crash tests set it, see tests/test_crash.cpp
+             */
+            extern void (*crash_point)();
+            // if set, called with every range flush writes back, see crash_point
+            extern void (*flush_point)(const void *, size_t);
+
             inline void mfence(void) {
                 asm volatile("mfence":::"memory");
+                if (crash_point) {
+                    crash_point();
+                }
+            }
+
+            inline void sfence(void) {
+                asm volatile("sfence":::"memory");
+                if (crash_point) {
+                    crash_point();
+                }
+            }
+
+            /*
+             * Write back every cache line covering [addr, addr + len) without any fence. clwb is used if the
+             * CPU supports it, then clflushopt, finally clflush. Batch several flushes and finish them with
+             * a single sfence, or call persist() for a single range.
+             */
+            auto flush(const void *addr, size_t len) noexcept -> void;
+
+            inline auto persist(const void *addr, size_t len) noexcept -> void {
+                flush(addr, len);
+                sfence();
             }
         }
         /*
@@ -151,18 +185,34 @@ namespace Hill {
                 return header.records == 0;
             }
 
+            // recompute valid from record headers, used on recovery when a crash may have left it stale
+            inline auto recount_valid() noexcept -> size_t {
+                auto headers = get_headers();
+                size_t valid = 0;
+                for (size_t i = 0; i < header.records; i++) {
+                    if (headers[i].offset != 0) {
+                        ++valid;
+                    }
+                }
+                header.valid = valid;
+                return valid;
+            }
+
+            // an empty page is reused from scratch, otherwise records would keep growing
             inline auto reset_cursor() noexcept -> void {
+                header.records = 0;
+                header.valid = 0;
                 header.header_cursor = sizeof(PageHeader);
                 header.record_cursor = sizeof(Page) - sizeof(Page *);
-#ifdef PMEM
-                pmem_persist(&header, sizeof(PageHeader));
+#ifdef __HILL_PMEM__
+                Util::persist(&header, sizeof(PageHeader));
 #endif
             }
 
             inline auto link_next(Page *p) noexcept -> void {
                 next = p;
-#ifdef PMEM
-                pmem_persist(&next, sizeof(Page *));
+#ifdef __HILL_PMEM__
+                Util::persist(&next, sizeof(Page *));
 #endif
             }
 
@@ -183,11 +233,7 @@ namespace Hill {
 
         class Allocator {
         public:
-#ifdef __HILL_LOG_ALLOCATOR__
-            Allocator() = default;
-#else
             Allocator() = delete;
-#endif
             ~Allocator() = default;
             Allocator(const Allocator &) = delete;
             Allocator(Allocator &&) = delete;
@@ -195,19 +241,18 @@ namespace Hill {
             auto operator=(Allocator &&) -> Allocator & = delete;
 
             static auto make_allocator(const byte_ptr_t &base, size_t size) -> Allocator * {
-#ifdef __HILL_LOG_ALLOCATOR__
-                auto allocator = new Allocator;
-                auto aligned = reinterpret_cast<Page *>(reinterpret_cast<uint64_t>(base + sizeof(AllocatorHeader)) & Constants::uPAGE_MASK);
-                allocator->header.base = reinterpret_cast<byte_ptr_t>(aligned + 1);
-                allocator->header.offset = 0;
-#else
-
                 auto allocator = reinterpret_cast<Allocator *>(base);
-                allocator->header.magic = Constants::uALLOCATOR_MAGIC;
+                allocator->header.magic = 0;
                 allocator->header.total_size = size;
                 allocator->header.freelist = nullptr;
 
                 auto aligned = reinterpret_cast<Page *>(reinterpret_cast<uint64_t>(base + sizeof(AllocatorHeader)) & Constants::uPAGE_MASK);
+#ifdef __HILL_LOG_ALLOCATOR__
+                allocator->header.base = reinterpret_cast<byte_ptr_t>(aligned + 1);
+                allocator->header.offset = 0;
+                allocator->header.reserved = 0;
+                allocator->header.granted = 0;
+#else
                 allocator->header.base = reinterpret_cast<Page *>(aligned + 1);
                 allocator->header.cursor = allocator->header.base;
 #endif
@@ -217,10 +262,14 @@ namespace Hill {
                     allocator->header.thread_busy_pages[i] = nullptr;
                     allocator->header.to_be_freed[i] = nullptr;
                     allocator->header.in_use[i] = false;
-                    allocator->header.write_cache[i] = reinterpret_cast<Page *>(new byte_t[sizeof(Constants::uPAGE_SIZE)]);
+                    allocator->header.write_cache[i] = reinterpret_cast<Page *>(new byte_t[Constants::uPAGE_SIZE]);
                     allocator->header.write_cache[i]->next = nullptr;
                 }
                 allocator->header.consumed = 0;
+                // a header is recognized only once all of it is durable
+                persist_field(allocator->header);
+                allocator->header.magic = Constants::uALLOCATOR_MAGIC;
+                persist_field(allocator->header.magic);
 
                 return allocator;
             }
@@ -242,39 +291,44 @@ namespace Hill {
                     break;
                 }
 
-                allocator->header.magic = Constants::uALLOCATOR_MAGIC;
-                allocator->header.total_size = size;
-                allocator->header.freelist = nullptr;
-
-                auto aligned = reinterpret_cast<Page *>(reinterpret_cast<uint64_t>(base + sizeof(AllocatorHeader)) & Constants::uPAGE_MASK);
-#ifndef __HILL_LOG_ALLOCATOR__
-                allocator->header.base = reinterpret_cast<Page *>(aligned + 1);
-                allocator->header.cursor = allocator->header.base;
-#endif
-                for (int i = 0; i < Constants::iTHREAD_LIST_NUM; i++) {
-                    allocator->header.thread_free_lists[i] = const_cast<Page *>(Constants::pTHREAD_LIST_AVAILABLE);
-                    allocator->header.thread_pending_pages[i] = nullptr;
-                    allocator->header.thread_busy_pages[i] = nullptr;
-                    allocator->header.to_be_freed[i] = nullptr;
-                    allocator->header.in_use[i] = false;
-                }
-                return allocator;
+                return make_allocator(base, size);
             }
 
             auto register_thread() noexcept -> std::optional<int>;
+            // claim a specific thread slot so that ids agree with ids from other allocators or the logger
+            auto register_thread(int id) noexcept -> std::optional<int>;
             auto unregister_thread(int id) noexcept -> void;
 
             auto allocate(int id, size_t size, byte_ptr_t &ptr) -> void;
             auto allocate_for_remote(byte_ptr_t &ptr) -> void;
+            // a region of allocate_for_remote handed back by the borrowing peer, its pages become free pages
+            auto free_for_remote(const byte_ptr_t &ptr) -> void;
             auto free(int id, byte_ptr_t &ptr) -> void;
             auto drain(int id) -> void;
 
             auto recover() -> Enums::AllocatorRecoveryStatus;
+            // walks every page and page list, reports any broken invariant to stderr
+            auto check_consistency() -> bool;
+            /*
+             * Pages emptied by WAL recovery are pushed to the global free list, pages out of this allocator
+             * or already tracked by any list are skipped. Returns the number of pages reclaimed
+             */
+            auto reclaim(const std::vector<Page *> &pages) -> size_t;
             inline auto get_consumed() const noexcept -> uint64_t {
                 return header.consumed.load();
             }
 
         private:
+            // the page allocator writes its metadata back field by field, in the order recovery expects
+            template<typename T>
+            static inline auto persist_field(const T &field) noexcept -> void {
+#ifdef __HILL_PMEM__
+                Util::persist(&field, sizeof(T));
+#else
+                (void)field;
+#endif
+            }
+
             struct AllocatorHeader {
                 uint64_t magic;
                 size_t total_size;
@@ -283,6 +337,13 @@ namespace Hill {
 #ifdef __HILL_LOG_ALLOCATOR__
                 byte_ptr_t base;
                 std::atomic_uint64_t offset;
+                /*
+                 * offset is never written back, nothing beyond reserved is handed out instead. reserved grows
+                 * by uLOG_RESERVATION and is durable before granted, which allocations check, catches up with
+                 * it. Recovery resumes at reserved, leaking at most one reservation
+                 */
+                std::atomic_uint64_t reserved;
+                std::atomic_uint64_t granted;
 #else
                 Page *base;
 #endif                
@@ -306,22 +367,29 @@ namespace Hill {
                 std::atomic_uint64_t consumed;
             } header;
 
-#ifndef __HILL_LOG_ALLOCATOR__
+#ifdef __HILL_LOG_ALLOCATOR__
+            auto reserve(uint64_t end) -> void;
+#else
             auto preallocate(int id) -> void;
 #endif
             auto recover_global_free_list() -> void {
                 for (int i = 0; i < Constants::iTHREAD_LIST_NUM; i++) {
                     // on-going allocation is detected
-                    if (header.thread_free_lists[i] == header.freelist) {
+                    if (header.freelist && header.thread_free_lists[i] == header.freelist) {
                         auto end = header.freelist;
-                        for (size_t i = 0; i < Constants::uPREALLOCATION; i++) {
-                            if (end) {
-                                end = end->next;
-                            }
+                        for (size_t j = 1; j < Constants::uPREALLOCATION && end->next; j++) {
+                            end = end->next;
                         }
-
                         header.freelist = end->next;
-                        end->next = nullptr;
+                    }
+                }
+
+                // the tail of a list taken from the global free list may still link into it
+                for (int i = 0; i < Constants::iTHREAD_LIST_NUM; i++) {
+                    for (auto p = header.thread_free_lists[i]; p && header.freelist; p = p->next) {
+                        if (p->next == header.freelist) {
+                            p->next = nullptr;
+                        }
                     }
                 }
             }
@@ -329,7 +397,7 @@ namespace Hill {
             auto recover_free_lists() -> void {
                 for (int i = 0; i < Constants::iTHREAD_LIST_NUM; i++) {
                     // on-going allocation
-                    if (header.thread_busy_pages[i] == header.thread_free_lists[i]) {
+                    if (header.thread_busy_pages[i] && header.thread_busy_pages[i] == header.thread_free_lists[i]) {
                         header.thread_free_lists[i] = header.thread_free_lists[i]->next;
                         header.thread_busy_pages[i]->next = nullptr;
                     }
@@ -338,8 +406,8 @@ namespace Hill {
 
             auto recover_global_heap() -> void {
                 for (int i = 0; i < Constants::iTHREAD_LIST_NUM; i++) {
-                    if (header.thread_free_lists[i] == header.cursor) {
-                        header.cursor += Constants::uPREALLOCATION;
+                    if (header.thread_free_lists[i] && header.thread_free_lists[i] == header.cursor) {
+                        header.cursor += Constants::uPREALLOCATION + 1;
                     }
                 }
             }
@@ -347,7 +415,7 @@ namespace Hill {
             auto recover_pending_list() -> void {
                 // on-going unregisteration
                 for (int i = 0; i < Constants::iTHREAD_LIST_NUM; i++) {
-                    if (header.thread_pending_pages[i] == header.thread_busy_pages[i]) {
+                    if (header.thread_busy_pages[i] && header.thread_pending_pages[i] == header.thread_busy_pages[i]) {
                         header.thread_busy_pages[i]->next = header.thread_free_lists[i];
                         header.thread_free_lists[i] = header.thread_busy_pages[i];
                         header.thread_busy_pages[i] = nullptr;
@@ -358,12 +426,20 @@ namespace Hill {
 
             auto recover_to_be_freed() -> void {
                 for (int i = 0; i < Constants::iTHREAD_LIST_NUM; i++) {
-                    if (header.to_be_freed[i]->next != nullptr) {
+                    auto page = header.to_be_freed[i];
+                    if (page == nullptr) {
+                        continue;
+                    }
+
+                    // the crash may fall between clearing a record header and decrementing valid
+                    if (page->recount_valid() == 0 && page != header.thread_busy_pages[i] &&
+                        page != header.thread_free_lists[i]) {
                         // freelists may have changed during recovery
-                        header.to_be_freed[i]->next = header.thread_free_lists[i];
-                        header.thread_free_lists[i] = header.to_be_freed[i];
-                        header.to_be_freed[i] = nullptr;
+                        page->reset_cursor();
+                        page->next = header.thread_free_lists[i];
+                        header.thread_free_lists[i] = page;
                     }
+                    header.to_be_freed[i] = nullptr;
                 }
             }
 
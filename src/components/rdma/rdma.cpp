@@ -1,4 +1,9 @@
 #include "rdma.hpp"
+
+#include <unordered_map>
+#include <atomic>
+
+#include <sys/uio.h>
 namespace Hill {
     namespace RDMAUtil {
         auto decode_rdma_status(const Enums::Status& status) -> std::string {
@@ -41,6 +46,10 @@ namespace Hill {
                 return "ReadError";
             case Enums::Status::WriteError:
                 return "WriteError";
+            case Enums::Status::PostFailed:
+                return "PostFailed";
+            case Enums::Status::RecvFailed:
+                return "RecvFailed";
             default:
                 return "Unknown status";
             }
@@ -52,13 +61,21 @@ namespace Hill {
                 return -1;
             }
 
+            if (transport) {
+                if (auto status = transport->connect(remote); status != Status::Ok) {
+                    std::cerr << "Loopback connection failed, error code: " << decode_rdma_status(status) << "\n";
+                    return -1;
+                }
+                return 0;
+            }
+
             auto init_attr = RDMADevice::get_default_qp_init_state_attr();
             if (auto [status, err] = modify_qp(*init_attr, RDMADevice::get_default_qp_init_state_attr_mask()); status != Status::Ok) {
                 std::cerr << "Modify QP to Init failed, error code: " << err << "\n";
                 return err;
             }
 
-            auto rtr_attr = RDMADevice::get_default_qp_rtr_attr(remote, device->get_ib_port(), device->get_gid_idx());
+            auto rtr_attr = RDMADevice::get_default_qp_rtr_attr(remote, ib_port, gid_idx);
             if (auto [status, err] = modify_qp(*rtr_attr, RDMADevice::get_default_qp_rtr_attr_mask()); status != Status::Ok) {
                 std::cerr << "Modify QP to Rtr failed, error code: " << err << "\n";
                 return err;
@@ -108,36 +125,15 @@ namespace Hill {
         auto RDMAContext::post_send_helper(const uint8_t *msg, size_t msg_len, enum ibv_wr_opcode opcode,
                                            size_t local_offset, size_t remote_offset) -> StatusPair
         {
-            struct ibv_sge sg;
-            struct ibv_send_wr sr;
-            struct ibv_send_wr *bad_wr;
             auto byte_buf = reinterpret_cast<byte_ptr_t>(buf) + local_offset;
 
             if (msg) {
                 memcpy(byte_buf, msg, msg_len);
             }
 
-            memset(&sg, 0, sizeof(sg));
-            sg.addr	  = reinterpret_cast<uint64_t>(byte_buf);
-            sg.length = msg_len;
-            sg.lkey	  = mr->lkey;
-
-            memset(&sr, 0, sizeof(sr));
-            sr.wr_id      = 0;
-            sr.sg_list    = &sg;
-            sr.num_sge    = 1;
-            sr.opcode     = opcode;
-            sr.send_flags = IBV_SEND_SIGNALED;
-
-            if (opcode != IBV_WR_SEND) {
-                sr.wr.rdma.remote_addr = remote.addr + remote_offset;
-                sr.wr.rdma.rkey = remote.rkey;
-            }
-
-            if (auto ret = ibv_post_send(qp, &sr, &bad_wr); ret != 0) {
-                return {Status::PostFailed, ret};
-            }
-            return {Status::Ok, 0};
+            auto remote_ptr = reinterpret_cast<byte_ptr_t>(remote.addr + remote_offset);
+            auto request = WorkRequest::make_request(opcode, byte_buf, remote_ptr, msg_len);
+            return post_batch(&request, 1);
         }
 
         auto RDMAContext::post_send_helper(const byte_ptr_t &ptr, const uint8_t *msg, size_t msg_len,
@@ -179,12 +175,64 @@ namespace Hill {
             return post_send_helper(ptr, msg, msg_len, IBV_WR_RDMA_WRITE, local_offset);
         }
 
+        auto RDMAContext::post_batch(const WorkRequest *requests, size_t num) -> StatusPair {
+            if (num == 0 || num > uMAX_SEND_WR) {
+                return {Status::InvalidArguments, 0};
+            }
+
+            if (transport) {
+                for (size_t i = 0; i < num; i++) {
+                    if (auto ret = transport->post(requests[i], i + 1 == num); ret.first != Status::Ok) {
+                        return ret;
+                    }
+                }
+                return {Status::Ok, 0};
+            }
+
+            struct ibv_sge sgs[uMAX_SEND_WR][WorkRequest::iMAX_PIECES];
+            struct ibv_send_wr srs[uMAX_SEND_WR];
+            struct ibv_send_wr *bad_wr;
+
+            for (size_t i = 0; i < num; i++) {
+                auto &request = requests[i];
+                for (int j = 0; j < request.num_pieces; j++) {
+                    auto &sg = sgs[i][j];
+                    memset(&sg, 0, sizeof(sg));
+                    sg.addr   = reinterpret_cast<uint64_t>(request.pieces[j].local);
+                    sg.length = request.pieces[j].size;
+                    sg.lkey   = mr->lkey;
+                }
+
+                auto &sr = srs[i];
+                memset(&sr, 0, sizeof(sr));
+                sr.wr_id      = 0;
+                sr.sg_list    = sgs[i];
+                sr.num_sge    = request.num_pieces;
+                sr.opcode     = request.opcode;
+                sr.next       = i + 1 == num ? nullptr : &srs[i + 1];
+                sr.send_flags = i + 1 == num ? IBV_SEND_SIGNALED : 0;
+                if (request.opcode != IBV_WR_SEND) {
+                    sr.wr.rdma.remote_addr = reinterpret_cast<uint64_t>(request.remote);
+                    sr.wr.rdma.rkey = remote.rkey;
+                }
+            }
+
+            if (auto ret = ibv_post_send(qp, srs, &bad_wr); ret != 0) {
+                return {Status::PostFailed, ret};
+            }
+            return {Status::Ok, 0};
+        }
+
         auto RDMAContext::post_recv_to(size_t msg_len, size_t offset) -> StatusPair {
             struct ibv_sge sg;
             struct ibv_recv_wr wr;
             struct ibv_recv_wr *bad_wr;
 
             auto tmp = (uint8_t *)buf + offset;
+            if (transport) {
+                return transport->post_recv(tmp, msg_len);
+            }
+
             memset(&sg, 0, sizeof(sg));
             sg.addr	  = (uintptr_t)tmp;
             sg.length = msg_len;
@@ -201,69 +249,151 @@ namespace Hill {
             return std::make_pair(Status::Ok, 0);
         }
 
+        auto RDMAContext::poll_cq(struct ibv_wc *wcs, int num, bool send) noexcept -> int {
+            if (transport) {
+                return transport->poll(wcs, num, send);
+            }
+            return ibv_poll_cq(send ? out_cq : in_cq, num, wcs);
+        }
+
         auto RDMAContext::poll_completion_once(bool send) noexcept -> int {
             struct ibv_wc wc;
             int ret;
-            auto cq = send ? out_cq : in_cq;
             do {
-                ret = ibv_poll_cq(cq, 1, &wc);
+                ret = poll_cq(&wc, 1, send);
             } while (ret == 0);
 
             return ret;
         }
 
-        auto RDMAContext::poll_one_completion(bool send) noexcept
-            -> std::pair<std::unique_ptr<struct ibv_wc>, int>
-        {
-            auto wc = std::make_unique<struct ibv_wc>();
+        auto RDMAContext::poll_one_completion(struct ibv_wc &wc, bool send) noexcept -> int {
             int ret;
-            auto cq = send ? out_cq : in_cq;            
             do {
-                ret = ibv_poll_cq(cq, 1, wc.get());
+                ret = poll_cq(&wc, 1, send);
             } while (ret == 0);
 
-            return {std::move(wc), ret};
+            return ret;
         }
 
-        auto RDMAContext::poll_multiple_completions(size_t no, bool send) noexcept
-            -> std::pair<std::unique_ptr<struct ibv_wc[]>, int>
-        {
-            auto wc = std::make_unique<struct ibv_wc[]>(no);
+        auto RDMAContext::poll_multiple_completions(struct ibv_wc *wcs, size_t no, bool send) noexcept -> int {
             int ret;
-            auto cq = send ? out_cq : in_cq;            
             do {
-                ret = ibv_poll_cq(cq, no, wc.get());
+                ret = poll_cq(wcs, no, send);
             } while (ret == 0);
 
-            return {std::move(wc), ret};
-        }        
+            return ret;
+        }
+
+        auto RDMAContext::poll_completions(struct ibv_wc *wcs, size_t num, bool send) noexcept -> int {
+            return poll_cq(wcs, num, send);
+        }
 
         auto RDMAContext::fill_buf(uint8_t *msg, size_t msg_len, size_t offset) -> void{
             memcpy((uint8_t *)buf + offset, msg, msg_len);
         }
 
 
+        DeviceResources::~DeviceResources() {
+            for (auto &[in, out] : cq_groups) {
+                if (in) ibv_destroy_cq(in);
+                if (out) ibv_destroy_cq(out);
+            }
+            for (auto mr : mrs) {
+                ibv_dereg_mr(mr);
+            }
+            if (pd) ibv_dealloc_pd(pd);
+            if (devices) ibv_free_device_list(devices);
+            if (ctx) ibv_close_device(ctx);
+        }
+
+        auto RDMADevice::get_mr(void *membuf, size_t memsize, int mr_access) -> struct ibv_mr * {
+            auto &mrs = resources->mrs;
+            auto &mr_accesses = resources->mr_accesses;
+            for (size_t i = 0; i < mrs.size(); i++) {
+                if (mrs[i]->addr == membuf && mrs[i]->length == memsize && mr_accesses[i] == mr_access) {
+                    return mrs[i];
+                }
+            }
+
+            auto mr = ibv_reg_mr(resources->pd, membuf, memsize, mr_access);
+            if (mr) {
+                mrs.push_back(mr);
+                mr_accesses.push_back(mr_access);
+            }
+            return mr;
+        }
+
+        auto RDMADevice::get_cq_group(int group, size_t cqe) -> std::pair<struct ibv_cq *, struct ibv_cq *> {
+            auto &cq_groups = resources->cq_groups;
+            auto ctx = resources->ctx;
+            if (size_t(group) >= cq_groups.size()) {
+                cq_groups.resize(group + 1, {nullptr, nullptr});
+            }
+
+            auto &[in, out] = cq_groups[group];
+            if (!in) {
+                in = ibv_create_cq(ctx, cqe, nullptr, nullptr, 0);
+            }
+            if (!out) {
+                out = ibv_create_cq(ctx, cqe, nullptr, nullptr, 0);
+            }
+            return cq_groups[group];
+        }
+
+        auto RDMADevice::get_loopback_cq_group(int group) -> std::shared_ptr<LoopbackTransport::CompletionQueue> {
+            auto &cq_groups = resources->loopback_cq_groups;
+            if (size_t(group) >= cq_groups.size()) {
+                cq_groups.resize(group + 1);
+            }
+
+            if (!cq_groups[group]) {
+                cq_groups[group] = std::make_shared<LoopbackTransport::CompletionQueue>();
+            }
+            return cq_groups[group];
+        }
+
         auto RDMADevice::open(void *membuf, size_t memsize, size_t cqe, int mr_access,
-                              struct ibv_qp_init_attr &attr) -> std::pair<std::unique_ptr<RDMAContext>, Status>
+                              struct ibv_qp_init_attr &attr, int cq_group)
+            -> std::pair<std::unique_ptr<RDMAContext>, Status>
         {
             auto rdma_ctx = RDMAContext::make_rdma_context();
             if (!membuf || !cqe) {
                 return {nullptr, Status::InvalidArguments};
             }
 
-            if (!(rdma_ctx->pd = ibv_alloc_pd(ctx))) {
-                return {nullptr, Status::CannotAllocPD};
+            rdma_ctx->resources = resources;
+            rdma_ctx->ib_port = ib_port;
+            rdma_ctx->gid_idx = gid_idx;
+            std::scoped_lock<std::mutex> _(resources->lock);
+            if (is_loopback()) {
+                auto cq = cq_group >= 0 ? get_loopback_cq_group(cq_group) : nullptr;
+                rdma_ctx->transport = new LoopbackTransport(latency, std::move(cq));
+                rdma_ctx->local.addr = (uint64_t)membuf;
+                rdma_ctx->transport->certify(rdma_ctx->local);
+                rdma_ctx->buf = membuf;
+                rdma_ctx->buf_size = memsize;
+                return {std::move(rdma_ctx), Status::Ok};
             }
 
-            if (!(rdma_ctx->in_cq = ibv_create_cq(ctx, cqe, nullptr, nullptr, 0))) {
-                return {nullptr, Status::CannotCreateCQ};
+            auto ctx = resources->ctx;
+            auto &pd = resources->pd;
+            if (!pd && !(pd = ibv_alloc_pd(ctx))) {
+                return {nullptr, Status::CannotAllocPD};
             }
+            rdma_ctx->pd = pd;
 
-            if (!(rdma_ctx->out_cq = ibv_create_cq(ctx, cqe, nullptr, nullptr, 0))) {
+            if (cq_group >= 0) {
+                std::tie(rdma_ctx->in_cq, rdma_ctx->out_cq) = get_cq_group(cq_group, cqe);
+                rdma_ctx->shared_cq = true;
+            } else {
+                rdma_ctx->in_cq = ibv_create_cq(ctx, cqe, nullptr, nullptr, 0);
+                rdma_ctx->out_cq = ibv_create_cq(ctx, cqe, nullptr, nullptr, 0);
+            }
+            if (!rdma_ctx->in_cq || !rdma_ctx->out_cq) {
                 return {nullptr, Status::CannotCreateCQ};
             }
 
-            if (!(rdma_ctx->mr = ibv_reg_mr(rdma_ctx->pd, membuf, memsize, mr_access))) {
+            if (!(rdma_ctx->mr = get_mr(membuf, memsize, mr_access))) {
                 return {nullptr, Status::CannotRegMR};
             }
 
@@ -291,7 +421,7 @@ namespace Hill {
             rdma_ctx->local.lid = pattr.lid;
 
             rdma_ctx->buf = membuf;
-            rdma_ctx->device = this;
+            rdma_ctx->buf_size = memsize;
             return {std::move(rdma_ctx), Status::Ok};
         }
 
@@ -300,10 +430,11 @@ namespace Hill {
             memset(at.get(), 0, sizeof(struct ibv_qp_init_attr));
 
             at->qp_type = IBV_QPT_RC;
-            at->sq_sig_all = 1;
-            at->cap.max_send_wr = 1;
+            // a batch signals only its last request
+            at->sq_sig_all = 0;
+            at->cap.max_send_wr = RDMAContext::uMAX_SEND_WR;
             at->cap.max_recv_wr = 1;
-            at->cap.max_send_sge = 1;
+            at->cap.max_send_sge = WorkRequest::iMAX_PIECES;
             at->cap.max_recv_sge = 1;
             return at;
         }
@@ -362,5 +493,164 @@ namespace Hill {
             attr->max_rd_atomic = 1;
             return attr;
         }
+
+        namespace {
+            // loopback contexts of this process by qp_num, for delivering sends
+            std::mutex loopback_lock;
+            std::unordered_map<uint32_t, LoopbackTransport *> loopback_peers;
+            std::atomic_uint32_t loopback_qp_nums(1);
+        }
+
+        LoopbackTransport::LoopbackTransport(std::chrono::nanoseconds latency_, std::shared_ptr<CompletionQueue> cq_)
+            : latency(latency_), qp_num(loopback_qp_nums.fetch_add(1)), peer_pid(0), peer_qp_num(0),
+              cq(cq_ ? std::move(cq_) : std::make_shared<CompletionQueue>()) {
+            std::scoped_lock<std::mutex> _(loopback_lock);
+            loopback_peers[qp_num] = this;
+        }
+
+        LoopbackTransport::~LoopbackTransport() {
+            std::scoped_lock<std::mutex> _(loopback_lock);
+            loopback_peers.erase(qp_num);
+        }
+
+        // a loopback certificate carries the pid as rkey, lid and gid are unused
+        auto LoopbackTransport::certify(connection_certificate &local) -> void {
+            local.rkey = uint32_t(getpid());
+            local.qp_num = qp_num;
+            local.lid = 0;
+            memset(local.gid, 0, sizeof(local.gid));
+        }
+
+        auto LoopbackTransport::connect(const connection_certificate &remote) -> Status {
+            if (remote.lid != 0 || remote.rkey == 0) {
+                // the peer is on a real NIC
+                return Status::InvalidArguments;
+            }
+            peer_pid = pid_t(remote.rkey);
+            peer_qp_num = remote.qp_num;
+            return Status::Ok;
+        }
+
+        auto LoopbackTransport::copy(enum ibv_wr_opcode opcode, byte_ptr_t local, uint64_t remote, size_t len) -> bool {
+            auto remote_ptr = reinterpret_cast<byte_ptr_t>(remote);
+            if (peer_pid == getpid()) {
+                if (opcode == IBV_WR_RDMA_READ) {
+                    memcpy(local, remote_ptr, len);
+                } else {
+                    memcpy(remote_ptr, local, len);
+                }
+                return true;
+            }
+
+            struct iovec l {local, len};
+            struct iovec r {remote_ptr, len};
+            auto ret = opcode == IBV_WR_RDMA_READ ? process_vm_readv(peer_pid, &l, 1, &r, 1, 0)
+                                                  : process_vm_writev(peer_pid, &l, 1, &r, 1, 0);
+            return ret == ssize_t(len);
+        }
+
+        auto LoopbackTransport::deliver(std::vector<byte_t> &&msg, std::chrono::steady_clock::time_point due) -> bool {
+            if (peer_pid != getpid()) {
+                return false;
+            }
+
+            std::scoped_lock<std::mutex> _(loopback_lock);
+            auto peer = loopback_peers.find(peer_qp_num);
+            if (peer == loopback_peers.end()) {
+                return false;
+            }
+
+            std::scoped_lock<std::mutex> __(peer->second->inbox_lock);
+            peer->second->inbox.push_back({due, std::move(msg)});
+            return true;
+        }
+
+        auto LoopbackTransport::post(const WorkRequest &request, bool signaled) -> StatusPair {
+            auto due = std::chrono::steady_clock::now() + latency;
+            Completion c {due, IBV_WC_RDMA_WRITE, IBV_WC_SUCCESS, uint32_t(request.size()), qp_num, signaled};
+            switch (request.opcode) {
+            case IBV_WR_RDMA_WRITE:
+                [[fallthrough]];
+            case IBV_WR_RDMA_READ: {
+                c.opcode = request.opcode == IBV_WR_RDMA_READ ? IBV_WC_RDMA_READ : IBV_WC_RDMA_WRITE;
+                auto remote = reinterpret_cast<uint64_t>(request.remote);
+                for (int i = 0; i < request.num_pieces; i++) {
+                    auto &piece = request.pieces[i];
+                    if (!copy(request.opcode, piece.local, remote, piece.size)) {
+                        c.status = IBV_WC_REM_ACCESS_ERR;
+                        break;
+                    }
+                    remote += piece.size;
+                }
+            }
+                break;
+            case IBV_WR_SEND: {
+                c.opcode = IBV_WC_SEND;
+                std::vector<byte_t> msg;
+                for (int i = 0; i < request.num_pieces; i++) {
+                    msg.insert(msg.end(), request.pieces[i].local, request.pieces[i].local + request.pieces[i].size);
+                }
+                if (!deliver(std::move(msg), due)) {
+                    std::cerr << ">> Error: loopback sends only reach peers in the same process\n";
+                    return {Status::PostFailed, -1};
+                }
+            }
+                break;
+            default:
+                return {Status::InvalidArguments, -1};
+            }
+
+            std::scoped_lock<std::mutex> _(cq->lock);
+            cq->completions.push_back(c);
+            return {Status::Ok, 0};
+        }
+
+        auto LoopbackTransport::post_recv(byte_ptr_t local, size_t len) -> StatusPair {
+            receives.push_back({local, len});
+            return {Status::Ok, 0};
+        }
+
+        auto LoopbackTransport::poll(struct ibv_wc *wcs, int num, bool send) -> int {
+            auto now = std::chrono::steady_clock::now();
+            int n = 0;
+            if (send) {
+                // operations of a QP complete in order, an unsignaled one is reported only if it failed
+                std::scoped_lock<std::mutex> _(cq->lock);
+                auto &completions = cq->completions;
+                while (n < num && !completions.empty() && completions.front().due <= now) {
+                    auto &c = completions.front();
+                    if (c.signaled || c.status != IBV_WC_SUCCESS) {
+                        memset(&wcs[n], 0, sizeof(struct ibv_wc));
+                        wcs[n].opcode = c.opcode;
+                        wcs[n].status = c.status;
+                        wcs[n].byte_len = c.byte_len;
+                        wcs[n].qp_num = c.qp_num;
+                        ++n;
+                    }
+                    completions.pop_front();
+                }
+                return n;
+            }
+
+            std::scoped_lock<std::mutex> _(inbox_lock);
+            while (n < num && !inbox.empty() && !receives.empty() && inbox.front().due <= now) {
+                auto &m = inbox.front();
+                auto [local, len] = receives.front();
+                memset(&wcs[n], 0, sizeof(struct ibv_wc));
+                wcs[n].opcode = IBV_WC_RECV;
+                wcs[n].qp_num = qp_num;
+                wcs[n].byte_len = m.bytes.size();
+                if (m.bytes.size() > len) {
+                    wcs[n].status = IBV_WC_LOC_LEN_ERR;
+                } else {
+                    memcpy(local, m.bytes.data(), m.bytes.size());
+                    wcs[n].status = IBV_WC_SUCCESS;
+                }
+                ++n;
+                inbox.pop_front();
+                receives.pop_front();
+            }
+            return n;
+        }
     }
 }
@@ -11,6 +11,9 @@
  *    6. rdma->modify_qp(rts_attr, rts_mask)
  *    7. rdma->post_send/recv/read/write
  *    8. rdma->poll_complection
+ *
+ * Device "loopback" is a software stand-in for a NIC, see LoopbackTransport. Steps 4 to 6 are done by
+ * default_connect for both kinds of devices.
  */
 #ifndef __HILL__RDMA__RDMA__
 #define __HILL__RDMA__RDMA__
@@ -21,6 +24,10 @@
 #include <functional>
 #include <iostream>
 #include <cstring>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <vector>
 
 #include <infiniband/verbs.h>
 #include <byteswap.h>
@@ -80,7 +87,152 @@ namespace Hill {
         using const_byte_ptr_t = const uint8_t *;
         auto decode_rdma_status(const Enums::Status& status) -> std::string;
 
-        class RDMADevice;
+        /*
+         * One work request of a batch. Its pieces, each in the registered buffer, are gathered into one remote
+         * range by a write or a send, or scattered from it by a read, e.g., a header and a value built apart
+         * need no copy to become adjacent. remote is ignored by sends.
+         */
+        struct WorkRequest {
+            static constexpr int iMAX_PIECES = 4;
+            struct Piece {
+                byte_ptr_t local;
+                uint32_t size;
+            };
+
+            enum ibv_wr_opcode opcode;
+            byte_ptr_t remote;
+            int num_pieces;
+            Piece pieces[iMAX_PIECES];
+
+            static auto make_request(enum ibv_wr_opcode opcode, const byte_ptr_t &local, const byte_ptr_t &remote,
+                                     size_t size) noexcept -> WorkRequest {
+                WorkRequest ret;
+                ret.opcode = opcode;
+                ret.remote = remote;
+                ret.num_pieces = 1;
+                ret.pieces[0] = {local, uint32_t(size)};
+                return ret;
+            }
+
+            // false if every piece is taken
+            inline auto add_piece(const byte_ptr_t &local, size_t size) noexcept -> bool {
+                if (num_pieces == iMAX_PIECES) {
+                    return false;
+                }
+                pieces[num_pieces++] = {local, uint32_t(size)};
+                return true;
+            }
+
+            inline auto size() const noexcept -> size_t {
+                size_t ret = 0;
+                for (int i = 0; i < num_pieces; i++) {
+                    ret += pieces[i].size;
+                }
+                return ret;
+            }
+        };
+
+        /*
+         * The operations an RDMAContext performs on its connection, for contexts opened on a software device.
+         * A context without a transport goes to libibverbs directly.
+         */
+        class Transport {
+        public:
+            virtual ~Transport() = default;
+            // fill the transport part of the local certificate, addr is already filled
+            virtual auto certify(connection_certificate &local) -> void = 0;
+            virtual auto connect(const connection_certificate &remote) -> Enums::Status = 0;
+            virtual auto post(const WorkRequest &request, bool signaled) -> StatusPair = 0;
+            virtual auto post_recv(byte_ptr_t local, size_t len) -> StatusPair = 0;
+            // never blocks, same as ibv_poll_cq
+            virtual auto poll(struct ibv_wc *wcs, int num, bool send) -> int = 0;
+        };
+
+        /*
+         * Emulation of an RC connection between two contexts on one host. One-sided operations copy directly
+         * between the registered buffer and the peer, by memcpy within a process and by process_vm_readv/writev
+         * across processes. Sends are delivered to posted receives of a peer in the same process only.
+         *
+         * Data moves when an operation is posted, its completion is reported latency later, which is how the
+         * wire delay of a NIC is injected.
+         */
+        class LoopbackTransport : public Transport {
+        public:
+            struct Completion {
+                std::chrono::steady_clock::time_point due;
+                enum ibv_wc_opcode opcode;
+                enum ibv_wc_status status;
+                uint32_t byte_len;
+                uint32_t qp_num;
+                bool signaled;
+            };
+
+            // send completions of one transport, or of every transport in a CQ group
+            struct CompletionQueue {
+                std::mutex lock;
+                std::deque<Completion> completions;
+            };
+
+            // cq is shared with the other transports of a CQ group, nullptr for a queue of its own
+            LoopbackTransport(std::chrono::nanoseconds latency_, std::shared_ptr<CompletionQueue> cq = nullptr);
+            ~LoopbackTransport() override;
+            LoopbackTransport(const LoopbackTransport &) = delete;
+            LoopbackTransport(LoopbackTransport &&) = delete;
+            auto operator=(const LoopbackTransport &) -> LoopbackTransport & = delete;
+            auto operator=(LoopbackTransport &&) -> LoopbackTransport & = delete;
+
+            auto certify(connection_certificate &local) -> void override;
+            auto connect(const connection_certificate &remote) -> Enums::Status override;
+            auto post(const WorkRequest &request, bool signaled) -> StatusPair override;
+            auto post_recv(byte_ptr_t local, size_t len) -> StatusPair override;
+            auto poll(struct ibv_wc *wcs, int num, bool send) -> int override;
+
+        private:
+            struct Message {
+                std::chrono::steady_clock::time_point due;
+                std::vector<byte_t> bytes;
+            };
+
+            std::chrono::nanoseconds latency;
+            uint32_t qp_num;
+            // the peer, pid tells whether it is in this process
+            pid_t peer_pid;
+            uint32_t peer_qp_num;
+            std::shared_ptr<CompletionQueue> cq;
+            std::deque<std::pair<byte_ptr_t, size_t>> receives;
+            std::mutex inbox_lock;
+            std::deque<Message> inbox;
+
+            auto copy(enum ibv_wr_opcode opcode, byte_ptr_t local, uint64_t remote, size_t len) -> bool;
+            auto deliver(std::vector<byte_t> &&msg, std::chrono::steady_clock::time_point due) -> bool;
+        };
+
+        /*
+         * Verbs resources of a device, shared by every context opened on it. The device and its contexts all
+         * hold a reference, so a context stays usable after its device is destroyed and the last of them
+         * releases the resources, QPs always before the CQs, MRs and PD they are created from.
+         */
+        struct DeviceResources {
+            struct ibv_device **devices;
+            struct ibv_context *ctx;
+            // only setting up connections contends here, and registering a region is the slow part anyway
+            std::mutex lock;
+            struct ibv_pd *pd;
+            // a region is registered once no matter how many connections expose it
+            std::vector<struct ibv_mr *> mrs;
+            std::vector<int> mr_accesses;
+            // a CQ group serves all its contexts
+            std::vector<std::pair<struct ibv_cq *, struct ibv_cq *>> cq_groups;
+            std::vector<std::shared_ptr<LoopbackTransport::CompletionQueue>> loopback_cq_groups;
+
+            DeviceResources() : devices(nullptr), ctx(nullptr), pd(nullptr) {};
+            ~DeviceResources();
+            DeviceResources(const DeviceResources &) = delete;
+            DeviceResources(DeviceResources &&) = delete;
+            auto operator=(const DeviceResources &) -> DeviceResources & = delete;
+            auto operator=(DeviceResources &&) -> DeviceResources & = delete;
+        };
+
         // Aggregation of pointers to ibv_context, ibv_pd, ibv_cq, ibv_mr and ibv_qp, which are used for further operations
         struct RDMAContext {
             struct ibv_context *ctx;
@@ -91,8 +243,19 @@ namespace Hill {
             struct ibv_qp *qp;
             connection_certificate local, remote;
             void *buf;
-            RDMADevice *device;
-            
+            size_t buf_size;
+            // keeps pd, mr and shared CQs alive as long as this context
+            std::shared_ptr<DeviceResources> resources;
+            int ib_port;
+            int gid_idx;
+            // software transport, nullptr if this context is backed by libibverbs
+            Transport *transport;
+            // CQs are shared by a group of contexts, see RDMADevice::open
+            bool shared_cq;
+
+            // send queue depth of a QP, also the longest batch post_batch accepts
+            static constexpr size_t uMAX_SEND_WR = 64;
+
             auto post_send_helper(const uint8_t *msg, size_t msg_len, enum ibv_wr_opcode opcode, size_t local_offset,
                                   size_t remote_offset) -> StatusPair;
             auto post_send_helper(const byte_ptr_t &ptr, const uint8_t *msg, size_t msg_len, enum ibv_wr_opcode opcode,
@@ -105,19 +268,19 @@ namespace Hill {
             auto operator=(const RDMAContext &) = delete;
             auto operator=(RDMAContext &&) = delete;
 
+            // value-initialized, i.e., every field is zero
             inline static auto make_rdma_context() -> std::unique_ptr<RDMAContext> {
-                auto ret = std::make_unique<RDMAContext>();
-                memset(ret.get(), 0, sizeof(RDMAContext));
-                return ret;
+                return std::make_unique<RDMAContext>();
             }
             
             ~RDMAContext() {
                 if (qp) ibv_destroy_qp(qp);
-                if (mr) ibv_dereg_mr(mr);
-                if (out_cq) ibv_destroy_cq(out_cq);
-                if (in_cq) ibv_destroy_cq(in_cq);                
-                if (pd) ibv_dealloc_pd(pd);
-                // do not release the ctx because it's shared by multiple RDMAContext instances
+                if (!shared_cq) {
+                    if (out_cq) ibv_destroy_cq(out_cq);
+                    if (in_cq) ibv_destroy_cq(in_cq);
+                }
+                delete transport;
+                // ctx, pd and mr are shared by multiple RDMAContext instances, resources releases them
             }
 
             auto default_connect(int socket) -> int;
@@ -138,17 +301,26 @@ namespace Hill {
             auto post_write(const byte_ptr_t &ptr, const uint8_t *msg, size_t msg_len, size_t local_offset = 0)
                 -> StatusPair;
 
+            /*
+             * Post num requests with a single ibv_post_send, i.e., one doorbell. Only the last one is signaled,
+             * so the batch generates exactly one completion. Requests of a QP complete in order, thus the
+             * completion of the last one implies all of them are done. num should not exceed uMAX_SEND_WR.
+             */
+            auto post_batch(const WorkRequest *requests, size_t num) -> StatusPair;
+
             auto post_recv_to(size_t msg_len, size_t offset = 0) -> StatusPair;
 
             /*
-             * A set of poll_completion functions. 
+             * A set of poll_completion functions, none of them allocates, completions go to the caller's array.
              * poll_completion_once(): just to check if a completion is generated
-             * poll_one_completion(): poll if one completion is generated and return a ibv_wc struct or an error
+             * poll_one_completion(): spin until one completion is generated and fill wc, or an error
+             * poll_multiple_completions(): spin until at least one of no completions is generated
+             * poll_completions(): never spin, returns the number of completions written to wcs or an error
              */
             auto poll_completion_once(bool send = true) noexcept -> int;
-            auto poll_one_completion(bool send = true) noexcept -> std::pair<std::unique_ptr<struct ibv_wc>, int>;
-            auto poll_multiple_completions(size_t no, bool send = true) noexcept
-                -> std::pair<std::unique_ptr<struct ibv_wc[]>, int>;
+            auto poll_one_completion(struct ibv_wc &wc, bool send = true) noexcept -> int;
+            auto poll_multiple_completions(struct ibv_wc *wcs, size_t no, bool send = true) noexcept -> int;
+            auto poll_completions(struct ibv_wc *wcs, size_t num, bool send = true) noexcept -> int;
             
             auto fill_buf(uint8_t *msg, size_t msg_len, size_t offset = 0) -> void;
 
@@ -159,6 +331,21 @@ namespace Hill {
             inline auto get_char_buf() const noexcept -> const char * {
                 return (char *)buf;
             }
+
+            /*
+             * The registered buffer doubles as a staging area: data built here can be posted with a nullptr
+             * msg so that post_* skips the memcpy
+             */
+            inline auto get_staging_buf() const noexcept -> byte_ptr_t {
+                return reinterpret_cast<byte_ptr_t>(buf);
+            }
+
+            inline auto get_staging_size() const noexcept -> size_t {
+                return buf_size;
+            }
+
+        private:
+            auto poll_cq(struct ibv_wc *wcs, int num, bool send) noexcept -> int;
         };
 
         /*
@@ -168,13 +355,21 @@ namespace Hill {
         class RDMADevice {
         private:
             std::string dev_name;
-            struct ibv_device **devices;
             struct ibv_device *device;
-            struct ibv_context *ctx;
             int ib_port;
             int gid_idx;
+            // only for the loopback device
+            std::chrono::nanoseconds latency;
+            std::shared_ptr<DeviceResources> resources;
+
+            auto get_mr(void *membuf, size_t memsize, int mr_access) -> struct ibv_mr *;
+            auto get_cq_group(int group, size_t cqe) -> std::pair<struct ibv_cq *, struct ibv_cq *>;
+            auto get_loopback_cq_group(int group) -> std::shared_ptr<LoopbackTransport::CompletionQueue>;
 
         public:
+            // name of the software device, no NIC is needed
+            static constexpr auto sLOOPBACK_DEVICE = "loopback";
+
             static auto make_rdma(const std::string &dev_name, int ib_port, int gid_idx)
                 -> std::pair<std::unique_ptr<RDMADevice>, Status>
             {
@@ -183,17 +378,24 @@ namespace Hill {
                 ret->dev_name = dev_name;
                 ret->ib_port = ib_port;
                 ret->gid_idx = gid_idx;
+                ret->latency = std::chrono::nanoseconds(0);
+                ret->device = nullptr;
+                ret->resources = std::make_shared<DeviceResources>();
+                if (ret->is_loopback()) {
+                    return std::make_pair(std::move(ret), Status::Ok);
+                }
                 
-                ret->devices = ibv_get_device_list(&dev_num);
-                if (!ret->devices) {
+                auto &devices = ret->resources->devices;
+                devices = ibv_get_device_list(&dev_num);
+                if (!devices) {
                     return std::make_pair(nullptr, Status::NoRDMADeviceList);
                 }
 
                 for (int i = 0; i < dev_num; i++) {
-                    if (dev_name.compare(ibv_get_device_name(ret->devices[i])) == 0) {
-                        if (auto ctx = ibv_open_device(ret->devices[i]); ctx) {
-                            ret->device = ret->devices[i];
-                            ret->ctx = ctx;
+                    if (dev_name.compare(ibv_get_device_name(devices[i])) == 0) {
+                        if (auto ctx = ibv_open_device(devices[i]); ctx) {
+                            ret->device = devices[i];
+                            ret->resources->ctx = ctx;
                             return std::make_pair(std::move(ret), Status::Ok);
                         }
                     }
@@ -204,10 +406,8 @@ namespace Hill {
 
             // never explicitly instantiated
             RDMADevice() = default;
-            ~RDMADevice() {
-                ibv_free_device_list(devices);
-                ibv_close_device(ctx);
-            }
+            // contexts still open keep the resources, see DeviceResources
+            ~RDMADevice() = default;
             RDMADevice(const RDMADevice &) = delete;
             RDMADevice(RDMADevice &&) = delete;
             RDMADevice &operator=(const RDMADevice &) = delete;
@@ -226,6 +426,15 @@ namespace Hill {
                 return dev_name;
             }
 
+            inline auto is_loopback() const noexcept -> bool {
+                return dev_name == sLOOPBACK_DEVICE;
+            }
+
+            // delay of every completion of contexts opened from now on, loopback device only
+            inline auto set_injected_latency(std::chrono::nanoseconds latency_) noexcept -> void {
+                latency = latency_;
+            }
+
             /*
               Open an initialized RDMA device made from `make_rdma`
               @membuf: memory region to be registered
@@ -233,9 +442,15 @@ namespace Hill {
               @cqe: completion queue capacity
               @attr: queue pair initialization attribute.
               No need to fill the `send_cq` and `recv_cq` fields, they are filled automatically
+              @cq_group: contexts of the same group share CQs of capacity cqe, -1 for CQs of its own.
+              Only contexts that never poll, e.g., passive ends of one-sided operations, or that are
+              polled by one thread for all of them should share. On the loopback device only send
+              completions are shared.
+
+              All contexts share one PD, and one MR per (membuf, memsize, mr_access).
             */
-            auto open(void *membuf, size_t memsize, size_t cqe, int mr_access, struct ibv_qp_init_attr &attr)
-                -> std::pair<std::unique_ptr<RDMAContext>, Status>;
+            auto open(void *membuf, size_t memsize, size_t cqe, int mr_access, struct ibv_qp_init_attr &attr,
+                      int cq_group = -1) -> std::pair<std::unique_ptr<RDMAContext>, Status>;
 
             inline static auto get_default_mr_access() -> int {
                 return IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
@@ -46,7 +46,243 @@ namespace Hill {
                 return;                
             }
 
-            (*ret->second)->expire += Constants::tLEASE;
+            list.erase(ret->second);
+            map.erase(ret);
+            --load;
+        }
+
+        CompactCache::CompactCache(size_t cache_cap, size_t num_shards)
+            : shards(num_shards), epoch(std::chrono::steady_clock::now()), now(0)
+        {
+            auto per_shard = (cache_cap + num_shards - 1) / num_shards;
+            buckets_per_shard = std::max<size_t>(1, (per_shard + Constants::iBUCKET_SLOTS - 1) / Constants::iBUCKET_SLOTS);
+            for (auto &shard : shards) {
+                // value-initialized, i.e., empty
+                shard.buckets = std::make_unique<Bucket[]>(buckets_per_shard);
+                shard.keys = std::make_unique<char[]>(buckets_per_shard * Constants::iBUCKET_SLOTS *
+                                                      Constants::uMAX_CACHED_KEY);
+                for (auto &c : shard.counters) {
+                    c.hits = c.misses = c.evictions = 0;
+                }
+            }
+        }
+
+        auto CompactCache::tick() -> uint32_t {
+            thread_local uint32_t ticks = 0;
+            if (ticks++ % Constants::uCLOCK_REFRESH == 0) {
+                auto elapsed = std::chrono::steady_clock::now() - epoch;
+                now.store(std::chrono::duration_cast<std::chrono::seconds>(elapsed).count(), std::memory_order_relaxed);
+            }
+            return now.load(std::memory_order_relaxed);
+        }
+
+        auto CompactCache::counters_of(Shard &shard) const noexcept -> Counters & {
+            static std::atomic_int stripes(0);
+            thread_local int stripe = stripes++ % Constants::iCOUNTER_STRIPES;
+            return shard.counters[stripe];
+        }
+
+        auto CompactCache::find(const Shard &shard, size_t b, uint16_t fp, std::string_view key) const noexcept -> int {
+            auto &bucket = shard.buckets[b];
+            for (int i = 0; i < Constants::iBUCKET_SLOTS; i++) {
+                if (bucket.fingerprints[i] == fp && bucket.key_sizes[i] == key.size() &&
+                    memcmp(key_of(shard, b, i), key.data(), key.size()) == 0) {
+                    return i;
+                }
+            }
+            return -1;
+        }
+
+        auto CompactCache::locate(uint64_t hash) -> Location {
+            // the low bits pick the shard, the middle ones the bucket and the high ones are the fingerprint
+            uint16_t fp = hash >> 48;
+            return {&shards[hash % shards.size()], (hash / shards.size()) % buckets_per_shard, fp == 0 ? uint16_t(1) : fp};
+        }
+
+        auto CompactCache::get(const std::string &key, CachedValue &out) -> bool {
+            auto [shard_ptr, b, fp] = locate(hash_of(key));
+            auto &shard = *shard_ptr;
+            auto &bucket = shard.buckets[b];
+            auto &counters = counters_of(shard);
+            auto time = tick();
+
+            int i;
+            uint32_t expires = 0;
+            while (true) {
+                auto version = bucket.version.load(std::memory_order_acquire);
+                if (version & 1) {
+                    continue;
+                }
+
+                i = find(shard, b, fp, key);
+                if (i != -1) {
+                    out.value_ptr = bucket.values[i];
+                    out.value_size = bucket.value_sizes[i];
+                    out.stamp = bucket.stamps[i];
+                    expires = bucket.expires[i];
+                }
+
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (bucket.version.load(std::memory_order_relaxed) == version) {
+                    break;
+                }
+            }
+
+            // an expired entry stays until it is overwritten
+            if (i == -1 || time > expires) {
+                counters.misses.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+
+            // a hot entry is referenced already, its bucket is not written again
+            uint8_t bit = 1 << i;
+            if ((bucket.referenced.load(std::memory_order_relaxed) & bit) == 0) {
+                bucket.referenced.fetch_or(bit, std::memory_order_relaxed);
+            }
+            counters.hits.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+
+        auto CompactCache::insert(const std::string &key, const PolymorphicPointer &value, size_t sz, uint64_t stamp)
+            -> void
+        {
+            if (key.size() > Constants::uMAX_CACHED_KEY) {
+                return;
+            }
+
+            auto [shard_ptr, b, fp] = locate(hash_of(key));
+            auto &shard = *shard_ptr;
+            auto time = tick();
+            std::scoped_lock<std::mutex> _(shard.lock);
+            auto &bucket = shard.buckets[b];
+            auto i = find(shard, b, fp, key);
+            for (int j = 0; i == -1 && j < Constants::iBUCKET_SLOTS; j++) {
+                if (bucket.fingerprints[j] == 0) {
+                    i = j;
+                }
+            }
+
+            // CLOCK, a referenced slot gets a second chance
+            if (i == -1) {
+                while (i == -1) {
+                    auto h = bucket.hand;
+                    bucket.hand = (h + 1) % Constants::iBUCKET_SLOTS;
+                    uint8_t bit = 1 << h;
+                    if (bucket.referenced.load(std::memory_order_relaxed) & bit) {
+                        bucket.referenced.fetch_and(~bit, std::memory_order_relaxed);
+                    } else {
+                        i = h;
+                    }
+                }
+                counters_of(shard).evictions.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            bucket.begin_write();
+            bucket.fingerprints[i] = fp;
+            bucket.key_sizes[i] = key.size();
+            memcpy(key_of(shard, b, i), key.data(), key.size());
+            bucket.referenced.fetch_and(~(1 << i), std::memory_order_relaxed);
+            bucket.expires[i] = time + std::chrono::duration_cast<std::chrono::seconds>(Constants::tLEASE).count();
+            bucket.values[i] = value;
+            bucket.value_sizes[i] = sz;
+            bucket.stamps[i] = stamp;
+            bucket.end_write();
+        }
+
+        auto CompactCache::expire(const std::string &key) -> void {
+            auto [shard_ptr, b, fp] = locate(hash_of(key));
+            auto &shard = *shard_ptr;
+            std::scoped_lock<std::mutex> _(shard.lock);
+            if (auto i = find(shard, b, fp, key); i != -1) {
+                auto &bucket = shard.buckets[b];
+                bucket.begin_write();
+                bucket.fingerprints[i] = 0;
+                bucket.end_write();
+            }
+        }
+
+        auto CompactCache::invalidate(uint64_t hash) -> void {
+            auto [shard_ptr, b, fp] = locate(hash);
+            auto &shard = *shard_ptr;
+            std::scoped_lock<std::mutex> _(shard.lock);
+            auto &bucket = shard.buckets[b];
+            bucket.begin_write();
+            for (int i = 0; i < Constants::iBUCKET_SLOTS; i++) {
+                if (bucket.fingerprints[i] == fp) {
+                    bucket.fingerprints[i] = 0;
+                }
+            }
+            bucket.end_write();
+        }
+
+        auto CompactCache::clear() -> void {
+            for (auto &shard : shards) {
+                std::scoped_lock<std::mutex> _(shard.lock);
+                for (size_t b = 0; b < buckets_per_shard; b++) {
+                    auto &bucket = shard.buckets[b];
+                    bucket.begin_write();
+                    memset(bucket.fingerprints, 0, sizeof(bucket.fingerprints));
+                    bucket.end_write();
+                }
+            }
+        }
+
+        auto CompactCache::hit_ratio() const noexcept -> double {
+            uint64_t hits = 0, accessed = 0;
+            for (const auto &s : shard_stats()) {
+                hits += s.hits;
+                accessed += s.hits + s.misses;
+            }
+            return double(hits) / accessed;
+        }
+
+        auto CompactCache::shard_stats() const -> std::vector<ShardStats> {
+            std::vector<ShardStats> ret;
+            ret.reserve(shards.size());
+            for (const auto &shard : shards) {
+                ShardStats s{0, 0, 0};
+                for (const auto &c : shard.counters) {
+                    s.hits += c.hits.load(std::memory_order_relaxed);
+                    s.misses += c.misses.load(std::memory_order_relaxed);
+                    s.evictions += c.evictions.load(std::memory_order_relaxed);
+                }
+                ret.push_back(s);
+            }
+            return ret;
+        }
+
+        auto BloomFilter::add(uint64_t hash) noexcept -> void {
+            probe(hash, [&](size_t word, uint64_t mask) {
+                if ((words[word].load(std::memory_order_relaxed) & mask) == 0) {
+                    words[word].fetch_or(mask, std::memory_order_relaxed);
+                }
+            });
+        }
+
+        auto BloomFilter::may_contain(uint64_t hash) const noexcept -> bool {
+            auto ret = true;
+            probe(hash, [&](size_t word, uint64_t mask) {
+                ret = ret && (words[word].load(std::memory_order_relaxed) & mask) != 0;
+            });
+            return ret;
+        }
+
+        auto BloomFilter::serialize(byte_t *buf) const noexcept -> void {
+            for (size_t i = 0; i < uWORDS; i++) {
+                auto w = words[i].load(std::memory_order_relaxed);
+                memcpy(buf + i * sizeof(uint64_t), &w, sizeof(uint64_t));
+            }
+        }
+
+        auto BloomFilter::merge(const byte_t *buf) noexcept -> void {
+            for (size_t i = 0; i < uWORDS; i++) {
+                uint64_t w;
+                memcpy(&w, buf + i * sizeof(uint64_t), sizeof(uint64_t));
+                // most words are unchanged since the last merge
+                if ((w & ~words[i].load(std::memory_order_relaxed)) != 0) {
+                    words[i].fetch_or(w, std::memory_order_relaxed);
+                }
+            }
         }
     }
 }
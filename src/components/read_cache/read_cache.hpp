@@ -9,6 +9,11 @@
 #include <unordered_map>
 #include <list>
 #include <chrono>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <string_view>
 using namespace std::literals;
 
 namespace Hill {
@@ -22,6 +27,19 @@ namespace Hill {
             constexpr size_t uCACHE_SIZE = 5000000UL;
 #endif
             constexpr auto tLEASE = 180s;
+
+            // CompactCache, keys longer than uMAX_CACHED_KEY are not cached
+            constexpr int iBUCKET_SLOTS = 8;
+            constexpr size_t uMAX_CACHED_KEY = 32;
+            constexpr size_t uCACHE_SHARDS = 64;
+            // a thread reads the clock every uCLOCK_REFRESH accesses
+            constexpr uint32_t uCLOCK_REFRESH = 1024;
+            constexpr int iCOUNTER_STRIPES = 8;
+
+            // BloomFilter, a key sets iFILTER_PROBES bits in one 512-bit block
+            constexpr size_t uFILTER_BITS = 1UL << 23;
+            constexpr size_t uFILTER_BLOCK_BITS = 512;
+            constexpr int iFILTER_PROBES = 4;
         }
 
         struct CacheItem {
@@ -84,6 +102,178 @@ namespace Hill {
             uint64_t hit;
             uint64_t accessed;
         };
+
+        struct CachedValue {
+            PolymorphicPointer value_ptr;
+            size_t value_size;
+            // stamp of the value when it is cached, 0 if unknown, see KVPair::next_stamp
+            uint64_t stamp;
+        };
+
+        // counters of a shard of a CompactCache
+        struct ShardStats {
+            uint64_t hits;
+            uint64_t misses;
+            uint64_t evictions;
+        };
+
+        /*
+         * A set-associative cache, a key hashes to a shard and to a bucket of iBUCKET_SLOTS slots in it.
+         * Slots are told apart by inline 16-bit fingerprints before any key is compared, and a full bucket
+         * evicts with CLOCK. Keys live in a per-shard arena, one uMAX_CACHED_KEY stride per slot, so an entry
+         * allocates nothing.
+         *
+         * One cache may serve every thread of a process. Writers lock their shard, readers take no lock, a
+         * bucket is versioned like a seqlock and a reader retries if a writer changes the bucket under it.
+         * Counters are striped over threads so that hits on a hot shard do not bounce one cache line.
+         */
+        class CompactCache {
+        public:
+            CompactCache(size_t cache_cap, size_t num_shards = Constants::uCACHE_SHARDS);
+            ~CompactCache() = default;
+            CompactCache(const CompactCache &) = delete;
+            CompactCache(CompactCache &&) = delete;
+            auto operator=(const CompactCache &) -> CompactCache & = delete;
+            auto operator=(CompactCache &&) -> CompactCache & = delete;
+
+            auto get(const std::string &key, CachedValue &out) -> bool;
+            auto insert(const std::string &key, const PolymorphicPointer &value, size_t sz, uint64_t stamp = 0) -> void;
+            // drop key
+            auto expire(const std::string &key) -> void;
+            // drop every key of hash, and maybe a few others sharing its bucket and fingerprint
+            auto invalidate(uint64_t hash) -> void;
+            auto clear() -> void;
+
+            auto hit_ratio() const noexcept -> double;
+            auto shard_stats() const -> std::vector<ShardStats>;
+
+            // servers name keys to invalidate by this hash, so all nodes must run the same build
+            static inline auto hash_of(std::string_view key) noexcept -> uint64_t {
+                return std::hash<std::string_view>{}(key);
+            }
+
+            inline auto capacity() const noexcept -> size_t {
+                return shards.size() * buckets_per_shard * Constants::iBUCKET_SLOTS;
+            }
+
+            // bytes held by the cache, all of them are allocated up front
+            inline auto footprint() const noexcept -> size_t {
+                return sizeof(CompactCache) + shards.size() * (sizeof(Shard) + buckets_per_shard *
+                    (sizeof(Bucket) + Constants::iBUCKET_SLOTS * Constants::uMAX_CACHED_KEY));
+            }
+
+        private:
+            struct Bucket {
+                // odd while a writer changes the bucket
+                std::atomic_uint32_t version;
+                // CLOCK reference bits, set by readers, and hand
+                std::atomic_uint8_t referenced;
+                uint8_t hand;
+                // 0 is an empty slot
+                uint16_t fingerprints[Constants::iBUCKET_SLOTS];
+                uint16_t key_sizes[Constants::iBUCKET_SLOTS];
+                // seconds since the cache is created
+                uint32_t expires[Constants::iBUCKET_SLOTS];
+                uint32_t value_sizes[Constants::iBUCKET_SLOTS];
+                PolymorphicPointer values[Constants::iBUCKET_SLOTS];
+                uint64_t stamps[Constants::iBUCKET_SLOTS];
+
+                // writers hold the lock of the shard
+                inline auto begin_write() noexcept -> void {
+                    version.store(version.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                    std::atomic_thread_fence(std::memory_order_release);
+                }
+
+                inline auto end_write() noexcept -> void {
+                    version.store(version.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+                }
+            };
+
+            struct alignas(64) Counters {
+                std::atomic_uint64_t hits;
+                std::atomic_uint64_t misses;
+                std::atomic_uint64_t evictions;
+            };
+
+            // shards of a shared cache do not share cache lines
+            struct alignas(64) Shard {
+                std::mutex lock;
+                std::unique_ptr<Bucket[]> buckets;
+                std::unique_ptr<char[]> keys;
+                Counters counters[Constants::iCOUNTER_STRIPES];
+            };
+
+            std::vector<Shard> shards;
+            size_t buckets_per_shard;
+            std::chrono::time_point<std::chrono::steady_clock> epoch;
+            // coarse clock, seconds since epoch
+            std::atomic_uint32_t now;
+
+            struct Location {
+                Shard *shard;
+                size_t bucket;
+                uint16_t fingerprint;
+            };
+
+            auto locate(uint64_t hash) -> Location;
+            auto tick() -> uint32_t;
+            // slot of key in bucket, -1 if absent
+            auto find(const Shard &shard, size_t b, uint16_t fp, std::string_view key) const noexcept -> int;
+            // counters of the calling thread
+            auto counters_of(Shard &shard) const noexcept -> Counters &;
+
+            inline auto key_of(const Shard &shard, size_t b, int slot) const noexcept -> char * {
+                return shard.keys.get() + (b * Constants::iBUCKET_SLOTS + slot) * Constants::uMAX_CACHED_KEY;
+            }
+        };
+
+        /*
+         * A blocked Bloom filter of the keys a server holds, so that a client answers a search of a key that
+         * was never inserted without asking. Keys are hashed with CompactCache::hash_of, and all bits of a key
+         * lie in one block, i.e., one cache line.
+         *
+         * Keys are never removed from a store, so bits are only ever set. A filter fetched from a server is
+         * merged word by word with fetch_or, and a reader racing a merge still sees every key of the older
+         * filter.
+         */
+        class BloomFilter {
+        public:
+            BloomFilter() : words(std::make_unique<std::atomic_uint64_t[]>(uWORDS)) {}
+            ~BloomFilter() = default;
+            BloomFilter(const BloomFilter &) = delete;
+            BloomFilter(BloomFilter &&) = delete;
+            auto operator=(const BloomFilter &) -> BloomFilter & = delete;
+            auto operator=(BloomFilter &&) -> BloomFilter & = delete;
+
+            auto add(uint64_t hash) noexcept -> void;
+            // false only if no key of hash was ever added
+            auto may_contain(uint64_t hash) const noexcept -> bool;
+
+            // buf holds size() bytes
+            auto serialize(byte_t *buf) const noexcept -> void;
+            auto merge(const byte_t *buf) noexcept -> void;
+
+            static constexpr auto size() noexcept -> size_t {
+                return Constants::uFILTER_BITS / 8;
+            }
+
+        private:
+            static constexpr size_t uWORDS = Constants::uFILTER_BITS / 64;
+            std::unique_ptr<std::atomic_uint64_t[]> words;
+
+            // calls f on the word index and the mask of each probe of hash
+            template<typename F>
+            inline auto probe(uint64_t hash, F &&f) const noexcept -> void {
+                constexpr auto blocks = Constants::uFILTER_BITS / Constants::uFILTER_BLOCK_BITS;
+                auto base = (hash % blocks) * (Constants::uFILTER_BLOCK_BITS / 64);
+                // bits inside the block come from a remix of the hash
+                auto bits = (hash ^ (hash >> 31)) * 0x9e3779b97f4a7c15UL;
+                for (int i = 0; i < Constants::iFILTER_PROBES; i++) {
+                    auto bit = (bits >> (9 * i)) & (Constants::uFILTER_BLOCK_BITS - 1);
+                    f(base + bit / 64, 1UL << (bit % 64));
+                }
+            }
+        };
     }
 }
 #endif
@@ -6,6 +6,11 @@
 #include "misc/misc.hpp"
 #include "cluster/cluster.hpp"
 
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <functional>
+
 namespace Hill {
     namespace Memory {
         namespace Constants {
@@ -13,6 +18,14 @@ namespace Hill {
             static constexpr uint64_t uREMOTE_POINTER_BITS_MASK = 0xc000000000000000UL;
             static constexpr uint64_t uREMOTE_POINTER_BITS = 0x2UL;
             static constexpr uint64_t uREMOTE_REGIONS = 32;
+            // a lent region is carved into blocks, each serving objects of one size class
+            static constexpr uint64_t uREMOTE_BLOCK_SIZE = 64 * 1024;
+            static constexpr uint64_t uREMOTE_BLOCKS = uREMOTE_REGION_SIZE / uREMOTE_BLOCK_SIZE;
+            static constexpr uint64_t uREMOTE_MIN_OBJECT = 32;
+            // 32B, 64B, ..., 64KB
+            static constexpr int iREMOTE_SIZE_CLASSES = 12;
+            // queued writes to one peer that trigger a post without waiting for flush
+            static constexpr size_t uREMOTE_WRITE_BATCH = 16;
         }
 
         namespace Enums {
@@ -201,63 +214,172 @@ namespace Hill {
 
 
         using namespace RDMAUtil;
+        /*
+         * Bookkeeping of one lent region. It is kept in DRAM because the region itself is on the lending peer
+         * and only reachable by RDMA. Objects are recorded as offsets into the region.
+         */
+        struct RemoteRegionMeta {
+            // live objects, the region is handed back once this drops to 0
+            uint64_t live;
+            // blocks carved from the region so far
+            uint64_t blocks;
+            // the block each size class is currently carving, frontier == limit means no such block
+            uint32_t frontiers[Constants::iREMOTE_SIZE_CLASSES];
+            uint32_t limits[Constants::iREMOTE_SIZE_CLASSES];
+            std::vector<uint32_t> free_lists[Constants::iREMOTE_SIZE_CLASSES];
+            uint8_t block_classes[Constants::uREMOTE_BLOCKS];
+
+            RemoteRegionMeta() : live(0), blocks(0) {
+                for (int i = 0; i < Constants::iREMOTE_SIZE_CLASSES; i++) {
+                    frontiers[i] = limits[i] = 0;
+                }
+            }
+        };
+
         /*
          * !!! NEVER INHERIT FROM ANY OTHER CLASSES OR STRUCTS
          * This class is not thread-safe, intending for thread-local use only
+         *
+         * A size-class allocator over one region lent by a peer. It lives in DRAM, see RemoteAgentState.
          */
         class RemoteAllocator {
         public:
-            RemoteAllocator() : base(nullptr) {
-                *reinterpret_cast<uint64_t *>(&meta) = 0UL;
-            };
+            RemoteAllocator() : base(nullptr), meta(nullptr) {};
+            ~RemoteAllocator() {
+                delete meta;
+            }
             RemoteAllocator(const RemotePointer &) = delete;
             RemoteAllocator(RemotePointer &&) = delete;
             auto operator=(const RemotePointer &) -> RemoteAllocator & = delete;
             auto operator=(RemoteAllocator &&) -> RemoteAllocator & = delete;
 
+            inline static auto class_of(size_t size) noexcept -> int {
+                int c = 0;
+                while ((Constants::uREMOTE_MIN_OBJECT << c) < size) {
+                    ++c;
+                }
+                return c;
+            }
+
+            inline static auto class_size(int c) noexcept -> size_t {
+                return Constants::uREMOTE_MIN_OBJECT << c;
+            }
+
             inline auto set_base(const RemotePointer &remote) noexcept -> void {
+                delete meta;
                 base = remote;
+                meta = new RemoteRegionMeta;
             }
-            
+
+            // stop using the region, returns its base so that it can be handed back to its owner
+            inline auto release() noexcept -> RemotePointer {
+                auto ret = base;
+                delete meta;
+                base = nullptr;
+                meta = nullptr;
+                return ret;
+            }
+
+            // ptr is nullptr if the region can not hold size more bytes
             auto allocate(size_t size, byte_ptr_t &ptr) noexcept -> void {
-                if (meta.counter + size >= Constants::uREMOTE_REGION_SIZE) {
-                    ptr = nullptr;
+                ptr = nullptr;
+                if (meta == nullptr || size > Constants::uREMOTE_BLOCK_SIZE) {
+                    return;
+                }
+
+                auto c = class_of(size);
+                uint32_t offset;
+                if (auto &list = meta->free_lists[c]; !list.empty()) {
+                    offset = list.back();
+                    list.pop_back();
+                } else {
+                    if (meta->frontiers[c] == meta->limits[c]) {
+                        if (meta->blocks == Constants::uREMOTE_BLOCKS) {
+                            return;
+                        }
+                        meta->block_classes[meta->blocks] = c;
+                        meta->frontiers[c] = meta->blocks * Constants::uREMOTE_BLOCK_SIZE;
+                        meta->limits[c] = meta->frontiers[c] + Constants::uREMOTE_BLOCK_SIZE;
+                        ++meta->blocks;
+                    }
+                    offset = meta->frontiers[c];
+                    meta->frontiers[c] += class_size(c);
                 }
 
-                ptr = base.raw_ptr() + meta.counter;
-                auto snap = meta;
-                ++snap.counter;
-                snap.cursor += size;
-                meta = snap;
+                ++meta->live;
+                ptr = base.raw_ptr() + offset;
+            }
+
+            inline auto free(const RemotePointer &ptr) noexcept -> void {
+                auto offset = uint32_t(ptr.raw_ptr() - base.raw_ptr());
+                meta->free_lists[meta->block_classes[offset / Constants::uREMOTE_BLOCK_SIZE]].push_back(offset);
+
+                // an empty region starts carving over, which undoes any fragmentation
+                if (--meta->live == 0) {
+                    delete meta;
+                    meta = new RemoteRegionMeta;
+                }
+            }
+
+            inline auto owns(const RemotePointer &ptr) const noexcept -> bool {
+                return meta != nullptr && ptr.raw_ptr() >= base.raw_ptr() &&
+                    ptr.raw_ptr() < base.raw_ptr() + Constants::uREMOTE_REGION_SIZE;
             }
 
+            // whether an allocation of any size class may still succeed
             inline auto available() const noexcept -> bool {
-                return !base.is_nullptr() && meta.cursor < Constants::uREMOTE_REGION_SIZE;
+                if (meta == nullptr) {
+                    return false;
+                }
+
+                if (meta->blocks < Constants::uREMOTE_BLOCKS) {
+                    return true;
+                }
+
+                for (int i = 0; i < Constants::iREMOTE_SIZE_CLASSES; i++) {
+                    if (!meta->free_lists[i].empty() || meta->frontiers[i] != meta->limits[i]) {
+                        return true;
+                    }
+                }
+                return false;
             }
-            
-            inline auto free(RemotePointer &ptr) noexcept -> void {
-                UNUSED(ptr);
-                --meta.counter;
+
+            inline auto is_in_use() const noexcept -> bool {
+                return meta != nullptr;
             }
 
             inline auto is_empty() const noexcept -> bool {
-                return meta.counter == 0;
+                return meta != nullptr && meta->live == 0;
             }
-            
+
         private:
             RemotePointer base;
-            // for persistent atomicity
-            struct {
-                // No. of current objects                
-                uint64_t counter : 32;
-                // Offset within this region => Regions size should not exceed 4GB
-                uint64_t cursor : 32;
-            } meta;
+            RemoteRegionMeta *meta;
         };
-        
+
+        /*
+         * DRAM side of a RemoteMemoryAgent, owned by the engine and bound to the agent on every start. It holds
+         * the allocators of borrowed regions and the regions released for their owners, nothing of which is
+         * meaningful after a restart
+         */
+        struct RemoteAgentState {
+            RemoteAllocator allocators[Constants::iTHREAD_LIST_NUM][Constants::uREMOTE_REGIONS];
+            // released by owner threads and drained by the memory monitor
+            std::mutex lock;
+            std::vector<RemotePointer> released;
+
+            static auto make_state() -> std::unique_ptr<RemoteAgentState> {
+                return std::make_unique<RemoteAgentState>();
+            }
+        };
+
         /*
          * My purpose of writing this class is for accessing remote PM. So I will always assume
          * RDMA connections exposing PM on other nodes are recorded here
+         *
+         * Each thread borrows up to uREMOTE_REGIONS regions and allocates from cursors[tid] first. A region
+         * other than the current one is released once it is empty and queued for its owner, see take_released.
+         * The agent lives in PM and only records which regions are borrowed, everything else is in state.
          */
         class RemoteMemoryAgent {
         public:
@@ -267,31 +389,78 @@ namespace Hill {
             auto operator=(const RemotePointer &) -> RemotePointer & = delete;
             auto operator=(RemotePointer &&) -> RemotePointer & = delete;
 
-            static auto make_agent(const byte_ptr_t &pm, std::array<std::unique_ptr<RDMAContext>, Cluster::Constants::uMAX_NODE> *p) -> RemoteMemoryAgent * {
+            static auto make_agent(const byte_ptr_t &pm, std::array<std::unique_ptr<RDMAContext>, Cluster::Constants::uMAX_NODE> *p,
+                                   RemoteAgentState *state) -> RemoteMemoryAgent * {
                 auto tmp = reinterpret_cast<RemoteMemoryAgent *>(pm);
                 memset(tmp, 0, sizeof(RemoteMemoryAgent));
                 tmp->peer_connections = p;
+                tmp->state = state;
                 return tmp;
             }
 
             auto add_region(int tid, const RemotePointer &ptr) -> bool {
-                if (++cursors[tid] < Constants::uREMOTE_REGIONS) {
-                    allocators[tid][++cursors[tid]].set_base(ptr);
-                    return true;
+                for (size_t i = 0; i < Constants::uREMOTE_REGIONS; i++) {
+                    if (!state->allocators[tid][i].is_in_use()) {
+                        state->allocators[tid][i].set_base(ptr);
+                        regions[tid][i] = ptr;
+                        cursors[tid] = i;
+                        return true;
+                    }
                 }
                 return false;
             }
 
+            // the current region is tried first, then any other region of this thread
             inline auto allocate(int tid, size_t size, byte_ptr_t &ptr) -> void {
-                allocators[tid][cursors[tid]].allocate(size, ptr);
+                auto &allocators = state->allocators[tid];
+                allocators[cursors[tid]].allocate(size, ptr);
+                if (ptr != nullptr) {
+                    return;
+                }
+
+                for (size_t i = 0; i < Constants::uREMOTE_REGIONS; i++) {
+                    if (i != cursors[tid] && allocators[i].is_in_use()) {
+                        allocators[i].allocate(size, ptr);
+                        if (ptr != nullptr) {
+                            cursors[tid] = i;
+                            return;
+                        }
+                    }
+                }
             }
 
             inline auto available(int tid) const noexcept -> bool {
-                return allocators[tid][cursors[tid]].available();
+                for (const auto &a : state->allocators[tid]) {
+                    if (a.available()) {
+                        return true;
+                    }
+                }
+                return false;
             }
 
             inline auto free(int tid, RemotePointer &ptr) {
-                allocators[tid][cursors[tid]].free(ptr);
+                for (size_t i = 0; i < Constants::uREMOTE_REGIONS; i++) {
+                    auto &a = state->allocators[tid][i];
+                    if (!a.owns(ptr)) {
+                        continue;
+                    }
+
+                    a.free(ptr);
+                    if (i != cursors[tid] && a.is_empty()) {
+                        regions[tid][i] = nullptr;
+                        std::scoped_lock<std::mutex> _(state->lock);
+                        state->released.push_back(a.release());
+                    }
+                    return;
+                }
+            }
+
+            // regions released since the last call, each should be handed back to its owner
+            inline auto take_released() -> std::vector<RemotePointer> {
+                std::scoped_lock<std::mutex> _(state->lock);
+                std::vector<RemotePointer> ret;
+                ret.swap(state->released);
+                return ret;
             }
 
             inline auto get_peer_connection(int tid, int node_id) -> std::unique_ptr<RDMAContext> & {
@@ -299,12 +468,231 @@ namespace Hill {
             }
 
         private:
-            RemoteAllocator allocators[Constants::iTHREAD_LIST_NUM][Constants::uREMOTE_REGIONS];
+            RemotePointer regions[Constants::iTHREAD_LIST_NUM][Constants::uREMOTE_REGIONS];
             size_t cursors[Constants::iTHREAD_LIST_NUM];
-            // a reference to the engine's peer connections
+            // references to the engine's DRAM side and peer connections, bound by make_agent
+            RemoteAgentState *state;
             std::array<std::unique_ptr<RDMAContext>, Cluster::Constants::uMAX_NODE> *peer_connections;
         };
+
+        /*
+         * !!! NEVER INHERIT FROM ANY OTHER CLASSES OR STRUCTS
+         * This class is not thread-safe, intending for thread-local use only
+         *
+         * Asynchronous RDMA writes of one thread. Values are staged in a ring over the registered buffer of each
+         * peer connection and queued, a flush posts the queue of a peer as one batch with only its last request
+         * signaled. A write right after the previous one of a peer, remote memory is usually carved in order,
+         * joins its request as another piece, or extends its last piece if the staged bytes are adjacent too.
+         * poll never blocks, every retired write runs its callback, in submission order per peer.
+         *
+         * Staged bytes are reused only after their chain completes, so nothing else may use the registered
+         * buffers, e.g., post_read or post_write with a message, while writes are pending. Call drain first.
+         */
+        class RemoteWriter {
+        public:
+            // false if the write failed
+            using Callback = std::function<void(bool)>;
+
+            RemoteWriter() = default;
+            ~RemoteWriter() = default;
+            RemoteWriter(const RemoteWriter &) = delete;
+            RemoteWriter(RemoteWriter &&) = delete;
+            auto operator=(const RemoteWriter &) -> RemoteWriter & = delete;
+            auto operator=(RemoteWriter &&) -> RemoteWriter & = delete;
+
+            static auto make_writer() -> std::unique_ptr<RemoteWriter> {
+                return std::make_unique<RemoteWriter>();
+            }
+
+            /*
+             * Reserve size bytes in the registered buffer of connection to node, the value should be built
+             * there and then submitted. Returns nullptr if the ring is full, drain and try again.
+             */
+            auto stage(RDMAContext *connection, int node, size_t size) -> byte_ptr_t {
+                auto &p = peers[node];
+                p.connection = connection;
+                auto capacity = connection->get_staging_size();
+                if (size > capacity) {
+                    return nullptr;
+                }
+
+                if (p.used == 0) {
+                    p.tail = 0;
+                }
+                // a value never wraps around, the tail of the ring is skipped instead
+                auto skipped = p.tail + size > capacity ? capacity - p.tail : 0;
+                if (p.used + skipped + size > capacity) {
+                    return nullptr;
+                }
+
+                if (skipped != 0) {
+                    p.tail = 0;
+                }
+                auto ret = connection->get_staging_buf() + p.tail;
+                p.tail += size;
+                p.used += skipped + size;
+                p.queued_bytes += skipped + size;
+                return ret;
+            }
+
+            // whether stage of size bytes succeeds for every peer
+            auto has_room(size_t size) const noexcept -> bool {
+                for (auto &p : peers) {
+                    if (p.connection == nullptr || p.used == 0) {
+                        continue;
+                    }
+
+                    auto capacity = p.connection->get_staging_size();
+                    auto skipped = p.tail + size > capacity ? capacity - p.tail : 0;
+                    if (p.used + skipped + size > capacity) {
+                        return false;
+                    }
+                }
+                return true;
+            }
+
+            // queue a write of staged to remote, done runs once the write completes
+            auto submit(int node, const byte_ptr_t &staged, size_t size, const byte_ptr_t &remote, Callback &&done)
+                -> void
+            {
+                auto &p = peers[node];
+                p.callbacks.push_back(std::move(done));
+                ++queued_writes;
+                if (auto last = p.queued.empty() ? nullptr : &p.queued.back();
+                    last != nullptr && last->remote + last->size() == remote) {
+                    auto &piece = last->pieces[last->num_pieces - 1];
+                    if (piece.local + piece.size == staged) {
+                        piece.size += size;
+                        return;
+                    }
+                    if (last->add_piece(staged, size)) {
+                        return;
+                    }
+                }
+
+                p.queued.push_back(WorkRequest::make_request(IBV_WR_RDMA_WRITE, staged, remote, size));
+                if (p.queued.size() >= Constants::uREMOTE_WRITE_BATCH) {
+                    flush(node);
+                }
+            }
+
+            // post every queued write
+            inline auto flush() -> void {
+                for (size_t node = 0; node < Cluster::Constants::uMAX_NODE; node++) {
+                    flush(node);
+                }
+            }
+
+            // retire completed chains without blocking, returns the number of writes retired
+            auto poll() -> size_t {
+                size_t retired = 0;
+                struct ibv_wc wcs[RDMAContext::uMAX_SEND_WR];
+                for (auto &p : peers) {
+                    if (p.chains.empty()) {
+                        continue;
+                    }
+
+                    auto n = p.connection->poll_completions(wcs, RDMAContext::uMAX_SEND_WR);
+                    for (int i = 0; i < n; i++) {
+                        retired += retire(p, wcs[i].status == IBV_WC_SUCCESS);
+                    }
+                }
+                return retired;
+            }
+
+            // post and wait for every write
+            inline auto drain() -> void {
+                flush();
+                while (pending_writes != 0) {
+                    poll();
+                }
+            }
+
+            // writes submitted but not retired yet
+            inline auto pending() const noexcept -> size_t {
+                return pending_writes + queued_writes;
+            }
+
+        private:
+            struct Chain {
+                size_t bytes;
+                size_t requests;
+                std::vector<Callback> callbacks;
+            };
+
+            struct Peer {
+                RDMAContext *connection = nullptr;
+                // ring of staged values
+                size_t tail = 0;
+                size_t used = 0;
+                // writes not posted yet and their staged bytes
+                std::vector<WorkRequest> queued;
+                std::vector<Callback> callbacks;
+                size_t queued_bytes = 0;
+                // posted batches in posting order, each completes with its one signaled request
+                std::deque<Chain> chains;
+                size_t in_flight = 0;
+            };
+
+            Peer peers[Cluster::Constants::uMAX_NODE];
+            // posted and queued writes
+            size_t pending_writes = 0;
+            size_t queued_writes = 0;
+
+            auto flush(int node) -> void {
+                auto &p = peers[node];
+                if (p.queued.empty()) {
+                    return;
+                }
+
+                // the send queue holds at most uMAX_SEND_WR requests
+                while (p.in_flight + p.queued.size() > RDMAContext::uMAX_SEND_WR) {
+                    struct ibv_wc wc;
+                    if (p.connection->poll_completions(&wc, 1) == 1) {
+                        retire(p, wc.status == IBV_WC_SUCCESS);
+                    }
+                }
+
+                auto requests = p.queued.size();
+                auto num = p.callbacks.size();
+                queued_writes -= num;
+                auto [status, err] = p.connection->post_batch(p.queued.data(), requests);
+                p.queued.clear();
+                Chain chain{p.queued_bytes, requests, std::move(p.callbacks)};
+                p.callbacks.clear();
+                p.queued_bytes = 0;
+
+                if (status != Status::Ok) {
+                    std::cerr << ">> Error: failed to post " << num << " writes to node " << node
+                              << ", error code: " << err << "\n";
+                    p.used -= chain.bytes;
+                    for (auto &c : chain.callbacks) {
+                        c(false);
+                    }
+                    return;
+                }
+
+                pending_writes += num;
+                p.in_flight += requests;
+                p.chains.push_back(std::move(chain));
+            }
+
+            auto retire(Peer &p, bool ok) -> size_t {
+                auto chain = std::move(p.chains.front());
+                p.chains.pop_front();
+                auto num = chain.callbacks.size();
+                p.used -= chain.bytes;
+                p.in_flight -= chain.requests;
+                pending_writes -= num;
+                if (!ok) {
+                    std::cerr << ">> Error: " << num << " remote writes failed\n";
+                }
+                for (auto &c : chain.callbacks) {
+                    c(ok);
+                }
+                return num;
+            }
+        };
     }
 }
 #endif
-
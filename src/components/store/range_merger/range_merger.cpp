@@ -1,37 +1,40 @@
 #include "range_merger.hpp"
+
+#include <algorithm>
 namespace Hill {
     namespace Store {
         auto Merger::merge(size_t total) -> std::vector<Indexing::ScanHolder> {
-            auto cmp = [](scanholder_iter_ptr_pair &lhs, scanholder_iter_ptr_pair &rhs) -> bool {
-                return *(*lhs.first)->key >= *(*rhs.first)->key;
+            std::vector<Indexing::ScanHolder> ret;
+            merge(total, ret);
+            return ret;
+        }
+
+        auto Merger::merge(size_t total, std::vector<Indexing::ScanHolder> &out) -> void {
+            auto cmp = [&](size_t lhs, size_t rhs) -> bool {
+                return *iters[lhs]->key >= *iters[rhs]->key;
             };
-            
-            std::priority_queue<scanholder_iter_ptr_pair,
-                                std::vector<scanholder_iter_ptr_pair>,
-                                decltype(cmp)> heap(cmp);
 
+            out.clear();
+            heap.clear();
             for (auto i = 0UL; i < iters.size(); i++) {
                 if (iters[i] == ends[i])
                     continue;
-                heap.push({&iters[i], &ends[i]});
+                heap.push_back(i);
             }
+            std::make_heap(heap.begin(), heap.end(), cmp);
 
-            std::vector<Indexing::ScanHolder> ret;
+            while(total > 0 && !heap.empty()) {
+                std::pop_heap(heap.begin(), heap.end(), cmp);
+                auto i = heap.back();
+                out.push_back(*iters[i]);
+                --total;
 
-            scanholder_iter_ptr p;
-            while(total > 0) {
-                p = heap.top().first;
-                if (*p == *heap.top().second) {
-                    heap.pop();
-                    continue;
+                if (++iters[i] == ends[i]) {
+                    heap.pop_back();
+                } else {
+                    std::push_heap(heap.begin(), heap.end(), cmp);
                 }
-                ret.push_back(**p);
-                heap.pop();
-                ++(*p);
-                --total;
             }
-
-            return ret;
         }
     }
 }
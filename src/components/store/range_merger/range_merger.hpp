@@ -8,6 +8,10 @@
 
 namespace Hill {
     namespace Store {
+        /*
+         * A merger is meant to be owned by one eRPC thread and reused across range requests: reset() only
+         * clears its internal vectors, so after warm-up merging allocates nothing.
+         */
         class Merger {
         public:
             Merger() = default;
@@ -23,22 +27,32 @@ namespace Hill {
                 auto ret = std::make_unique<Merger>();
                 
                 for (auto &vec : ranges) {
-                    ret->iters.push_back(vec.begin());
-                    ret->ends.push_back(vec.end());
+                    ret->add_range(vec);
                 }
 
                 return ret;
             }
 
+            inline auto reset() noexcept -> void {
+                iters.clear();
+                ends.clear();
+                heap.clear();
+            }
+
+            inline auto add_range(std::vector<Indexing::ScanHolder> &range) -> void {
+                iters.push_back(range.begin());
+                ends.push_back(range.end());
+            }
+
             auto merge(size_t total) -> std::vector<Indexing::ScanHolder>;
+            // merged holders are written to out, whose capacity is kept
+            auto merge(size_t total, std::vector<Indexing::ScanHolder> &out) -> void;
             
         private:
-            using scanholder_iter_ptr = std::vector<Indexing::ScanHolder>::iterator *;
-            using scanholder_iter_ptr_pair = std::pair<std::vector<Indexing::ScanHolder>::iterator *,
-                std::vector<Indexing::ScanHolder>::iterator *>;
-            
             std::vector<std::vector<Indexing::ScanHolder>::iterator> iters;
             std::vector<std::vector<Indexing::ScanHolder>::iterator> ends;
+            // indexes of non-empty ranges, a min-heap on their current keys
+            std::vector<size_t> heap;
         };
     }
 }
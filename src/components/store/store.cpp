@@ -1,15 +1,55 @@
 #include "store.hpp"
-#include "store/range_merger/range_merger.hpp"
 
 #include <chrono>
 
 namespace Hill {
     namespace Store {
+        auto InvalidationLog::append(uint64_t hash) noexcept -> void {
+            auto seq = head.fetch_add(1) + 1;
+            auto &slot = slots[seq % Constants::uINVALIDATION_LOG];
+            // readers of the slot see either the old seq or 0 until the new hash is in place
+            slot.seq.store(0);
+            slot.hash.store(hash);
+            slot.seq.store(seq);
+        }
+
+        auto InvalidationLog::collect(uint64_t since, InvalidationBatch &batch) const noexcept -> void {
+            auto last = head.load();
+            batch.seq = since;
+            batch.count = 0;
+            // a restarted server starts over from 1
+            if (since > last || last - since > Constants::uINVALIDATION_LOG) {
+                batch.seq = last;
+                batch.count = Constants::uINVALIDATION_RESET;
+                return;
+            }
+
+            for (auto s = since + 1; s <= last && batch.count < Constants::iMAX_INVALIDATIONS; s++) {
+                auto &slot = slots[s % Constants::uINVALIDATION_LOG];
+                auto seq = slot.seq.load();
+                auto hash = slot.hash.load();
+                if (seq != s || slot.seq.load() != s) {
+                    // being written, the rest is sent next time
+                    break;
+                }
+                batch.hashes[batch.count++] = hash;
+                batch.seq = s;
+            }
+        }
+
         auto StoreServer::launch(int num_threads) -> bool {
 #if defined(__HILL_DEBUG__) || defined(__HILL_INFO__)
             std::cout << ">> Launching server node at " << server->get_addr_uri() << "\n";
             std::cout << ">> B+ Tree degree is " << Indexing::Constants::iDEGREE << "\n";
 #endif
+            // a re-opened PM is served with the partitioning it was populated with
+            if (server->is_recovered() && server->get_partitions() != 0 && server->get_partitions() != num_threads) {
+                std::cerr << ">> Error: pmem is partitioned for " << server->get_partitions() << " threads, but "
+                          << num_threads << " are requested\n";
+                return false;
+            }
+            server->set_partitions(num_threads);
+
             is_launched = server->launch();
             if (!is_launched) {
                 return false;
@@ -18,15 +58,19 @@ namespace Hill {
             num_launched_threads = num_threads;
             int i;
             for (i = 0; i < num_threads; i++) {
-                std::thread([&](int btid) {
+                std::thread([&, num_threads](int btid) {
+                    // background threads live on the socket owning their partition
+                    auto socket = server->socket_of(btid, num_threads);
+                    server->pin_to_socket(socket);
+
                     tid_lock.lock();
-                    auto atid = server->get_allocator()->register_thread();
-                    if (!atid.has_value()) {
+                    auto ltid = server->get_logger()->register_thread();
+                    if (!ltid.has_value()) {
                         throw std::runtime_error("Failed to register memeory allocator during server launching");
                     }
 
-                    auto ltid = server->get_logger()->register_thread();
-                    if (!ltid.has_value()) {
+                    auto atid = server->get_allocator(socket)->register_thread(ltid.value());
+                    if (!atid.has_value()) {
                         throw std::runtime_error("Failed to register memeory allocator during server launching");
                     }
                     tid_lock.unlock();
@@ -37,38 +81,137 @@ namespace Hill {
 
                     auto tid = atid.value();
 #if defined(__HILL_DEBUG__) || defined(__HILL_INFO__)
-                    std::cout << ">> Launching background thread " << btid << "\n";
+                    std::cout << ">> Launching background thread " << btid << " on socket " << socket << "\n";
 #endif
 
-                    Indexing::OLFIT olfit(atid.value(), server->get_allocator(), server->get_logger());
-                    leaves[btid] = olfit.get_root().get_as<Indexing::LeafNode *>();
+                    std::unique_ptr<Indexing::OLFIT> olfit;
+                    auto head = reinterpret_cast<Indexing::LeafNode *>(server->get_partition_head(btid));
+                    if (server->is_recovered() && head != nullptr) {
+                        olfit = std::make_unique<Indexing::OLFIT>(head, server->get_allocator(socket), server->get_logger(),
+                                                                  [&](const byte_ptr_t &ptr) {
+                                                                      return server->is_rolled_back(ptr);
+                                                                  });
+                    } else {
+                        olfit = std::make_unique<Indexing::OLFIT>(tid, server->get_allocator(socket), server->get_logger());
+                        head = olfit->get_root().get_as<Indexing::LeafNode *>();
+#ifdef __HILL_PINDEX__
+                        // only leaves on PM survive a restart
+                        server->set_partition_head(btid, reinterpret_cast<byte_ptr_t>(head));
+#endif
+                    }
+                    leaves[btid] = head;
+
+                    // keys of a re-opened partition go into the key filter before the filter is served
+                    for (auto leaf = head; leaf != nullptr; leaf = leaf->next) {
+                        for (auto k : leaf->keys) {
+                            if (k != nullptr) {
+                                known_keys.add(ReadCache::CompactCache::hash_of({k->raw_chars(), k->size()}));
+                            }
+                        }
+                    }
+                    ++seeded_partitions;
+
+                    auto last_rebalance = std::chrono::steady_clock::now();
+                    auto logger = server->get_logger();
+                    /*
+                     * A successful write is rolled back by recovery until its WAL batch is checkpointed, so its
+                     * client is answered only then, in commit order. A failed write changes nothing and is
+                     * answered right away.
+                     */
+                    std::deque<HeldResponse> held;
+                    auto answer = [&](IncomeMessage *msg, Indexing::Enums::OpStatus status,
+                                      Memory::PolymorphicPointer value) {
+                        if (status != Indexing::Enums::OpStatus::Ok) {
+                            msg->output.value = value;
+                            msg->output.status.store(status);
+                            return;
+                        }
+                        held.push_back({logger->get_committed(tid), msg, status, value});
+                    };
+                    auto release = [&]() {
+                        auto durable = logger->get_durable(tid);
+                        while (!held.empty() && held.front().seq <= durable) {
+                            auto &h = held.front();
+                            h.msg->output.value = h.value;
+                            h.msg->output.status.store(h.status);
+                            held.pop_front();
+                        }
+                    };
+                    // a spilled value is answered once its RDMA write completes
+                    auto respond = [&](IncomeMessage *msg) {
+                        return [this, msg, btid, &answer](Indexing::Enums::OpStatus status,
+                                                          Memory::PolymorphicPointer value) {
+                            if (status == Indexing::Enums::OpStatus::Ok) {
+                                keep_for_backups(btid, *msg);
+                            }
+                            answer(msg, status, value);
+                            server->get_node()->available_pm = server->get_node()->total_pm - server->get_consumed();
+                        };
+                    };
+                    uint64_t polls = 0, busy = 0;
                     while (is_launched) {
                         IncomeMessage *msg;
-                        if (req_queues[btid].pop(msg)) {
+                        olfit->poll_writes();
+                        // reads alone would keep the partition busy and a batch open forever
+                        if (!held.empty()) {
+                            logger->tick(tid);
+                            release();
+                        }
+                        if (++polls % Constants::uPOLL_REPORT == 0) {
+                            all_polls[btid].store(polls, std::memory_order_relaxed);
+                            busy_polls[btid].store(busy, std::memory_order_relaxed);
+                        }
+
+                        if (!req_queues[btid].pop(msg)) {
+                            // post remote writes still queued and close a partially filled WAL batch when
+                            // requests stop coming
+                            olfit->flush_writes();
+                            logger->tick(tid);
+
+                            // spilled values only move while the partition is idle
+                            if (auto now = std::chrono::steady_clock::now();
+                                olfit->has_agent() && now - last_rebalance >= Constants::tREBALANCE_INTERVAL) {
+                                last_rebalance = now;
+                                rebalance(tid, *olfit);
+                            }
+                        } else {
+                            ++busy;
                             switch (msg->input.op) {
                             case Enums::RPCOperations::Update: {
-                                auto [status, value_ptr] = olfit.update(tid, msg->input.key, msg->input.key_size,
-                                                                        msg->input.value, msg->input.value_size);
-                                msg->output.value = value_ptr;
-                                msg->output.status.store(status);
+                                auto [status, value_ptr] = olfit->update(tid, msg->input.key, msg->input.key_size,
+                                                                        msg->input.value, msg->input.value_size,
+                                                                        respond(msg));
+                                if (status == Indexing::Enums::OpStatus::Pending) {
+                                    break;
+                                }
+                                if (status == Indexing::Enums::OpStatus::Ok) {
+                                    keep_for_backups(btid, *msg);
+                                }
+                                answer(msg, status, value_ptr);
                                 // update here is not atomic but it's ok,
                                 // because we just send temporal values to other servers and get_consumed is atomic
                                 // so we wouldn't have INCORRECT values
-                                server->get_node()->available_pm = server->get_node()->total_pm - server->get_allocator()->get_consumed();
+                                server->get_node()->available_pm = server->get_node()->total_pm - server->get_consumed();
                             }
                                 break;
                             case Enums::RPCOperations::Insert: {
-                                auto [status, value_ptr] = olfit.insert(tid, msg->input.key, msg->input.key_size,
+                                auto [status, value_ptr] = olfit->insert(tid, msg->input.key, msg->input.key_size,
                                                                         msg->input.value, msg->input.value_size,
-                                                                        msg->input.hkey, msg->input.hvalue);
-                                msg->output.value = value_ptr;
-                                msg->output.status.store(status);
+                                                                        msg->input.hkey, msg->input.hvalue,
+                                                                        respond(msg));
+                                if (status == Indexing::Enums::OpStatus::Pending) {
+                                    break;
+                                }
+                                if (status == Indexing::Enums::OpStatus::Ok) {
+                                    keep_for_backups(btid, *msg);
+                                }
+                                answer(msg, status, value_ptr);
 
-                                server->get_node()->available_pm = server->get_node()->total_pm - server->get_allocator()->get_consumed();
+                                server->get_node()->available_pm = server->get_node()->total_pm - server->get_consumed();
                             }
                                 break;
                             case Enums::RPCOperations::Search: {
-                                auto [v, v_sz] = olfit.search(msg->input.key, msg->input.key_size);
+                                auto [v, v_sz] = olfit->search(msg->input.key, msg->input.key_size, &msg->output.fence);
                                 if (v == nullptr) {
                                     msg->output.value = nullptr;
                                     msg->output.status.store(Indexing::Enums::OpStatus::Failed);
@@ -80,9 +223,8 @@ namespace Hill {
                             }
                                 break;
                             case Enums::RPCOperations::Range: {
-                                auto vec = olfit.scan(msg->input.key, msg->input.key_size, msg->input.value_size);
-                                msg->output.values = std::move(vec);
-                                if (vec.size() != 0) {
+                                olfit->scan(msg->input.key, msg->input.key_size, msg->input.value_size, msg->output.values);
+                                if (msg->output.values.size() != 0) {
                                     msg->output.status.store(Indexing::Enums::OpStatus::Ok);
                                 } else {
                                     msg->output.status.store(Indexing::Enums::OpStatus::Failed);
@@ -90,7 +232,11 @@ namespace Hill {
                             }
                                 break;
                             case Enums::RPCOperations::CallForMemory:
-                                olfit.enable_agent(msg->input.agent);
+                                olfit->enable_agent(msg->input.agent);
+                                msg->output.status.store(Indexing::Enums::OpStatus::Ok);
+                                break;
+                            case Enums::RPCOperations::RunTask:
+                                (*msg->input.task)(btid, tid, *olfit);
                                 msg->output.status.store(Indexing::Enums::OpStatus::Ok);
                                 break;
                             default:
@@ -105,6 +251,589 @@ namespace Hill {
             return true;
         }
 
+        auto StoreServer::rebalance(int tid, Indexing::OLFIT &olfit) -> void {
+            auto allowed = Constants::dNODE_CAPPACITY_LIMIT * server->get_node()->total_pm;
+            auto consumed = server->get_consumed();
+            if (consumed >= allowed * Constants::dREBALANCE_WATERMARK) {
+                // local memory is tight again, spill to regions the partition still holds
+                if (!olfit.is_spilling() && consumed >= allowed && server->get_agent()->available(tid)) {
+                    olfit.enable_agent(server->get_agent());
+                }
+                return;
+            }
+
+            olfit.stop_spilling();
+            if (olfit.migrate_home(tid, Constants::uREBALANCE_BATCH) != 0) {
+                server->get_node()->available_pm = server->get_node()->total_pm - server->get_consumed();
+            }
+        }
+
+        auto StoreServer::run_on_partition(int partition, const PartitionTask &task) -> void {
+            IncomeMessage msg;
+            msg.input.op = Enums::RPCOperations::RunTask;
+            msg.input.task = &task;
+            while (!req_queues[partition].push(&msg));
+            while (msg.output.status.load() == Indexing::Enums::OpStatus::Unkown);
+        }
+
+        auto StoreServer::redirect_of(const hill_key_t *key, bool is_write) const noexcept -> int {
+            std::string_view k(key->raw_chars(), key->size());
+            auto node = server->get_node();
+            int owner;
+            uint64_t backups = 0;
+            if (auto table = node->cluster_status.get_routes(); table != nullptr) {
+                auto i = table->position(k);
+                owner = i == table->bounds.size() ? 0 : table->nodes[i];
+                backups = i == table->bounds.size() ? 0 : table->backups[i];
+            } else {
+                owner = node->cluster_status.filter_node(k);
+            }
+
+            // node 0 is the monitor, the key is not assigned yet
+            if (owner != 0 && owner != node->node_id) {
+                auto fresh = std::chrono::steady_clock::now().time_since_epoch().count() - applied_at[owner].load() <=
+                    std::chrono::duration_cast<std::chrono::steady_clock::duration>(Constants::tSTALENESS_BOUND).count();
+                if (!is_write && (backups >> node->node_id & 1) && fresh) {
+                    return -1;
+                }
+                return owner;
+            }
+
+            if (is_write && fencing.load() && k >= fence_low && k < fence_high) {
+                return node->node_id;
+            }
+            return -1;
+        }
+
+        auto StoreServer::keep_for_backups(int partition, const IncomeMessage &msg) -> void {
+            auto node = server->get_node();
+            auto table = node->cluster_status.get_routes();
+            if (table == nullptr) {
+                return;
+            }
+
+            auto i = table->position({msg.input.key, msg.input.key_size});
+            if (i == table->bounds.size() || table->nodes[i] != node->node_id || table->backups[i] == 0) {
+                return;
+            }
+
+            auto &buffer = shipping[partition];
+            auto size = sizeof(uint64_t) + sizeof(Enums::RPCOperations) + sizeof(KVPair::HillStringHeader) * 2 +
+                msg.input.key_size + msg.input.value_size;
+            std::scoped_lock l(buffer.lock);
+            auto offset = buffer.records.size();
+            buffer.records.resize(offset + size);
+            byte_ptr_t buf = buffer.records.data() + offset;
+            *reinterpret_cast<uint64_t *>(buf) = table->backups[i];
+            buf += sizeof(uint64_t);
+            *reinterpret_cast<Enums::RPCOperations *>(buf) = msg.input.op;
+            buf += sizeof(Enums::RPCOperations);
+            buf += KVPair::HillString::make_string(buf, msg.input.key, msg.input.key_size).object_size();
+            KVPair::HillString::make_string(buf, msg.input.value, msg.input.value_size);
+        }
+
+        auto StoreServer::migrate_range(erpc::Rpc<erpc::CTransport> *rm_rpc, ServerContext &s_ctx,
+                                        const Cluster::MigrationOrder &order) -> bool
+        {
+            auto node = server->get_node();
+            auto &meta = node->cluster_status;
+            auto table = meta.get_routes();
+            int target = order.target;
+            if (table == nullptr) {
+                return false;
+            }
+
+            // the first key of each leaf and the number of keys of the leaf
+            std::vector<std::pair<std::string, size_t>> samples;
+            for (int p = 0; p < num_launched_threads; p++) {
+                run_on_partition(p, [&](int partition, int, Indexing::OLFIT &) {
+                    for (auto leaf = leaves[partition]; leaf != nullptr; leaf = leaf->next) {
+                        size_t n = 0;
+                        while (n < Indexing::Constants::iNUM_HIGHKEY && leaf->keys[n] != nullptr) {
+                            ++n;
+                        }
+                        if (n != 0) {
+                            samples.emplace_back(leaf->keys[0]->to_string(), n);
+                        }
+                    }
+                });
+            }
+
+            std::vector<size_t> sizes(table->bounds.size(), 0);
+            for (const auto &[key, n] : samples) {
+                if (auto b = table->position(key); b != table->bounds.size() && table->nodes[b] == node->node_id) {
+                    sizes[b] += n;
+                }
+            }
+            if (sizes.empty()) {
+                return false;
+            }
+            auto bound = std::max_element(sizes.begin(), sizes.end()) - sizes.begin();
+            if (sizes[bound] == 0) {
+                return false;
+            }
+
+            std::vector<std::pair<std::string, size_t>> in_range;
+            for (auto &sample : samples) {
+                if (table->position(sample.first) == size_t(bound)) {
+                    in_range.push_back(std::move(sample));
+                }
+            }
+            std::sort(in_range.begin(), in_range.end());
+
+            // the lower half keeps at least the first leaf
+            size_t below = in_range[0].second, m = 1;
+            while (m < in_range.size() && below + in_range[m].second <= sizes[bound] / 2) {
+                below += in_range[m++].second;
+            }
+            if (m == in_range.size()) {
+                return false;
+            }
+            const auto at = in_range[m].first;
+            const auto high = table->bounds[bound];
+
+            if (s_ctx.erpc_sessions[target] == -1 && !establish_memory_erpc(rm_rpc, s_ctx, s_ctx.thread_id, target)) {
+                std::cerr << ">> Error: can't connect remote server " << target << "'s rpc\n";
+                return false;
+            }
+
+            fence_low = at;
+            fence_high = high;
+            fencing = true;
+            // writes admitted before the fence was up land before their keys are read
+            for (auto c : contexts) {
+                if (c == nullptr) {
+                    continue;
+                }
+                if (auto seq = c->write_seq.load(); seq & 1) {
+                    while (c->write_seq.load() == seq);
+                }
+            }
+
+            auto req = rm_rpc->alloc_msg_buffer_or_die(Constants::uMIGRATION_MSG_SIZE);
+            auto resp = rm_rpc->alloc_msg_buffer_or_die(sizeof(Enums::RPCOperations) + sizeof(Enums::RPCStatus));
+            auto header = sizeof(Enums::RPCOperations) + sizeof(bool) + sizeof(uint64_t);
+            *reinterpret_cast<Enums::RPCOperations *>(req.buf) = Enums::RPCOperations::MigrateRange;
+            header += KVPair::HillString::make_string(req.buf + header, high.c_str(), high.size()).object_size();
+            header += KVPair::HillString::make_string(req.buf + header, at.c_str(), at.size()).object_size();
+
+            auto offset = header;
+            uint64_t count = 0;
+            auto send = [&](bool last) {
+                *reinterpret_cast<bool *>(req.buf + sizeof(Enums::RPCOperations)) = last;
+                *reinterpret_cast<uint64_t *>(req.buf + sizeof(Enums::RPCOperations) + sizeof(bool)) = count;
+                rm_rpc->resize_msg_buffer(&req, offset);
+                s_ctx.is_done = false;
+                rm_rpc->enqueue_request(s_ctx.erpc_sessions[target], Enums::RPCOperations::MigrateRange, &req, &resp,
+                                        response_continuation, &s_ctx);
+                while (!s_ctx.is_done) {
+                    rm_rpc->run_event_loop_once();
+                }
+                offset = header;
+                count = 0;
+                return *reinterpret_cast<Enums::RPCStatus *>(resp.buf + sizeof(Enums::RPCOperations)) ==
+                    Enums::RPCStatus::Ok;
+            };
+
+            auto ok = true;
+            size_t moved = 0;
+            for (int p = 0; p < num_launched_threads && ok; p++) {
+                auto cursor = at;
+                auto status = Indexing::Enums::OpStatus::Retry;
+                while (status == Indexing::Enums::OpStatus::Retry && ok) {
+                    std::string last_key;
+                    run_on_partition(p, [&](int, int tid, Indexing::OLFIT &olfit) {
+                        status = olfit.export_range(tid, cursor, high, [&](const hill_key_t *k, const hill_value_t *v) {
+                            if (offset + k->object_size() + v->object_size() > Constants::uMIGRATION_MSG_SIZE) {
+                                return false;
+                            }
+                            memcpy(req.buf + offset, k, k->object_size());
+                            offset += k->object_size();
+                            memcpy(req.buf + offset, v, v->object_size());
+                            offset += v->object_size();
+                            ++count;
+                            last_key = k->to_string();
+                            return true;
+                        });
+                    });
+
+                    // a pair larger than a request never fits
+                    if (status == Indexing::Enums::OpStatus::Failed || count == 0) {
+                        ok = status == Indexing::Enums::OpStatus::Ok;
+                        continue;
+                    }
+                    moved += count;
+                    ok = send(false);
+                    // the least string greater than the last key
+                    cursor = last_key + '\0';
+                }
+            }
+
+            // the target takes the range over with the last request, then so does this node
+            ok = ok && send(true) && meta.split_range(high, at, target);
+            fencing = false;
+            rm_rpc->free_msg_buffer(req);
+            rm_rpc->free_msg_buffer(resp);
+            if (!ok) {
+                std::cerr << ">> Error: failed to move keys from " << at << " to node " << target << ", the range stays\n";
+                return false;
+            }
+
+            // clients caching the moved values hear of it with their next responses to this node
+            for (int p = 0; p < num_launched_threads; p++) {
+                run_on_partition(p, [&](int, int tid, Indexing::OLFIT &olfit) {
+                    olfit.remove_range(tid, at, high, [&](const std::string &key) {
+                        invalidations.append(ReadCache::CompactCache::hash_of(key));
+                    });
+                });
+            }
+            node->available_pm = node->total_pm - server->get_consumed();
+#if defined(__HILL_DEBUG__) || defined(__HILL_INFO__)
+            std::cout << ">> Moved " << moved << " keys from " << at << " to node " << target << "\n";
+#endif
+            return true;
+        }
+
+        auto StoreServer::ship_writes(erpc::Rpc<erpc::CTransport> *rm_rpc, ServerContext &s_ctx, erpc::MsgBuffer &req,
+                                      erpc::MsgBuffer &resp) -> void
+        {
+            auto node = server->get_node();
+            auto &meta = node->cluster_status;
+            // a backup not reached misses writes and is seeded again once it is back
+            auto reachable = [&](int b) {
+                if (!meta.cluster.nodes[b].is_active) {
+                    seeded[b] = false;
+                    return false;
+                }
+                if (s_ctx.erpc_sessions[b] == -1 && !establish_memory_erpc(rm_rpc, s_ctx, s_ctx.thread_id, b)) {
+                    std::cerr << ">> Error: can't connect backup " << b << "'s rpc\n";
+                    seeded[b] = false;
+                    return false;
+                }
+                return true;
+            };
+
+            uint64_t targets = 0;
+            if (auto table = meta.get_routes(); table != nullptr) {
+                for (size_t i = 0; i < table->bounds.size(); i++) {
+                    if (table->nodes[i] == node->node_id) {
+                        targets |= table->backups[i];
+                    }
+                }
+            }
+            // before the writes are taken, so that writes made while copying are shipped after the copy
+            for (int b = 1; b < int(Cluster::Constants::uMAX_NODE); b++) {
+                if ((targets >> b & 1) && b != node->node_id && !seeded[b] && reachable(b)) {
+                    seeded[b] = seed_backup(rm_rpc, s_ctx, req, resp, b);
+                }
+            }
+
+            std::vector<byte_t> records;
+            for (int p = 0; p < num_launched_threads; p++) {
+                std::scoped_lock l(shipping[p].lock);
+                records.insert(records.end(), shipping[p].records.begin(), shipping[p].records.end());
+                shipping[p].records.clear();
+            }
+
+            // a record is skipped over with the size of its key and value
+            auto next = [&](size_t offset) {
+                offset += sizeof(uint64_t) + sizeof(Enums::RPCOperations);
+                offset += reinterpret_cast<hill_key_t *>(&records[offset])->object_size();
+                return offset + reinterpret_cast<hill_value_t *>(&records[offset])->object_size();
+            };
+
+            for (size_t offset = 0; offset < records.size(); offset = next(offset)) {
+                targets |= *reinterpret_cast<uint64_t *>(&records[offset]);
+            }
+
+            const auto header = sizeof(Enums::RPCOperations) + sizeof(int) + sizeof(uint64_t) * 2;
+            for (int b = 1; b < int(Cluster::Constants::uMAX_NODE); b++) {
+                // the copy a backup not seeded yet gets holds these writes
+                if (!(targets >> b & 1) || b == node->node_id || !reachable(b) || !seeded[b]) {
+                    continue;
+                }
+
+                // records of the backup in order, split into requests
+                size_t cursor = 0;
+                do {
+                    auto offset = header;
+                    uint64_t count = 0;
+                    for (; cursor < records.size(); cursor = next(cursor)) {
+                        if (!(*reinterpret_cast<uint64_t *>(&records[cursor]) >> b & 1)) {
+                            continue;
+                        }
+
+                        auto record = cursor + sizeof(uint64_t);
+                        auto size = next(cursor) - record;
+                        if (offset + size > Constants::uREPLICATION_MSG_SIZE) {
+                            if (count != 0) {
+                                break;
+                            }
+                            std::cerr << ">> Error: a write of " << size << " bytes never fits a replication request\n";
+                            continue;
+                        }
+                        memcpy(req.buf + offset, &records[record], size);
+                        offset += size;
+                        ++count;
+                    }
+
+                    *reinterpret_cast<Enums::RPCOperations *>(req.buf) = Enums::RPCOperations::Replicate;
+                    *reinterpret_cast<int *>(req.buf + sizeof(Enums::RPCOperations)) = node->node_id;
+                    auto fields = req.buf + sizeof(Enums::RPCOperations) + sizeof(int);
+                    *reinterpret_cast<uint64_t *>(fields) = ++shipped_seqs[b];
+                    *reinterpret_cast<uint64_t *>(fields + sizeof(uint64_t)) = count;
+                    if (!send_replication(rm_rpc, s_ctx, req, resp, b, offset)) {
+                        break;
+                    }
+                } while (cursor < records.size());
+            }
+        }
+
+        auto StoreServer::seed_backup(erpc::Rpc<erpc::CTransport> *rm_rpc, ServerContext &s_ctx, erpc::MsgBuffer &req,
+                                      erpc::MsgBuffer &resp, int backup) -> bool
+        {
+            auto node = server->get_node();
+            auto table = node->cluster_status.get_routes();
+            if (table == nullptr) {
+                return false;
+            }
+
+            // answers of the copy report the old sequence number, they do not ask for another copy
+            seed_seqs[backup] = shipped_seqs[backup];
+            const auto header = sizeof(Enums::RPCOperations) + sizeof(int) + sizeof(uint64_t) * 2 + sizeof(bool);
+            auto offset = header;
+            uint64_t count = 0;
+            size_t copied = 0;
+            auto send = [&](bool last) {
+                *reinterpret_cast<Enums::RPCOperations *>(req.buf) = Enums::RPCOperations::Seed;
+                *reinterpret_cast<int *>(req.buf + sizeof(Enums::RPCOperations)) = node->node_id;
+                auto fields = req.buf + sizeof(Enums::RPCOperations) + sizeof(int);
+                *reinterpret_cast<uint64_t *>(fields) = shipped_seqs[backup];
+                *reinterpret_cast<uint64_t *>(fields + sizeof(uint64_t)) = count;
+                *reinterpret_cast<bool *>(fields + sizeof(uint64_t) * 2) = last;
+                copied += count;
+                auto ok = send_replication(rm_rpc, s_ctx, req, resp, backup, offset);
+                offset = header;
+                count = 0;
+                return ok;
+            };
+
+            for (size_t i = 0; i < table->bounds.size(); i++) {
+                if (table->nodes[i] != node->node_id || !(table->backups[i] >> backup & 1)) {
+                    continue;
+                }
+
+                const auto &high = table->bounds[i];
+                for (int p = 0; p < num_launched_threads; p++) {
+                    auto cursor = i == 0 ? std::string() : table->bounds[i - 1];
+                    auto status = Indexing::Enums::OpStatus::Retry;
+                    while (status == Indexing::Enums::OpStatus::Retry) {
+                        std::string last_key;
+                        auto took = false;
+                        run_on_partition(p, [&](int, int tid, Indexing::OLFIT &olfit) {
+                            status = olfit.export_range(tid, cursor, high, [&](const hill_key_t *k, const hill_value_t *v) {
+                                auto size = sizeof(Enums::RPCOperations) + k->object_size() + v->object_size();
+                                if (offset + size > Constants::uREPLICATION_MSG_SIZE) {
+                                    return false;
+                                }
+                                *reinterpret_cast<Enums::RPCOperations *>(req.buf + offset) = Enums::RPCOperations::Insert;
+                                offset += sizeof(Enums::RPCOperations);
+                                memcpy(req.buf + offset, k, k->object_size());
+                                offset += k->object_size();
+                                memcpy(req.buf + offset, v, v->object_size());
+                                offset += v->object_size();
+                                ++count;
+                                last_key = k->to_string();
+                                took = true;
+                                return true;
+                            });
+                        });
+
+                        // a pair larger than a request never fits
+                        if (status == Indexing::Enums::OpStatus::Failed ||
+                            (status == Indexing::Enums::OpStatus::Retry && count == 0)) {
+                            std::cerr << ">> Error: can't copy keys from " << cursor << " to backup " << backup << "\n";
+                            return false;
+                        }
+                        if (status == Indexing::Enums::OpStatus::Retry) {
+                            if (!send(false)) {
+                                return false;
+                            }
+                            // the least string greater than the last key, the request may be full of earlier keys
+                            if (took) {
+                                cursor = last_key + '\0';
+                            }
+                        }
+                    }
+                }
+            }
+
+            if (!send(true)) {
+                return false;
+            }
+#if defined(__HILL_DEBUG__) || defined(__HILL_INFO__)
+            std::cout << ">> Seeded backup " << backup << " with " << copied << " keys\n";
+#endif
+            return true;
+        }
+
+        auto StoreServer::send_replication(erpc::Rpc<erpc::CTransport> *rm_rpc, ServerContext &s_ctx,
+                                           erpc::MsgBuffer &req, erpc::MsgBuffer &resp, int backup, size_t size) -> bool
+        {
+            auto op = *reinterpret_cast<Enums::RPCOperations *>(req.buf);
+            rm_rpc->resize_msg_buffer(&req, size);
+            s_ctx.is_done = false;
+            s_ctx.waiting = ++s_ctx.request_seq;
+            rm_rpc->enqueue_request(s_ctx.erpc_sessions[backup], op, &req, &resp, replication_continuation,
+                                    reinterpret_cast<void *>(s_ctx.waiting));
+            auto deadline = std::chrono::steady_clock::now() + Constants::tREQUEST_TIMEOUT;
+            for (uint64_t polls = 1; !s_ctx.is_done; polls++) {
+                rm_rpc->run_event_loop_once();
+                if (!s_ctx.is_done && polls % Constants::uTIMEOUT_CHECK == 0 &&
+                    std::chrono::steady_clock::now() > deadline) {
+                    s_ctx.abandoned.push_back({s_ctx.waiting, req, resp});
+                    req = rm_rpc->alloc_msg_buffer_or_die(req.max_data_size);
+                    resp = rm_rpc->alloc_msg_buffer_or_die(resp.max_data_size);
+                    break;
+                }
+            }
+
+            auto answered = s_ctx.is_done;
+            s_ctx.waiting = 0;
+            Wire::Reader reader(resp.buf + sizeof(Enums::RPCOperations),
+                                resp.data_size - std::min(resp.data_size, sizeof(Enums::RPCOperations)));
+            auto status = Enums::RPCStatus::Failed;
+            uint64_t applied = 0;
+            bool diverged = false;
+            if (!answered || !reader.take<Enums::RPCStatus, uint64_t, bool>(status, applied, diverged) ||
+                status != Enums::RPCStatus::Ok) {
+                std::cerr << ">> Error: backup " << backup << (answered ? " refused" : " did not answer")
+                          << " a replication request, seeding it again\n";
+                seeded[backup] = false;
+                return false;
+            }
+
+            // a backup still waiting for the last copy missed batches before it, the copy holds them
+            if (diverged && applied >= seed_seqs[backup]) {
+                std::cerr << ">> Error: backup " << backup << " missed writes after " << applied << ", seeding it again\n";
+                seeded[backup] = false;
+            }
+            return true;
+        }
+
+        auto StoreServer::replication_continuation(void *context, void *tag) -> void {
+            auto s_ctx = reinterpret_cast<ServerContext *>(context);
+            auto t = reinterpret_cast<uintptr_t>(tag);
+            if (t == s_ctx->waiting) {
+                s_ctx->is_done = true;
+                return;
+            }
+
+            // given up on, eRPC is done with its buffers now
+            for (auto it = s_ctx->abandoned.begin(); it != s_ctx->abandoned.end(); it++) {
+                if (it->tag == t) {
+                    s_ctx->rpc->free_msg_buffer(it->req);
+                    s_ctx->rpc->free_msg_buffer(it->resp);
+                    s_ctx->abandoned.erase(it);
+                    return;
+                }
+            }
+        }
+
+        auto StoreServer::apply_replicas() -> void {
+            std::deque<ReplicaBatch> batches;
+            {
+                std::scoped_lock l(replica_lock);
+                batches.swap(replicas);
+            }
+
+            for (const auto &batch : batches) {
+                if (batch.seeding) {
+                    // reads of the main server are not served before the copy is whole
+                    diverged[batch.node] = true;
+                } else {
+                    // a batch the main server gave up on and answered late is in a copy sent since
+                    if (diverged[batch.node] || batch.seq <= applied_seqs[batch.node]) {
+                        continue;
+                    }
+                    // a lost batch is never sent again, the main server seeds this node anew once it hears of it
+                    if (batch.seq != applied_seqs[batch.node] + 1) {
+                        std::cerr << ">> Error: missed writes " << applied_seqs[batch.node] + 1 << " to "
+                                  << batch.seq - 1 << " of node " << batch.node << ", waiting for a copy\n";
+                        diverged[batch.node] = true;
+                        continue;
+                    }
+                    applied_seqs[batch.node] = batch.seq;
+                }
+
+                // each partition applies the records of its keys, which keeps the order of each key
+                std::vector<std::vector<const byte_t *>> shares(num_launched_threads);
+                auto buf = batch.records.data();
+                for (uint64_t i = 0; i < batch.count; i++) {
+                    auto key = reinterpret_cast<const hill_key_t *>(buf + sizeof(Enums::RPCOperations));
+                    auto value = reinterpret_cast<const hill_value_t *>(reinterpret_cast<const byte_t *>(key) +
+                                                                        key->object_size());
+                    shares[CityHash64(key->raw_chars(), key->size()) % num_launched_threads].push_back(buf);
+                    buf = reinterpret_cast<const byte_t *>(value) + value->object_size();
+                }
+
+                std::atomic_uint64_t failed(0);
+                PartitionTask task = [&](int partition, int tid, Indexing::OLFIT &olfit) {
+                    for (auto record : shares[partition]) {
+                        auto op = *reinterpret_cast<const Enums::RPCOperations *>(record);
+                        auto key = reinterpret_cast<const hill_key_t *>(record + sizeof(Enums::RPCOperations));
+                        auto value = reinterpret_cast<const hill_value_t *>(reinterpret_cast<const byte_t *>(key) +
+                                                                            key->object_size());
+                        // a key this node missed is inserted by an update and an insert replaces an old copy
+                        auto status = Indexing::Enums::OpStatus::Failed;
+                        if (op == Enums::RPCOperations::Update) {
+                            status = olfit.update(tid, key->raw_chars(), key->size(), value->raw_chars(),
+                                                  value->size()).first;
+                        }
+                        if (status != Indexing::Enums::OpStatus::Ok) {
+                            status = olfit.insert(tid, key->raw_chars(), key->size(), value->raw_chars(), value->size(),
+                                                  key, value).first;
+                            if (status == Indexing::Enums::OpStatus::RepeatInsert) {
+                                status = olfit.update(tid, key->raw_chars(), key->size(), value->raw_chars(),
+                                                      value->size()).first;
+                            }
+                        }
+
+                        if (status != Indexing::Enums::OpStatus::Ok) {
+                            ++failed;
+                            continue;
+                        }
+                        auto hash = ReadCache::CompactCache::hash_of({key->raw_chars(), key->size()});
+                        known_keys.add(hash);
+                        invalidations.append(hash);
+                    }
+                };
+
+                // partitions apply their shares at the same time
+                std::unique_ptr<IncomeMessage[]> msgs(new IncomeMessage[num_launched_threads]);
+                for (int p = 0; p < num_launched_threads; p++) {
+                    msgs[p].input.op = Enums::RPCOperations::RunTask;
+                    msgs[p].input.task = &task;
+                    while (!req_queues[p].push(&msgs[p]));
+                }
+                for (int p = 0; p < num_launched_threads; p++) {
+                    while (msgs[p].output.status.load() == Indexing::Enums::OpStatus::Unkown);
+                }
+
+                server->get_node()->available_pm = server->get_node()->total_pm - server->get_consumed();
+                if (failed != 0) {
+                    std::cerr << ">> Error: failed to apply " << failed << " writes of node " << batch.node << "\n";
+                }
+                if (batch.seeding && batch.last) {
+                    applied_seqs[batch.node] = batch.seq;
+                    diverged[batch.node] = false;
+                }
+                if (!diverged[batch.node]) {
+                    applied_at[batch.node] = batch.received.time_since_epoch().count();
+                }
+            }
+        }
+
         auto StoreServer::launch_one_erpc_listen_thread() -> bool {
             if (!is_launched) {
                 return false;
@@ -144,6 +873,7 @@ namespace Hill {
                                                                Memory::Constants::iTHREAD_LIST_NUM,
                                                                RPCWrapper::ghost_sm_handler);
                 IncomeMessage msg;
+                uint64_t last_polls = 0, last_busy = 0;
                 while(this->is_launched) {
                     for (auto &i : this->contexts) {
                         if (i == nullptr)
@@ -162,6 +892,47 @@ namespace Hill {
                             i->need_memory.store(false);
                         }
                     }
+
+                    // regions emptied by background threads go back to their owners
+                    for (const auto &region : server->get_agent()->take_released()) {
+                        for (auto &i : this->contexts) {
+                            if (i != nullptr) {
+                                return_remote_mem(rm_rpc, *i, i->thread_id, region);
+                                break;
+                            }
+                        }
+                    }
+
+                    // the monitor tells busy nodes from their share of polls finding a request
+                    uint64_t polls = 0, busy = 0;
+                    for (int p = 0; p < num_launched_threads; p++) {
+                        polls += all_polls[p].load(std::memory_order_relaxed);
+                        busy += busy_polls[p].load(std::memory_order_relaxed);
+                    }
+                    if (polls != last_polls) {
+                        server->get_node()->cpu_usage = float(busy - last_busy) / (polls - last_polls);
+                    }
+                    last_polls = polls;
+                    last_busy = busy;
+
+                    auto &meta = server->get_node()->cluster_status;
+                    meta.atomic_read_begin();
+                    auto order = meta.migration;
+                    meta.atomic_read_end();
+                    if (order.id != 0 && !order.done && order.source == server->get_node()->node_id) {
+                        for (auto &i : this->contexts) {
+                            if (i != nullptr) {
+                                migrate_range(rm_rpc, *i, order);
+                                break;
+                            }
+                        }
+
+                        // done even if the range stays, so the monitor is free to give another order
+                        std::scoped_lock l(meta.lock);
+                        if (meta.migration.id == order.id) {
+                            meta.migration.done = true;
+                        }
+                    }
                     sleep(1);
                 }
             });
@@ -170,6 +941,41 @@ namespace Hill {
             return true;
         }
 
+        auto StoreServer::launch_one_replication_thread() -> bool {
+            if (!is_launched) {
+                return false;
+            }
+
+            std::thread t([&] {
+                ServerContext s_ctx;
+                s_ctx.thread_id = Memory::Constants::iTHREAD_LIST_NUM + 1;
+                s_ctx.self = this;
+                s_ctx.node_id = server->get_node()->node_id;
+                s_ctx.server = server.get();
+                s_ctx.num_launched_threads = num_launched_threads;
+                // requests are answered in replication_continuation, which finds the context here
+                auto rm_rpc = new erpc::Rpc<erpc::CTransport>(this->nexus, reinterpret_cast<void *>(&s_ctx),
+                                                              Memory::Constants::iTHREAD_LIST_NUM + 1,
+                                                              RPCWrapper::ghost_sm_handler);
+                s_ctx.rpc = rm_rpc;
+
+                auto req = rm_rpc->alloc_msg_buffer_or_die(Constants::uREPLICATION_MSG_SIZE);
+                auto resp = rm_rpc->alloc_msg_buffer_or_die(sizeof(Enums::RPCOperations) + sizeof(Enums::RPCStatus) +
+                                                            sizeof(uint64_t) + sizeof(bool));
+                while (this->is_launched) {
+                    auto start = std::chrono::steady_clock::now();
+                    ship_writes(rm_rpc, s_ctx, req, resp);
+                    apply_replicas();
+                    std::this_thread::sleep_until(start + Constants::tREPLICATION_INTERVAL);
+                }
+                rm_rpc->free_msg_buffer(req);
+                rm_rpc->free_msg_buffer(resp);
+            });
+            t.detach();
+
+            return true;
+        }
+
         auto StoreServer::register_erpc_handler_thread() noexcept -> std::optional<std::thread> {
             if (!is_launched) {
                 return {};
@@ -178,6 +984,7 @@ namespace Hill {
             auto tid = server->register_thread();
 
             return std::thread([&] (int tid) {
+                this->server->pin_to_nic();
                 ServerContext s_ctx;
                 s_ctx.thread_id = tid;
                 s_ctx.self = this;
@@ -278,6 +1085,35 @@ namespace Hill {
             return ptr;
         }
 
+        auto StoreServer::return_remote_mem(erpc::Rpc<erpc::CTransport> *rm_rpc, ServerContext &s_ctx, int tid,
+                                            const Memory::RemotePointer &region) -> bool
+        {
+            auto node_id = region.get_node();
+            if (s_ctx.erpc_sessions[node_id] == -1) {
+                if (!establish_memory_erpc(rm_rpc, s_ctx, tid, node_id)) {
+                    std::cerr << ">> Error: can't connect remote server " << node_id << "'s rpc\n";
+                    return false;
+                }
+            }
+
+            auto buf = s_ctx.req_bufs[node_id].buf;
+            s_ctx.is_done = false;
+            *reinterpret_cast<Enums::RPCOperations *>(buf) = Enums::RPCOperations::ReturnMemory;
+            *reinterpret_cast<Memory::RemotePointer *>(buf + sizeof(Enums::RPCOperations)) = region;
+            rm_rpc->enqueue_request(s_ctx.erpc_sessions[node_id], Enums::RPCOperations::ReturnMemory,
+                                    &s_ctx.req_bufs[node_id], &s_ctx.resp_bufs[node_id],
+                                    response_continuation, &s_ctx);
+            while (!s_ctx.is_done) {
+                rm_rpc->run_event_loop_once();
+            }
+
+            auto status = *reinterpret_cast<Enums::RPCStatus *>(s_ctx.resp_bufs[node_id].buf + sizeof(Enums::RPCOperations));
+#ifdef __HILL_INFO__
+            std::cout << ">> Returned remote memory " << region.void_ptr() << " to node " << node_id << "\n";
+#endif
+            return status == Enums::RPCStatus::Ok;
+        }
+
         auto StoreServer::establish_memory_erpc(erpc::Rpc<erpc::CTransport> *rm_rpc, ServerContext &s_ctx, int tid, int node_id)
             -> bool
         {
@@ -333,18 +1169,30 @@ namespace Hill {
             auto handle_sampler = ctx->handle_sampler;
             auto &sampler = handle_sampler->insert_sampler;
 #endif
-            Enums::RPCOperations type; KVPair::HillString *key, *value;
+            ClientRequest request{};
+            auto parsed = false;
 #ifdef __HILL_SAMPLE__
             {
                 SampleRecorder<uint64_t> _(sampler, HandleSampler::PARSE);
 #endif
-                auto r = parse_request_message(req_handle, context);
-                type = std::get<0>(r);
-                key = std::get<1>(r);
-                value = std::get<2>(r);
+                parsed = parse_request_message(req_handle, Enums::RPCOperations::Insert, request);
 #ifdef __HILL_SAMPLE__
             }
 #endif
+            if (!parsed) {
+                reply_malformed(req_handle, ctx, request, Enums::RPCOperations::Insert);
+                return;
+            }
+            auto type = Enums::RPCOperations::Insert;
+            auto key = request.key, value = request.value;
+            // odd until the write lands, see migrate_range
+            ctx->write_seq.fetch_add(1);
+            if (auto node = ctx->self->redirect_of(key, true); node != -1) {
+                ctx->write_seq.fetch_add(1);
+                reply_wrong_node(req_handle, ctx, request, node);
+                return;
+            }
+
             IncomeMessage msg;
             msg.input.key = key->raw_chars();
             msg.input.key_size = key->size();
@@ -356,6 +1204,8 @@ namespace Hill {
             msg.input.hvalue = value;
 
             msg.output.status = Indexing::Enums::OpStatus::Unkown;
+            // before the key can be found, so a filter fetched from now on never rules it out
+            ctx->self->known_keys.add(ReadCache::CompactCache::hash_of({msg.input.key, msg.input.key_size}));
             // this is fast we do not need to sample
             auto pos = CityHash64(msg.input.key, msg.input.key_size) % ctx->num_launched_threads;
             auto allowed = Constants::dNODE_CAPPACITY_LIMIT * server->get_node()->total_pm;
@@ -364,11 +1214,11 @@ namespace Hill {
             {
                 SampleRecorder<uint64_t> _(sampler, HandleSampler::CAP_CHECK);
 #endif
-                insufficient = server->get_allocator()->get_consumed() >= allowed &&
+                insufficient = server->get_consumed() >= allowed &&
                     !server->get_agent()->available(pos);
                 if (insufficient) {
                     ctx->self->agent_locks[pos].lock();
-                    insufficient = server->get_allocator()->get_consumed() >= allowed &&
+                    insufficient = server->get_consumed() >= allowed &&
                         !server->get_agent()->available(pos);
 
                     if (insufficient) {
@@ -397,23 +1247,17 @@ namespace Hill {
 #ifdef __HILL_SAMPLE__
             }
 #endif
-            auto &resp = req_handle->pre_resp_msgbuf;
-            constexpr auto total_msg_size = sizeof(Enums::RPCOperations) + sizeof(Enums::RPCStatus) + sizeof(Memory::PolymorphicPointer);
-            ctx->rpc->resize_msg_buffer(&resp, total_msg_size);
-
+            auto status = Enums::RPCStatus::Failed;
+            Wire::Writer writer(nullptr, 0);
 #ifdef __HILL_SAMPLE__
             {
                 SampleRecorder<uint64_t> _(sampler, HandleSampler::RESP_MSG);
 #endif
-
-                *reinterpret_cast<Enums::RPCOperations *>(resp.buf) = Enums::RPCOperations::Insert;
-                auto offset = sizeof(Enums::RPCOperations);
                 switch(msg.output.status.load()){
                 case Indexing::Enums::OpStatus::Ok:
-                    *reinterpret_cast<Enums::RPCStatus *>(resp.buf + offset) = Enums::RPCStatus::Ok;
+                    status = Enums::RPCStatus::Ok;
                     break;
                 case Indexing::Enums::OpStatus::NoMemory:
-                    *reinterpret_cast<Enums::RPCStatus *>(resp.buf + offset) = Enums::RPCStatus::NoMemory;
                     // agent's memory is available but not sufficient;
                     ctx->self->agent_locks[pos].lock();
                     ctx->self->index_ids[ctx->thread_id] = pos;
@@ -424,20 +1268,20 @@ namespace Hill {
 
                     goto retry;
                 default:
-                    *reinterpret_cast<Enums::RPCStatus *>(resp.buf + offset) = Enums::RPCStatus::Failed;
                     break;
                 }
 
-                offset += sizeof(Enums::RPCStatus);
-                *reinterpret_cast<Memory::PolymorphicPointer *>(resp.buf + offset) = msg.output.value;
+                writer = begin_response(req_handle, ctx, request, status);
+                WriteResult::encode(writer, msg.output.value);
 #ifdef __HILL_SAMPLE__
             }
 #endif
+            ctx->write_seq.fetch_add(1);
 #ifdef __HILL_SAMPLE__
             {
                 SampleRecorder<uint64_t> _(sampler, HandleSampler::RESP);
 #endif
-                ctx->rpc->enqueue_response(req_handle, &resp);
+                send_response(req_handle, ctx, request, writer);
 #ifdef __HILL_SAMPLE__
             }
 #endif
@@ -453,18 +1297,30 @@ namespace Hill {
             auto handle_sampler = ctx->handle_sampler;
             auto &sampler = handle_sampler->update_sampler;
 #endif
-            Enums::RPCOperations type; KVPair::HillString *key, *value;
+            ClientRequest request{};
+            auto parsed = false;
 #ifdef __HILL_SAMPLE__
             {
                 SampleRecorder<uint64_t> _(sampler, HandleSampler::PARSE);
 #endif
-                auto r = parse_request_message(req_handle, context);
-                type = std::get<0>(r);
-                key = std::get<1>(r);
-                value = std::get<2>(r);
+                parsed = parse_request_message(req_handle, Enums::RPCOperations::Update, request);
 #ifdef __HILL_SAMPLE__
             }
 #endif
+            if (!parsed) {
+                reply_malformed(req_handle, ctx, request, Enums::RPCOperations::Update);
+                return;
+            }
+            auto type = Enums::RPCOperations::Update;
+            auto key = request.key, value = request.value;
+            // odd until the write lands, see migrate_range
+            ctx->write_seq.fetch_add(1);
+            if (auto node = ctx->self->redirect_of(key, true); node != -1) {
+                ctx->write_seq.fetch_add(1);
+                reply_wrong_node(req_handle, ctx, request, node);
+                return;
+            }
+
             IncomeMessage msg;
             msg.input.key = key->raw_chars();
             msg.input.key_size = key->size();
@@ -480,11 +1336,11 @@ namespace Hill {
             {
                 SampleRecorder<uint64_t> _(sampler, HandleSampler::CAP_CHECK);
 #endif
-                insufficient = server->get_allocator()->get_consumed() >= allowed &&
+                insufficient = server->get_consumed() >= allowed &&
                     !server->get_agent()->available(pos);
                 if (insufficient) {
                     ctx->self->agent_locks[pos].lock();
-                    insufficient = server->get_allocator()->get_consumed() >= allowed &&
+                    insufficient = server->get_consumed() >= allowed &&
                         !server->get_agent()->available(pos);
 
                     if (insufficient) {
@@ -513,22 +1369,22 @@ namespace Hill {
 #ifdef __HILL_SAMPLE__
             }
 #endif
-            auto &resp = req_handle->pre_resp_msgbuf;
-            constexpr auto total_msg_size = sizeof(Enums::RPCOperations) + sizeof(Enums::RPCStatus) + sizeof(Memory::PolymorphicPointer);
-            ctx->rpc->resize_msg_buffer(&resp, total_msg_size);
+            // clients caching the old value hear of it with their next responses
+            if (msg.output.status.load() == Indexing::Enums::OpStatus::Ok) {
+                ctx->self->invalidations.append(ReadCache::CompactCache::hash_of({key->raw_chars(), key->size()}));
+            }
+
+            auto status = Enums::RPCStatus::Failed;
+            Wire::Writer writer(nullptr, 0);
 #ifdef __HILL_SAMPLE__
             {
                 SampleRecorder<uint64_t> _(sampler, HandleSampler::RESP_MSG);
 #endif
-                *reinterpret_cast<Enums::RPCOperations *>(resp.buf) = Enums::RPCOperations::Update;
-                auto offset = sizeof(Enums::RPCOperations);
-
                 switch(msg.output.status.load()){
                 case Indexing::Enums::OpStatus::Ok:
-                    *reinterpret_cast<Enums::RPCStatus *>(resp.buf + offset) = Enums::RPCStatus::Ok;
+                    status = Enums::RPCStatus::Ok;
                     break;
                 case Indexing::Enums::OpStatus::NoMemory:
-                    *reinterpret_cast<Enums::RPCStatus *>(resp.buf + offset) = Enums::RPCStatus::NoMemory;
                     // agent's memory is available but not sufficient;
                     ctx->self->agent_locks[pos].lock();
                     ctx->self->index_ids[ctx->thread_id] = pos;
@@ -539,20 +1395,20 @@ namespace Hill {
 
                     goto retry;
                 default:
-                    *reinterpret_cast<Enums::RPCStatus *>(resp.buf + offset) = Enums::RPCStatus::Failed;
                     break;
                 }
 
-                offset += sizeof(Enums::RPCStatus);
-                *reinterpret_cast<Memory::PolymorphicPointer *>(resp.buf + offset) = msg.output.value;
+                writer = begin_response(req_handle, ctx, request, status);
+                WriteResult::encode(writer, msg.output.value);
 #ifdef __HILL_SAMPLE__
             }
 #endif
+            ctx->write_seq.fetch_add(1);
 #ifdef __HILL_SAMPLE__
             {
                 SampleRecorder<uint64_t> _(sampler, HandleSampler::RESP);
 #endif
-                ctx->rpc->enqueue_response(req_handle, &resp);
+                send_response(req_handle, ctx, request, writer);
 #ifdef __HILL_SAMPLE__
             }
 #endif
@@ -567,18 +1423,26 @@ namespace Hill {
             auto handle_sampler = ctx->handle_sampler;
             auto &sampler = handle_sampler->search_sampler;
 #endif
-            Enums::RPCOperations type; KVPair::HillString *key, *value;
+            ClientRequest request{};
+            auto parsed = false;
 #ifdef __HILL_SAMPLE__
             {
                 SampleRecorder<uint64_t> _(sampler, HandleSampler::PARSE);
 #endif
-                auto t = parse_request_message(req_handle, context);
-                type = std::get<0>(t);
-                key = std::get<1>(t);
-                value = std::get<2>(t);
+                parsed = parse_request_message(req_handle, Enums::RPCOperations::Search, request);
 #ifdef __HILL_SAMPLE__
             }
 #endif
+            if (!parsed) {
+                reply_malformed(req_handle, ctx, request, Enums::RPCOperations::Search);
+                return;
+            }
+            auto type = Enums::RPCOperations::Search;
+            auto key = request.key;
+            if (auto node = ctx->self->redirect_of(key, false); node != -1) {
+                reply_wrong_node(req_handle, ctx, request, node);
+                return;
+            }
             IncomeMessage msg;
             msg.input.key = key->raw_chars();
             msg.input.key_size = key->size();
@@ -596,34 +1460,40 @@ namespace Hill {
 #ifdef __HILL_SAMPLE__
             }
 #endif
-            auto& resp = req_handle->pre_resp_msgbuf;
-            constexpr auto total_msg_size = sizeof(Enums::RPCOperations) + sizeof(Memory::PolymorphicPointer)
-                + sizeof(size_t) + sizeof(Enums::RPCStatus);
-
+            auto status = msg.output.value == nullptr ? Enums::RPCStatus::Failed : Enums::RPCStatus::Ok;
+            Wire::Writer writer(nullptr, 0);
 #ifdef __HILL_SAMPLE__
             {
                 SampleRecorder<uint64_t> _(sampler, HandleSampler::RESP_MSG);
 #endif
-                ctx->rpc->resize_msg_buffer(&resp, total_msg_size);
-                *reinterpret_cast<Enums::RPCOperations *>(resp.buf) = Enums::RPCOperations::Search;
-
-                auto offset = sizeof(Enums::RPCOperations);
-                if (msg.output.value == nullptr) {
-                    *reinterpret_cast<Enums::RPCStatus *>(resp.buf + offset) = Enums::RPCStatus::Failed;
-                } else {
-                    *reinterpret_cast<Enums::RPCStatus *>(resp.buf + offset) = Enums::RPCStatus::Ok;
-
-                    offset += sizeof(Enums::RPCStatus);
-                    if (msg.output.value.is_remote()) {
-                        *reinterpret_cast<Memory::PolymorphicPointer *>(resp.buf + offset) = msg.output.value;
-                    } else {
-                        auto poly = Memory::PolymorphicPointer::make_polymorphic_pointer(Memory::RemotePointer::make_remote_pointer(ctx->node_id, msg.output.value.local_ptr()));
-                        *reinterpret_cast<Memory::PolymorphicPointer *>(resp.buf + offset) = poly;
+                writer = begin_response(req_handle, ctx, request, status);
+                if (status == Enums::RPCStatus::Ok) {
+                    auto poly = msg.output.value;
+                    if (!poly.is_remote()) {
+                        poly = Memory::PolymorphicPointer::make_polymorphic_pointer(
+                            Memory::RemotePointer::make_remote_pointer(ctx->node_id, msg.output.value.local_ptr()));
+                    }
+                    uint64_t size = msg.output.value.is_remote() ? msg.output.value_size + 64 : msg.output.value_size;
+
+                    // where the client finds the key by itself next time
+                    auto fence = msg.output.fence;
+#ifndef __HILL_PINDEX__
+                    // leaves are in DRAM, out of reach of clients
+                    fence.leaf = nullptr;
+#endif
+                    auto low = fence.low ? std::string_view(fence.low->raw_chars(), fence.low->size()) : "";
+                    auto high = fence.high ? std::string_view(fence.high->raw_chars(), fence.high->size()) : "";
+                    uint32_t partitions = ctx->num_launched_threads;
+                    if (sizeof(Wire::MessageHeader) + ResponseHead::min_size + SearchResult::min_size +
+                        FenceResult::size_of(partitions, low, high) > Constants::uMAX_MSG_SIZE) {
+                        fence.leaf = nullptr;
                     }
 
-                    offset += sizeof(Memory::PolymorphicPointer);
-                    *reinterpret_cast<size_t *>(resp.buf + offset) =
-                        msg.output.value.is_remote() ? msg.output.value_size + 64 : msg.output.value_size;
+                    SearchResult::encode(writer, poly, size, msg.output.fence.stamp, fence.leaf);
+                    if (fence.leaf != nullptr) {
+                        writer.add_flags(Wire::Enums::Flags::Fence);
+                        FenceResult::encode(writer, partitions, low, high);
+                    }
                 }
 #ifdef __HILL_SAMPLE__
             }
@@ -632,7 +1502,7 @@ namespace Hill {
             {
                 SampleRecorder<uint64_t> _(sampler, HandleSampler::RESP);
 #endif
-                ctx->rpc->enqueue_response(req_handle, &resp);
+                send_response(req_handle, ctx, request, writer);
 #ifdef __HILL_SAMPLE__
             }
 #endif
@@ -647,29 +1517,39 @@ namespace Hill {
             auto handle_sampler = ctx->handle_sampler;
             auto &sampler = handle_sampler->scan_sampler;
 #endif
-            Enums::RPCOperations type; KVPair::HillString *key, *value;
+            ClientRequest request{};
+            auto parsed = false;
 #ifdef __HILL_SAMPLE__
             {
                 SampleRecorder<uint64_t> _(sampler, HandleSampler::PARSE);
 #endif
-                auto t = parse_request_message(req_handle, context);
-                type = std::get<0>(t);
-                key = std::get<1>(t);
-                value = std::get<2>(t);
+                parsed = parse_request_message(req_handle, Enums::RPCOperations::Range, request);
 #ifdef __HILL_SAMPLE__
             }
 #endif
+            if (!parsed) {
+                reply_malformed(req_handle, ctx, request, Enums::RPCOperations::Range);
+                return;
+            }
+            auto type = Enums::RPCOperations::Range;
+            auto key = request.key;
+            if (auto node = ctx->self->redirect_of(key, false); node != -1) {
+                reply_wrong_node(req_handle, ctx, request, node);
+                return;
+            }
 
-            IncomeMessage msgs[Memory::Constants::iTHREAD_LIST_NUM];
-            std::vector<std::vector<Indexing::ScanHolder>> ranges;
+            auto msgs = ctx->scan_msgs;
+            auto &merger = ctx->merger;
+            merger.reset();
 #ifdef __HILL_SAMPLE__
             {
                 SampleRecorder<uint64_t> _(sampler, HandleSampler::INDEXING);
 #endif
                 for (auto i = 0; i < ctx->num_launched_threads; i++) {
+                    msgs[i].reset();
                     msgs[i].input.key = key->raw_chars();
                     msgs[i].input.key_size = key->size();
-                    msgs[i].input.value_size = *reinterpret_cast<size_t *>(value);
+                    msgs[i].input.value_size = request.num;
                     msgs[i].input.op = type;
                     msgs[i].output.status = Indexing::Enums::OpStatus::Unkown;
                     while(!ctx->queues[i].push(&msgs[i]));
@@ -677,7 +1557,7 @@ namespace Hill {
 
                 for (auto i = 0; i < ctx->num_launched_threads; i++) {
                     while(msgs[i].output.status.load() == Indexing::Enums::OpStatus::Unkown);
-                    ranges.push_back(std::move(msgs[i].output.values));
+                    merger.add_range(msgs[i].output.values);
                 }
 #ifdef __HILL_SAMPLE__
             }
@@ -688,109 +1568,304 @@ namespace Hill {
             {
                 SampleRecorder<uint64_t> _(sampler, HandleSampler::MERGE);
 #endif
-                auto merger = Merger::make_merger(ranges);
-                auto holders = merger->merge(msgs[0].input.value_size);
-                ret = holders.size();
+                merger.merge(msgs[0].input.value_size, ctx->merged);
+                ret = ctx->merged.size();
 #ifdef __HILL_SAMPLE__
             }
 #endif
 
-            auto& resp = req_handle->pre_resp_msgbuf;
+            Wire::Writer writer(nullptr, 0);
 #ifdef __HILL_SAMPLE__
             {
                 SampleRecorder<uint64_t> _(sampler, HandleSampler::RESP_MSG);
 #endif
-                constexpr auto total_msg_size = sizeof(Enums::RPCOperations) + sizeof(Memory::PolymorphicPointer)
-                    + sizeof(size_t) + sizeof(Enums::RPCStatus);
+                writer = begin_response(req_handle, ctx, request, Enums::RPCStatus::Ok);
+                RangeResult::encode(writer, ret);
+#ifdef __HILL_SAMPLE__
+            }
+#endif
+#ifdef __HILL_SAMPLE__
+            {
+                SampleRecorder<uint64_t> _(sampler, HandleSampler::RESP);
+#endif
+                send_response(req_handle, ctx, request, writer);
+#ifdef __HILL_SAMPLE__
+            }
+#endif
+        }
+
+        auto StoreServer::memory_handler(erpc::ReqHandle *req_handle, void *context) -> void {
+            auto ctx = reinterpret_cast<ServerContext *>(context);
+            auto tid = ctx->thread_id;
+            auto allocator = ctx->server->get_allocator();
+            auto logger = ctx->server->get_logger();
+            auto &ptr = logger->make_log(tid, WAL::Enums::Ops::RemoteMemory);
+
+            allocator->allocate_for_remote(ptr);
+            logger->seal(tid);
+
+            auto &resp = req_handle->pre_resp_msgbuf;
+            constexpr auto total_msg_size = sizeof(Enums::RPCOperations) + sizeof(Enums::RPCStatus) + sizeof(Memory::RemotePointer);
+
+            ctx->rpc->resize_msg_buffer(&resp, total_msg_size);
+            *reinterpret_cast<Enums::RPCOperations *>(resp.buf) = Enums::RPCOperations::CallForMemory;
+            auto offset = sizeof(Enums::RPCOperations);
+
+            if (ptr) {
+                *reinterpret_cast<Enums::RPCStatus *>(resp.buf + offset) = Enums::RPCStatus::Ok;
+            } else {
+                *reinterpret_cast<Enums::RPCStatus *>(resp.buf + offset) = Enums::RPCStatus::NoMemory;
+            }
+            offset += sizeof(Enums::RPCStatus);
+
+            auto rptr = Memory::RemotePointer::make_remote_pointer(ctx->node_id, ptr);
+            *reinterpret_cast<Memory::RemotePointer *>(resp.buf + offset) = rptr;
+#ifdef __HILL_INFO__
+            std::cout << ">> Offering remote memory " << rptr.void_ptr() << "\n";
+#endif
+
+            ctx->rpc->enqueue_response(req_handle, &resp);
+            logger->commit(tid);
+        }
+
+        auto StoreServer::return_memory_handler(erpc::ReqHandle *req_handle, void *context) -> void {
+            auto ctx = reinterpret_cast<ServerContext *>(context);
+            auto requests = req_handle->get_req_msgbuf();
+            auto region = *reinterpret_cast<Memory::RemotePointer *>(requests->buf + sizeof(Enums::RPCOperations));
+
+            auto &resp = req_handle->pre_resp_msgbuf;
+            constexpr auto total_msg_size = sizeof(Enums::RPCOperations) + sizeof(Enums::RPCStatus);
+            ctx->rpc->resize_msg_buffer(&resp, total_msg_size);
+            *reinterpret_cast<Enums::RPCOperations *>(resp.buf) = Enums::RPCOperations::ReturnMemory;
+
+            // regions are lent by memory_handler from the first allocator
+            auto status = Enums::RPCStatus::Ok;
+            if (region.is_nullptr() || region.get_node() != ctx->node_id) {
+                status = Enums::RPCStatus::Failed;
+            } else {
+                ctx->server->get_allocator()->free_for_remote(region.get_as<byte_ptr_t>());
+#ifdef __HILL_INFO__
+                std::cout << ">> Remote memory " << region.void_ptr() << " is returned\n";
+#endif
+            }
+            *reinterpret_cast<Enums::RPCStatus *>(resp.buf + sizeof(Enums::RPCOperations)) = status;
+            ctx->rpc->enqueue_response(req_handle, &resp);
+        }
+
+        auto StoreServer::filter_handler(erpc::ReqHandle *req_handle, void *context) -> void {
+            auto ctx = reinterpret_cast<ServerContext *>(context);
+            auto self = ctx->self;
+            constexpr auto header_size = sizeof(Wire::MessageHeader) + sizeof(Enums::RPCStatus);
+
+            ClientRequest request{};
+            if (!parse_request_message(req_handle, Enums::RPCOperations::FetchFilter, request)) {
+                auto &resp = req_handle->pre_resp_msgbuf;
+                Wire::Writer writer(resp.buf, resp.max_data_size);
+                writer.begin(Enums::RPCOperations::FetchFilter, request.header.request_id);
+                writer.put<Enums::RPCStatus>(Enums::RPCStatus::Malformed);
+                ctx->rpc->resize_msg_buffer(&resp, writer.finish());
+                ctx->rpc->enqueue_response(req_handle, &resp);
+                return;
+            }
+
+            // a filter does not fit in a pre-allocated response, eRPC frees this buffer once it is sent
+            auto &resp = req_handle->dyn_resp_msgbuf;
+            resp = ctx->rpc->alloc_msg_buffer_or_die(header_size + ReadCache::BloomFilter::size());
+            Wire::Writer writer(resp.buf, header_size + ReadCache::BloomFilter::size());
+            writer.begin(Enums::RPCOperations::FetchFilter, request.header.request_id);
+
+            // a partition still being re-opened holds keys the filter lacks
+            if (self->seeded_partitions.load() != self->num_launched_threads) {
+                writer.put<Enums::RPCStatus>(Enums::RPCStatus::Failed);
+            } else {
+                writer.put<Enums::RPCStatus>(Enums::RPCStatus::Ok);
+                self->known_keys.serialize(writer.reserve(ReadCache::BloomFilter::size()));
+            }
+            ctx->rpc->resize_msg_buffer(&resp, writer.finish());
+            ctx->rpc->enqueue_response(req_handle, &resp);
+        }
+
+        auto StoreServer::migrate_handler(erpc::ReqHandle *req_handle, void *context) -> void {
+            auto ctx = reinterpret_cast<ServerContext *>(context);
+            auto requests = req_handle->get_req_msgbuf();
+            // not framed, see StoreServer, but every field is still checked against the message
+            Wire::Reader reader(requests->buf + sizeof(Enums::RPCOperations),
+                                requests->data_size - std::min(requests->data_size, sizeof(Enums::RPCOperations)));
+            bool last = false;
+            uint64_t count = 0;
+            hill_key_t *high = nullptr, *at = nullptr;
+            auto status = reader.take<bool, uint64_t, Wire::String, Wire::String>(last, count, high, at) ?
+                Enums::RPCStatus::Ok : Enums::RPCStatus::Failed;
 
-                ctx->rpc->resize_msg_buffer(&resp, total_msg_size);
-                *reinterpret_cast<Enums::RPCOperations *>(resp.buf) = Enums::RPCOperations::Range;
+            IncomeMessage msg;
+            for (uint64_t i = 0; i < count && status == Enums::RPCStatus::Ok; i++) {
+                hill_key_t *key;
+                hill_value_t *value;
+                if (!reader.take<Wire::String, Wire::String>(key, value)) {
+                    status = Enums::RPCStatus::Failed;
+                    break;
+                }
 
-                auto offset = sizeof(Enums::RPCOperations);
-                *reinterpret_cast<Enums::RPCStatus *>(resp.buf + offset) = Enums::RPCStatus::Ok;
+                ctx->self->known_keys.add(ReadCache::CompactCache::hash_of({key->raw_chars(), key->size()}));
+                auto pos = CityHash64(key->raw_chars(), key->size()) % ctx->num_launched_threads;
+                // a copy left by an earlier attempt to move the range is replaced
+                for (auto op : {Enums::RPCOperations::Insert, Enums::RPCOperations::Update}) {
+                    msg.reset();
+                    msg.input.key = key->raw_chars();
+                    msg.input.key_size = key->size();
+                    msg.input.value = value->raw_chars();
+                    msg.input.value_size = value->size();
+                    msg.input.hkey = key;
+                    msg.input.hvalue = value;
+                    msg.input.op = op;
+                    while (!ctx->queues[pos].push(&msg));
+                    while (msg.output.status.load() == Indexing::Enums::OpStatus::Unkown);
+                    if (msg.output.status.load() != Indexing::Enums::OpStatus::RepeatInsert) {
+                        break;
+                    }
+                }
 
-                offset += sizeof(Enums::RPCStatus);
-                *reinterpret_cast<size_t *>(resp.buf + offset) = ret;
-#ifdef __HILL_SAMPLE__
+                if (msg.output.status.load() != Indexing::Enums::OpStatus::Ok) {
+                    status = Enums::RPCStatus::Failed;
+                }
             }
-#endif
-#ifdef __HILL_SAMPLE__
-            {
-                SampleRecorder<uint64_t> _(sampler, HandleSampler::RESP);
-#endif
-                ctx->rpc->enqueue_response(req_handle, &resp);
-#ifdef __HILL_SAMPLE__
+            ctx->server->get_node()->available_pm = ctx->server->get_node()->total_pm - ctx->server->get_consumed();
+
+            // every key of the range is here, clients are sent here from now on
+            if (status == Enums::RPCStatus::Ok && last &&
+                !ctx->server->get_node()->cluster_status.split_range(high->to_string(), at->to_string(), ctx->node_id)) {
+                status = Enums::RPCStatus::Failed;
             }
-#endif
+
+            auto &resp = req_handle->pre_resp_msgbuf;
+            ctx->rpc->resize_msg_buffer(&resp, sizeof(Enums::RPCOperations) + sizeof(Enums::RPCStatus));
+            *reinterpret_cast<Enums::RPCOperations *>(resp.buf) = Enums::RPCOperations::MigrateRange;
+            *reinterpret_cast<Enums::RPCStatus *>(resp.buf + sizeof(Enums::RPCOperations)) = status;
+            ctx->rpc->enqueue_response(req_handle, &resp);
         }
 
-        auto StoreServer::memory_handler(erpc::ReqHandle *req_handle, void *context) -> void {
+        auto StoreServer::replicate_handler(erpc::ReqHandle *req_handle, void *context) -> void {
             auto ctx = reinterpret_cast<ServerContext *>(context);
-            auto tid = ctx->thread_id;
-            auto allocator = ctx->server->get_allocator();
-            auto logger = ctx->server->get_logger();
-            auto &ptr = logger->make_log(tid, WAL::Enums::Ops::RemoteMemory);
+            auto requests = req_handle->get_req_msgbuf();
+            // not framed, see StoreServer, but every record is still checked against the message
+            Wire::Reader reader(requests->buf + sizeof(Enums::RPCOperations),
+                                requests->data_size - std::min(requests->data_size, sizeof(Enums::RPCOperations)));
+            ReplicaBatch batch;
+            auto kind = *reinterpret_cast<Enums::RPCOperations *>(requests->buf);
+            batch.seeding = kind == Enums::RPCOperations::Seed;
+            batch.last = false;
+            auto ok = requests->data_size >= sizeof(Enums::RPCOperations) &&
+                reader.take<int, uint64_t, uint64_t>(batch.node, batch.seq, batch.count) &&
+                (!batch.seeding || reader.take<bool>(batch.last)) &&
+                batch.node >= 0 && batch.node < int(Cluster::Constants::uMAX_NODE);
+            batch.received = std::chrono::steady_clock::now();
+
+            // writes are applied by the replication thread, the main server is not held up by them
+            auto records = reader.remaining();
+            auto buf = requests->buf + requests->data_size - records;
+            for (uint64_t i = 0; ok && i < batch.count; i++) {
+                Enums::RPCOperations op;
+                hill_key_t *key;
+                hill_value_t *value;
+                ok = reader.take<Enums::RPCOperations, Wire::String, Wire::String>(op, key, value);
+            }
+            // what the replication thread has applied so far, batches just queued are not in yet
+            uint64_t applied = 0;
+            bool diverged = false;
+            if (ok) {
+                applied = ctx->self->applied_seqs[batch.node];
+                diverged = ctx->self->diverged[batch.node];
+                batch.records.assign(buf, buf + records - reader.remaining());
+                std::scoped_lock l(ctx->self->replica_lock);
+                ctx->self->replicas.push_back(std::move(batch));
+            }
+            auto &resp = req_handle->pre_resp_msgbuf;
+            ctx->rpc->resize_msg_buffer(&resp, sizeof(Enums::RPCOperations) + sizeof(Enums::RPCStatus) +
+                                        sizeof(uint64_t) + sizeof(bool));
+            Wire::Writer writer(resp.buf, resp.max_data_size);
+            writer.put<Enums::RPCOperations, Enums::RPCStatus, uint64_t, bool>(
+                kind, ok ? Enums::RPCStatus::Ok : Enums::RPCStatus::Failed, applied, diverged);
+            ctx->rpc->enqueue_response(req_handle, &resp);
+        }
 
-            allocator->allocate_for_remote(ptr);
+        auto StoreServer::reply_wrong_node(erpc::ReqHandle *req_handle, ServerContext *ctx, const ClientRequest &request,
+                                           int node) -> void
+        {
+            auto writer = begin_response(req_handle, ctx, request, Enums::RPCStatus::WrongNode);
+            RedirectBody::encode(writer, node);
+            send_response(req_handle, ctx, request, writer);
+        }
 
-            auto &resp = req_handle->pre_resp_msgbuf;
-            constexpr auto total_msg_size = sizeof(Enums::RPCOperations) + sizeof(Enums::RPCStatus) + sizeof(Memory::RemotePointer);
+        auto StoreServer::reply_malformed(erpc::ReqHandle *req_handle, ServerContext *ctx, const ClientRequest &request,
+                                          Enums::RPCOperations op) -> void
+        {
+            // the header may be what is wrong, the response is of the handler's operation
+            auto answered = request;
+            answered.header.op = op;
+            auto writer = begin_response(req_handle, ctx, answered, Enums::RPCStatus::Malformed);
+            send_response(req_handle, ctx, answered, writer);
+        }
 
-            ctx->rpc->resize_msg_buffer(&resp, total_msg_size);
-            *reinterpret_cast<Enums::RPCOperations *>(resp.buf) = Enums::RPCOperations::CallForMemory;
-            auto offset = sizeof(Enums::RPCOperations);
+        auto StoreServer::begin_response(erpc::ReqHandle *req_handle, ServerContext *ctx, const ClientRequest &request,
+                                         Enums::RPCStatus status, uint8_t flags) -> Wire::Writer
+        {
+            auto &resp = req_handle->pre_resp_msgbuf;
+            Wire::Writer writer(resp.buf, std::min(size_t(resp.max_data_size), Constants::uMAX_MSG_SIZE));
+            writer.begin(request.header.op, request.header.request_id, flags);
 
-            if (ptr) {
-                *reinterpret_cast<Enums::RPCStatus *>(resp.buf + offset) = Enums::RPCStatus::Ok;
-            } else {
-                *reinterpret_cast<Enums::RPCStatus *>(resp.buf + offset) = Enums::RPCStatus::NoMemory;
+            InvalidationBatch batch{};
+            // since of a malformed request is not to be trusted
+            if (status != Enums::RPCStatus::Malformed) {
+                ctx->self->invalidations.collect(request.since, batch);
             }
-            offset += sizeof(Enums::RPCStatus);
-
-            auto rptr = Memory::RemotePointer::make_remote_pointer(ctx->node_id, ptr);
-            *reinterpret_cast<Memory::RemotePointer *>(resp.buf + offset) = rptr;
-#ifdef __HILL_INFO__
-            std::cout << ">> Offering remote memory " << rptr.void_ptr() << "\n";
-#endif
+            ResponseHead::encode(writer, batch, status);
+            return writer;
+        }
 
+        auto StoreServer::send_response(erpc::ReqHandle *req_handle, ServerContext *ctx, const ClientRequest &request,
+                                        Wire::Writer &writer) -> void
+        {
+            auto &resp = req_handle->pre_resp_msgbuf;
+            auto size = writer.finish();
+            if (size == 0) {
+                std::cerr << ">> Error: response to request " << request.header.request_id << " does not fit\n";
+                writer = begin_response(req_handle, ctx, request, Enums::RPCStatus::Failed);
+                size = writer.finish();
+            }
+            ctx->rpc->resize_msg_buffer(&resp, size);
             ctx->rpc->enqueue_response(req_handle, &resp);
-            logger->commit(tid);
         }
 
-        auto StoreServer::parse_request_message(const erpc::ReqHandle *req_handle, const void *ctx)
-            -> std::tuple<Enums::RPCOperations, KVPair::HillString *, KVPair::HillString *>
+        auto StoreServer::parse_request_message(const erpc::ReqHandle *req_handle, Enums::RPCOperations op,
+                                                ClientRequest &request) noexcept -> bool
         {
-            UNUSED(ctx);
             auto requests = req_handle->get_req_msgbuf();
+            Wire::Reader reader(requests->buf, requests->data_size);
+            if (!reader.open(request.header) || request.header.op != op) {
+                return false;
+            }
 
-            auto buf = requests->buf;
-            auto type = *reinterpret_cast<Enums::RPCOperations *>(buf);
-            KVPair::HillString *key = nullptr, *key_or_value = nullptr;
-            buf += sizeof(Enums::RPCOperations);
-
-            switch(type){
+            auto parsed = false;
+            switch(op){
             case Enums::RPCOperations::Insert:
                 [[fallthrough]];
-            case Enums::RPCOperations::Range:
-                // range here gets a HillString * for value,
-                // we should cast it to size_t outside this function
-                [[fallthrough]];
             case Enums::RPCOperations::Update:
-                key = reinterpret_cast<hill_key_t *>(buf);
-                buf += key->object_size();
-                key_or_value = reinterpret_cast<hill_value_t *>(buf);
+                parsed = WriteRequest::decode(reader, request.since, request.key, request.value);
                 break;
             case Enums::RPCOperations::Search:
-                key = reinterpret_cast<hill_key_t *>(buf);
+                parsed = SearchRequest::decode(reader, request.since, request.key);
                 break;
-            case Enums::RPCOperations::CallForMemory:
+            case Enums::RPCOperations::Range:
+                parsed = RangeRequest::decode(reader, request.since, request.key, request.num);
+                break;
+            case Enums::RPCOperations::FetchFilter:
+                parsed = true;
                 break;
             default:
-                type = Enums::RPCOperations::Unknown;
                 break;
             }
 
-            return {type, key, key_or_value};
+            return parsed && reader.finished();
         }
 
         auto StoreClient::register_thread(const Workload::StringWorkload &load, Stats::SyntheticStats &stats)
@@ -805,6 +1880,16 @@ namespace Hill {
                 return {};
             }
 
+            // threads are registered one by one, the first with a negative cache makes the filters
+            if (negative_cache) {
+                const auto &cluster = client->get_cluster_meta().cluster;
+                for (size_t i = 1; i <= cluster.node_num; i++) {
+                    if (auto node_id = cluster.nodes[i].node_id; node_id != 0 && key_filters[node_id] == nullptr) {
+                        key_filters[node_id] = std::make_unique<KeyFilter>();
+                    }
+                }
+            }
+
             return std::thread([&](int tid) {
 #if defined(__HILL_DEBUG__) || defined(__HILL_INFO__)
                 std::cout << ">> Client thread launched\n";
@@ -812,14 +1897,29 @@ namespace Hill {
                 ClientContext c_ctx;
                 c_ctx.thread_id = tid;
                 c_ctx.client = this->client.get();
+                c_ctx.one_sided = one_sided;
+                c_ctx.backup_reads = backup_reads;
+                c_ctx.request_timeout = request_timeout;
+                if (negative_cache) {
+                    c_ctx.key_filters = key_filters;
+                }
+                if (shared_cache != nullptr) {
+                    c_ctx.cache = shared_cache.get();
+                } else {
+                    c_ctx.own_cache = std::make_unique<ReadCache::CompactCache>(ReadCache::Constants::uCACHE_SIZE, 1);
+                    c_ctx.cache = c_ctx.own_cache.get();
+                }
 
                 std::optional<int> _node_id;
                 int node_id;
+                // node_id is a backup of the key if it differs
+                int main_node = 0;
+                bool failed_over = false;
                 stats.reset();
                 size_t counter = 0;
                 std::chrono::time_point<std::chrono::steady_clock> start, end;
                 c_ctx.rpc = new erpc::Rpc<erpc::CTransport>(nexus, reinterpret_cast<void *>(&c_ctx),
-                                                            tid, RPCWrapper::ghost_sm_handler);
+                                                            tid, session_handler);
 
                 c_ctx.client_sampler = new Sampling::ClientSampler(10000);
                 c_ctx.client_sampler->prepare();
@@ -851,34 +1951,60 @@ namespace Hill {
                         break;
                     }
 #endif
+                    if (c_ctx.key_filters != nullptr && counter % Constants::uFILTER_CHECK == 0) {
+                        refresh_key_filters(c_ctx);
+                    }
+
                     if (i.type == Workload::Enums::Search) {
 #ifdef __HILL_SAMPLE__
                         {
                             SampleRecorder<size_t> _(*sampler, ClientSampler::CACHE);
 #endif
-                            auto ret = c_ctx.cache.get(i.key);
-                            if (ret != nullptr) {
+                            ReadCache::CachedValue cached;
+                            if (c_ctx.cache->get(i.key, cached)) {
+                                auto fresh = true;
 #ifdef __HILL_FETCH_VALUE__
 #ifdef __HILL_SAMPLE__
                                 {
                                     SampleRecorder<size_t> _(*sampler, ClientSampler::CACHE_RDMA);
 #endif
-                                    auto re_ptr = ret->value_ptr.remote_ptr();
+                                    auto re_ptr = cached.value_ptr.remote_ptr();
                                     c_ctx.client->read_from(c_ctx.thread_id, re_ptr.get_node(),
-                                                            re_ptr.get_as<byte_ptr_t>(), ret->value_size);
+                                                            re_ptr.get_as<byte_ptr_t>(), cached.value_size);
                                     c_ctx.client->poll_completion_once(c_ctx.thread_id, re_ptr.get_node());
+                                    // the memory is freed or reused since the value is cached
+                                    auto value = reinterpret_cast<KVPair::HillString *>(
+                                        c_ctx.client->get_buf(c_ctx.thread_id, re_ptr.get_node()).get());
+                                    fresh = value->is_valid() && value->stamp() == cached.stamp;
 #ifdef __HILL_SAMPLE__
                                 }
 #endif
 #endif
-                                ++c_ctx.num_search;
-                                ++c_ctx.suc_search;
-                                ++c_ctx.RTTs[1];
-                                goto sample;
+                                if (fresh) {
+                                    ++c_ctx.num_search;
+                                    ++c_ctx.suc_search;
+                                    ++c_ctx.RTTs[1];
+                                    goto sample;
+                                }
+                                c_ctx.cache->expire(i.key);
                             }
 #ifdef __HILL_SAMPLE__
                         }
 #endif
+                        // never inserted, the server would not find it either
+                        if (c_ctx.key_filters != nullptr && !may_exist(c_ctx, i.key)) {
+                            ++c_ctx.num_search;
+                            ++c_ctx.suc_negative;
+                            goto sample;
+                        }
+
+                        if (c_ctx.one_sided && search_one_sided(c_ctx, i.key)) {
+                            ++c_ctx.num_search;
+                            ++c_ctx.suc_search;
+                            ++c_ctx.suc_one_sided;
+                            ++c_ctx.RTTs[2];
+                            goto sample;
+                        }
                     }
 
                     c_ctx.is_done = false;
@@ -895,29 +2021,95 @@ namespace Hill {
                     }
 
                     node_id = _node_id.value();
+                    main_node = node_id;
+                    if (i.type == Workload::Enums::Search && c_ctx.backup_reads) {
+                        node_id = replica_of(c_ctx, i.key, node_id);
+                    }
+                    // this client finds its own inserts before the filter is fetched again
+                    if (i.type == Workload::Enums::Insert && c_ctx.key_filters != nullptr &&
+                        c_ctx.key_filters[node_id] != nullptr) {
+                        c_ctx.key_filters[node_id]->filter.add(ReadCache::CompactCache::hash_of(i.key));
+                    }
 
+                    /*
+                     * A server answering WrongNode names the node to ask, see StoreServer. A node not answering
+                     * in time is suspected and the request goes to whichever node can take it, see failover_of.
+                     */
+                    failed_over = false;
+                    for (int tries = 0;; tries++) {
+                        c_ctx.is_done = false;
+                        c_ctx.redirect = -1;
+                        auto answered = false;
+                        if (is_usable(c_ctx, node_id)) {
+                            // echoed by the response, see response_continuation
+                            c_ctx.waiting = tag_of(node_id, ++c_ctx.request_seq);
+                            auto prepared = false;
 #ifdef __HILL_SAMPLE__
-                    {
-                        SampleRecorder<size_t> _(*sampler, ClientSampler::PRE_REQ);
+                            {
+                                SampleRecorder<size_t> _(*sampler, ClientSampler::PRE_REQ);
 #endif
-                        prepare_request(node_id, i, c_ctx);
+                                prepared = prepare_request(node_id, i, c_ctx);
 #ifdef __HILL_SAMPLE__
-                    }
+                            }
 #endif
-                    // cache is updated in the response_continuation
+                            // too large for a message, no node would take it
+                            if (!prepared) {
+                                std::cerr << ">> Error: request of " << i.key << " does not fit in a message\n";
+                                c_ctx.waiting = 0;
+                                break;
+                            }
+                            // cache is updated in the response_continuation
 #ifdef __HILL_SAMPLE__
-                    {
-                        SampleRecorder<size_t> _(*sampler, ClientSampler::RPC);
+                            {
+                                SampleRecorder<size_t> _(*sampler, ClientSampler::RPC);
+#endif
+                                c_ctx.rpc->enqueue_request(c_ctx.erpc_sessions[node_id], i.type,
+                                                           &c_ctx.req_bufs[node_id], &c_ctx.resp_bufs[node_id],
+                                                           response_continuation,
+                                                           reinterpret_cast<void *>(c_ctx.waiting));
+                                answered = wait_response(c_ctx, node_id);
+                                if (!answered) {
+                                    abandon(c_ctx, c_ctx.req_bufs[node_id], c_ctx.resp_bufs[node_id]);
+                                }
+                                c_ctx.waiting = 0;
+#ifdef __HILL_SAMPLE__
+                            }
 #endif
-                        c_ctx.rpc->enqueue_request(c_ctx.erpc_sessions[node_id], i.type,
-                                                   &c_ctx.req_bufs[node_id], &c_ctx.resp_bufs[node_id],
-                                                   response_continuation, &node_id);
-                        while(!c_ctx.is_done) {
-                            c_ctx.rpc->run_event_loop_once();
+                            if (answered && c_ctx.redirect == -1) {
+                                break;
+                            }
+                            if (!answered) {
+                                suspect(c_ctx, node_id);
+                            }
                         }
-#ifdef __HILL_SAMPLE__
+
+                        if (!answered) {
+                            failed_over = true;
+                            c_ctx.redirect = failover_of(c_ctx, i, node_id);
+                        }
+
+                        ++c_ctx.num_reroute;
+                        if (tries == Constants::iMAX_REROUTES || c_ctx.redirect <= 0 ||
+                            size_t(c_ctx.redirect) >= Cluster::Constants::uMAX_NODE) {
+                            // given up, counted as a failed request
+                            c_ctx.num_insert += i.type == Workload::Enums::Insert;
+                            c_ctx.num_search += i.type == Workload::Enums::Search;
+                            c_ctx.num_update += i.type == Workload::Enums::Update;
+                            c_ctx.num_range += i.type == Workload::Enums::Range;
+                            break;
+                        }
+
+                        // the key is being moved away from the node, or no node takes over yet
+                        if (c_ctx.redirect == node_id || !answered) {
+                            std::this_thread::sleep_for(Constants::tREROUTE_BACKOFF);
+                        }
+                        node_id = c_ctx.redirect;
+                    }
+                    c_ctx.num_failover += failed_over;
+                    if (i.type == Workload::Enums::Search && node_id != main_node && c_ctx.redirect == -1 &&
+                        !failed_over) {
+                        ++c_ctx.suc_backup;
                     }
-#endif
                 sample:
                     if ((++counter) % 10000 == 0) {
                         end = std::chrono::steady_clock::now();
@@ -929,14 +2121,29 @@ namespace Hill {
                 stats.throughputs.timing_stop();
                 stats.throughputs.num_ops = c_ctx.num_insert + c_ctx.num_search + c_ctx.num_update + c_ctx.num_range;
                 stats.throughputs.suc_ops = c_ctx.suc_insert + c_ctx.suc_search + c_ctx.suc_update + c_ctx.suc_range;
-                stats.cache_hit_ratio = c_ctx.cache.hit_ratio();
+                stats.cache_hit_ratio = c_ctx.cache->hit_ratio();
                 this->client->unregister_thread(tid);
 
                 std::cout << ">> Correctness report:\n";
                 std::cout << "-->> insert: " << c_ctx.suc_insert << "/" << c_ctx.num_insert << "\n";
                 std::cout << "-->> search: " << c_ctx.suc_search << "/" << c_ctx.num_search << "\n";
+                if (c_ctx.one_sided) {
+                    std::cout << "-->> one-sided search: " << c_ctx.suc_one_sided << "/" << c_ctx.suc_search << "\n";
+                }
+                if (c_ctx.key_filters != nullptr) {
+                    std::cout << "-->> negative search: " << c_ctx.suc_negative << "/" << c_ctx.num_search << "\n";
+                }
                 std::cout << "-->> update: " << c_ctx.suc_update << "/" << c_ctx.num_update << "\n";
                 std::cout << "-->> range: " << c_ctx.suc_range << "/" << c_ctx.num_range << "\n";
+                if (c_ctx.num_reroute != 0) {
+                    std::cout << "-->> rerouted requests: " << c_ctx.num_reroute << "\n";
+                }
+                if (c_ctx.backup_reads) {
+                    std::cout << "-->> backup search: " << c_ctx.suc_backup << "/" << c_ctx.num_search << "\n";
+                }
+                if (c_ctx.num_failover != 0) {
+                    std::cout << "-->> failed over requests: " << c_ctx.num_failover << "\n";
+                }
 #ifdef __HILL_SAMPLE__
                 std::cout << ">> Insert breakdown: "; c_ctx.client_sampler->report_insert(); std::cout << "\n";
                 std::cout << ">> Search breakdown: "; c_ctx.client_sampler->report_search(); std::cout << "\n";
@@ -947,8 +2154,7 @@ namespace Hill {
         }
 
         auto StoreClient::connect_all_servers(int tid, ClientContext &c_ctx) -> bool {
-            const auto &meta = this->client->get_cluster_meta();
-            const auto &cluster = meta.cluster;
+            const auto &cluster = this->client->get_cluster_meta().cluster;
 
             // skip the monitor
             for (int i = 1; i <= cluster.node_num; i++) {
@@ -960,86 +2166,437 @@ namespace Hill {
                     }
                 }
 
+                if (!connect_server(c_ctx, node_id)) {
+                    std::cerr << "Client can not open a session with server " << node_id << "\n";
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        auto StoreClient::connect_server(ClientContext &c_ctx, int node_id) -> bool {
+            const auto &meta = c_ctx.client->get_cluster_meta();
 #ifdef __HILL_INFO__
-                std::cout << ">> Creating eRPC for thread " << tid << "\n";
-                std::cout << ">> Connecting to node " << node_id << " at listen port: "
-                          << meta.cluster.nodes[node_id].erpc_listen_port << "\n";
+            std::cout << ">> Creating eRPC for thread " << c_ctx.thread_id << "\n";
+            std::cout << ">> Connecting to node " << node_id << " at listen port: "
+                      << meta.cluster.nodes[node_id].erpc_listen_port << "\n";
 #endif
-                auto socket = Misc::socket_connect(false,
-                                                   meta.cluster.nodes[node_id].erpc_listen_port,
-                                                   meta.cluster.nodes[node_id].addr.to_string().c_str());
+            auto socket = Misc::socket_connect(false,
+                                               meta.cluster.nodes[node_id].erpc_listen_port,
+                                               meta.cluster.nodes[node_id].addr.to_string().c_str());
+            if (socket == -1) {
+                return false;
+            }
 #ifdef __HILL_INFO__
-                std::cout << ">> Connected\n";
+            std::cout << ">> Connected\n";
 #endif
-                auto remote_id = 0;
-                read(socket, &remote_id, sizeof(remote_id));
+            auto remote_id = 0;
+            auto got = read(socket, &remote_id, sizeof(remote_id));
+            shutdown(socket, 0);
+            close(socket);
+            if (got != sizeof(remote_id)) {
+                return false;
+            }
+
+            auto &node = meta.cluster.nodes[node_id];
+            auto server_uri = node.addr.to_string() + ":" + std::to_string(node.erpc_port);
+            auto rpc = c_ctx.rpc;
+            // session_handler resets it if the session can not be made
+            c_ctx.erpc_sessions[node_id] = rpc->create_session(server_uri, remote_id);
+            while (c_ctx.erpc_sessions[node_id] >= 0 && !rpc->is_connected(c_ctx.erpc_sessions[node_id])) {
+                rpc->run_event_loop_once();
+            }
+            if (c_ctx.erpc_sessions[node_id] < 0) {
+                c_ctx.erpc_sessions[node_id] = -1;
+                return false;
+            }
+
+            // a session opened again keeps the buffers
+            if (c_ctx.resp_bufs[node_id].buf == nullptr) {
+                c_ctx.req_bufs[node_id] = rpc->alloc_msg_buffer_or_die(Constants::uMAX_MSG_SIZE);
+                // search responses may carry leaf fences
+                c_ctx.resp_bufs[node_id] = rpc->alloc_msg_buffer_or_die(Constants::uMAX_MSG_SIZE);
+            }
+            return true;
+        }
+
+        auto StoreClient::session_handler(int session, erpc::SmEventType event, erpc::SmErrType, void *context)
+            -> void
+        {
+            if (event == erpc::SmEventType::kConnected) {
+                return;
+            }
+
+            auto ctx = reinterpret_cast<ClientContext *>(context);
+            for (auto &s : ctx->erpc_sessions) {
+                if (s == session) {
+                    s = -1;
+                }
+            }
+        }
+
+        auto StoreClient::wait_response(ClientContext &c_ctx, int node_id) -> bool {
+            auto deadline = std::chrono::steady_clock::now() + c_ctx.request_timeout;
+            for (uint64_t polls = 1; !c_ctx.is_done; polls++) {
+                c_ctx.rpc->run_event_loop_once();
+                if (c_ctx.is_done) {
+                    break;
+                }
+                if (c_ctx.erpc_sessions[node_id] == -1 ||
+                    (polls % Constants::uTIMEOUT_CHECK == 0 && std::chrono::steady_clock::now() > deadline)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        auto StoreClient::abandon(ClientContext &c_ctx, erpc::MsgBuffer &req, erpc::MsgBuffer &resp) -> void {
+            c_ctx.abandoned.push_back({c_ctx.waiting, req, resp});
+            req = c_ctx.rpc->alloc_msg_buffer_or_die(req.max_data_size);
+            resp = c_ctx.rpc->alloc_msg_buffer_or_die(resp.max_data_size);
+        }
+
+        auto StoreClient::release_abandoned(ClientContext &c_ctx, uintptr_t tag) -> void {
+            for (auto it = c_ctx.abandoned.begin(); it != c_ctx.abandoned.end(); it++) {
+                if (it->tag == tag) {
+                    c_ctx.rpc->free_msg_buffer(it->req);
+                    c_ctx.rpc->free_msg_buffer(it->resp);
+                    c_ctx.abandoned.erase(it);
+                    return;
+                }
+            }
+        }
+
+        auto StoreClient::suspect(ClientContext &c_ctx, int node_id) -> void {
+            c_ctx.suspected |= 1ULL << node_id;
+            c_ctx.suspected_versions[node_id] = c_ctx.client->get_cluster_meta().cluster.nodes[node_id].version;
+            c_ctx.suspected_at[node_id] = std::chrono::steady_clock::now();
+        }
 
-                auto &node = meta.cluster.nodes[node_id];
-                auto server_uri = node.addr.to_string() + ":" + std::to_string(node.erpc_port);
-                auto rpc = c_ctx.rpc;
-                c_ctx.erpc_sessions[node_id] = rpc->create_session(server_uri, remote_id);
-                while (!rpc->is_connected(c_ctx.erpc_sessions[node_id])) {
-                    rpc->run_event_loop_once();
+        auto StoreClient::is_usable(ClientContext &c_ctx, int node_id) -> bool {
+            const auto &node = c_ctx.client->get_cluster_meta().cluster.nodes[node_id];
+            if (c_ctx.suspected >> node_id & 1) {
+                // restarted or back from a stall as the monitor sees it
+                if (!node.is_active || (node.version <= c_ctx.suspected_versions[node_id] &&
+                                        std::chrono::steady_clock::now() - c_ctx.suspected_at[node_id] <
+                                        Constants::tSUSPECT_RETRY)) {
+                    return false;
                 }
+                c_ctx.suspected &= ~(1ULL << node_id);
+            }
+
+            // a node the monitor takes as failed may not even answer a connect
+            if (c_ctx.erpc_sessions[node_id] != -1) {
+                return true;
+            }
+            if (!node.is_active || !connect_server(c_ctx, node_id)) {
+                suspect(c_ctx, node_id);
+                return false;
+            }
+            return true;
+        }
+
+        auto StoreClient::failover_of(ClientContext &c_ctx, const Workload::WorkloadItem &item, int node_id) -> int {
+            const auto &meta = c_ctx.client->get_cluster_meta();
+            if (auto main = meta.filter_node(item.key); main != 0 && main != node_id && is_usable(c_ctx, main)) {
+                return main;
+            }
+
+            // a backup answers only if it is fresh enough, otherwise it sends the request back to the main server
+            auto table = meta.get_routes();
+            if (item.type != Workload::Enums::Search || table == nullptr) {
+                return node_id;
+            }
+            auto backups = table->backups_of(item.key);
+            for (size_t b = 1; b < Cluster::Constants::uMAX_NODE; b++) {
+                if ((backups >> b & 1) && int(b) != node_id && is_usable(c_ctx, b)) {
+                    return b;
+                }
+            }
+            return node_id;
+        }
+
+        /*
+         * 1. read the leaf image, a torn one means a writer is in there
+         * 2. read the key, the value and the version of the leaf behind one doorbell. Reads of a QP are served
+         *    in order, so an unchanged version means the value was not replaced or freed before it was read
+         * Any surprise, e.g., a key moved away by a split, is left to the server.
+         */
+        auto StoreClient::search_one_sided(ClientContext &c_ctx, const std::string &key) -> bool {
+            auto client = c_ctx.client;
+            auto tid = c_ctx.thread_id;
+            // node 0 is the monitor, the key is not assigned yet
+            auto node_id = client->get_cluster_meta().filter_node(key);
+            if (node_id == 0) {
+                return false;
+            }
+
+            auto &directory = c_ctx.directories[node_id];
+            auto leaf = directory.find(key.c_str(), key.size());
+            if (leaf == nullptr) {
+                return false;
+            }
+
+            auto buf = client->get_buf(tid, node_id).get();
+            client->read_from(tid, node_id, reinterpret_cast<byte_ptr_t>(leaf), sizeof(Indexing::LeafNode));
+            client->poll_completion_once(tid, node_id);
+
+            auto image = reinterpret_cast<Indexing::LeafNode *>(buf);
+            if (!image->is_stable()) {
+                return false;
+            }
+
+            auto i = image->probe(CityHash64(key.c_str(), key.size()));
+            if (i == -1) {
+                return false;
+            }
+
+            auto key_size = sizeof(KVPair::HillStringHeader) + key.size();
+            auto key_buf = buf + sizeof(Indexing::LeafNode);
+            auto version_buf = key_buf + key_size;
+            RDMAUtil::WorkRequest requests[3];
+            size_t num = 0;
+            requests[num++] = RDMAUtil::WorkRequest::make_request(IBV_WR_RDMA_READ, key_buf,
+                                                                  reinterpret_cast<byte_ptr_t>(image->keys[i]), key_size);
+
+            Memory::PolymorphicPointer value = image->values[i];
+            if (value.is_local()) {
+                value = Memory::PolymorphicPointer::make_polymorphic_pointer(
+                    Memory::RemotePointer::make_remote_pointer(node_id, value.local_ptr()));
+            }
+#ifdef __HILL_FETCH_VALUE__
+            auto value_node = value.remote_ptr().get_node();
+            auto value_size = image->value_sizes[i];
+            auto value_buf = version_buf + sizeof(uint64_t);
+            if (value_buf + value_size > buf + Hill::Constants::uLOCAL_BUF_SIZE) {
+                return false;
+            }
+
+            if (value_node == node_id) {
+                requests[num++] = RDMAUtil::WorkRequest::make_request(IBV_WR_RDMA_READ, value_buf,
+                                                                      value.get_as<byte_ptr_t>(), value_size);
+            } else {
+                // the value lives on another node, read it before the version is checked again
+                client->read_from(tid, value_node, value.get_as<byte_ptr_t>(), value_size);
+                client->poll_completion_once(tid, value_node);
+            }
+#endif
+            requests[num++] = RDMAUtil::WorkRequest::make_request(IBV_WR_RDMA_READ, version_buf,
+                                                                  reinterpret_cast<byte_ptr_t>(&leaf->version),
+                                                                  sizeof(uint64_t));
+            if (client->post_batch_to(tid, node_id, requests, num).first != RDMAUtil::Status::Ok) {
+                return false;
+            }
+            client->poll_completion_once(tid, node_id);
 
-                c_ctx.req_bufs[node_id] = rpc->alloc_msg_buffer_or_die(64);
-                c_ctx.resp_bufs[node_id] = rpc->alloc_msg_buffer_or_die(64);
-                shutdown(socket, 0);
+            auto fetched_key = reinterpret_cast<KVPair::HillString *>(key_buf);
+            if (*reinterpret_cast<uint64_t *>(version_buf) != image->version || !fetched_key->is_valid() ||
+                fetched_key->compare(key.c_str(), key.size()) != 0) {
+                return false;
             }
+#ifdef __HILL_FETCH_VALUE__
+            // the leaf is stable, but a value on another node is read before the leaf is checked
+            auto fetched_value = reinterpret_cast<KVPair::HillString *>(
+                value_node == node_id ? value_buf : client->get_buf(tid, value_node).get());
+            if (!fetched_value->is_valid() || fetched_value->stamp() != image->stamps[i]) {
+                return false;
+            }
+#endif
+
+            c_ctx.cache->insert(key, value, image->value_sizes[i], image->stamps[i]);
             return true;
         }
 
+        auto StoreClient::replica_of(ClientContext &c_ctx, const std::string &key, int main) -> int {
+            auto table = c_ctx.client->get_cluster_meta().get_routes();
+            if (table == nullptr) {
+                return main;
+            }
+
+            // only backups this thread has a session with are asked
+            int candidates[Cluster::Constants::uMAX_NODE];
+            size_t num = 0;
+            candidates[num++] = main;
+            auto backups = table->backups_of(key);
+            for (size_t b = 1; b < Cluster::Constants::uMAX_NODE; b++) {
+                if ((backups >> b & 1) && int(b) != main && c_ctx.erpc_sessions[b] != -1 &&
+                    !(c_ctx.suspected >> b & 1)) {
+                    candidates[num++] = b;
+                }
+            }
+            return candidates[c_ctx.num_search % num];
+        }
+
+        auto StoreClient::apply_invalidations(ClientContext &c_ctx, int node_id, const InvalidationBatch &batch) -> void {
+            // a shared cache is cleared for every thread, which only happens to a thread idle for long
+            if (batch.count == Constants::uINVALIDATION_RESET) {
+                c_ctx.cache->clear();
+            } else {
+                for (int i = 0; i < batch.count; i++) {
+                    c_ctx.cache->invalidate(batch.hashes[i]);
+                }
+            }
+            c_ctx.invalidation_seqs[node_id] = batch.seq;
+        }
+
+        auto StoreClient::may_exist(const ClientContext &c_ctx, const std::string &key) -> bool {
+            auto node_id = c_ctx.client->get_cluster_meta().filter_node(key);
+            const auto &filter = c_ctx.key_filters[node_id];
+            if (filter == nullptr || !filter->ready.load(std::memory_order_acquire)) {
+                return true;
+            }
+            return filter->filter.may_contain(ReadCache::CompactCache::hash_of(key));
+        }
+
+        auto StoreClient::refresh_key_filters(ClientContext &c_ctx) -> void {
+            auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+            constexpr auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                Constants::tFILTER_REFRESH).count();
+            constexpr auto header_size = sizeof(Wire::MessageHeader) + sizeof(Enums::RPCStatus);
+
+            for (size_t n = 1; n < Cluster::Constants::uMAX_NODE; n++) {
+                auto &filter = c_ctx.key_filters[n];
+                if (filter == nullptr || c_ctx.erpc_sessions[n] == -1 || (c_ctx.suspected >> n & 1) ||
+                    now - filter->refreshed.load() < interval) {
+                    continue;
+                }
+
+                // another thread is fetching it
+                std::unique_lock<std::mutex> l(filter->fetching, std::try_to_lock);
+                if (!l.owns_lock()) {
+                    continue;
+                }
+                filter->refreshed = now;
+
+                if (c_ctx.filter_resp_bufs[n].buf == nullptr) {
+                    c_ctx.filter_req_bufs[n] = c_ctx.rpc->alloc_msg_buffer_or_die(sizeof(Wire::MessageHeader));
+                    c_ctx.filter_resp_bufs[n] = c_ctx.rpc->alloc_msg_buffer_or_die(
+                        header_size + ReadCache::BloomFilter::size());
+                }
+
+                c_ctx.is_done = false;
+                c_ctx.waiting = tag_of(n, ++c_ctx.request_seq);
+                // the body is empty
+                Wire::Writer writer(c_ctx.filter_req_bufs[n].buf, sizeof(Wire::MessageHeader));
+                writer.begin(Enums::RPCOperations::FetchFilter, c_ctx.waiting);
+                writer.finish();
+                c_ctx.rpc->enqueue_request(c_ctx.erpc_sessions[n], Enums::RPCOperations::FetchFilter,
+                                           &c_ctx.filter_req_bufs[n], &c_ctx.filter_resp_bufs[n],
+                                           filter_continuation, reinterpret_cast<void *>(c_ctx.waiting));
+                // the filter is fetched again next time
+                if (!wait_response(c_ctx, n)) {
+                    abandon(c_ctx, c_ctx.filter_req_bufs[n], c_ctx.filter_resp_bufs[n]);
+                    suspect(c_ctx, n);
+                }
+                c_ctx.waiting = 0;
+            }
+        }
+
+        auto StoreClient::filter_continuation(void *context, void *tag) -> void {
+            auto node_id = node_of_tag(tag);
+            auto ctx = reinterpret_cast<ClientContext *>(context);
+            // given up on, eRPC is done with its buffers now
+            if (reinterpret_cast<uintptr_t>(tag) != ctx->waiting) {
+                release_abandoned(*ctx, reinterpret_cast<uintptr_t>(tag));
+                return;
+            }
+            auto &resp = ctx->filter_resp_bufs[node_id];
+            Wire::Reader reader(resp.buf, resp.data_size);
+            Wire::MessageHeader header;
+            auto status = Enums::RPCStatus::Malformed;
+            if (!reader.open(header) || header.op != Enums::RPCOperations::FetchFilter || header.request_id != ctx->waiting ||
+                !reader.take<Enums::RPCStatus>(status) ||
+                (status == Enums::RPCStatus::Ok && reader.remaining() != ReadCache::BloomFilter::size())) {
+                std::cerr << ">> Error: malformed filter from node " << node_id << "\n";
+                status = Enums::RPCStatus::Malformed;
+            }
+
+            if (status == Enums::RPCStatus::Ok) {
+                auto &filter = ctx->key_filters[node_id];
+                // or-ed in, so keys this client inserted since the server built the filter stay
+                filter->filter.merge(reader.rest());
+                filter->ready.store(true, std::memory_order_release);
+            }
+            ctx->is_done = true;
+        }
+
         auto StoreClient::prepare_request(int node_id, const Workload::WorkloadItem &item,
                                           ClientContext &c_ctx) -> bool
         {
-            auto type = item.type;
-            uint8_t *buf = c_ctx.req_bufs[node_id].buf;
+            auto &req = c_ctx.req_bufs[node_id];
+            Wire::Writer writer(req.buf, req.max_data_size);
             c_ctx.requesting_key = &item.key;
-            switch(type) {
+            // every request asks for the invalidations the client has not heard of
+            auto since = c_ctx.invalidation_seqs[node_id];
+            switch(item.type) {
             case Hill::Workload::Enums::WorkloadType::Update:
-                *reinterpret_cast<Enums::RPCOperations *>(buf) = Enums::RPCOperations::Update;
-                buf += sizeof(Enums::RPCOperations);
-                KVPair::HillString::make_string(buf, item.key.c_str(), item.key.size());
-                buf += reinterpret_cast<hill_key_t *>(buf)->object_size();
-                KVPair::HillString::make_string(buf, item.key_or_value.c_str(), item.key_or_value.size());
+                c_ctx.requesting_op = Enums::RPCOperations::Update;
+                writer.begin(c_ctx.requesting_op, c_ctx.waiting);
+                WriteRequest::encode(writer, since, item.key, item.key_or_value);
                 break;
             case Hill::Workload::Enums::WorkloadType::Insert:
-                *reinterpret_cast<Enums::RPCOperations *>(buf) = Enums::RPCOperations::Insert;
-                buf += sizeof(Enums::RPCOperations);
-                KVPair::HillString::make_string(buf, item.key.c_str(), item.key.size());
-                buf += reinterpret_cast<hill_key_t *>(buf)->object_size();
-                KVPair::HillString::make_string(buf, item.key_or_value.c_str(), item.key_or_value.size());
+                c_ctx.requesting_op = Enums::RPCOperations::Insert;
+                writer.begin(c_ctx.requesting_op, c_ctx.waiting);
+                WriteRequest::encode(writer, since, item.key, item.key_or_value);
                 break;
             case Hill::Workload::Enums::WorkloadType::Search:
-                *reinterpret_cast<Enums::RPCOperations *>(buf) = Enums::RPCOperations::Search;
-                buf += sizeof(Enums::RPCOperations);
-                KVPair::HillString::make_string(buf, item.key.c_str(), item.key.size());
+                c_ctx.requesting_op = Enums::RPCOperations::Search;
+                writer.begin(c_ctx.requesting_op, c_ctx.waiting);
+                SearchRequest::encode(writer, since, item.key);
                 break;
             case Hill::Workload::Enums::WorkloadType::Range:
-                *reinterpret_cast<Enums::RPCOperations *>(buf) = Enums::RPCOperations::Range;
-                buf += sizeof(Enums::RPCOperations);
-                KVPair::HillString::make_string(buf, item.key.c_str(), item.key.size());
-                *reinterpret_cast<size_t *>(buf) = Constants::dRANGE_SIZE;
+                c_ctx.requesting_op = Enums::RPCOperations::Range;
+                writer.begin(c_ctx.requesting_op, c_ctx.waiting);
+                RangeRequest::encode(writer, since, item.key, uint64_t(Constants::dRANGE_SIZE));
                 break;
             default:
                 return false;
             }
+
+            auto size = writer.finish();
+            if (size == 0) {
+                return false;
+            }
+            c_ctx.rpc->resize_msg_buffer(&req, size);
             return true;
         }
 
         auto StoreClient::response_continuation(void *context, void *tag) -> void {
-            auto node_id = *reinterpret_cast<int *>(tag);
+            auto node_id = node_of_tag(tag);
             auto ctx = reinterpret_cast<ClientContext *>(context);
-            auto buf = ctx->resp_bufs[node_id].buf;
-            auto key = *ctx->requesting_key;
+            // given up on, see wait_response, eRPC is done with its buffers now
+            if (reinterpret_cast<uintptr_t>(tag) != ctx->waiting) {
+                release_abandoned(*ctx, reinterpret_cast<uintptr_t>(tag));
+                return;
+            }
+            auto &resp = ctx->resp_bufs[node_id];
+            const auto &key = *ctx->requesting_key;
+            auto op = ctx->requesting_op;
+
+            // a response to another request or cut short is not trusted, not even its invalidations
+            Wire::Reader reader(resp.buf, resp.data_size);
+            Wire::MessageHeader header;
+            InvalidationBatch batch;
+            auto status = Enums::RPCStatus::Malformed;
+            if (!reader.open(header) || header.op != op || header.request_id != ctx->waiting ||
+                !ResponseHead::decode(reader, batch, status)) {
+                status = Enums::RPCStatus::Malformed;
+            }
+            if (status == Enums::RPCStatus::Malformed) {
+                std::cerr << ">> Error: malformed response from node " << node_id << "\n";
+            }
 
-            auto op = *reinterpret_cast<Enums::RPCOperations *>(buf);
-            buf += sizeof(Enums::RPCOperations);
-            auto status = *reinterpret_cast<Enums::RPCStatus *>(buf);
-            buf += sizeof(Enums::RPCStatus);
-            auto poly = *reinterpret_cast<Memory::PolymorphicPointer *>(buf);
-            buf += sizeof(Memory::PolymorphicPointer);
-            auto size = *reinterpret_cast<size_t *>(buf);
+            // sent elsewhere, the request is counted once it is served
+            if (status == Enums::RPCStatus::WrongNode) {
+                if (!RedirectBody::decode(reader, ctx->redirect)) {
+                    ctx->redirect = -1;
+                    status = Enums::RPCStatus::Failed;
+                } else {
+                    apply_invalidations(*ctx, node_id, batch);
+                    ctx->is_done = true;
+                    return;
+                }
+            }
 
 #ifdef __HILL_SAMPLE__
             Sampling::Sampler<uint64_t> *sampler = nullptr;
@@ -1065,18 +2622,32 @@ namespace Hill {
 #endif
                 switch(op) {
                 case Enums::RPCOperations::Insert: {
+                    // no size or stamp comes back, the key is cached by its first search
                     if (status == Enums::RPCStatus::Ok) {
                         ++ctx->suc_insert;
-                        ctx->cache.insert(key, poly, size);
                     }
                     ++ctx->num_insert;
                     break;
                 }
 
                 case Enums::RPCOperations::Search: {
+                    Memory::PolymorphicPointer poly = nullptr;
+                    uint64_t size = 0, stamp = 0;
+                    Indexing::LeafNode *leaf = nullptr;
+                    if (status == Enums::RPCStatus::Ok && !SearchResult::decode(reader, poly, size, stamp, leaf)) {
+                        status = Enums::RPCStatus::Failed;
+                    }
                     if (status == Enums::RPCStatus::Ok) {
                         ++ctx->suc_search;
-                        ctx->cache.insert(key, poly, size);
+                        ctx->cache->insert(key, poly, size, stamp);
+
+                        uint32_t partitions;
+                        KVPair::HillString *low, *high;
+                        if (ctx->one_sided && leaf != nullptr && (header.flags & Wire::Enums::Flags::Fence) &&
+                            FenceResult::decode(reader, partitions, low, high)) {
+                            ctx->directories[node_id].learn(partitions, key.c_str(), key.size(), low->to_string(),
+                                                            high->to_string(), leaf);
+                        }
                     }
 #ifdef __HILL_FETCH_VALUE__
                     // value is embeded
@@ -1086,9 +2657,16 @@ namespace Hill {
                         break;
                     }
 
-                    node_id = poly.remote_ptr().get_node();
-                    ctx->client->read_from(ctx->thread_id, node_id, poly.get_as<byte_ptr_t>(), size);
-                    ctx->client->poll_completion_once(ctx->thread_id, node_id);
+                    {
+                        auto value_node = poly.remote_ptr().get_node();
+                        ctx->client->read_from(ctx->thread_id, value_node, poly.get_as<byte_ptr_t>(), size);
+                        ctx->client->poll_completion_once(ctx->thread_id, value_node);
+                        // replaced right after the search, the next search goes to the server
+                        auto value = reinterpret_cast<KVPair::HillString *>(ctx->client->get_buf(ctx->thread_id, value_node).get());
+                        if (!value->is_valid() || value->stamp() != stamp) {
+                            ctx->cache->expire(key);
+                        }
+                    }
                     ++ctx->RTTs[2];
 #endif
                     ++ctx->num_search;
@@ -1098,7 +2676,7 @@ namespace Hill {
                 case Enums::RPCOperations::Update: {
                     if (status == Enums::RPCStatus::Ok) {
                         ++ctx->suc_update;
-                        ctx->cache.expire(key);
+                        ctx->cache->expire(key);
                     }
                     ++ctx->num_update;
                     break;
@@ -1115,6 +2693,10 @@ namespace Hill {
                 default:
                     break;
                 }
+                // after the key is cached, so an invalidation racing with this request drops it
+                if (status != Enums::RPCStatus::Malformed) {
+                    apply_invalidations(*ctx, node_id, batch);
+                }
                 ctx->is_done = true;
 #ifdef __HILL_SAMPLE__
             }
@@ -12,8 +12,12 @@
 #include "city/city.hpp"
 #include "stats/stats.hpp"
 #include "sampler/sampler.hpp"
+#include "store/range_merger/range_merger.hpp"
+#include "store/wire_format/wire_format.hpp"
 
 #include "boost/lockfree/queue.hpp"
+
+#include <deque>
 /*
  * The complete implementation of Hill is here.
  *
@@ -45,6 +49,64 @@ namespace Hill {
             using tBOOST_QUEUE_CAP = boost::lockfree::capacity<iMSG_QUEUE_CAP>;
 
             static constexpr double dRANGE_SIZE = 86;
+
+            /*
+             * An idle background thread migrates spilled values home at most every tREBALANCE_INTERVAL, moving
+             * up to uREBALANCE_BATCH values per round. Spilling stops once consumption drops below
+             * dREBALANCE_WATERMARK of the capacity limit and resumes once the limit is hit again.
+             */
+            static constexpr double dREBALANCE_WATERMARK = 0.9;
+            static constexpr size_t uREBALANCE_BATCH = 16;
+            static constexpr auto tREBALANCE_INTERVAL = std::chrono::milliseconds(1);
+
+            /*
+             * A server remembers the last uINVALIDATION_LOG keys whose values are replaced, and a response
+             * tells a client about at most iMAX_INVALIDATIONS of them, see InvalidationLog.
+             */
+            static constexpr size_t uINVALIDATION_LOG = 4096;
+            static constexpr int iMAX_INVALIDATIONS = 8;
+            // the client is too far behind the log and drops its whole cache
+            static constexpr uint8_t uINVALIDATION_RESET = 0xff;
+
+            /*
+             * With a negative cache, a client thread looks at its key filters every uFILTER_CHECK requests and
+             * fetches those older than tFILTER_REFRESH again. A key inserted by another client in between may
+             * be reported missing until then.
+             */
+            static constexpr size_t uFILTER_CHECK = 4096;
+            static constexpr auto tFILTER_REFRESH = std::chrono::milliseconds(100);
+
+            /*
+             * A range is moved to another node in requests of at most uMIGRATION_MSG_SIZE bytes. Writes of the
+             * keys being moved are turned away meanwhile, their clients come back after tREROUTE_BACKOFF and
+             * give up after iMAX_REROUTES tries.
+             */
+            static constexpr size_t uMIGRATION_MSG_SIZE = 64 * 1024;
+            static constexpr auto tREROUTE_BACKOFF = std::chrono::milliseconds(1);
+            static constexpr int iMAX_REROUTES = 60000;
+            // partition threads publish their poll counters this often, see StoreServer::busy_polls
+            static constexpr uint64_t uPOLL_REPORT = 1024;
+
+            /*
+             * A main server ships writes of its ranges to their backups every tREPLICATION_INTERVAL, in requests
+             * of at most uREPLICATION_MSG_SIZE bytes, and an empty one if nothing is written so that backups
+             * know it is alive. A backup answers reads of a range only if it has applied all its main server
+             * shipped until tSTALENESS_BOUND ago. A backup missing writes, after a restart of either side or a
+             * request given up on after tREQUEST_TIMEOUT, is seeded with a copy of the ranges it backs before it
+             * gets writes again, see StoreServer::seed_backup.
+             */
+            static constexpr size_t uREPLICATION_MSG_SIZE = 64 * 1024;
+            static constexpr auto tREPLICATION_INTERVAL = std::chrono::milliseconds(1);
+            static constexpr auto tSTALENESS_BOUND = std::chrono::milliseconds(100);
+
+            /*
+             * A client gives up waiting for a response after tREQUEST_TIMEOUT by default, reading the clock every
+             * uTIMEOUT_CHECK polls. The node is then suspected and not asked again until the monitor hears of it
+             * anew, or for tSUSPECT_RETRY if the monitor keeps it active.
+             */
+            static constexpr auto tREQUEST_TIMEOUT = std::chrono::milliseconds(50);
+            static constexpr uint64_t uTIMEOUT_CHECK = 64;
+            static constexpr auto tSUSPECT_RETRY = std::chrono::seconds(1);
         }
 
         namespace Enums {
@@ -58,6 +120,18 @@ namespace Hill {
 
                 // for peer server
                 CallForMemory,
+                ReturnMemory,
+
+                // for client, not a workload type
+                FetchFilter,
+
+                // for peer server
+                MigrateRange,
+                Replicate,
+                Seed,
+
+                // for background threads of this node, never sent
+                RunTask,
 
                 // guardian
                 Unknown,
@@ -67,9 +141,40 @@ namespace Hill {
                 Ok = 0,
                 NoMemory,
                 Failed,
+                // the key is served by another node, or is being moved away from this one
+                WrongNode,
+                // the request is cut short or of another wire version, nothing else is in the response
+                Malformed,
             };
         }
 
+        // run by a background thread on its partition, with the tid it registered
+        using PartitionTask = std::function<void(int partition, int tid, Indexing::OLFIT &olfit)>;
+
+        /*
+         * Writes of a partition to keys with backups, in the order the partition applies them. Records are
+         * uint64_t backups | RPCOperations op | hill_key_t key | hill_value_t value, backups is a bitmap of
+         * the nodes the record goes to, see Cluster::RouteTable::backups.
+         */
+        struct ReplicationBuffer {
+            std::mutex lock;
+            std::vector<byte_t> records;
+        };
+
+        // writes shipped by a main server, waiting to be applied on this node
+        struct ReplicaBatch {
+            int node;
+            // batches of a main server are numbered from 1 in the order they are shipped
+            uint64_t seq;
+            // a piece of a copy of the ranges of the main server, the copy holds every batch up to seq once last
+            bool seeding;
+            bool last;
+            std::chrono::steady_clock::time_point received;
+            uint64_t count;
+            // op | hill_key_t key | hill_value_t value
+            std::vector<byte_t> records;
+        };
+
         struct IncomeMessage {
             struct {
                 const char *key;
@@ -86,6 +191,9 @@ namespace Hill {
 
                 KVPair::HillString *hkey;
                 KVPair::HillString *hvalue;
+
+                // for RunTask only
+                const PartitionTask *task;
             } input;
 
             // output
@@ -94,6 +202,8 @@ namespace Hill {
                 Memory::PolymorphicPointer value;
                 size_t value_size;
                 std::vector<Indexing::ScanHolder> values;
+                // leaf of a searched key, shipped to clients for one-sided lookups
+                Indexing::LeafFence fence;
             } output;
 
             IncomeMessage() {
@@ -111,14 +221,114 @@ namespace Hill {
                 input.value = nullptr;
                 input.value_size = 0;
                 input.op = Enums::RPCOperations::Unknown;
+                input.task = nullptr;
 
                 output.status = Indexing::Enums::OpStatus::Unkown;
                 output.value = nullptr;
                 output.value_size = 0;
+                output.fence = {nullptr, nullptr, nullptr, 0};
+            }
+        };
+
+        // the result of a write, told to its client once the WAL batch up to seq is checkpointed
+        struct HeldResponse {
+            size_t seq;
+            IncomeMessage *msg;
+            Indexing::Enums::OpStatus status;
+            Memory::PolymorphicPointer value;
+        };
+
+        // piggybacked on responses to clients
+        struct InvalidationBatch {
+            // the client has heard of every invalidation up to seq
+            uint64_t seq;
+            // number of hashes, or Constants::uINVALIDATION_RESET
+            uint8_t count;
+            uint64_t hashes[Constants::iMAX_INVALIDATIONS];
+        } __attribute__((packed));
+
+        /*
+         * Bodies of the messages between clients and servers, after a Wire::MessageHeader, see StoreServer.
+         * A response starts with ResponseHead and goes on by its status.
+         */
+        using SearchRequest = Wire::Layout<uint64_t, Wire::String>;
+        using WriteRequest = Wire::Layout<uint64_t, Wire::String, Wire::String>;
+        using RangeRequest = Wire::Layout<uint64_t, Wire::String, uint64_t>;
+        using ResponseHead = Wire::Layout<InvalidationBatch, Enums::RPCStatus>;
+        using RedirectBody = Wire::Layout<int>;
+        using WriteResult = Wire::Layout<Memory::PolymorphicPointer>;
+        using SearchResult = Wire::Layout<Memory::PolymorphicPointer, uint64_t, uint64_t, Indexing::LeafNode *>;
+        using FenceResult = Wire::Layout<uint32_t, Wire::String, Wire::String>;
+        using RangeResult = Wire::Layout<uint64_t>;
+
+        // a client request as it is on the wire, strings point into the request buffer
+        struct ClientRequest {
+            Wire::MessageHeader header;
+            uint64_t since;
+            KVPair::HillString *key;
+            KVPair::HillString *value;
+            // number of keys a Range asks for
+            uint64_t num;
+        };
+
+        /*
+         * Hashes of keys whose values are replaced on this server, numbered from 1 in the order of the
+         * replacements, the hash is ReadCache::CompactCache::hash_of. Each request carries the last number
+         * its client has heard of and the response carries what happened since, so a client drops a stale
+         * cache entry by its next request to the server. Slots are published like a seqlock, a reader never
+         * blocks and stops at a slot still being written.
+         */
+        class InvalidationLog {
+        public:
+            InvalidationLog() : head(0) {
+                for (auto &s : slots) {
+                    s.seq = 0;
+                    s.hash = 0;
+                }
             }
+            ~InvalidationLog() = default;
+            InvalidationLog(const InvalidationLog &) = delete;
+            InvalidationLog(InvalidationLog &&) = delete;
+            auto operator=(const InvalidationLog &) -> InvalidationLog & = delete;
+            auto operator=(InvalidationLog &&) -> InvalidationLog & = delete;
+
+            auto append(uint64_t hash) noexcept -> void;
+            auto collect(uint64_t since, InvalidationBatch &batch) const noexcept -> void;
+
+        private:
+            struct Slot {
+                std::atomic_uint64_t seq;
+                std::atomic_uint64_t hash;
+            };
+
+            std::atomic_uint64_t head;
+            Slot slots[Constants::uINVALIDATION_LOG];
+        };
+
+        /*
+         * What a client knows of the keys of a server, shared by all threads of the client. A server keeps one
+         * filter of all ranges it leads, so one filter serves every range of its main server.
+         */
+        struct KeyFilter {
+            ReadCache::BloomFilter filter;
+            // false until the first fetch succeeds, an unready filter rules nothing out
+            std::atomic_bool ready;
+            // steady clock of the last fetch
+            std::atomic<std::chrono::steady_clock::rep> refreshed;
+            // at most one thread fetches the filter at a time
+            std::mutex fetching;
+
+            KeyFilter() : ready(false), refreshed(0) {}
         };
 
         class StoreServer;
+        // buffers of a request given up on are still eRPC's till the continuation of its tag runs
+        struct AbandonedRequest {
+            uintptr_t tag;
+            erpc::MsgBuffer req;
+            erpc::MsgBuffer resp;
+        };
+
         struct ServerContext {
             StoreServer *self;
 
@@ -137,10 +347,25 @@ namespace Hill {
             erpc::MsgBuffer resp_bufs[Cluster::Constants::uMAX_NODE];
 
             bool is_done;
+            // of the replication thread, tag of the request waited for, see StoreServer::send_replication
+            uintptr_t waiting;
+            uint64_t request_seq;
+            std::vector<AbandonedRequest> abandoned;
+
+            // odd while a write of this thread is in flight, see StoreServer::migrate_range
+            std::atomic_uint64_t write_seq;
 
             HandleSampler *handle_sampler;
 
-            ServerContext() : thread_id(0), node_id(0), queues(nullptr) {
+            /*
+             * Per-thread scratch objects for range requests. They are reused across requests so that their
+             * vectors keep their capacity and a scan does not touch the heap in steady state.
+             */
+            IncomeMessage scan_msgs[Memory::Constants::iTHREAD_LIST_NUM];
+            Merger merger;
+            std::vector<Indexing::ScanHolder> merged;
+
+            ServerContext() : thread_id(0), node_id(0), queues(nullptr), waiting(0), request_seq(0), write_seq(0) {
                 for (auto &s : erpc_sessions) {
                     s = -1;
                 }
@@ -160,7 +385,43 @@ namespace Hill {
             bool is_done;
             Stats::SyntheticStats stats;
             const std::string *requesting_key;
-            ReadCache::Cache cache;
+            // op of the request waited for, a malformed response counts as a failed one of it
+            Enums::RPCOperations requesting_op;
+            // the cache of the process if it is shared, otherwise own_cache
+            ReadCache::CompactCache *cache;
+            // private to the thread, a single shard is enough
+            std::unique_ptr<ReadCache::CompactCache> own_cache;
+            // leaves of each server, searched with one-sided reads if one_sided is set
+            bool one_sided;
+            Indexing::LeafDirectory directories[Cluster::Constants::uMAX_NODE];
+            // last invalidation heard of from each server, see InvalidationLog
+            uint64_t invalidation_seqs[Cluster::Constants::uMAX_NODE];
+            // filters of servers if the client caches negative lookups, nullptr otherwise
+            std::unique_ptr<KeyFilter> *key_filters;
+            erpc::MsgBuffer filter_req_bufs[Cluster::Constants::uMAX_NODE];
+            erpc::MsgBuffer filter_resp_bufs[Cluster::Constants::uMAX_NODE];
+            uint64_t suc_one_sided;
+            // searches answered by a key filter
+            uint64_t suc_negative;
+            // node a WrongNode response sends the request to, -1 if none
+            int redirect;
+            uint64_t num_reroute;
+            // searches are spread over the main server and backups of a key if set
+            bool backup_reads;
+            // searches answered by a backup
+            uint64_t suc_backup;
+            // tag of the request waited for, responses with other tags are given up, see StoreClient::tag_of
+            uintptr_t waiting;
+            uint64_t request_seq;
+            // the next request to the node takes fresh buffers, see StoreClient::abandon
+            std::vector<AbandonedRequest> abandoned;
+            std::chrono::steady_clock::duration request_timeout;
+            // bit n is set if node n timed out, with its version in the meta and the time then
+            uint64_t suspected;
+            uint64_t suspected_versions[Cluster::Constants::uMAX_NODE];
+            std::chrono::steady_clock::time_point suspected_at[Cluster::Constants::uMAX_NODE];
+            // requests sent elsewhere because a node timed out or lost its session
+            uint64_t num_failover;
             uint64_t num_insert;
             uint64_t suc_insert;
             uint64_t num_search;
@@ -175,7 +436,7 @@ namespace Hill {
 
             ClientSampler *client_sampler;
 
-            ClientContext() : thread_id(0), is_done(false), cache(ReadCache::Constants::uCACHE_SIZE){
+            ClientContext() : thread_id(0), is_done(false), cache(nullptr), key_filters(nullptr) {
                 thread_id = 0;
                 is_done = false;
                 for (auto &u : server_uri) {
@@ -192,54 +453,117 @@ namespace Hill {
                     r = 0;
                 }
 
+                for (auto &s : invalidation_seqs) {
+                    s = 0;
+                }
+
+                for (auto &b : filter_resp_bufs) {
+                    b.buf = nullptr;
+                }
+
+                for (auto &b : resp_bufs) {
+                    b.buf = nullptr;
+                }
+
                 num_insert = suc_insert = num_search = suc_search = num_update = suc_update = num_range = suc_range = 0;
+                one_sided = false;
+                suc_one_sided = 0;
+                suc_negative = 0;
+                redirect = -1;
+                num_reroute = 0;
+                backup_reads = false;
+                suc_backup = 0;
+                waiting = 0;
+                request_seq = 0;
+                request_timeout = Constants::tREQUEST_TIMEOUT;
+                suspected = 0;
+                num_failover = 0;
             }
         };
 
         /*
          * StoreServer handles all erpc calls
-         * an income message is in one of following formats
-         * 1. Insert:
-         *    |       first byte      | following bytes
-         *    | RPCOperations::Insert | hill_key_t key| hill_value_t value |
+         * Messages of clients are a Wire::MessageHeader followed by a body, a request is refused with
+         * RPCStatus::Malformed if its header does not match its length or a field runs past it. Bodies of
+         * income messages are as follows, since is the last invalidation the client has heard of from this
+         * server, see InvalidationLog
+         * 1. Insert, Update: WriteRequest
+         *    | uint64_t since | hill_key_t key | hill_value_t value |
+         *
+         * 2. Search: SearchRequest
+         *    | uint64_t since | hill_key_t key |
+         *
+         * 3. Range: RangeRequest
+         *    | uint64_t since | hill_key_t start | uint64_t num |
          *
-         * 2. Search:
-         *    |       first byte      | following bytes
-         *    | RPCOperations::Search | hill_key_t key |
+         * 4. FetchFilter
+         *    empty
          *
-         * 3. Update:
-         *    |       first byte      | following bytes
-         *    | RPCOperations::Update | hill_key_t key | hill_value_t new_value |
+         * and bodies of responses, after ResponseHead | InvalidationBatch batch | RPCStatus |, batch carries
+         * the invalidations after since
+         * 1. Insert, Update: WriteResult
+         *    | PolymorphicPointer |
          *
-         * 4. Scan
-         *    |      first byte     | following bytes
-         *    | RPCOperations::Scan | hill_key_t start | hill_key_t end |
+         * 2. Search: SearchResult if the status is Ok
+         *    | PolymorphicPointer | uint64_t size | uint64_t stamp | LeafNode *leaf |
+         *    followed by FenceResult if Wire::Enums::Fence is set in the header
+         *    | uint32_t partitions | hill_key_t low | hill_key_t high |, empty bounds are unbounded
          *
+         * 3. Range: RangeResult
+         *    | uint64_t num |
+         *
+         * 4. FetchFilter, without ResponseHead
+         *    | RPCStatus | BloomFilter filter |
+         *    filter is only present if the status is Ok, see ReadCache::BloomFilter::serialize
+         *
+         * A client request of a key this node does not serve is answered with RPCStatus::WrongNode followed
+         * by RedirectBody, int node, the node to ask instead. It is this node if the key is being moved.
+         *
+         * Messages between servers are not framed, an income message is in one of following formats
          * 5. CallForMemory
          *    |           first byte         |
          *    | RPCOperations::CallForMemory |
          *
-         * responses are in one of following formats
-         * 1. Insert:
-         *    |       first byte      |  following bytes
-         *    | RPCOperations::Insert |    RPCStatus   | PolymorphicPointer
+         * 6. ReturnMemory
+         *    |           first byte        | following bytes
+         *    | RPCOperations::ReturnMemory | RemotePointer region
          *
-         * 2. Search:
-         *    |       first byte      |  following bytes
-         *    | RPCOperations::Search |    RPCStatus   | PolymorphicPointer | size_t size
+         * 7. MigrateRange
+         *    |           first byte        | following bytes
+         *    | RPCOperations::MigrateRange | bool last | uint64_t count | hill_key_t high | hill_key_t at |
+         *    | count * (hill_key_t key | hill_value_t value) |
+         *    keys are in [at, high), with last the receiver takes the range over, see migrate_range
          *
-         * 3. Update:
-         *    |       first byte      |  following bytes
-         *    | RPCOperations::Update |    RPCStatus   | PolymorphicPointer
+         * 8. Replicate
+         *    |          first byte        | following bytes
+         *    | RPCOperations::Replicate   | int node | uint64_t seq | uint64_t count |
+         *    | count * (RPCOperations op | hill_key_t key | hill_value_t value) |
+         *    node is the main server, seq numbers its requests to this node, op is Insert or Update, see ship_writes
          *
-         * 4. Scan
-         *    |      first byte     |
-         *    | RPCOperations::Scan |
+         * 9. Seed
+         *    |        first byte      | following bytes
+         *    | RPCOperations::Seed    | int node | uint64_t seq | uint64_t count | bool last |
+         *    | count * (RPCOperations op | hill_key_t key | hill_value_t value) |
+         *    a piece of a copy of the ranges node leads and this node backs, see seed_backup
          *
+         * and their responses are in one of following formats, a server refuses a message cut short with
+         * RPCStatus::Failed
          * 5. CallForMemory
-         *    |           first byte         |
-         *    | RPCOperations::CallForMemory |
+         *    |           first byte         |  following bytes
+         *    | RPCOperations::CallForMemory |    RPCStatus   | RemotePointer
+         *
+         * 6. ReturnMemory
+         *    |           first byte        |  following bytes
+         *    | RPCOperations::ReturnMemory |    RPCStatus   |
          *
+         * 7. MigrateRange
+         *    |           first byte        |  following bytes
+         *    | RPCOperations::MigrateRange |    RPCStatus   |
+         *
+         * 8. Replicate, 9. Seed
+         *    |          first byte       |  following bytes
+         *    | RPCOperations::Replicate  |    RPCStatus   | uint64_t applied | bool diverged |
+         *    applied is the last batch of the main server applied here and diverged is set if one is missed
          */
         class StoreServer {
         public:
@@ -264,6 +588,11 @@ namespace Hill {
                 ret->nexus->register_req_func(Enums::RPCOperations::Update, update_handler);
                 ret->nexus->register_req_func(Enums::RPCOperations::Range, range_handler);
                 ret->nexus->register_req_func(Enums::RPCOperations::CallForMemory, memory_handler);
+                ret->nexus->register_req_func(Enums::RPCOperations::ReturnMemory, return_memory_handler);
+                ret->nexus->register_req_func(Enums::RPCOperations::FetchFilter, filter_handler);
+                ret->nexus->register_req_func(Enums::RPCOperations::MigrateRange, migrate_handler);
+                ret->nexus->register_req_func(Enums::RPCOperations::Replicate, replicate_handler);
+                ret->nexus->register_req_func(Enums::RPCOperations::Seed, replicate_handler);
                 ret->erpc_id_cursor = 0;
 
                 for (auto &i : ret->contexts) {
@@ -271,6 +600,18 @@ namespace Hill {
                 }
 
                 ret->is_launched = false;
+                ret->seeded_partitions = 0;
+                ret->fencing = false;
+                for (int i = 0; i < Memory::Constants::iTHREAD_LIST_NUM; i++) {
+                    ret->busy_polls[i] = ret->all_polls[i] = 0;
+                }
+                for (size_t i = 0; i < Cluster::Constants::uMAX_NODE; i++) {
+                    ret->applied_at[i] = 0;
+                    ret->shipped_seqs[i] = ret->seed_seqs[i] = 0;
+                    ret->applied_seqs[i] = 0;
+                    ret->diverged[i] = false;
+                    ret->seeded[i] = false;
+                }
                 return ret;
             }
 
@@ -289,6 +630,12 @@ namespace Hill {
             // launch one thread that periodically checks memory resource amount and
             // apply for remote memory if it finds any thread is short of memory
             auto launch_one_memory_monitor_thread() -> bool;
+
+            /*
+             * launch one thread that ships writes of ranges this node leads to their backups and applies
+             * writes shipped to this node, see Constants::tREPLICATION_INTERVAL
+             */
+            auto launch_one_replication_thread() -> bool;
             /*
              * If a thread is successfully registered, a background thread would be launched handling
              * income eRPC requests.
@@ -297,6 +644,9 @@ namespace Hill {
             auto use_agent() noexcept -> void;
             static auto check_available_mem(erpc::Rpc<erpc::CTransport> *rm_rpc, ServerContext &s_ctx, int tid)
                 -> Memory::RemotePointer;
+            // hand an emptied region back to the peer lending it
+            static auto return_remote_mem(erpc::Rpc<erpc::CTransport> *rm_rpc, ServerContext &s_ctx, int tid,
+                                          const Memory::RemotePointer &region) -> bool;
             static auto establish_memory_erpc(erpc::Rpc<erpc::CTransport> *rm_rpc, ServerContext &s_ctx, int tid, int node_id) -> bool;
             static auto response_continuation(void *context, void *tag) -> void;
         private:
@@ -320,14 +670,117 @@ namespace Hill {
             std::vector<int> erpc_ids;
             std::atomic_uint erpc_id_cursor;
 
+            InvalidationLog invalidations;
+
+            // every key this node has held, served once all partitions have put their keys in
+            ReadCache::BloomFilter known_keys;
+            std::atomic_int seeded_partitions;
+
+            // writes of keys in [fence_low, fence_high) are turned away while they are moved
+            std::atomic_bool fencing;
+            std::string fence_low;
+            std::string fence_high;
+
+            // polls of each partition thread finding a request and all of them, how busy this node is
+            std::atomic_uint64_t busy_polls[Memory::Constants::iTHREAD_LIST_NUM];
+            std::atomic_uint64_t all_polls[Memory::Constants::iTHREAD_LIST_NUM];
+
+            // writes of each partition waiting to be shipped to backups
+            ReplicationBuffer shipping[Memory::Constants::iTHREAD_LIST_NUM];
+            // writes shipped to this node waiting to be applied
+            std::mutex replica_lock;
+            std::deque<ReplicaBatch> replicas;
+            // steady clock when the last batch applied from each main server was received
+            std::atomic<std::chrono::steady_clock::rep> applied_at[Cluster::Constants::uMAX_NODE];
+            // last seq shipped to each node, of the replication thread only
+            uint64_t shipped_seqs[Cluster::Constants::uMAX_NODE];
+            // last seq applied from each node and whether one is missed, written by the replication thread
+            std::atomic_uint64_t applied_seqs[Cluster::Constants::uMAX_NODE];
+            std::atomic_bool diverged[Cluster::Constants::uMAX_NODE];
+            // of the replication thread only, whether each backup has a copy and the seq the copy is as of
+            bool seeded[Cluster::Constants::uMAX_NODE];
+            uint64_t seed_seqs[Cluster::Constants::uMAX_NODE];
+
+            // one throttled round of migrating a partition's remote values home, see Constants
+            auto rebalance(int tid, Indexing::OLFIT &olfit) -> void;
+
+            // run task on the background thread of partition and wait for it
+            auto run_on_partition(int partition, const PartitionTask &task) -> void;
+
+            /*
+             * -1 if key is served here, otherwise the node to ask, which is this one if key is being moved. A
+             * backup of key serves reads while it is fresh, see Constants::tSTALENESS_BOUND
+             */
+            auto redirect_of(const hill_key_t *key, bool is_write) const noexcept -> int;
+
+            // called by partition threads once a write is applied, keeps it for backups if key has any
+            auto keep_for_backups(int partition, const IncomeMessage &msg) -> void;
+
+            /*
+             * One round of replication of the replication thread:
+             * 1. records kept by partitions are sent to each of their backups in order, a backup of any range
+             *    this node leads gets a request even if there is nothing to send
+             * 2. batches received from main servers are applied, each partition applies its share in order
+             */
+            auto ship_writes(erpc::Rpc<erpc::CTransport> *rm_rpc, ServerContext &s_ctx, erpc::MsgBuffer &req,
+                             erpc::MsgBuffer &resp) -> void;
+            auto apply_replicas() -> void;
+
+            /*
+             * Stream every key of the ranges this node leads and backup backs to it in Seed requests, as of the
+             * last batch shipped to it. Writes kept for backups meanwhile are shipped after the copy, so the
+             * backup ends up with the latest value of each key. False if the backup does not take all of it.
+             */
+            auto seed_backup(erpc::Rpc<erpc::CTransport> *rm_rpc, ServerContext &s_ctx, erpc::MsgBuffer &req,
+                             erpc::MsgBuffer &resp, int backup) -> bool;
+
+            /*
+             * Send the size bytes of req to backup and wait for the answer for at most Constants::tREQUEST_TIMEOUT.
+             * On timeout req and resp are left to eRPC and replaced. False if the backup does not take the request,
+             * the backup is then seeded again, as it is if it reports a missed batch.
+             */
+            auto send_replication(erpc::Rpc<erpc::CTransport> *rm_rpc, ServerContext &s_ctx, erpc::MsgBuffer &req,
+                                  erpc::MsgBuffer &resp, int backup, size_t size) -> bool;
+            // frees the buffers of a request given up on, see send_replication
+            static auto replication_continuation(void *context, void *tag) -> void;
+
+            /*
+             * Carry out a Cluster::MigrationOrder given to this node:
+             * 1. pick the range this node leads with the most keys, judged by one sample per leaf, and split it
+             *    at its median sample
+             * 2. turn away writes of the upper half and wait for those already admitted
+             * 3. stream the upper half partition by partition to the target, which takes the range over with
+             *    the last request
+             * 4. split the range in the local ClusterMeta, lift the fence and remove the moved keys
+             * False if the range stays here.
+             */
+            auto migrate_range(erpc::Rpc<erpc::CTransport> *rm_rpc, ServerContext &s_ctx,
+                               const Cluster::MigrationOrder &order) -> bool;
+
             static auto insert_handler(erpc::ReqHandle *req_handle, void *context) -> void;
             static auto update_handler(erpc::ReqHandle *req_handle, void *context) -> void;
             static auto search_handler(erpc::ReqHandle *req_handle, void *context) -> void;
             static auto range_handler(erpc::ReqHandle *req_handle, void *context) -> void;
             static auto memory_handler(erpc::ReqHandle *req_handle, void *context) -> void;
-
-            static auto parse_request_message(const erpc::ReqHandle *req_handle, const void *s_ctx) ->
-                std::tuple<Enums::RPCOperations, KVPair::HillString *, KVPair::HillString *>;
+            static auto return_memory_handler(erpc::ReqHandle *req_handle, void *context) -> void;
+            static auto filter_handler(erpc::ReqHandle *req_handle, void *context) -> void;
+            static auto migrate_handler(erpc::ReqHandle *req_handle, void *context) -> void;
+            static auto replicate_handler(erpc::ReqHandle *req_handle, void *context) -> void;
+            static auto reply_wrong_node(erpc::ReqHandle *req_handle, ServerContext *ctx, const ClientRequest &request,
+                                         int node) -> void;
+            // answer a request parse_request_message refuses, with no invalidations
+            static auto reply_malformed(erpc::ReqHandle *req_handle, ServerContext *ctx, const ClientRequest &request,
+                                        Enums::RPCOperations op) -> void;
+            // start a response to request in the pre-allocated buffer, the caller appends the rest of the body
+            static auto begin_response(erpc::ReqHandle *req_handle, ServerContext *ctx, const ClientRequest &request,
+                                       Enums::RPCStatus status, uint8_t flags = Wire::Enums::Flags::None) -> Wire::Writer;
+            // send what writer holds, a response not fitting turns into a Failed one
+            static auto send_response(erpc::ReqHandle *req_handle, ServerContext *ctx, const ClientRequest &request,
+                                      Wire::Writer &writer) -> void;
+
+            // false if the request is not one of op with all its fields in the buffer
+            static auto parse_request_message(const erpc::ReqHandle *req_handle, Enums::RPCOperations op,
+                                              ClientRequest &request) noexcept -> bool;
         };
 
         class StoreClient {
@@ -345,9 +798,59 @@ namespace Hill {
                 ret->nexus = new erpc::Nexus(ret->client->get_rpc_uri(), 0, 0);
 
                 ret->is_launched = false;
+                ret->one_sided = false;
+                ret->negative_cache = false;
+                ret->backup_reads = false;
+                ret->request_timeout = Constants::tREQUEST_TIMEOUT;
                 return ret;
             }
 
+            /*
+             * Threads registered from now on share one cache of capacity entries instead of keeping a private
+             * one each, so a hot key is cached once per process. The cache outlives the threads.
+             */
+            inline auto enable_shared_cache(size_t capacity = ReadCache::Constants::uCACHE_SIZE) -> void {
+                shared_cache = std::make_unique<ReadCache::CompactCache>(capacity);
+            }
+
+            inline auto get_shared_cache() const noexcept -> const ReadCache::CompactCache * {
+                return shared_cache.get();
+            }
+
+            /*
+             * Threads registered from now on search servers' leaves with one-sided RDMA reads when they know
+             * the leaf of a key, and fall back to eRPC otherwise. Only servers keeping their leaves on PM,
+             * i.e., built with __HILL_PINDEX__, make leaves known.
+             */
+            inline auto enable_one_sided_search() noexcept -> void {
+                one_sided = true;
+            }
+
+            /*
+             * Threads registered from now on fetch a filter of the keys of each server and answer a search
+             * of a key the filter rules out without asking the server, see Constants::tFILTER_REFRESH.
+             */
+            inline auto enable_negative_cache() noexcept -> void {
+                negative_cache = true;
+            }
+
+            /*
+             * Threads registered from now on send searches to backups of a key as well as to its main server.
+             * A backup answers with a value at most about Constants::tSTALENESS_BOUND old, and sends the search
+             * to the main server if it is further behind.
+             */
+            inline auto enable_backup_reads() noexcept -> void {
+                backup_reads = true;
+            }
+
+            /*
+             * Threads registered from now on give up a request not answered within timeout and send it to
+             * whichever node serves its key now, see Constants::tREQUEST_TIMEOUT.
+             */
+            inline auto set_request_timeout(std::chrono::microseconds timeout) noexcept -> void {
+                request_timeout = timeout;
+            }
+
             inline auto launch() -> bool {
 #if defined(__HILL_DEBUG__) || defined(__HILL_INFO__)
                 std::cout << ">> Launching client node at " << client->get_addr_uri() << "\n";
@@ -364,10 +867,56 @@ namespace Hill {
             std::unique_ptr<Client> client;
             erpc::Nexus *nexus;
             bool is_launched;
+            bool one_sided;
+            std::unique_ptr<ReadCache::CompactCache> shared_cache;
+            bool negative_cache;
+            bool backup_reads;
+            std::chrono::microseconds request_timeout;
+            std::unique_ptr<KeyFilter> key_filters[Cluster::Constants::uMAX_NODE];
 
             auto connect_all_servers(int tid, ClientContext &c_ctx) -> bool;
+            // (re)open the session of this thread with node_id, false if the node can not be reached
+            static auto connect_server(ClientContext &c_ctx, int node_id) -> bool;
+            // drops the session of a client thread once eRPC reports it broken
+            static auto session_handler(int session, erpc::SmEventType event, erpc::SmErrType error, void *context)
+                -> void;
+
+            /*
+             * A request to node_id is tagged with the node and a sequence number of the thread, so a response
+             * arriving after the request is given up is told apart and dropped.
+             */
+            static inline auto tag_of(int node_id, uint64_t seq) noexcept -> uintptr_t {
+                return (uintptr_t(seq) << 8) | uintptr_t(node_id);
+            }
+            static inline auto node_of_tag(const void *tag) noexcept -> int {
+                return int(reinterpret_cast<uintptr_t>(tag) & 0xff);
+            }
+            // run the event loop till the response comes, false on timeout or when the session breaks
+            static auto wait_response(ClientContext &c_ctx, int node_id) -> bool;
+            // leaves req and resp to the request waited for and replaces them with buffers of the same sizes
+            static auto abandon(ClientContext &c_ctx, erpc::MsgBuffer &req, erpc::MsgBuffer &resp) -> void;
+            // frees the buffers of the request tagged with tag if it was given up on
+            static auto release_abandoned(ClientContext &c_ctx, uintptr_t tag) -> void;
+            static auto suspect(ClientContext &c_ctx, int node_id) -> void;
+            // not suspected and with a session, which is opened again if the node is back
+            static auto is_usable(ClientContext &c_ctx, int node_id) -> bool;
+            /*
+             * Node to send item to after node_id fails to answer: the main server of the key as the monitor now
+             * has it, or a backup for a search. node_id itself if none can take it yet.
+             */
+            static auto failover_of(ClientContext &c_ctx, const Workload::WorkloadItem &item, int node_id) -> int;
+            // false if the search has to go through eRPC
+            static auto search_one_sided(ClientContext &c_ctx, const std::string &key) -> bool;
+            // the main server or one of the backups of key, in turn
+            static auto replica_of(ClientContext &c_ctx, const std::string &key, int main) -> int;
             auto prepare_request(int node_id, const Workload::WorkloadItem &item, ClientContext &c_ctx) -> bool;
             static auto response_continuation(void *context, void *tag) -> void;
+            static auto apply_invalidations(ClientContext &c_ctx, int node_id, const InvalidationBatch &batch) -> void;
+            // false if the filter of the server of key rules key out
+            static auto may_exist(const ClientContext &c_ctx, const std::string &key) -> bool;
+            // fetch the filters older than Constants::tFILTER_REFRESH
+            static auto refresh_key_filters(ClientContext &c_ctx) -> void;
+            static auto filter_continuation(void *context, void *tag) -> void;
         };
     }
 }
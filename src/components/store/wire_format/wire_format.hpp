@@ -0,0 +1,260 @@
+#ifndef __HILL__STORE__WIRE_FORMAT__WIRE_FORMAT__
+#define __HILL__STORE__WIRE_FORMAT__WIRE_FORMAT__
+
+#include "kv_pair/kv_pair.hpp"
+
+#include <cstring>
+#include <string_view>
+#include <type_traits>
+
+/*
+ * The wire format of messages between clients and servers. A message is a MessageHeader followed by a body
+ * whose fields are listed by a Layout, e.g., Layout<uint64_t, String> is a uint64_t and a HillString. The
+ * encoder and the decoder of a Layout are generated from that list at compile time, so an operation only
+ * names its fields once and both sides agree on them.
+ *
+ * Decoding never copies strings: a String field is a HillString * into the message buffer, checked to lie
+ * within the message first. Other fields are copied out with memcpy, which compiles to the same loads as a
+ * reinterpret_cast but holds for unaligned fields, too. The fixed part of a Layout, its min_size, is checked
+ * against the message once, so only the length of each string is checked on top of the loads of the casts.
+ */
+namespace Hill {
+    namespace Store {
+        namespace Wire {
+            using namespace Memory::TypeAliases;
+
+            namespace Constants {
+                // bumped whenever a layout changes, a message of another version is refused as a whole
+                static constexpr uint8_t uVERSION = 1;
+                // a HillString holds at most this many bytes, see KVPair::HillStringHeader
+                static constexpr size_t uMAX_STRING_SIZE = (1 << 15) - 1;
+            }
+
+            namespace Enums {
+                // no enum class, flags are or-ed into MessageHeader::flags
+                enum Flags : uint8_t {
+                    None = 0,
+                    // a search response carries the leaf of its key, see StoreServer
+                    Fence = 1,
+                };
+            }
+
+            /*
+             * length counts the bytes of the body, and a message is taken only if its buffer holds exactly
+             * that many after the header. request_id is chosen by the sender of a request and echoed by the
+             * response, so a late response is told apart.
+             */
+            struct MessageHeader {
+                uint8_t version;
+                uint8_t op;
+                uint8_t flags;
+                uint8_t reserved;
+                uint32_t length;
+                uint64_t request_id;
+            } __attribute__((packed));
+
+            // a string field, decoded as a HillString * into the message and encoded from a std::string_view
+            struct String {};
+
+            // a field of a trivially copyable type is put on the wire as its bytes
+            template<typename T>
+            struct Field {
+                static_assert(std::is_trivially_copyable_v<T>, "a field is copied as bytes");
+                using decoded_t = T;
+                using encoded_t = T;
+
+                static constexpr size_t min_size = sizeof(T);
+
+                static inline auto size_of(const T &) noexcept -> size_t {
+                    return sizeof(T);
+                }
+
+                // min_size is checked by the caller, see Reader::take
+                static inline auto decode(byte_t *&cursor, size_t &, T &out) noexcept -> bool {
+                    memcpy(&out, cursor, sizeof(T));
+                    cursor += sizeof(T);
+                    return true;
+                }
+
+                static inline auto encode(byte_t *&cursor, const byte_t *end, const T &in) noexcept -> bool {
+                    if (size_t(end - cursor) < sizeof(T)) {
+                        return false;
+                    }
+                    memcpy(cursor, &in, sizeof(T));
+                    cursor += sizeof(T);
+                    return true;
+                }
+            };
+
+            template<>
+            struct Field<String> {
+                using decoded_t = KVPair::HillString *;
+                using encoded_t = std::string_view;
+
+                static constexpr size_t min_size = sizeof(KVPair::HillStringHeader);
+
+                static inline auto size_of(const std::string_view &in) noexcept -> size_t {
+                    return sizeof(KVPair::HillStringHeader) + in.size();
+                }
+
+                // the header is in min_size, the content is taken from slack, the bytes beyond all min_size
+                static inline auto decode(byte_t *&cursor, size_t &slack, KVPair::HillString *&out) noexcept
+                    -> bool
+                {
+                    out = reinterpret_cast<KVPair::HillString *>(cursor);
+                    auto content = out->object_size() - sizeof(KVPair::HillStringHeader);
+                    if (content > slack) {
+                        return false;
+                    }
+                    slack -= content;
+                    cursor += out->object_size();
+                    return true;
+                }
+
+                static inline auto encode(byte_t *&cursor, const byte_t *end, const std::string_view &in) noexcept
+                    -> bool
+                {
+                    if (in.size() > Constants::uMAX_STRING_SIZE || size_t(end - cursor) < size_of(in)) {
+                        return false;
+                    }
+                    cursor += KVPair::HillString::make_string(cursor, in.data(), in.size()).object_size();
+                    return true;
+                }
+            };
+
+            /*
+             * A view of a received message. open checks the header against the buffer, then a Layout takes
+             * the fields in order, after checking its fixed part against what is left.
+             */
+            class Reader {
+            public:
+                Reader(byte_t *buf, size_t size) noexcept : cursor(buf), end(buf + size) {}
+                ~Reader() = default;
+                Reader(const Reader &) = default;
+                Reader(Reader &&) = default;
+                auto operator=(const Reader &) -> Reader & = default;
+                auto operator=(Reader &&) -> Reader & = default;
+
+                // false if the buffer does not hold one whole message of this version
+                inline auto open(MessageHeader &header) noexcept -> bool {
+                    return take<MessageHeader>(header) && header.version == Constants::uVERSION &&
+                        header.length == remaining();
+                }
+
+                /*
+                 * One compare for the fixed size fields, then one per string. On a local cursor, so stores to out
+                 * are not taken to alias it
+                 */
+                template<typename ...Fields>
+                inline auto take(typename Field<Fields>::decoded_t &...out) noexcept -> bool {
+                    constexpr auto min_size = (Field<Fields>::min_size + ... + 0);
+                    if (remaining() < min_size) {
+                        return false;
+                    }
+                    auto at = cursor;
+                    auto slack = remaining() - min_size;
+                    auto ok = (Field<Fields>::decode(at, slack, out) && ...);
+                    cursor = at;
+                    return ok;
+                }
+
+                // the rest of the body, e.g., a serialized filter, taken as a whole
+                inline auto rest() noexcept -> byte_t * {
+                    auto ret = cursor;
+                    cursor += remaining();
+                    return ret;
+                }
+
+                inline auto remaining() const noexcept -> size_t {
+                    return end - cursor;
+                }
+
+                // a message with bytes after its last field is malformed, too
+                inline auto finished() const noexcept -> bool {
+                    return cursor == end;
+                }
+
+            private:
+                byte_t *cursor;
+                const byte_t *end;
+            };
+
+            /*
+             * Builds a message in a buffer of capacity bytes. A field that does not fit fails the whole message,
+             * which finish reports, so callers check once.
+             */
+            class Writer {
+            public:
+                Writer(byte_t *buf, size_t capacity) noexcept : buf(buf), cursor(buf), end(buf + capacity), ok(true) {}
+                ~Writer() = default;
+                Writer(const Writer &) = default;
+                Writer(Writer &&) = default;
+                auto operator=(const Writer &) -> Writer & = default;
+                auto operator=(Writer &&) -> Writer & = default;
+
+                inline auto begin(uint8_t op, uint64_t request_id, uint8_t flags = Enums::Flags::None) noexcept -> void {
+                    cursor = buf;
+                    ok = Field<MessageHeader>::encode(cursor, end, {Constants::uVERSION, op, flags, 0, 0, request_id});
+                }
+
+                template<typename ...Fields>
+                inline auto put(const typename Field<Fields>::encoded_t &...in) noexcept -> bool {
+                    ok = ok && (Field<Fields>::encode(cursor, end, in) && ...);
+                    return ok;
+                }
+
+                // room for a body part written by the caller, nullptr if size bytes do not fit
+                inline auto reserve(size_t size) noexcept -> byte_t * {
+                    if (!ok || size_t(end - cursor) < size) {
+                        ok = false;
+                        return nullptr;
+                    }
+                    cursor += size;
+                    return cursor - size;
+                }
+
+                inline auto add_flags(uint8_t flags) noexcept -> void {
+                    reinterpret_cast<MessageHeader *>(buf)->flags |= flags;
+                }
+
+                // size of the message, 0 if it does not fit
+                inline auto finish() noexcept -> size_t {
+                    if (!ok) {
+                        return 0;
+                    }
+                    auto header = reinterpret_cast<MessageHeader *>(buf);
+                    header->length = cursor - buf - sizeof(MessageHeader);
+                    return cursor - buf;
+                }
+
+            private:
+                byte_t *buf;
+                byte_t *cursor;
+                const byte_t *end;
+                bool ok;
+            };
+
+            // fields of a message body in order, see Field for how each is put on the wire
+            template<typename ...Fields>
+            struct Layout {
+                // size of the body with every string empty
+                static constexpr size_t min_size = (Field<Fields>::min_size + ... + 0);
+
+                static inline auto size_of(const typename Field<Fields>::encoded_t &...in) noexcept -> size_t {
+                    return (Field<Fields>::size_of(in) + ... + 0);
+                }
+
+                static inline auto decode(Reader &reader, typename Field<Fields>::decoded_t &...out) noexcept -> bool {
+                    return reader.take<Fields...>(out...);
+                }
+
+                static inline auto encode(Writer &writer, const typename Field<Fields>::encoded_t &...in) noexcept
+                    -> bool
+                {
+                    return writer.put<Fields...>(in...);
+                }
+            };
+        }
+    }
+}
+#endif
@@ -2,26 +2,72 @@
 namespace Hill {
     namespace WAL {
         std::mutex wal_global_lock;        
-        auto LogRegion::recover(LogEntryAction action) noexcept -> page_vector_ptr {
-            std::unordered_set<Memory::Page *> page_set;
-            auto freed_pages = std::make_unique<std::vector<Memory::Page *>>();
-            for (size_t i = checkpointed; i < cursor; i++) {
-                if (entries[i].status == Enums::LogStatus::Uncommited && entries[i].address != 0) {
-                    if (!action(recover_op(entries[i], page_set, freed_pages))) {
-                        return nullptr;
+        auto PageSet::insert(Memory::Page *page) noexcept -> bool {
+            auto i = (reinterpret_cast<uint64_t>(page) / Memory::Constants::uPAGE_SIZE) * 0x9e3779b97f4a7c15UL;
+            for (auto probe = i; ; probe++) {
+                auto &slot = table[probe & mask];
+                auto cur = slot.load(std::memory_order_acquire);
+                if (cur == page) {
+                    return false;
+                }
+
+                if (cur == nullptr) {
+                    if (slot.compare_exchange_strong(cur, page, std::memory_order_acq_rel)) {
+                        return true;
+                    }
+
+                    // lost the slot, possibly to the same page
+                    if (cur == page) {
+                        return false;
                     }
                 }
             }
-            checkpointed = 0;
-            Memory::Util::mfence();
-            cursor = 0;
-            return freed_pages;
         }
 
-        auto LogRegion::recover_op(LogEntry &entry,
-                                   std::unordered_set<Memory::Page *> &set,
-                                   page_vector_ptr &freed_pages) noexcept -> LogEntry & {
-            auto addr = entry.address;
+        auto LogRegion::pending() noexcept -> size_t {
+            auto seq = head;
+            for (; seq < head + capacity; seq++) {
+                auto &entry = entry_of(seq);
+                if (!entry.is_valid() || entry.get_lap() != lap_of(seq, capacity)) {
+                    break;
+                }
+            }
+            return seq - head;
+        }
+
+        auto LogRegion::replay(LogEntryAction action, PageSet &pages) noexcept -> std::optional<size_t> {
+            size_t replayed = 0;
+            auto seq = head;
+            for (; seq < head + capacity; seq++) {
+                auto &entry = entry_of(seq);
+                // the ring ends at the first entry left from a previous lap
+                if (!entry.is_valid() || entry.get_lap() != lap_of(seq, capacity)) {
+                    break;
+                }
+
+                if (entry.get_address() != nullptr) {
+                    if (!action(recover_op(entry, pages))) {
+                        return {};
+                    }
+                    ++replayed;
+                }
+            }
+            head = seq;
+#ifdef __HILL_PMEM__
+            Memory::Util::persist(&head, sizeof(head));
+#endif
+            return replayed;
+        }
+
+        auto LogRegion::recover_op(LogEntry &entry, PageSet &pages) noexcept -> LogEntry & {
+            // a log allocator has no pages and never reuses memory, regions lent to or borrowed from peers
+            // are not made of pages, nothing to roll back in either case
+#ifndef __HILL_LOG_ALLOCATOR__
+            if (entry.is_remote() || entry.get_op() == Enums::Ops::RemoteMemory) {
+                return entry;
+            }
+
+            auto addr = entry.get_address();
             auto page_ptr = Memory::Page::get_page(addr);
             auto page_as_byte_ptr = reinterpret_cast<byte_ptr_t>(page_ptr);
             auto headers = page_ptr->get_headers();
@@ -31,64 +77,141 @@ namespace Hill {
                 if (headers[i].offset == offset) {
                     // always reclaim uncommited memory
                     headers[i].offset = 0;
+#ifdef __HILL_PMEM__
+                    Memory::Util::persist(&headers[i], sizeof(headers[i]));
+#endif
                 }
             }
 
-            if (set.find(page_ptr) == set.end()) {
-                auto ret = recover_page(page_ptr);
-                set.insert(page_ptr);
-                
-                if (ret.has_value()) {
-                    freed_pages->push_back(ret.value());
-                }
-            }
-
+            // valid counts are recounted after all rollbacks, a page may hold several uncommitted records
+            pages.insert(page_ptr);
+#else
+            (void)pages;
+#endif
             return entry;
         }
 
-        auto LogRegion::recover_page(Memory::Page *page_ptr) noexcept -> std::optional<Memory::Page *>{
-            auto headers = page_ptr->get_headers();
-            size_t valid = 0;
-            for (size_t i = 0; i < page_ptr->header.records; i++) {
-                if (headers[i].offset != 0) {
-                    ++valid;
-                }
-            }
-
-            if (valid == 0) {
+        auto LogRegion::recount_page(Memory::Page *page_ptr) noexcept -> std::optional<Memory::Page *>{
+            if (page_ptr->recount_valid() == 0) {
                 page_ptr->reset_cursor();
                 return page_ptr;
             }
 
-            page_ptr->header.valid = valid;
-#ifdef PMEM
-            pmem_persist(&page_ptr->header, sizeof(page_ptr->header));
+#ifdef __HILL_PMEM__
+            Memory::Util::persist(&page_ptr->header, sizeof(page_ptr->header));
 #endif
             return {};
         }
 
-        auto LogRegion::make_log(Enums::Ops op) noexcept ->  byte_ptr_t & {
-            entries[cursor].address = nullptr;
-            Memory::Util::mfence();
-            entries[cursor].op = op;
-            entries[cursor].status = Enums::LogStatus::Uncommited;
-            Memory::Util::mfence();
+        auto LogRegions::recover(LogEntryAction action, int threads, RecoveryStats &stats) noexcept -> page_vector_ptr {
+            auto start = std::chrono::steady_clock::now();
+            threads = std::clamp(threads, 1, Constants::iREGION_NUM);
+
+            size_t expected = 0;
+            for (int i = 0; i < Constants::iREGION_NUM; i++) {
+                expected += get_region(i).pending();
+            }
+            auto pages = PageSet::make_page_set(expected);
+
+            std::atomic_size_t entries(0);
+            std::atomic_bool failed(false);
+            std::vector<std::thread> workers;
+            for (int t = 0; t < threads; t++) {
+                workers.emplace_back([&, t] {
+                    for (int i = t; i < Constants::iREGION_NUM; i += threads) {
+                        auto replayed = get_region(i).replay(action, *pages);
+                        if (!replayed.has_value()) {
+                            failed = true;
+                            return;
+                        }
+                        entries += replayed.value();
+                    }
+                });
+            }
+            for (auto &w : workers) {
+                w.join();
+            }
+
+            if (failed) {
+                return nullptr;
+            }
+
+            std::vector<std::vector<Memory::Page *>> freed(threads);
+            std::atomic_size_t touched(0);
+            workers.clear();
+            for (int t = 0; t < threads; t++) {
+                workers.emplace_back([&, t] {
+                    for (size_t i = t; i < pages->slots(); i += threads) {
+                        auto page = pages->at(i);
+                        if (page == nullptr) {
+                            continue;
+                        }
+
+                        ++touched;
+                        if (auto ret = LogRegion::recount_page(page); ret.has_value()) {
+                            freed[t].push_back(ret.value());
+                        }
+                    }
+                });
+            }
+            for (auto &w : workers) {
+                w.join();
+            }
+
+            auto out = std::make_unique<std::vector<Memory::Page *>>();
+            for (auto &f : freed) {
+                out->insert(out->end(), f.begin(), f.end());
+            }
+
+            stats.entries = entries;
+            stats.pages = touched;
+            stats.threads = threads;
+            stats.period = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+            return out;
+        }
+
+        auto LogRegion::checkpoint(size_t seq) noexcept -> void {
+            if (seq == head) {
+                return;
+            }
 
-            return entries[cursor++].address;
+#ifdef __HILL_PMEM__
+            // entries are written back as they are made or packed, the fence orders them and whatever the
+            // operations wrote back before the head moves past them
+            Memory::Util::sfence();
+#endif
+            head = seq;
+#ifdef __HILL_PMEM__
+            Memory::Util::flush(&head, sizeof(head));
+            Memory::Util::sfence();
+#endif
         }
 
-        auto LogRegion::checkpoint() noexcept -> void {
-            for (size_t i = checkpointed; i < cursor; i++) {
-                // no need to check if entry is UNCOMMITED because this is a runtime method
-                entries[i].commit();
-            }
-            checkpointed = 0;
-            Memory::Util::mfence();            
-            cursor = checkpointed;
-#ifdef PMEM
-            // checkpointed is not forced to persist since recover just replays the checkpointing
-            pmem_persist(&cursor, sizeof(cursor));
+        auto Logger::recover_unique_logger(const byte_ptr_t &pm_ptr, LogEntryAction action, size_t capacity,
+                                           int threads, const std::vector<Memory::Allocator *> &allocators)
+            -> std::unique_ptr<Logger> {
+            auto out = std::make_unique<Logger>();
+            auto tmp = reinterpret_cast<LogRegions *>(pm_ptr);
+            if (tmp->magic == Constants::uLOG_REGIONS_MAGIC) {
+                auto freed = tmp->recover(action, threads, out->recovery_stats);
+                if (freed == nullptr) {
+                    return nullptr;
+                }
+
+                for (auto allocator : allocators) {
+                    out->recovery_stats.reclaimed += allocator->reclaim(*freed);
+                }
+#ifdef __HILL_INFO__
+                std::cout << ">> WAL recovered in " << out->recovery_stats.period.count() << "us by "
+                          << out->recovery_stats.threads << " threads: " << out->recovery_stats.entries
+                          << " entries replayed, " << out->recovery_stats.pages << " pages recounted, "
+                          << out->recovery_stats.reclaimed << " pages reclaimed\n";
 #endif
+            }
+
+            out->regions = &LogRegions::make_regions(pm_ptr, capacity);
+            out->init_utility();
+            return out;
         }
 
         auto Logger::register_thread() noexcept -> std::optional<int> {
@@ -102,10 +225,20 @@ namespace Hill {
             return {};
         }
 
+        auto Logger::backpressure(int id) noexcept -> void {
+            auto &cursor = cursors[id];
+            // a single operation filling the whole ring is committed so far, its earlier entries are not
+            // rolled back any more
+            if (cursor.committed == regions->get_region(id).head) {
+                pack(id, cursor.tail);
+                cursor.committed = cursor.tail;
+            }
+            checkpoint(id);
+        }
+
         auto Logger::unregister_thread(int id) noexcept -> void {
-            regions->regions[id].checkpoint();
+            checkpoint(id);
             in_use[id] = false;
-            counters[id] = 0;
         }
 
     }
@@ -6,7 +6,10 @@
 
 #include <memory>
 #include <functional>
-#include <unordered_set>
+#include <chrono>
+#include <algorithm>
+#include <thread>
+#include <vector>
 
 namespace Hill {
     using namespace Memory::TypeAliases;
@@ -21,16 +24,26 @@ namespace Hill {
             static constexpr size_t uBATCH_SIZE = 64UL;
             static constexpr size_t uREGION_SIZE = 1024UL;
 #endif
-            static constexpr uint64_t uLOG_REGIONS_MAGIC = 0x1357246813572468UL;
+            // default number of entries in each thread's ring, configurable via wal_region
+            static constexpr size_t uREGION_CAPACITY = uBATCH_SIZE * uREGION_SIZE;
+            // references returned by make_log stay valid for this many subsequent make_log calls
+            static constexpr size_t uPENDING_LOGS = 16UL;
+            static constexpr uint64_t uLOG_REGIONS_MAGIC = 0x1357246813572469UL;
+
+            static constexpr uint64_t uENTRY_ADDRESS_MASK = 0xff00ffffffffffffUL;
+            static constexpr uint64_t uENTRY_OP_SHIFT = 48;
+            static constexpr uint64_t uENTRY_OP_MASK = 0x7UL;
+            static constexpr uint64_t uENTRY_LAP_SHIFT = 51;
+            static constexpr uint64_t uENTRY_LAP_MASK = 0xfUL;
+            static constexpr uint64_t uENTRY_VALID = 1UL << 55;
+            // see Memory::RemotePointer, remote memory is reclaimed by its owner instead of the WAL
+            static constexpr uint64_t uENTRY_REMOTE_MASK = 0xc000000000000000UL;
+            static constexpr uint64_t uENTRY_REMOTE_BITS = 0x8000000000000000UL;
+            // a partially filled batch is committed once its first commit is this old, see Logger::tick
+            static constexpr auto tGROUP_COMMIT_TIMEOUT = std::chrono::microseconds(100);
         }
 
         namespace Enums {
-            enum class LogStatus {
-                Uncommited,
-                Committed,
-                None,
-            };
-
             enum class LoggerRecoverStatus {
                 Ok,
                 NoLogger,
@@ -62,81 +75,164 @@ namespace Hill {
             using SharedLogger = std::shared_ptr<Logger>;
         }
 
+        /*
+         * A LogEntry is packed in 8 bytes
+         *
+         * 63      56 55 54    51 50  48 47                    0
+         * ------------------------------------------------------
+         * |   A    | B |   C    |  D   |          E           |
+         * ------------------------------------------------------
+         * A: highest byte of the address, i.e., bits of a RemotePointer
+         * B: valid bit
+         * C: lap of the ring when the entry is made
+         * D: op
+         * E: lower 48 bits of the address
+         *
+         * Bits 48-55 are the filling hint of a RemotePointer and are zero for any user-space address, so
+         * clearing them restores both local and remote pointers.
+         */
         struct LogEntry {
-            byte_ptr_t address;
-            Enums::Ops op;
-            Enums::LogStatus status;
-
-            LogEntry() : address(nullptr), op(Enums::Ops::Unknown),status(Enums::LogStatus::None) {};
+            uint64_t word;
 
-            static auto make_entry(const byte_ptr_t &ptr) -> LogEntry & {
-                auto tmp = reinterpret_cast<LogEntry *>(ptr);
-                tmp->address = nullptr;
-                tmp->op = Enums::Ops::Unknown;
-                tmp->status = Enums::LogStatus::None;
-                return *tmp;
+            static auto make_entry(LogEntry &entry, Enums::Ops op, uint64_t lap) noexcept -> LogEntry & {
+                entry.word = Constants::uENTRY_VALID |
+                    ((lap & Constants::uENTRY_LAP_MASK) << Constants::uENTRY_LAP_SHIFT) |
+                    ((static_cast<uint64_t>(op) & Constants::uENTRY_OP_MASK) << Constants::uENTRY_OP_SHIFT);
+                return entry;
             }
 
-            inline auto get_address() noexcept -> byte_ptr_t & {
-                return address;
+            inline auto get_address() const noexcept -> byte_ptr_t {
+                return reinterpret_cast<byte_ptr_t>(word & Constants::uENTRY_ADDRESS_MASK);
             }
 
-            inline auto set_op(Enums::Ops _op) noexcept -> void {
-                op = _op;
+            inline auto set_address(const byte_ptr_t &ptr) noexcept -> void {
+                word = (word & ~Constants::uENTRY_ADDRESS_MASK) |
+                    (reinterpret_cast<uint64_t>(ptr) & Constants::uENTRY_ADDRESS_MASK);
             }
 
-            inline auto get_op() const noexcept -> const Enums::Ops & {
-                return op;
+            inline auto get_op() const noexcept -> Enums::Ops {
+                return static_cast<Enums::Ops>((word >> Constants::uENTRY_OP_SHIFT) & Constants::uENTRY_OP_MASK);
             }
 
-            inline auto get_status() const noexcept -> const Enums::LogStatus & {
-                return status;
+            inline auto get_lap() const noexcept -> uint64_t {
+                return (word >> Constants::uENTRY_LAP_SHIFT) & Constants::uENTRY_LAP_MASK;
             }
 
-            inline auto commit() noexcept -> void {
-                status = Enums::LogStatus::Committed;
+            inline auto is_valid() const noexcept -> bool {
+                return word & Constants::uENTRY_VALID;
             }
 
-            inline auto reset() noexcept -> void {
-                address = nullptr;
-                status = Enums::LogStatus::None;
+            inline auto is_remote() const noexcept -> bool {
+                return (word & Constants::uENTRY_REMOTE_MASK) == Constants::uENTRY_REMOTE_BITS;
             }
 
+            LogEntry() = delete;
             ~LogEntry() = default;
             LogEntry(const LogEntry &) = delete;
             LogEntry(LogEntry &&) = delete;
             auto operator=(const LogEntry &) -> LogEntry & = delete;
             auto operator=(LogEntry &&) -> LogEntry & = delete;
+        };
+
 
+        /*
+         * A fixed-size lock-free set of pages, replaying threads use it to agree on which pages have to be
+         * recounted once all rollbacks are done. Pages are never removed.
+         */
+        class PageSet {
+        public:
+            static auto make_page_set(size_t expected) -> std::unique_ptr<PageSet> {
+                auto out = std::make_unique<PageSet>();
+                size_t slots = 16;
+                while (slots < expected * 2) {
+                    slots <<= 1;
+                }
+                out->table = std::make_unique<std::atomic<Memory::Page *>[]>(slots);
+                for (size_t i = 0; i < slots; i++) {
+                    out->table[i] = nullptr;
+                }
+                out->mask = slots - 1;
+                return out;
+            }
+
+            // returns true if the page is inserted by this call
+            auto insert(Memory::Page *page) noexcept -> bool;
+
+            inline auto slots() const noexcept -> size_t {
+                return mask + 1;
+            }
+
+            inline auto at(size_t i) const noexcept -> Memory::Page * {
+                return table[i].load(std::memory_order_relaxed);
+            }
+
+            PageSet() = default;
+            ~PageSet() = default;
+            PageSet(const PageSet &) = delete;
+            PageSet(PageSet &&) = delete;
+            auto operator=(const PageSet &) -> PageSet & = delete;
+            auto operator=(PageSet &&) -> PageSet & = delete;
+
+        private:
+            std::unique_ptr<std::atomic<Memory::Page *>[]> table;
+            size_t mask;
         };
 
+        struct RecoveryStats {
+            size_t entries = 0;
+            size_t pages = 0;
+            size_t reclaimed = 0;
+            int threads = 0;
+            std::chrono::microseconds period = std::chrono::microseconds(0);
+        };
 
         /*
-         * A LogRegion is a continuous persistent memory chunk recording operations
+         * A LogRegion is a ring of LogEntries on persistent memory owned by one thread
+         *
+         * Every entry is identified by a monotonically increasing sequence number, the slot it occupies is
+         * seq % capacity and the lap stamped in it is derived from seq / capacity. Entries before head are
+         * committed and may be overwritten. On recovery, entries are replayed from head until an entry is
+         * invalid or stamped with a stale lap, which marks where the ring stopped.
          *
-         * A thread first get a LogEntry via make_log. Then it decides if a commit
-         * is needed and call LogEntry::commit to actively commit a log. Or it can
-         * wait for a checkpointing for batch commit.
+         * The entries follow the header directly, thus a region occupies size_of(capacity) bytes.
          */
         using LogEntryAction = std::function<bool(LogEntry &)>;
-        struct LogRegion {
-            size_t checkpointed;
-            size_t cursor;
-            LogEntry entries[Constants::uBATCH_SIZE * Constants::uREGION_SIZE];
+        struct alignas(Memory::Constants::uCACHELINE_SIZE) LogRegion {
+            // sequence number of the oldest uncommitted entry
+            size_t head;
+            size_t capacity;
+
+            static auto size_of(size_t capacity) noexcept -> size_t {
+                auto size = sizeof(LogRegion) + capacity * sizeof(LogEntry);
+                return (size + Memory::Constants::uCACHELINE_SIZE - 1) & ~(Memory::Constants::uCACHELINE_SIZE - 1);
+            }
 
-            static auto make_region(const byte_ptr_t &ptr) -> LogRegion & {
+            static auto make_region(const byte_ptr_t &ptr, size_t capacity) -> LogRegion & {
                 auto tmp = reinterpret_cast<LogRegion *>(ptr);
-
-                for (auto &e : tmp->entries) {
-                    LogEntry::make_entry(reinterpret_cast<byte_ptr_t>(&e));
-                }
-                tmp->checkpointed = 0;
-                tmp->cursor = 0;
+                memset(ptr, 0, size_of(capacity));
+                tmp->head = 0;
+                tmp->capacity = capacity;
                 return *tmp;
             }
 
+            // laps run 1 to 15 and over again, entries are never stamped with lap 0, so a zeroed region holds no entry
+            static inline auto lap_of(size_t seq, size_t capacity) noexcept -> uint64_t {
+                return seq / capacity % Constants::uENTRY_LAP_MASK + 1;
+            }
+
+            inline auto get_entries() noexcept -> LogEntry * {
+                return reinterpret_cast<LogEntry *>(reinterpret_cast<byte_ptr_t>(this) + sizeof(LogRegion));
+            }
+
+            inline auto entry_of(size_t seq) noexcept -> LogEntry & {
+                return get_entries()[seq % capacity];
+            }
+
+            // number of entries a replay would visit
+            auto pending() noexcept -> size_t;
+
             /*
-             * Recover iterates over each uncheckpointed log entry and apply the
+             * Replay iterates over each uncheckpointed log entry and apply the
              * user-defined callback to the entry
              *
              * During the iteration, memory chunks are logically reclaimed, contents
@@ -144,13 +240,20 @@ namespace Hill {
              * to use the contents. The logically reclaimed memory chunks is allocated
              * upon allocation, thus once recovery is done, the contents are not
              * guaranteed to be valid.
+             *
+             * Pages touched are put in pages, their valid counts are stale until recount_page is called.
+             * Returns the number of replayed entries, or nothing if the callback fails.
              */
-            using page_vector_ptr = std::unique_ptr<std::vector<Memory::Page *>>;
-            auto recover(LogEntryAction log_action) noexcept -> page_vector_ptr;
+            auto replay(LogEntryAction log_action, PageSet &pages) noexcept -> std::optional<size_t>;
+
+            // returns the page if rollbacks left no valid record in it
+            static auto recount_page(Memory::Page *) noexcept -> std::optional<Memory::Page *>;
 
-            // it is possible that log runs out the region, use with caution
-            auto make_log(Enums::Ops op) noexcept -> byte_ptr_t & ;
-            auto checkpoint() noexcept -> void;
+            /*
+             * Group commit: moving head past a batch commits all its entries at once. Entries up to seq are
+             * written back before head, usually a no-op as make_log and seal already did, then head.
+             */
+            auto checkpoint(size_t seq) noexcept -> void;
 
             LogRegion() = delete;
             ~LogRegion() = default;
@@ -165,35 +268,66 @@ namespace Hill {
              * memory. Contents in reclaimed memory chunk are not touched, so applications can still use
              * the contents.
              */
-            auto recover_op(LogEntry &, std::unordered_set<Memory::Page *> &, page_vector_ptr &) noexcept -> LogEntry &;
-            auto recover_page(Memory::Page *) noexcept -> std::optional<Memory::Page *>;
+            auto recover_op(LogEntry &, PageSet &) noexcept -> LogEntry &;
         };
 
-        struct LogRegions {
+        struct alignas(Memory::Constants::uCACHELINE_SIZE) LogRegions {
             size_t magic;
-            LogRegion regions[Constants::iREGION_NUM];
+            // number of entries in each region
+            size_t capacity;
+
+            static auto size_of(size_t capacity) noexcept -> size_t {
+                return sizeof(LogRegions) + Constants::iREGION_NUM * LogRegion::size_of(capacity);
+            }
 
-            static auto make_regions(const byte_ptr_t &ptr) -> LogRegions & {
+            static auto make_regions(const byte_ptr_t &ptr, size_t capacity) -> LogRegions & {
                 auto tmp = reinterpret_cast<LogRegions *>(ptr);
 
+                tmp->capacity = capacity;
                 for (int i = 0; i < Constants::iREGION_NUM; i++) {
-                    LogRegion::make_region(reinterpret_cast<byte_ptr_t>(&tmp->regions[i]));
+                    LogRegion::make_region(reinterpret_cast<byte_ptr_t>(&tmp->get_region(i)), capacity);
                 }
 
+#ifdef __HILL_PMEM__
+                Memory::Util::persist(tmp, size_of(capacity));
+#endif
                 tmp->magic = Constants::uLOG_REGIONS_MAGIC;
+#ifdef __HILL_PMEM__
+                Memory::Util::persist(&tmp->magic, sizeof(tmp->magic));
+#endif
                 return *tmp;
             }
 
-            static auto recover_or_make_regions(const byte_ptr_t &ptr, LogEntryAction action) noexcept -> LogRegions & {
+            static auto recover_or_make_regions(const byte_ptr_t &ptr, size_t capacity, LogEntryAction action) noexcept
+                -> LogRegions & {
                 auto tmp = reinterpret_cast<LogRegions *>(ptr);
 
+                // the recorded capacity is used, the configured one may have changed since the crash
                 if (tmp->magic == Constants::uLOG_REGIONS_MAGIC) {
-                    for (int i = 0; i < Constants::iREGION_NUM; i++) {
-                        tmp->regions[i].recover(action);
-                    }
+                    RecoveryStats stats;
+                    tmp->recover(action, 1, stats);
                 }
 
-                return make_regions(ptr);
+                return make_regions(ptr, capacity);
+            }
+
+            /*
+             * Regions are sharded across threads, each thread replays its regions and collects the touched
+             * pages in a shared PageSet. Once every rollback is done, the pages are recounted in parallel.
+             * The action may be called concurrently if threads > 1.
+             *
+             * Returns pages left empty, or nullptr if the action fails.
+             */
+            using page_vector_ptr = std::unique_ptr<std::vector<Memory::Page *>>;
+            auto recover(LogEntryAction action, int threads, RecoveryStats &stats) noexcept -> page_vector_ptr;
+
+            inline auto get_region(int id) noexcept -> LogRegion & {
+                auto cursor = reinterpret_cast<byte_ptr_t>(this) + sizeof(LogRegions);
+                return *reinterpret_cast<LogRegion *>(cursor + id * LogRegion::size_of(capacity));
+            }
+
+            inline auto size() const noexcept -> size_t {
+                return size_of(capacity);
             }
 
             LogRegions() = delete;
@@ -205,6 +339,25 @@ namespace Hill {
 
         };
 
+        /*
+         * Volatile part of a ring. Entries in [head, committed) wait for the next checkpoint and entries in
+         * [committed, tail) belong to the operation in progress.
+         *
+         * Since an address no longer fits in an entry as is, make_log hands out a DRAM slot in pending and
+         * the address is packed into the entry by seal, on commit, or when the slot is recycled uPENDING_LOGS
+         * logs later. Entries in [packed, tail) are not packed yet.
+         *
+         * Entries are written back as they are made or packed and fenced together by seal, entries in
+         * [fenced, tail) may not be durable yet.
+         */
+        struct LogCursor {
+            size_t tail;
+            size_t committed;
+            size_t packed;
+            size_t fenced;
+            byte_ptr_t pending[Constants::uPENDING_LOGS];
+        };
+
         /*
          * !!! NEVER INHERIT FROM ANY OTHER CLASSES OR STRUCTS
          * WAL::logger is used in combination with Memory::MemoryManager to avoid memory leaks and
@@ -212,37 +365,57 @@ namespace Hill {
          *
          * Upon recovery, each address should be checked, i.e., the page owning the the address.
          * should be scanned to find the exact number of valid records. Since logging entryies are
-         * committed in batches, there at most Constants::iREGION_NUM * Constants::uBATCH_SIZE
+         * committed in batches, there at most Constants::iREGION_NUM * batch_size
+         *
+         * Batches are closed either when batch_size commits are collected or, if the owner thread calls
+         * tick() while idle, when the oldest commit in the batch exceeds the timeout. Operations committed
+         * in an unfinished batch are rolled back by recovery, a batch size of 1 gives per-operation durability.
+         *
+         * When a ring is full, make_log closes the current batch early instead of overwriting entries.
          */
         class Logger {
         public:
-            static auto make_unique_logger(const byte_ptr_t &pm_ptr) -> std::unique_ptr<Logger> {
+            static auto make_unique_logger(const byte_ptr_t &pm_ptr, size_t capacity = Constants::uREGION_CAPACITY)
+                -> std::unique_ptr<Logger> {
                 auto out = std::make_unique<Logger>();
-                out->regions = &LogRegions::make_regions(pm_ptr);
+                out->regions = &LogRegions::make_regions(pm_ptr, capacity);
                 out->init_utility();
 
                 return out;
             }
 
-            static auto make_shared_logger(const byte_ptr_t &pm_ptr) -> std::shared_ptr<Logger> {
+            static auto make_shared_logger(const byte_ptr_t &pm_ptr, size_t capacity = Constants::uREGION_CAPACITY)
+                -> std::shared_ptr<Logger> {
                 auto out = std::make_shared<Logger>();
-                out->regions = &LogRegions::make_regions(pm_ptr);
+                out->regions = &LogRegions::make_regions(pm_ptr, capacity);
                 out->init_utility();
 
                 return out;
             }
 
-            static auto recover_unique_logger(const byte_ptr_t &pm_ptr, LogEntryAction action) -> std::unique_ptr<Logger> {
+            static auto recover_unique_logger(const byte_ptr_t &pm_ptr, LogEntryAction action,
+                                              size_t capacity = Constants::uREGION_CAPACITY)
+                -> std::unique_ptr<Logger> {
                 auto out = std::make_unique<Logger>();
-                out->regions = &LogRegions::recover_or_make_regions(pm_ptr, action);
+                out->regions = &LogRegions::recover_or_make_regions(pm_ptr, capacity, action);
                 out->init_utility();
 
                 return out;
             }
 
-            static auto recover_shared_logger(const byte_ptr_t &pm_ptr, LogEntryAction action) -> std::shared_ptr<Logger> {
+            /*
+             * Parallel recovery for startup, pages emptied by rolling back uncommitted entries are handed
+             * back to whichever of allocators owns them. See get_recovery_stats for the outcome.
+             */
+            static auto recover_unique_logger(const byte_ptr_t &pm_ptr, LogEntryAction action, size_t capacity,
+                                              int threads, const std::vector<Memory::Allocator *> &allocators)
+                -> std::unique_ptr<Logger>;
+
+            static auto recover_shared_logger(const byte_ptr_t &pm_ptr, LogEntryAction action,
+                                              size_t capacity = Constants::uREGION_CAPACITY)
+                -> std::shared_ptr<Logger> {
                 auto out = std::make_shared<Logger>();
-                out->regions = &LogRegions::recover_or_make_regions(pm_ptr, action);
+                out->regions = &LogRegions::recover_or_make_regions(pm_ptr, capacity, action);
                 out->init_utility();
 
                 return out;
@@ -250,19 +423,99 @@ namespace Hill {
 
             auto register_thread() noexcept -> std::optional<int>;
             auto unregister_thread(int id) noexcept -> void;
+
+            /*
+             * The entry is written back but not fenced, so call seal before anything the entry guards is written,
+             * e.g., before an object is freed or linked. The address is filled in the returned slot, e.g., by an
+             * allocator, and packed by seal too. An allocator fencing its own records makes the entry durable
+             * first, so recovery sees the operation even if it crashes before the address is known.
+             *
+             * The returned reference is valid until Constants::uPENDING_LOGS more logs are made by thread id
+             */
             inline auto make_log(int id, Enums::Ops op) noexcept -> byte_ptr_t & {
-                return regions->regions[id].make_log(op);
+                return make_log(id, op, nullptr);
+            }
+
+            // an address known up front, e.g., of an object about to be freed, is durable along with the entry
+            inline auto make_log(int id, Enums::Ops op, const byte_ptr_t &addr) noexcept -> byte_ptr_t & {
+                auto &region = regions->get_region(id);
+                auto &cursor = cursors[id];
+                if (cursor.tail - region.head == region.capacity) {
+                    backpressure(id);
+                }
+
+                if (cursor.tail - cursor.packed == Constants::uPENDING_LOGS) {
+                    pack(id, cursor.packed + 1);
+                }
+
+                auto &entry = region.entry_of(cursor.tail);
+                LogEntry::make_entry(entry, op, LogRegion::lap_of(cursor.tail, region.capacity));
+                entry.set_address(addr);
+#ifdef __HILL_PMEM__
+                Memory::Util::flush(&entry, sizeof(entry));
+#endif
+                auto &slot = cursor.pending[cursor.tail % Constants::uPENDING_LOGS];
+                slot = addr;
+                ++cursor.tail;
+                return slot;
+            }
+
+            // pack addresses filled in the slots of thread id, the entries made so far are durable with one fence
+            inline auto seal(int id) noexcept -> void {
+                auto &cursor = cursors[id];
+                if (cursor.fenced == cursor.tail) {
+                    return;
+                }
+
+                pack(id, cursor.tail);
+#ifdef __HILL_PMEM__
+                Memory::Util::sfence();
+#endif
+                cursor.fenced = cursor.tail;
             }
 
             inline auto commit(int id) noexcept -> void {
-                if (++counters[id] == Constants::uBATCH_SIZE) {
-                    regions->regions[id].checkpoint();
-                    counters[id] = 0;
+                pack(id, cursors[id].tail);
+                cursors[id].committed = cursors[id].tail;
+                if (++counters[id] == 1) {
+                    batch_starts[id] = std::chrono::steady_clock::now();
+                }
+
+                if (counters[id] >= batch_size) {
+                    checkpoint(id);
                 }
             }
 
             inline auto checkpoint(int id) noexcept -> void {
-                regions->regions[id].checkpoint();
+                regions->get_region(id).checkpoint(cursors[id].committed);
+                counters[id] = 0;
+            }
+
+            // only the thread owning id should tick, usually when it finds nothing to do
+            inline auto tick(int id) noexcept -> void {
+                if (counters[id] != 0 && std::chrono::steady_clock::now() - batch_starts[id] >= timeout) {
+                    checkpoint(id);
+                }
+            }
+
+            // entries of thread id before this sequence number are committed
+            inline auto get_committed(int id) const noexcept -> size_t {
+                return cursors[id].committed;
+            }
+
+            // entries of thread id before this sequence number are checkpointed and survive a crash
+            inline auto get_durable(int id) const noexcept -> size_t {
+                return regions->get_region(id).head;
+            }
+
+            // a batch larger than a ring would always be closed early by make_log
+            inline auto set_group_commit(size_t batch, std::chrono::microseconds t) noexcept -> void {
+                batch_size = std::clamp(batch, 1UL, regions->capacity);
+                timeout = t;
+            }
+
+            inline auto get_recovery_stats() const noexcept -> const RecoveryStats & {
+                return recovery_stats;
             }
 
             Logger() = default;
@@ -276,13 +529,38 @@ namespace Hill {
             LogRegions *regions;
             bool in_use[Constants::iREGION_NUM];
             size_t counters[Constants::iREGION_NUM];
+            LogCursor cursors[Constants::iREGION_NUM];
+            std::chrono::steady_clock::time_point batch_starts[Constants::iREGION_NUM];
+            size_t batch_size;
+            std::chrono::microseconds timeout;
+            RecoveryStats recovery_stats;
 
             auto init_utility() noexcept -> void {
                 for (int i = 0; i < Constants::iREGION_NUM; i++) {
                     in_use[i] = false;
                     counters[i] = 0;
+                    auto head = regions->get_region(i).head;
+                    cursors[i].tail = head;
+                    cursors[i].committed = head;
+                    cursors[i].packed = head;
+                    cursors[i].fenced = head;
+                }
+                batch_size = std::min(Constants::uBATCH_SIZE, regions->capacity);
+                timeout = Constants::tGROUP_COMMIT_TIMEOUT;
+            }
+
+            inline auto pack(int id, size_t seq) noexcept -> void {
+                auto &region = regions->get_region(id);
+                auto &cursor = cursors[id];
+                for (; cursor.packed < seq; ++cursor.packed) {
+                    region.entry_of(cursor.packed).set_address(cursor.pending[cursor.packed % Constants::uPENDING_LOGS]);
+#ifdef __HILL_PMEM__
+                    Memory::Util::flush(&region.entry_of(cursor.packed), sizeof(LogEntry));
+#endif
                 }
             }
+
+            auto backpressure(int id) noexcept -> void;
         };
     }
 }
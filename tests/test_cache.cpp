@@ -5,36 +5,328 @@
 #include <iostream>
 #include <fstream>
 #include <unordered_map>
-
+#include <atomic>
+#include <thread>
 #include <random>
+#include <cmath>
+#include <new>
+
+#include <malloc.h>
 
 using namespace Hill;
 using namespace Hill::ReadCache;
+
+// live heap bytes of this process
+static std::atomic_int64_t heap_bytes(0);
+
+auto operator new(size_t size) -> void * {
+    if (auto p = malloc(size); p) {
+        heap_bytes += malloc_usable_size(p);
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+auto operator new[](size_t size) -> void * {
+    return operator new(size);
+}
+
+auto operator delete(void *p) noexcept -> void {
+    if (p) {
+        heap_bytes -= malloc_usable_size(p);
+    }
+    free(p);
+}
+
+auto operator delete[](void *p) noexcept -> void {
+    operator delete(p);
+}
+
+auto operator delete(void *p, size_t) noexcept -> void {
+    operator delete(p);
+}
+
+auto operator delete[](void *p, size_t) noexcept -> void {
+    operator delete(p);
+}
+
+// value of the i-th key, so that a hit can be checked
+auto value_of(size_t i) -> PolymorphicPointer {
+    return PolymorphicPointer::make_polymorphic_pointer(reinterpret_cast<byte_ptr_t>((i + 1) * 64));
+}
+
+template<typename F>
+auto time_ns(size_t ops, F &&f) -> double {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    auto end = std::chrono::steady_clock::now();
+    return double(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count()) / ops;
+}
+
+/*
+ * Usage: test_cache [-c entries] [-b lookups] [-m threads] [-y ycsb type]
+ * Fills the LRU cache and the compact cache with the same YCSB-like keys and reports bytes per entry and
+ * the latency of a hit, then the throughput of a compact cache shared by threads and its hit ratio against
+ * private caches of the same budget, and the false positive ratio of a Bloom filter. With -y, the hit ratios of both on the YCSB run file are reported as well.
+ */
 int main(int argc, char *argv[]) {
     CmdParser::Parser parser;
 
-    parser.add_option<size_t>("--capacity", "-c", 100);
-    parser.add_option<size_t>("--batch", "-b", 100);
-    parser.add_option<std::string>("--ycsb", "-y", "C");
+    parser.add_option<size_t>("--capacity", "-c", 1000000);
+    parser.add_option<size_t>("--batch", "-b", 10000000);
+    parser.add_option<int>("--multithread", "-m", 4);
+    parser.add_option("--ycsb", "-y");
     parser.parse(argc, argv);
 
+    auto capacity = parser.get_as<size_t>("--capacity").value();
+    auto batch = parser.get_as<size_t>("--batch").value();
+    auto threads = parser.get_as<int>("--multithread").value();
 
-    auto load_type = parser.get_as<std::string>("--ycsb").value();
-    Cache cache(1000000);
-    // auto load = Workload::read_ycsb_workload("2M_load_" + load_type + "_debug.data");
-    auto run = Workload::read_ycsb_workload("2M_run_" + load_type + "_debug.data");
+    std::mt19937_64 rng(2021);
+    std::vector<std::string> keys;
+    keys.reserve(capacity);
+    for (size_t i = 0; i < capacity; i++) {
+        keys.push_back("user" + std::to_string(rng()));
+    }
+    std::vector<size_t> lookups(batch);
+    for (auto &l : lookups) {
+        l = rng() % capacity;
+    }
+
+    // the LRU cache
+    auto before = heap_bytes.load();
+    auto lru = std::make_unique<Cache>(capacity);
+    for (size_t i = 0; i < capacity; i++) {
+        lru->insert(keys[i], value_of(i), i);
+    }
+    auto lru_bytes = double(heap_bytes.load() - before) / capacity;
 
-    for (const auto &r : run[0]) {
-        if (cache.get(r.key) == nullptr) {
-            cache.insert(r.key, nullptr, 0);
+    size_t lru_hits = 0;
+    auto lru_ns = time_ns(batch, [&]() {
+        for (auto l : lookups) {
+            if (auto item = lru->get(keys[l]); item != nullptr && item->value_size == l) {
+                ++lru_hits;
+            }
         }
+    });
+    lru.reset();
+
+    // the compact cache of the same capacity, private to a thread
+    before = heap_bytes.load();
+    auto compact = std::make_unique<CompactCache>(capacity, 1);
+    for (size_t i = 0; i < capacity; i++) {
+        compact->insert(keys[i], value_of(i), i);
+    }
+    auto compact_bytes = double(heap_bytes.load() - before) / compact->capacity();
+
+    size_t compact_hits = 0;
+    CachedValue cached;
+    auto compact_ns = time_ns(batch, [&]() {
+        for (auto l : lookups) {
+            if (compact->get(keys[l], cached)) {
+                if (cached.value_size != l || cached.value_ptr.raw_ptr() != value_of(l).raw_ptr()) {
+                    std::cout << "Compact cache returns a wrong value for " << keys[l] << "\n";
+                    exit(-1);
+                }
+                ++compact_hits;
+            }
+        }
+    });
+
+    std::cout << ">> LRU cache: " << lru_bytes << " bytes per entry, " << lru_ns << " ns per lookup, hit ratio "
+              << double(lru_hits) / batch << "\n";
+    std::cout << ">> Compact cache: " << compact_bytes << " bytes per entry, " << compact_ns
+              << " ns per lookup, hit ratio " << double(compact_hits) / batch << "\n";
+
+    if (lru_hits != batch) {
+        std::cout << "LRU cache should hold every key\n";
+        return -1;
     }
-    
-    for (const auto &r : run[0]) {
-        if (cache.get(r.key) == nullptr) {
-            cache.insert(r.key, nullptr, 0);
+
+    // a key is always cached right after it is inserted, whatever it evicts
+    for (size_t i = 0; i < capacity; i++) {
+        auto cold = "cold" + std::to_string(i);
+        compact->insert(cold, value_of(i), i);
+        if (!compact->get(cold, cached) || cached.value_size != i) {
+            std::cout << "Compact cache loses " << cold << " right after inserting it\n";
+            return -1;
+        }
+    }
+
+    // an updated key is dropped, and so is a key a server invalidates by hash, other keys stay
+    compact->insert("stamped", value_of(1), 1, 42);
+    if (!compact->get("stamped", cached) || cached.stamp != 42) {
+        std::cout << "Compact cache loses the stamp of a value\n";
+        return -1;
+    }
+    compact->expire("stamped");
+    if (compact->get("stamped", cached)) {
+        std::cout << "An expired key should be dropped\n";
+        return -1;
+    }
+    compact->insert("stamped", value_of(1), 1, 43);
+    compact->invalidate(CompactCache::hash_of("stamped"));
+    if (compact->get("stamped", cached) || !compact->get("cold0", cached)) {
+        std::cout << "Invalidation should drop exactly the invalidated key\n";
+        return -1;
+    }
+
+    Cache expiring(2);
+    expiring.insert("stamped", value_of(1), 1);
+    expiring.expire("stamped");
+    if (expiring.get("stamped") != nullptr) {
+        std::cout << "An expired key should be dropped from the LRU cache\n";
+        return -1;
+    }
+
+    // one compact cache shared by every thread
+    auto shared = std::make_unique<CompactCache>(capacity);
+    for (size_t i = 0; i < capacity; i++) {
+        shared->insert(keys[i], value_of(i), i);
+    }
+
+    std::vector<std::thread> workers;
+    auto shared_ns = time_ns(batch, [&]() {
+        for (int t = 0; t < threads; t++) {
+            workers.emplace_back([&, t]() {
+                CachedValue v;
+                for (size_t i = t; i < batch; i += threads) {
+                    shared->get(keys[lookups[i]], v);
+                }
+            });
+        }
+        for (auto &w : workers) {
+            w.join();
+        }
+    });
+    std::cout << ">> Shared compact cache, " << threads << " threads: " << 1000 / shared_ns << " Mops/s\n";
+
+    // readers never see a torn entry while a writer keeps replacing and dropping entries of their bucket
+    std::atomic_bool stop(false);
+    std::atomic_bool torn(false);
+    std::thread writer([&]() {
+        for (size_t r = 0; !stop; r++) {
+            auto k = r % 64;
+            shared->insert(keys[k], value_of(k), k);
+            if (r % 3 == 0) {
+                shared->expire(keys[(k + 1) % 64]);
+            }
+        }
+    });
+    workers.clear();
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&]() {
+            CachedValue v;
+            for (size_t i = 0; i < batch / threads; i++) {
+                auto k = i % 64;
+                if (shared->get(keys[k], v) && (v.value_size != k || v.value_ptr.raw_ptr() != value_of(k).raw_ptr())) {
+                    torn = true;
+                }
+            }
+        });
+    }
+    for (auto &w : workers) {
+        w.join();
+    }
+    stop = true;
+    writer.join();
+    if (torn) {
+        std::cout << "A reader of the shared cache sees a torn entry\n";
+        return -1;
+    }
+
+    // threads reading through the same skewed keys, a private cache each or one shared cache of the same budget
+    auto read_through = [&](auto cache_of) -> void {
+        workers.clear();
+        for (int t = 0; t < threads; t++) {
+            workers.emplace_back([&, t]() {
+                std::mt19937_64 trng(t);
+                std::uniform_real_distribution<double> u(0, 1);
+                CachedValue v;
+                auto &cache = cache_of(t);
+                for (size_t i = 0; i < batch / threads; i++) {
+                    // a few keys take most lookups
+                    size_t k = capacity * 4 * std::pow(u(trng), 4);
+                    if (!cache.get(keys[k % capacity] + "#" + std::to_string(k), v)) {
+                        cache.insert(keys[k % capacity] + "#" + std::to_string(k), value_of(k), k);
+                    }
+                }
+            });
+        }
+        for (auto &w : workers) {
+            w.join();
+        }
+    };
+
+    std::vector<std::unique_ptr<CompactCache>> privates;
+    for (int t = 0; t < threads; t++) {
+        privates.push_back(std::make_unique<CompactCache>(capacity / threads, 1));
+    }
+    read_through([&](int t) -> CompactCache & { return *privates[t]; });
+    double private_ratio = 0;
+    for (auto &p : privates) {
+        private_ratio += p->hit_ratio() / threads;
+    }
+
+    auto budget = std::make_unique<CompactCache>(capacity);
+    read_through([&](int) -> CompactCache & { return *budget; });
+    uint64_t evictions = 0;
+    for (const auto &s : budget->shard_stats()) {
+        evictions += s.evictions;
+    }
+    std::cout << ">> Same budget, " << threads << " threads: private caches hit " << private_ratio
+              << ", shared cache hits " << budget->hit_ratio() << " with " << evictions << " evictions\n";
+    if (threads > 1 && budget->hit_ratio() <= private_ratio) {
+        std::cout << "A shared cache should hit more than private caches of the same budget\n";
+        return -1;
+    }
+
+    // a filter never rules out an added key, and a merged copy rules out no more than the original
+    {
+        auto filter = std::make_unique<BloomFilter>();
+        for (size_t i = 0; i < capacity; i += 2) {
+            filter->add(CompactCache::hash_of(keys[i]));
+        }
+        auto buf = std::make_unique<byte_t[]>(BloomFilter::size());
+        filter->serialize(buf.get());
+        auto copy = std::make_unique<BloomFilter>();
+        copy->add(CompactCache::hash_of("local"));
+        copy->merge(buf.get());
+
+        size_t false_positives = 0;
+        for (size_t i = 0; i < capacity; i++) {
+            auto hash = CompactCache::hash_of(keys[i]);
+            if (i % 2 == 0 && (!filter->may_contain(hash) || !copy->may_contain(hash))) {
+                std::cout << "Bloom filter rules out " << keys[i] << "\n";
+                return -1;
+            }
+            false_positives += i % 2 == 1 && filter->may_contain(hash);
+        }
+        if (!copy->may_contain(CompactCache::hash_of("local"))) {
+            std::cout << "Merging a Bloom filter loses a key\n";
+            return -1;
+        }
+        std::cout << ">> Bloom filter of " << capacity / 2 << " keys: false positive ratio "
+                  << double(false_positives) / (capacity / 2) << "\n";
+    }
+
+    if (auto ycsb = parser.get_as<std::string>("--ycsb"); ycsb.has_value()) {
+        auto run = Workload::read_ycsb_workload("2M_run_" + ycsb.value() + "_debug.data");
+        Cache ycsb_lru(capacity);
+        CompactCache ycsb_compact(capacity, 1);
+        for (int round = 0; round < 2; round++) {
+            for (const auto &r : run[0]) {
+                if (ycsb_lru.get(r.key) == nullptr) {
+                    ycsb_lru.insert(r.key, nullptr, 0);
+                }
+                if (!ycsb_compact.get(r.key, cached)) {
+                    ycsb_compact.insert(r.key, nullptr, 0);
+                }
+            }
         }
+        std::cout << ">> YCSB " << ycsb.value() << " hit ratio, LRU: " << ycsb_lru.hit_ratio() << ", compact: "
+                  << ycsb_compact.hit_ratio() << "\n";
     }
 
-    std::cout << "Hit ratio: " << cache.hit_ratio() << "\n";
+    std::cout << "Tests passed\n";
 }
@@ -3,6 +3,9 @@
 #include "cmd_parser/cmd_parser.hpp"
 
 #include <iostream>
+#include <random>
+#include <chrono>
+#include <algorithm>
 
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -86,6 +89,293 @@ auto test_network_serialization() -> void {
     client.join();
 }
 
+// the route table answers like the linear scan of the range group, even if starts are out of order
+auto test_routing() -> bool {
+    ClusterMeta meta;
+    meta.group.add_main("m", 1);
+    meta.group.add_main("f", 2);
+    meta.group.add_main("t", 3);
+    meta.group.add_main("p", 4);
+    meta.group.add_main("zz", 5);
+    auto table = RouteTable::make_route_table(meta.group, 1);
+
+    auto check = [](const ClusterMeta &meta, const RouteTable &table, const std::string &key) -> bool {
+        auto node = meta.filter_node_no_lock(key);
+        auto range = table.locate(key);
+        if (table.node_of(key) != node || (range == -1 ? 0 : meta.group.infos[range].nodes[0]) != node) {
+            std::cout << "Route table sends " << key << " to node " << table.node_of(key) << " instead of " << node << "\n";
+            return false;
+        }
+        return true;
+    };
+
+    for (auto key : {"", "a", "f", "g", "m", "n", "p", "q", "t", "u", "zz", "zzz"}) {
+        if (!check(meta, *table, key)) {
+            return false;
+        }
+    }
+
+    // thousands of ranges sharing a prefix, keys with and without it
+    ClusterMeta large;
+    std::mt19937_64 rng(2021);
+    std::vector<std::string> starts;
+    for (int i = 0; i < 4096; i++) {
+        starts.push_back("user" + std::to_string(rng() % 100000000));
+    }
+    std::sort(starts.begin(), starts.end());
+    for (const auto &start : starts) {
+        large.group.add_main(start, 1 + rng() % 63);
+    }
+    table = RouteTable::make_route_table(large.group, 1);
+    std::vector<std::string> keys;
+    for (int i = 0; i < 100000; i++) {
+        keys.push_back("user" + std::to_string(rng() % 1000000000).substr(0, 1 + i % 9));
+    }
+    for (auto key : {"", "u", "user", "user0", "usez", "usea", "zzz"}) {
+        keys.push_back(key);
+    }
+    for (const auto &key : keys) {
+        if (!check(large, *table, key)) {
+            return false;
+        }
+    }
+
+    auto time_ns = [&](auto &&route) -> double {
+        auto start = std::chrono::steady_clock::now();
+        volatile int sink = 0;
+        for (const auto &key : keys) {
+            sink = sink + route(key);
+        }
+        auto end = std::chrono::steady_clock::now();
+        return double(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count()) / keys.size();
+    };
+    auto linear = time_ns([&](const std::string &key) { return large.filter_node_no_lock(key); });
+    auto radix = time_ns([&](const std::string &key) { return table->node_of(key); });
+    std::cout << ">> Routing over " << large.group.num_infos << " ranges, linear scan: " << linear
+              << " ns, route table: " << radix << " ns\n";
+    return true;
+}
+
+// a split range sends its upper half to the new node, and peers adopt the split whatever order they hear in
+auto test_splitting() -> bool {
+    auto make_meta = []() {
+        auto meta = std::make_unique<ClusterMeta>();
+        meta->group.add_main("f", 1);
+        meta->group.add_main("m", 2);
+        meta->group.add_main("t", 1);
+        for (size_t i = 0; i < meta->group.num_infos; i++) {
+            meta->group.infos[i].version = 1;
+        }
+        meta->publish_routes();
+        return meta;
+    };
+
+    auto expect = [](const ClusterMeta &meta, const std::string &key, int node) -> bool {
+        if (meta.filter_node(key) != node || meta.filter_node_no_lock(key) != node) {
+            std::cout << key << " is sent to node " << meta.filter_node(key) << " instead of " << node << "\n";
+            return false;
+        }
+        return true;
+    };
+
+    auto split = make_meta();
+    if (split->split_range("m", "x", 3) || split->split_range("t", "h", 3) || !split->split_range("m", "h", 3)) {
+        std::cout << "A range is split at a key out of it\n";
+        return false;
+    }
+    for (auto [key, node] : std::vector<std::pair<std::string, int>>{
+            {"a", 1}, {"f", 2}, {"g", 2}, {"h", 3}, {"l", 3}, {"m", 1}, {"z", 0}}) {
+        if (!expect(*split, key, node)) {
+            return false;
+        }
+    }
+
+    split->migration = {1, 2, 3, true};
+    auto buf = split->serialize();
+    ClusterMeta copy;
+    copy.deserialize(buf.get());
+    if (copy.group.num_infos != 4 || copy.migration.id != 1 || !copy.migration.done || !expect(copy, "h", 3)) {
+        std::cout << "A split is lost in serialization\n";
+        return false;
+    }
+
+    auto peer = make_meta();
+    peer->migration = {1, 2, 3, false};
+    auto stale = make_meta();
+    peer->update(*split);
+    peer->update(*stale);
+    if (!expect(*peer, "h", 3) || !expect(*peer, "g", 2) || !peer->migration.done) {
+        std::cout << "A peer does not keep the split\n";
+        return false;
+    }
+    return true;
+}
+
+auto test_backups() -> bool {
+    auto meta = std::make_unique<ClusterMeta>();
+    meta->group.add_main("f", 1);
+    meta->group.add_main("m", 2);
+    meta->group.append_cpu("f", 2);
+    meta->group.append_cpu("f", 3);
+    meta->group.append_mem("f", 4);
+    meta->group.append_cpu("m", 1);
+    for (size_t i = 0; i < meta->group.num_infos; i++) {
+        meta->group.infos[i].version = 1;
+    }
+    meta->publish_routes();
+
+    auto expect = [](const ClusterMeta &meta, const std::string &key, uint64_t backups) -> bool {
+        auto table = meta.get_routes();
+        if (table == nullptr || table->backups_of(key) != backups) {
+            std::cout << "Backups of " << key << " are " << (table ? table->backups_of(key) : 0) << " instead of "
+                      << backups << "\n";
+            return false;
+        }
+        return true;
+    };
+
+    // a memory node is no backup, and no range holds z
+    if (!expect(*meta, "a", 0b1100) || !expect(*meta, "g", 0b10) || !expect(*meta, "z", 0)) {
+        return false;
+    }
+
+    // node 3 takes over [c, f) and stops being its backup
+    if (!meta->split_range("f", "c", 3) || !expect(*meta, "a", 0b1100) || !expect(*meta, "d", 0b100)) {
+        return false;
+    }
+
+    auto buf = meta->serialize();
+    ClusterMeta copy;
+    copy.deserialize(buf.get());
+    if (!expect(copy, "a", 0b1100) || !expect(copy, "d", 0b100) || !expect(copy, "g", 0b10)) {
+        std::cout << "Backups are lost in serialization\n";
+        return false;
+    }
+    return true;
+}
+
+auto test_failover() -> bool {
+    auto meta = std::make_unique<ClusterMeta>();
+    meta->group.add_main("f", 1);
+    meta->group.add_main("m", 1);
+    meta->group.add_main("z", 2);
+    meta->group.append_mem("f", 2);
+    meta->group.append_cpu("f", 3);
+    meta->group.append_cpu("f", 4);
+    meta->group.append_cpu("z", 1);
+    for (size_t i = 0; i < meta->group.num_infos; i++) {
+        meta->group.infos[i].version = 1;
+    }
+    for (int i = 1; i <= 4; i++) {
+        meta->cluster.nodes[i].node_id = i;
+        meta->cluster.nodes[i].is_active = i != 3;
+    }
+    meta->publish_routes();
+
+    // a memory node or an inactive one takes over nothing, and a range without a backup stays
+    if (meta->fail_node(1) != 1 || meta->cluster.nodes[1].is_active) {
+        std::cout << "Expecting one range of node 1 handed over\n";
+        return false;
+    }
+
+    auto table = meta->get_routes();
+    if (table->node_of("a") != 4 || table->backups_of("a") != 0b1000 || table->node_of("g") != 1 ||
+        table->node_of("n") != 2 || table->backups_of("n") != 0b10) {
+        std::cout << "Ranges of node 1 are handed over wrongly\n";
+        return false;
+    }
+
+    // a reader held up across many newer tables still reads the one it got
+    for (int i = 0; i < 64; i++) {
+        meta->publish_routes();
+    }
+    if (table->node_of("a") != 4 || table->backups_of("n") != 0b10 || meta->get_routes() == table) {
+        std::cout << "A table in use is reclaimed\n";
+        return false;
+    }
+
+    // peers adopt the new layout
+    ClusterMeta peer;
+    peer.group.add_main("f", 1);
+    peer.group.add_main("m", 1);
+    peer.group.add_main("z", 2);
+    for (size_t i = 0; i < peer.group.num_infos; i++) {
+        peer.group.infos[i].version = 1;
+    }
+    if (!peer.merge_group(meta->group) || peer.get_routes()->node_of("a") != 4) {
+        std::cout << "A handed over range is not taken by peers\n";
+        return false;
+    }
+    return true;
+}
+
+auto test_messages() -> bool {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        std::cout << "Can't make a socket pair\n";
+        return false;
+    }
+
+    ClusterMeta sender, receiver;
+    for (auto meta : {&sender, &receiver}) {
+        meta->group.add_main("f", 1);
+        meta->group.add_main("m", 2);
+        meta->group.infos[0].version = meta->group.infos[1].version = 1;
+        meta->publish_routes();
+    }
+
+    // a heartbeat gives the entry a new version only if the stats change
+    sender.cluster.nodes[2].node_id = 2;
+    if (!sender.merge_heartbeat({2, 100, 0.5}) || sender.merge_heartbeat({2, 100, 0.5}) ||
+        sender.cluster.nodes[2].version != 1 || sender.merge_heartbeat({0, 1, 0})) {
+        std::cout << "Heartbeats are merged wrongly\n";
+        return false;
+    }
+    sender.split_range("m", "h", 3);
+    sender.migration = {1, 2, 3, true};
+
+    auto group = std::make_unique<byte_t[]>(sender.group_size());
+    auto group_size = sender.serialize_group(group.get());
+    if (group_size != sender.group_size() ||
+        !send_message(fds[0], Enums::MessageType::Nodes, &sender.cluster.nodes[2], sizeof(NodeInfo)) ||
+        !send_message(fds[0], Enums::MessageType::Ranges, group.get(), group_size) ||
+        !send_message(fds[0], Enums::MessageType::Migration, &sender.migration, sizeof(MigrationOrder))) {
+        std::cout << "Can't send messages\n";
+        return false;
+    }
+
+    MessageHeader header;
+    std::vector<byte_t> body;
+    for (int i = 0; i < 3; i++) {
+        if (!recv_message(fds[1], header, body) || !receiver.apply(header, body.data())) {
+            std::cout << "Message " << i << " is not taken\n";
+            return false;
+        }
+    }
+    if (receiver.cluster.nodes[2].available_pm != 100 || receiver.filter_node("h") != 3 ||
+        receiver.filter_node("g") != 2 || !receiver.migration.done) {
+        std::cout << "Messages are merged wrongly\n";
+        return false;
+    }
+
+    // a cut group or a body of the wrong size is turned down
+    RangeGroup cut;
+    header = {Enums::MessageType::Heartbeat, sizeof(Heartbeat)};
+    if (ClusterMeta::deserialize_group(group.get(), group_size - 1, cut) || receiver.apply(header, group.get())) {
+        std::cout << "A malformed message is taken\n";
+        return false;
+    }
+
+    // a closed socket ends receiving
+    close(fds[0]);
+    if (recv_message(fds[1], header, body)) {
+        std::cout << "A message is received from a closed socket\n";
+        return false;
+    }
+    close(fds[1]);
+    return true;
+}
+
 auto test_file_parsing() -> void {
     auto n1 = Node::make_node("./node1.info");
     n1->dump();
@@ -158,5 +448,8 @@ auto main(int argc, char *argv[]) -> int {
     // test_serialization();
     // std::cout << "\n>> network serialization\n";
     // test_network_serialization();
+    if (!test_routing() || !test_splitting() || !test_backups() || !test_failover() || !test_messages()) {
+        return -1;
+    }
     test_keepalive(argc, argv);
 }
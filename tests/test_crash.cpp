@@ -0,0 +1,360 @@
+#include "wal/wal.hpp"
+#include "memory_manager/memory_manager.hpp"
+
+#include <iostream>
+#include <vector>
+#include <random>
+#include <cstring>
+#include <string>
+#include <unordered_set>
+
+#include <sys/mman.h>
+
+using namespace Hill;
+using namespace Hill::Memory;
+
+/*
+ * Crash-consistency harness
+ *
+ * A workload of logged allocations and frees runs on a DRAM region standing in for PM. Lines written back by
+ * Memory::Util::flush reach the durable image at the next fence, other stores never do, which is the worst
+ * case of what PM holds. Memory::Util::crash_point is called after every fence, the k-th call snapshots the
+ * durable image as if the machine crashes right there. After the workload, the snapshot is copied back to the
+ * same address, recovered with Allocator::recover_or_makie_allocator and the WAL, and checked:
+ *  - every object whose batch was checkpointed before the crash is intact and not rolled back
+ *  - an object committed in a batch whose checkpoint is not durable is rolled back
+ *  - an object being deleted at the crash is either intact or gone
+ *  - a committed delete is not rolled back
+ *  - new allocations never overlap surviving objects
+ * and with the page allocator, whose records tell which objects are allocated:
+ *  - the allocator passes check_consistency, before and after new allocations
+ *
+ * Usage: test_crash [all | random <crash points>] [ops]
+ */
+namespace {
+    constexpr size_t uREGION_SIZE = 4 * 1024 * 1024;
+    constexpr size_t uLOG_CAPACITY = 64;
+    constexpr size_t uSEED = 2021;
+
+    enum class State {
+        Inserting,
+        // committed, but the batch is not checkpointed yet
+        Inserted,
+        Live,
+        Deleting,
+        Removed,
+        Deleted,
+    };
+
+    struct Object {
+        byte_ptr_t ptr;
+        size_t size;
+        uint64_t id;
+        State state;
+        // the WAL ring head has to pass this for the operation to be durable
+        size_t seq;
+    };
+
+    byte_ptr_t region;
+    // lines written back and fenced, and lines written back since the last fence
+    std::vector<byte_t> durable(uREGION_SIZE);
+    std::vector<size_t> flushed;
+    std::vector<byte_t> snapshot(uREGION_SIZE);
+    std::vector<Object> objects;
+    std::vector<Object> snapshot_objects;
+    int workload_tid;
+    size_t fences;
+    size_t crash_at;
+    bool crashed;
+
+    auto on_flush(const void *addr, size_t len) -> void {
+        auto begin = reinterpret_cast<uintptr_t>(addr);
+        auto start = reinterpret_cast<uintptr_t>(region);
+        // e.g., the DRAM write caches of the allocator
+        if (begin + len <= start || begin >= start + uREGION_SIZE) {
+            return;
+        }
+
+        auto line = (std::max(begin, start) - start) & ~(Constants::uCACHELINE_SIZE - 1);
+        auto end = std::min(begin + len, start + uREGION_SIZE) - start;
+        for (; line < end; line += Constants::uCACHELINE_SIZE) {
+            flushed.push_back(line);
+        }
+    }
+
+    auto on_fence() -> void {
+        for (auto line : flushed) {
+            memcpy(durable.data() + line, region + line, Constants::uCACHELINE_SIZE);
+        }
+        flushed.clear();
+
+        if (++fences == crash_at) {
+            snapshot = durable;
+            snapshot_objects = objects;
+            crashed = true;
+        }
+    }
+
+    auto log_size() -> size_t {
+        return (WAL::LogRegions::size_of(uLOG_CAPACITY) + Constants::uPAGE_SIZE - 1) & Constants::uPAGE_MASK;
+    }
+
+    auto fill(const Object &o) -> void {
+        for (size_t i = 0; i < o.size; i++) {
+            o.ptr[i] = (o.id * 31 + i) & 0xff;
+        }
+    }
+
+    auto intact(const Object &o) -> bool {
+        for (size_t i = 0; i < o.size; i++) {
+            if (o.ptr[i] != ((o.id * 31 + i) & 0xff)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    auto present(const Object &o) -> bool {
+        auto page = Page::get_page(o.ptr);
+        auto headers = page->get_headers();
+        auto offset = o.ptr - reinterpret_cast<byte_ptr_t>(page);
+        for (size_t i = 0; i < page->header.records; i++) {
+            if (headers[i].offset == offset) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    auto overlap(const byte_ptr_t &a, size_t a_sz, const byte_ptr_t &b, size_t b_sz) -> bool {
+        return a < b + b_sz && b < a + a_sz;
+    }
+
+    auto run_workload(size_t ops, size_t batch) -> void {
+        objects.clear();
+        fences = 0;
+        crashed = false;
+        memset(region, 0, uREGION_SIZE);
+        memset(durable.data(), 0, uREGION_SIZE);
+        flushed.clear();
+        Util::crash_point = on_fence;
+        Util::flush_point = on_flush;
+
+        auto logger = WAL::Logger::make_unique_logger(region, uLOG_CAPACITY);
+        logger->set_group_commit(batch, WAL::Constants::tGROUP_COMMIT_TIMEOUT);
+        auto alloc = Allocator::make_allocator(region + log_size(), uREGION_SIZE - log_size());
+        auto tid = logger->register_thread().value();
+        alloc->register_thread(tid);
+        workload_tid = tid;
+
+        std::mt19937_64 rng(uSEED);
+        std::vector<size_t> live;
+        std::vector<size_t> batched;
+        // operations become durable only when their batch is checkpointed
+        auto commit = [&](size_t k, State committed) {
+            objects[k].state = committed;
+            objects[k].seq = logger->cursors[tid].tail;
+            logger->commit(tid);
+            batched.push_back(k);
+            if (logger->counters[tid] == 0) {
+                for (auto b : batched) {
+                    objects[b].state = objects[b].state == State::Inserted ? State::Live : State::Deleted;
+                }
+                batched.clear();
+            }
+        };
+
+        for (size_t i = 0; i < ops; i++) {
+            if (live.empty() || rng() % 4 != 0) {
+                objects.push_back({nullptr, 16 + rng() % 200, i, State::Inserting, 0});
+                auto k = objects.size() - 1;
+                auto &ptr = logger->make_log(tid, WAL::Enums::Ops::Insert);
+                alloc->allocate(tid, objects[k].size, ptr);
+                logger->seal(tid);
+                objects[k].ptr = ptr;
+                fill(objects[k]);
+                Util::persist(ptr, objects[k].size);
+                commit(k, State::Inserted);
+                live.push_back(k);
+            } else {
+                auto pick = rng() % live.size();
+                auto k = live[pick];
+                live[pick] = live.back();
+                live.pop_back();
+
+                objects[k].state = State::Deleting;
+                auto &ptr = logger->make_log(tid, WAL::Enums::Ops::Delete, objects[k].ptr);
+                alloc->free(tid, ptr);
+                commit(k, State::Removed);
+            }
+        }
+        Util::crash_point = nullptr;
+        Util::flush_point = nullptr;
+    }
+
+    auto check_recovery(size_t &leaked, size_t &replayed) -> bool {
+        memcpy(region, snapshot.data(), uREGION_SIZE);
+        auto &regions = *reinterpret_cast<WAL::LogRegions *>(region);
+        auto head = regions.magic == WAL::Constants::uLOG_REGIONS_MAGIC ? regions.get_region(workload_tid).head : 0;
+
+        auto alloc = Allocator::recover_or_makie_allocator(region + log_size(), uREGION_SIZE - log_size());
+        if (alloc == nullptr) {
+            std::cout << "Allocator is not recovered\n";
+            return false;
+        }
+
+        std::unordered_set<byte_ptr_t> rolled_back;
+        auto logger = WAL::Logger::recover_unique_logger(region, [&](WAL::LogEntry &e) {
+            rolled_back.insert(e.get_address());
+            return true;
+        }, uLOG_CAPACITY, 2, {alloc});
+
+        if (logger != nullptr) {
+            replayed += logger->get_recovery_stats().entries;
+        }
+
+        if (logger == nullptr || !alloc->check_consistency()) {
+            std::cout << "Allocator is inconsistent after recovery\n";
+            return false;
+        }
+
+        // an object is dropped either by rolling back its allocation or by the WAL reporting it
+        auto gone = [&](const Object &o) {
+#ifndef __HILL_LOG_ALLOCATOR__
+            if (!present(o)) {
+                return true;
+            }
+#endif
+            return rolled_back.count(o.ptr) != 0;
+        };
+
+        std::vector<const Object *> survivors;
+        for (auto &o : snapshot_objects) {
+            switch(o.state) {
+            case State::Live:
+                if (gone(o) || !intact(o)) {
+                    std::cout << "Committed object " << o.id << " is lost\n";
+                    return false;
+                }
+                survivors.push_back(&o);
+                break;
+            case State::Inserted:
+                // committed in a batch whose checkpoint is not durable, recovery has to undo it
+                if (o.seq > head && !rolled_back.count(o.ptr)) {
+                    std::cout << "Object " << o.id << " of an unfinished batch is not rolled back\n";
+                    return false;
+                }
+                [[fallthrough]];
+            case State::Deleting:
+                [[fallthrough]];
+            case State::Removed:
+                if (!gone(o)) {
+                    if (!intact(o)) {
+                        std::cout << "Object " << o.id << " in an open batch is corrupted\n";
+                        return false;
+                    }
+                    survivors.push_back(&o);
+                }
+                break;
+            case State::Inserting:
+                // an allocation whose address is not sealed yet is not known to recovery, it leaks
+                if (o.ptr != nullptr && !gone(o)) {
+                    if (!intact(o)) {
+                        ++leaked;
+                    }
+                    survivors.push_back(&o);
+                }
+                break;
+            case State::Deleted:
+                if (rolled_back.count(o.ptr)) {
+                    std::cout << "Committed delete of object " << o.id << " is rolled back\n";
+                    return false;
+                }
+                break;
+            default:
+                break;
+            }
+        }
+
+        auto tid = logger->register_thread().value();
+        alloc->register_thread(tid);
+        for (size_t i = 0; i < 256; i++) {
+            byte_ptr_t ptr = nullptr;
+            alloc->allocate(tid, 64, ptr);
+            for (auto s : survivors) {
+                if (overlap(ptr, 64, s->ptr, s->size)) {
+                    std::cout << "New allocation overlaps object " << s->id << "\n";
+                    return false;
+                }
+            }
+        }
+
+        if (!alloc->check_consistency()) {
+            std::cout << "Allocator is inconsistent after new allocations\n";
+            return false;
+        }
+        return true;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    std::string mode = argc > 1 ? argv[1] : "all";
+    auto random = mode == "random";
+    size_t points = (random && argc > 2) ? atoll(argv[2]) : 0;
+    size_t ops = 300;
+    if (argc > (random ? 3 : 2)) {
+        ops = atoll(argv[random ? 3 : 2]);
+    }
+
+    region = reinterpret_cast<byte_ptr_t>(mmap(nullptr, uREGION_SIZE, PROT_READ | PROT_WRITE,
+                                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (region == MAP_FAILED) {
+        std::cout << "Unable to map region\n";
+        return -1;
+    }
+
+    // batch 1 commits every operation, a larger batch leaves operations for recovery to roll back
+    for (auto batch : {1UL, 8UL}) {
+        // a dry run counts the fences
+        crash_at = 0;
+        run_workload(ops, batch);
+        auto total = fences;
+
+        std::vector<size_t> crash_points;
+        if (random) {
+            std::mt19937_64 rng(std::random_device{}());
+            for (size_t i = 0; i < points; i++) {
+                crash_points.push_back(1 + rng() % total);
+            }
+        } else {
+            for (size_t i = 1; i <= total; i++) {
+                crash_points.push_back(i);
+            }
+        }
+
+        size_t leaked = 0;
+        size_t replayed = 0;
+        for (auto point : crash_points) {
+            crash_at = point;
+            run_workload(ops, batch);
+            if (!crashed) {
+                std::cout << "Crash point " << point << " is never reached\n";
+                return -1;
+            }
+
+            // recovery reports are not interesting here
+            auto buf = std::cout.rdbuf(nullptr);
+            auto recovered = check_recovery(leaked, replayed);
+            std::cout.rdbuf(buf);
+            if (!recovered) {
+                std::cout << "Recovery from crash point " << point << " with batch " << batch << " fails\n";
+                return -1;
+            }
+        }
+        std::cout << ">> batch " << batch << ": " << ops << " operations, " << crash_points.size()
+                  << " of " << total << " crash points, " << replayed << " entries replayed, "
+                  << leaked << " in-flight allocations leaked\n";
+    }
+
+    std::cout << "Tests passed\n";
+}
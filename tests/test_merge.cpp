@@ -0,0 +1,479 @@
+#include "store/range_merger/range_merger.hpp"
+
+#include <iostream>
+#include <atomic>
+#include <cstdlib>
+#include <algorithm>
+#include <new>
+#include <thread>
+
+#include <sys/socket.h>
+
+using namespace Hill;
+using namespace Hill::Indexing;
+
+// every heap allocation in this process goes through here
+static std::atomic_uint64_t allocations(0);
+
+auto operator new(size_t size) -> void * {
+    ++allocations;
+    if (auto p = malloc(size); p) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+auto operator new[](size_t size) -> void * {
+    return operator new(size);
+}
+
+auto operator delete(void *p) noexcept -> void {
+    free(p);
+}
+
+auto operator delete[](void *p) noexcept -> void {
+    free(p);
+}
+
+auto operator delete(void *p, size_t) noexcept -> void {
+    free(p);
+}
+
+auto operator delete[](void *p, size_t) noexcept -> void {
+    free(p);
+}
+
+constexpr int iPARTITIONS = 4;
+constexpr int iKEYS = 10000;
+constexpr size_t uSCAN = 100;
+constexpr int iROUNDS = 1000;
+
+int main() {
+    auto alloc = Memory::Allocator::make_allocator(new byte_t[1024 * 1024 * 256], 1024 * 1024 * 256);
+    auto logger = WAL::Logger::make_unique_logger(new byte_t[WAL::LogRegions::size_of(WAL::Constants::uREGION_CAPACITY)]);
+
+    std::unique_ptr<OLFIT> partitions[iPARTITIONS];
+    int tids[iPARTITIONS];
+    LeafNode *heads[iPARTITIONS];
+    for (int i = 0; i < iPARTITIONS; i++) {
+        tids[i] = logger->register_thread().value();
+        alloc->register_thread(tids[i]);
+        partitions[i] = std::make_unique<OLFIT>(tids[i], alloc, logger.get());
+        heads[i] = partitions[i]->get_root().get_as<LeafNode *>();
+    }
+
+    auto buf = std::make_unique<byte_t[]>(1024);
+    for (int i = 0; i < iKEYS; i++) {
+        auto key = std::to_string(100000000 + i);
+        auto &hkey = KVPair::HillString::make_string(buf.get(), key.c_str(), key.size());
+        auto p = i % iPARTITIONS;
+        partitions[p]->insert(tids[p], key.c_str(), key.size(), key.c_str(), key.size(), &hkey, &hkey);
+    }
+
+    std::vector<ScanHolder> ranges[iPARTITIONS];
+    std::vector<ScanHolder> merged;
+    Store::Merger merger;
+
+    auto round = [&](int r) -> bool {
+        auto k = (r * 7) % (iKEYS - uSCAN);
+        auto key = std::to_string(100000000 + k);
+        if (partitions[k % iPARTITIONS]->search(key.c_str(), key.size()).first == nullptr) {
+            std::cout << "Can not find " << key << "\n";
+            return false;
+        }
+
+        for (int i = 0; i < iPARTITIONS; i++) {
+            partitions[i]->scan(key.c_str(), key.size(), uSCAN, ranges[i]);
+        }
+
+        merger.reset();
+        for (auto &r : ranges) {
+            merger.add_range(r);
+        }
+        merger.merge(uSCAN, merged);
+
+        if (merged.size() != uSCAN) {
+            std::cout << "Expecting " << uSCAN << " keys from the merger, got " << merged.size() << "\n";
+            return false;
+        }
+
+        for (size_t i = 1; i < merged.size(); i++) {
+            if (!(*merged[i - 1].key < *merged[i].key)) {
+                std::cout << "Merged keys are not sorted\n";
+                return false;
+            }
+        }
+        return true;
+    };
+
+    // warm up, buffers reach their final capacity here
+    if (!round(0)) {
+        return -1;
+    }
+
+    auto before = allocations.load();
+    for (int r = 1; r <= iROUNDS; r++) {
+        if (!round(r)) {
+            return -1;
+        }
+    }
+    auto after = allocations.load();
+
+    if (after != before) {
+        std::cout << after - before << " heap allocations in " << iROUNDS << " steady state scans\n";
+        return -1;
+    }
+
+    // a client learns leaves from search fences, stale ones may miss keys but never return a wrong value
+    LeafDirectory directory;
+    auto check_directory = [&](int keys) -> bool {
+        for (int i = 0; i < keys; i += iPARTITIONS) {
+            auto key = std::to_string(100000000 + i);
+            auto leaf = directory.find(key.c_str(), key.size());
+            if (leaf == nullptr) {
+                continue;
+            }
+
+            auto slot = leaf->probe(CityHash64(key.c_str(), key.size()));
+            if (!leaf->is_stable() || (slot != -1 && leaf->keys[slot]->compare(key.c_str(), key.size()) == 0 &&
+                                       leaf->values[slot] != partitions[0]->search(key.c_str(), key.size()).first)) {
+                std::cout << "Leaf of " << key << " from the directory is wrong\n";
+                return false;
+            }
+        }
+        return true;
+    };
+
+    for (int i = 0; i < iKEYS; i += iPARTITIONS) {
+        auto key = std::to_string(100000000 + i);
+        LeafFence fence;
+        partitions[0]->search(key.c_str(), key.size(), &fence);
+        if ((fence.low && fence.low->compare(key.c_str(), key.size()) > 0) ||
+            (fence.high && fence.high->compare(key.c_str(), key.size()) <= 0)) {
+            std::cout << "Fence of " << key << " does not cover it\n";
+            return -1;
+        }
+        directory.learn(1, key.c_str(), key.size(), fence.low ? fence.low->to_string() : "",
+                        fence.high ? fence.high->to_string() : "", fence.leaf);
+        if (directory.find(key.c_str(), key.size()) != fence.leaf) {
+            std::cout << "Learnt leaf of " << key << " is not found\n";
+            return -1;
+        }
+    }
+
+    // splits outdate learnt ranges
+    for (int i = iKEYS; i < 2 * iKEYS; i += iPARTITIONS) {
+        auto key = std::to_string(100000000 + i);
+        auto &hkey = KVPair::HillString::make_string(buf.get(), key.c_str(), key.size());
+        partitions[0]->insert(tids[0], key.c_str(), key.size(), key.c_str(), key.size(), &hkey, &hkey);
+    }
+    if (!check_directory(2 * iKEYS)) {
+        return -1;
+    }
+
+    // a value carries the stamp its leaf reports, an update stamps the new value afresh
+    {
+        auto key = std::to_string(100000000);
+        LeafFence fence;
+        auto old = partitions[0]->search(key.c_str(), key.size(), &fence).first.get_as<KVPair::HillString *>();
+        auto stamp = fence.stamp;
+        if (stamp == 0 || old->stamp() != stamp) {
+            std::cout << "Value of " << key << " is not stamped as its leaf says\n";
+            return -1;
+        }
+        partitions[0]->update(tids[0], key.c_str(), key.size(), key.c_str(), key.size());
+        auto value = partitions[0]->search(key.c_str(), key.size(), &fence).first.get_as<KVPair::HillString *>();
+        if (fence.stamp == stamp || value->stamp() != fence.stamp) {
+            std::cout << "Updated value of " << key << " is not stamped afresh\n";
+            return -1;
+        }
+    }
+
+    auto torn = partitions[0]->get_root().get_as<InnerNode *>()->children[0].get_as<LeafNode *>();
+    torn->begin_write();
+    if (torn->is_stable()) {
+        std::cout << "A leaf being written should not be stable\n";
+        return -1;
+    }
+    torn->end_write();
+
+    // lines of a read may land out of order, an image with the versions of one write and a slot of another
+    auto image = std::make_unique<byte_t[]>(sizeof(LeafNode));
+    memcpy(image.get(), torn, sizeof(LeafNode));
+    auto torn_image = reinterpret_cast<LeafNode *>(image.get());
+    if (!torn_image->is_stable()) {
+        std::cout << "A copy of a leaf at rest should be stable\n";
+        return -1;
+    }
+    torn_image->values[1] = torn_image->values[0];
+    if (torn_image->is_stable()) {
+        std::cout << "A leaf image with a slot from another write should not be stable\n";
+        return -1;
+    }
+
+    // re-open the trees from their first leaves as a restarted server does, one key is rolled back
+    const std::string dropped = std::to_string(100000000 + 4);
+    for (int i = 0; i < iPARTITIONS; i++) {
+        partitions[i] = std::make_unique<OLFIT>(heads[i], alloc, logger.get(), [&](const byte_ptr_t &ptr) {
+            return reinterpret_cast<KVPair::HillString *>(ptr)->compare(dropped.c_str(), dropped.size()) == 0;
+        });
+    }
+
+    for (int i = 0; i < iKEYS; i++) {
+        auto key = std::to_string(100000000 + i);
+        auto found = partitions[i % iPARTITIONS]->search(key.c_str(), key.size()).first != nullptr;
+        if (found != (key != dropped)) {
+            std::cout << "Re-opened tree " << (found ? "keeps " : "loses ") << key << "\n";
+            return -1;
+        }
+    }
+
+    for (int r = 1; r <= iROUNDS; r++) {
+        if (!round(r)) {
+            return -1;
+        }
+    }
+
+    // a range is exported in pieces and then removed, its leaves stay sorted and dense
+    {
+        const std::string from = std::to_string(100005000), end = std::to_string(100006000);
+        std::vector<std::string> exported;
+        auto cursor = from;
+        auto status = Enums::OpStatus::Retry;
+        while (status == Enums::OpStatus::Retry) {
+            size_t taken = 0;
+            status = partitions[1]->export_range(tids[1], cursor, end, [&](const hill_key_t *k, const hill_value_t *v) {
+                if (taken == 64) {
+                    return false;
+                }
+                if (k->compare(v->raw_chars(), v->size()) != 0) {
+                    std::cout << "Exported value of " << k->to_string() << " is wrong\n";
+                    exit(-1);
+                }
+                exported.push_back(k->to_string());
+                ++taken;
+                return true;
+            });
+            if (!exported.empty()) {
+                cursor = exported.back() + '\0';
+            }
+        }
+
+        if (status != Enums::OpStatus::Ok || exported.size() != 250 || !std::is_sorted(exported.begin(), exported.end()) ||
+            std::adjacent_find(exported.begin(), exported.end()) != exported.end()) {
+            std::cout << "Expecting 250 sorted keys exported, got " << exported.size() << "\n";
+            return -1;
+        }
+
+        size_t told = 0;
+        auto removed = partitions[1]->remove_range(tids[1], from, end, [&](const std::string &) { ++told; });
+        if (removed != 250 || told != 250) {
+            std::cout << "Expecting 250 keys removed, got " << removed << "\n";
+            return -1;
+        }
+
+        for (int i = 4997; i <= 6001; i += iPARTITIONS) {
+            auto key = std::to_string(100000000 + i);
+            auto found = partitions[1]->search(key.c_str(), key.size()).first != nullptr;
+            if (found != (key < from || key >= end)) {
+                std::cout << (found ? "Removed " : "Kept ") << key << " is " << (found ? "found" : "lost") << "\n";
+                return -1;
+            }
+        }
+
+        for (auto leaf = heads[1]; leaf != nullptr; leaf = leaf->next) {
+            for (int i = 1; i < Constants::iNUM_HIGHKEY; i++) {
+                if (leaf->keys[i] != nullptr && (leaf->keys[i - 1] == nullptr || !(*leaf->keys[i - 1] < *leaf->keys[i]))) {
+                    std::cout << "A leaf is left with a hole or out of order\n";
+                    return -1;
+                }
+            }
+        }
+
+        for (const auto &key : exported) {
+            auto &hkey = KVPair::HillString::make_string(buf.get(), key.c_str(), key.size());
+            partitions[1]->insert(tids[1], key.c_str(), key.size(), key.c_str(), key.size(), &hkey, &hkey);
+            if (partitions[1]->search(key.c_str(), key.size()).first == nullptr) {
+                std::cout << "Removed " << key << " can not be inserted again\n";
+                return -1;
+            }
+        }
+    }
+
+    // a partition spilling to a loopback peer, which lends part of its buffer as a remote region
+    {
+        using RDMAUtil::RDMADevice;
+        using RDMAUtil::RDMAContext;
+        constexpr size_t uSTAGING = 4096;
+        constexpr size_t uLENT = 4 * 1024 * 1024;
+        auto [device, status] = RDMADevice::make_rdma(RDMADevice::sLOOPBACK_DEVICE, 1, -1);
+        if (status != RDMAUtil::Status::Ok) {
+            std::cout << "Loopback device should always be available\n";
+            return -1;
+        }
+        auto local_buf = std::make_unique<byte_t[]>(uSTAGING);
+        auto lent = std::make_unique<byte_t[]>(uLENT);
+        auto [local, ls] = device->open(local_buf.get(), uSTAGING, 16, RDMADevice::get_default_mr_access(),
+                                        *RDMADevice::get_default_qp_init_attr());
+        auto [peer, ps] = device->open(lent.get(), uLENT, 16, RDMADevice::get_default_mr_access(),
+                                       *RDMADevice::get_default_qp_init_attr());
+        int fds[2];
+        socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+        std::thread accepting([&, &peer = peer]() { peer->default_connect(fds[1]); });
+        auto connected = local->default_connect(fds[0]) == 0;
+        accepting.join();
+        if (!connected) {
+            std::cout << "Loopback contexts should connect\n";
+            return -1;
+        }
+
+        auto peers = std::make_unique<std::array<std::unique_ptr<RDMAContext>, Cluster::Constants::uMAX_NODE>[]>(
+            Memory::Constants::iTHREAD_LIST_NUM);
+        peers[tids[2]][1] = std::move(local);
+        auto agent_pm = std::make_unique<byte_t[]>(sizeof(Memory::RemoteMemoryAgent));
+        auto agent_state = Memory::RemoteAgentState::make_state();
+        auto agent = Memory::RemoteMemoryAgent::make_agent(agent_pm.get(), peers.get(), agent_state.get());
+        agent->add_region(tids[2], Memory::RemotePointer::make_remote_pointer(1, lent.get()));
+        auto olfit = std::make_unique<OLFIT>(tids[2], alloc, logger.get());
+        olfit->enable_agent(agent);
+
+        // a value larger than the staging buffer fails cleanly, its key is not left without a value
+        const std::string big_key = std::to_string(300000000);
+        const std::string big_value(uSTAGING * 2, 'v');
+        auto &hkey = KVPair::HillString::make_string(buf.get(), big_key.c_str(), big_key.size());
+        auto [big, _] = olfit->insert(tids[2], big_key.c_str(), big_key.size(), big_value.c_str(), big_value.size(),
+                                      &hkey, nullptr);
+        if (big != Enums::OpStatus::Failed || olfit->get_root().get_as<LeafNode *>()->keys[0] != nullptr) {
+            std::cout << "An oversized value should fail and leave no key behind\n";
+            return -1;
+        }
+        auto [again, value] = olfit->insert(tids[2], big_key.c_str(), big_key.size(), big_key.c_str(),
+                                            big_key.size(), &hkey, nullptr);
+        if (again != Enums::OpStatus::Ok || value.is_local() ||
+            olfit->search(big_key.c_str(), big_key.size()).first != value) {
+            std::cout << "A key whose value failed should be inserted again\n";
+            return -1;
+        }
+
+        // an oversized update fails the same way, its logged value is not left open for the next operation
+        olfit->drain_writes();
+        auto [updated, _u] = olfit->update(tids[2], big_key.c_str(), big_key.size(), big_value.c_str(),
+                                           big_value.size());
+        if (updated != Enums::OpStatus::Failed || logger->get_committed(tids[2]) != logger->cursors[tids[2]].tail ||
+            olfit->search(big_key.c_str(), big_key.size()).first != value) {
+            std::cout << "An oversized update should fail and close its operation\n";
+            return -1;
+        }
+
+        // once spilling stops, spilled values come home intact and are charged to the local allocator
+        std::vector<std::string> spilled{big_key};
+        for (int i = 1; i <= 8; i++) {
+            spilled.push_back(std::to_string(300000000 + i));
+            auto value = "value of " + spilled.back();
+            auto &k = KVPair::HillString::make_string(buf.get(), spilled.back().c_str(), spilled.back().size());
+            if (olfit->insert(tids[2], spilled.back().c_str(), spilled.back().size(), value.c_str(), value.size(),
+                              &k, nullptr).first != Enums::OpStatus::Ok) {
+                std::cout << "A small value should be spilled\n";
+                return -1;
+            }
+        }
+
+        // the remote copies are read here, directly out of the lent region
+        olfit->drain_writes();
+        size_t expected = 0;
+        for (const auto &key : spilled) {
+            auto value = olfit->search(key.c_str(), key.size()).first;
+            if (!value.is_remote()) {
+                std::cout << "Value of " << key << " should be remote before migration\n";
+                return -1;
+            }
+            expected += value.get_as<KVPair::HillString *>()->object_size();
+        }
+
+        olfit->stop_spilling();
+        auto consumed = alloc->get_consumed();
+        auto moved = olfit->migrate_home(tids[2], spilled.size());
+        if (moved != spilled.size() || alloc->get_consumed() - consumed != expected) {
+            std::cout << moved << " values are moved home, consumption grows by "
+                      << alloc->get_consumed() - consumed << " instead of " << expected << "\n";
+            return -1;
+        }
+        for (size_t i = 0; i < spilled.size(); i++) {
+            auto value = olfit->search(spilled[i].c_str(), spilled[i].size()).first;
+            auto content = i == 0 ? spilled[i] : "value of " + spilled[i];
+            if (!value.is_local() || value.get_as<KVPair::HillString *>()->compare(content.c_str(), content.size()) != 0) {
+                std::cout << "Value of " << spilled[i] << " is not brought home intact\n";
+                return -1;
+            }
+        }
+        if (olfit->migrate_home(tids[2], spilled.size()) != 0) {
+            std::cout << "Nothing should be left to migrate\n";
+            return -1;
+        }
+
+        // deferred writes are answered by their callbacks once the remote writes retire, also across a split
+        olfit->enable_agent(agent);
+        std::vector<std::pair<Enums::OpStatus, Memory::PolymorphicPointer>> answers;
+        auto done = [&](Enums::OpStatus s, Memory::PolymorphicPointer p) {
+            answers.emplace_back(s, p);
+        };
+        std::vector<std::string> deferred;
+        for (int i = 0; i < Indexing::Constants::iNUM_HIGHKEY; i++) {
+            deferred.push_back(std::to_string(400000000 + i));
+            auto &k = KVPair::HillString::make_string(buf.get(), deferred.back().c_str(), deferred.back().size());
+            if (olfit->insert(tids[2], deferred.back().c_str(), deferred.back().size(), deferred.back().c_str(),
+                              deferred.back().size(), &k, nullptr, done).first != Enums::OpStatus::Pending) {
+                std::cout << "A spilled write with a callback should be deferred\n";
+                return -1;
+            }
+        }
+        if (olfit->get_root().is_leaf()) {
+            std::cout << "Deferred writes should have split the root leaf\n";
+            return -1;
+        }
+        olfit->flush_writes();
+        for (int spins = 0; answers.size() < deferred.size() && spins < 1000000; spins++) {
+            olfit->poll_writes();
+        }
+        if (answers.size() != deferred.size()) {
+            std::cout << answers.size() << " of " << deferred.size() << " deferred writes are answered\n";
+            return -1;
+        }
+        for (size_t i = 0; i < deferred.size(); i++) {
+            auto [s, value] = answers[i];
+            if (s != Enums::OpStatus::Ok || !value.is_remote() ||
+                olfit->search(deferred[i].c_str(), deferred[i].size()).first != value) {
+                std::cout << "Deferred write of " << deferred[i] << " is answered wrongly\n";
+                return -1;
+            }
+        }
+
+        // a value failing in a leaf being split fails the insert, the split stays and the key is taken back
+        auto fresh = std::make_unique<OLFIT>(tids[2], alloc, logger.get());
+        fresh->enable_agent(agent);
+        for (int i = 0; i < Indexing::Constants::iNUM_HIGHKEY; i++) {
+            auto key = std::to_string(500000000 + i);
+            auto &k = KVPair::HillString::make_string(buf.get(), key.c_str(), key.size());
+            fresh->insert(tids[2], key.c_str(), key.size(), key.c_str(), key.size(), &k, nullptr);
+        }
+        const std::string split_key = std::to_string(500000000 + Indexing::Constants::iNUM_HIGHKEY);
+        auto &sk = KVPair::HillString::make_string(buf.get(), split_key.c_str(), split_key.size());
+        auto [split_status, _v] = fresh->insert(tids[2], split_key.c_str(), split_key.size(), big_value.c_str(),
+                                                big_value.size(), &sk, nullptr);
+        if (split_status != Enums::OpStatus::Failed || fresh->get_root().is_leaf()) {
+            std::cout << "An oversized value inserted by a split should fail\n";
+            return -1;
+        }
+        auto leaf = fresh->get_root().get_as<InnerNode *>()->children[0].get_as<LeafNode *>();
+        for (; leaf != nullptr; leaf = leaf->next) {
+            for (int i = 0; i < Indexing::Constants::iNUM_HIGHKEY && leaf->keys[i] != nullptr; i++) {
+                if (leaf->keys[i]->compare(split_key.c_str(), split_key.size()) == 0) {
+                    std::cout << "A key whose value failed in a split is left behind\n";
+                    return -1;
+                }
+            }
+        }
+    }
+
+    std::cout << "Tests passed\n";
+}
@@ -72,7 +72,7 @@ auto run_client(int tid, std::unique_ptr<RDMAContext> &rdma_ctx, size_t pmem_siz
     auto s = steady_clock::now();
     for (int i = 0; i < batch; i++) {
         rdma_ctx->post_write(buf, 19, 0, offsets[i]);
-        rdma_ctx->poll_one_completion();
+        rdma_ctx->poll_completion_once();
         if (i > 0 && i % 1000 == 0) {
             auto e = steady_clock::now();
             latencies.push_back(duration_cast<microseconds>(e - s).count() / 1000);
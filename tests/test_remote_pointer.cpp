@@ -1,7 +1,13 @@
 #include "remote_memory/remote_memory.hpp"
 
 #include <iostream>
+#include <memory>
+#include <thread>
+#include <chrono>
+
+#include <sys/socket.h>
 using namespace Hill::Memory;
+using namespace Hill::RDMAUtil;
 int main() {
     byte_t tmp = 0;
 
@@ -27,5 +33,190 @@ int main() {
         return -1;
     }
 
+    // remote regions are never touched by the allocator, fake addresses are fine
+    auto agent_pm = std::make_unique<byte_t[]>(sizeof(RemoteMemoryAgent));
+    auto agent_state = RemoteAgentState::make_state();
+    auto agent = RemoteMemoryAgent::make_agent(agent_pm.get(), nullptr, agent_state.get());
+    auto a = RemotePointer::make_remote_pointer(2, 0x100000000UL);
+    auto b = RemotePointer::make_remote_pointer(3, 0x200000000UL);
+    agent->add_region(0, a);
+
+    byte_ptr_t small, large, again;
+    agent->allocate(0, 24, small);
+    agent->allocate(0, 100, large);
+    if (small != a.raw_ptr() || large != a.raw_ptr() + Constants::uREMOTE_BLOCK_SIZE ||
+        RemotePointer(small).get_node() != 2) {
+        std::cout << "Each size class should carve its own block\n";
+        return -1;
+    }
+
+    RemotePointer freed(small);
+    agent->free(0, freed);
+    agent->allocate(0, 20, again);
+    if (again != small) {
+        std::cout << "A freed object should be reused by its size class\n";
+        return -1;
+    }
+
+    // a drained region that is not the current one goes back to its owner
+    agent->add_region(0, b);
+    byte_ptr_t on_b;
+    agent->allocate(0, 4096, on_b);
+    RemotePointer r_again(again), r_large(large);
+    agent->free(0, r_again);
+    agent->free(0, r_large);
+    auto released = agent->take_released();
+    if (released.size() != 1 || released[0].raw_ptr() != a.raw_ptr() || !agent->take_released().empty()) {
+        std::cout << "The emptied region should be released exactly once\n";
+        return -1;
+    }
+
+    size_t blocks = 0;
+    for (byte_ptr_t p = on_b; p != nullptr; ++blocks) {
+        agent->allocate(0, Constants::uREMOTE_BLOCK_SIZE, p);
+    }
+    if (blocks != Constants::uREMOTE_BLOCKS) {
+        std::cout << "Region should hold " << Constants::uREMOTE_BLOCKS - 1 << " more blocks, got "
+                  << blocks - 1 << "\n";
+        return -1;
+    }
+
+    // a pair of loopback contexts stands in for a NIC, one is the local end, the other exposes "remote" PM
+    constexpr auto tLATENCY = std::chrono::microseconds(50);
+    auto [device, status] = RDMADevice::make_rdma(RDMADevice::sLOOPBACK_DEVICE, 1, -1);
+    if (status != Status::Ok) {
+        std::cout << "Loopback device should always be available\n";
+        return -1;
+    }
+    device->set_injected_latency(tLATENCY);
+
+    constexpr size_t uBUF = 4096;
+    auto local_buf = std::make_unique<byte_t[]>(uBUF);
+    auto remote_buf = std::make_unique<byte_t[]>(Constants::uREMOTE_REGION_SIZE / 64);
+    auto [local, ls] = device->open(local_buf.get(), uBUF, 16, RDMADevice::get_default_mr_access(),
+                                    *RDMADevice::get_default_qp_init_attr());
+    auto [peer, ps] = device->open(remote_buf.get(), Constants::uREMOTE_REGION_SIZE / 64, 16,
+                                   RDMADevice::get_default_mr_access(), *RDMADevice::get_default_qp_init_attr());
+    int fds[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    std::thread accepting([&, &peer = peer]() { peer->default_connect(fds[1]); });
+    auto connected = local->default_connect(fds[0]) == 0;
+    accepting.join();
+    if (!connected) {
+        std::cout << "Loopback contexts should connect\n";
+        return -1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    local->post_write(remote_buf.get() + 8, reinterpret_cast<const uint8_t *>("hello"), 5);
+    local->poll_completion_once();
+    if (std::chrono::steady_clock::now() - start < tLATENCY || memcmp(remote_buf.get() + 8, "hello", 5) != 0) {
+        std::cout << "A loopback write should land and complete after the injected latency\n";
+        return -1;
+    }
+
+    // one doorbell, the second read scatters a remote range into two pieces
+    WorkRequest batch[2] = {
+        WorkRequest::make_request(IBV_WR_RDMA_WRITE, local_buf.get(), remote_buf.get() + 32, 4),
+        WorkRequest::make_request(IBV_WR_RDMA_READ, local_buf.get() + 100, remote_buf.get() + 8, 2),
+    };
+    memcpy(local_buf.get(), "abcd", 4);
+    batch[1].add_piece(local_buf.get() + 200, 3);
+    ibv_wc wcs[2];
+    local->post_batch(batch, 2);
+    if (local->poll_multiple_completions(wcs, 2) != 1 || memcmp(remote_buf.get() + 32, "abcd", 4) != 0 ||
+        memcmp(local_buf.get() + 100, "he", 2) != 0 || memcmp(local_buf.get() + 200, "llo", 3) != 0) {
+        std::cout << "A batch should complete once with every request done\n";
+        return -1;
+    }
+
+    peer->post_recv_to(16, 64);
+    local->post_send(reinterpret_cast<const uint8_t *>("ping"), 4);
+    local->poll_completion_once();
+    peer->poll_completion_once(false);
+    if (memcmp(peer->get_char_buf() + 64, "ping", 4) != 0) {
+        std::cout << "A loopback send should reach the posted receive\n";
+        return -1;
+    }
+
+    // the writer chains queued writes and publishes each of them in order once the chain completes
+    auto writer = RemoteWriter::make_writer();
+    std::vector<size_t> published;
+    constexpr size_t uWRITES = Constants::uREMOTE_WRITE_BATCH * 3 + 5;
+    for (size_t i = 0; i < uWRITES; i++) {
+        auto staged = writer->stage(local.get(), 1, 256);
+        if (staged == nullptr) {
+            writer->drain();
+            staged = writer->stage(local.get(), 1, 256);
+        }
+        memset(staged, int(i), 256);
+        writer->submit(1, staged, 256, remote_buf.get() + i * 256, [&, i](bool ok) {
+            if (ok) {
+                published.push_back(i);
+            }
+        });
+        writer->poll();
+    }
+    writer->drain();
+    if (published.size() != uWRITES || writer->pending() != 0) {
+        std::cout << "Every write should be published, got " << published.size() << "\n";
+        return -1;
+    }
+    for (size_t i = 0; i < uWRITES; i++) {
+        if (published[i] != i || remote_buf[i * 256] != byte_t(i) || remote_buf[i * 256 + 255] != byte_t(i)) {
+            std::cout << "Write " << i << " is published out of order or corrupted\n";
+            return -1;
+        }
+    }
+
+    // contexts of one CQ group report to one queue, and they outlive the device they are opened on
+    {
+        constexpr int iGROUPED = 4;
+        auto [grouping, gs] = RDMADevice::make_rdma(RDMADevice::sLOOPBACK_DEVICE, 1, -1);
+        auto grouped_buf = std::make_unique<byte_t[]>(uBUF * iGROUPED);
+        std::unique_ptr<RDMAContext> ends[iGROUPED], lenders[iGROUPED];
+        for (int i = 0; i < iGROUPED; i++) {
+            ends[i] = grouping->open(grouped_buf.get() + i * uBUF, uBUF, 16, RDMADevice::get_default_mr_access(),
+                                     *RDMADevice::get_default_qp_init_attr(), 0).first;
+            lenders[i] = grouping->open(remote_buf.get(), Constants::uREMOTE_REGION_SIZE / 64, 16,
+                                        RDMADevice::get_default_mr_access(), *RDMADevice::get_default_qp_init_attr()).first;
+        }
+        grouping.reset();
+
+        for (int i = 0; i < iGROUPED; i++) {
+            int pair[2];
+            socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+            std::thread lending([&, i]() { lenders[i]->default_connect(pair[1]); });
+            auto ok = ends[i]->default_connect(pair[0]) == 0;
+            lending.join();
+            if (!ok) {
+                std::cout << "Contexts should connect after their device is gone\n";
+                return -1;
+            }
+            auto msg = "end " + std::to_string(i);
+            ends[i]->post_write(remote_buf.get() + 8192 + i * 16, reinterpret_cast<const uint8_t *>(msg.c_str()),
+                                msg.size());
+        }
+
+        ibv_wc grouped[iGROUPED];
+        int got = 0;
+        for (int spins = 0; got < iGROUPED && spins < 1000000; spins++) {
+            auto n = ends[0]->poll_completions(grouped + got, iGROUPED - got);
+            got += n > 0 ? n : 0;
+        }
+        if (got != iGROUPED || ends[1]->poll_completions(grouped, iGROUPED) != 0) {
+            std::cout << "Completions of a CQ group should all be polled through one context, got " << got << "\n";
+            return -1;
+        }
+        for (int i = 0; i < iGROUPED; i++) {
+            auto msg = "end " + std::to_string(i);
+            if (grouped[i].qp_num != ends[i]->local.qp_num || grouped[i].status != IBV_WC_SUCCESS ||
+                memcmp(remote_buf.get() + 8192 + i * 16, msg.c_str(), msg.size()) != 0) {
+                std::cout << "Write of grouped context " << i << " is reported wrongly\n";
+                return -1;
+            }
+        }
+    }
+
     std::cout << "Tests passed\n";
 }
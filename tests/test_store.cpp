@@ -45,6 +45,11 @@ auto run_server(const std::string &config, int threads) -> void {
         return;
     }
 
+    if (!server->launch_one_replication_thread()) {
+        std::cout << "Can't launch replication thread\n";
+        return;
+    }
+
     for (auto &t : handler_threads) {
         if (t.joinable()) {
             t.join();
@@ -55,8 +60,41 @@ auto run_server(const std::string &config, int threads) -> void {
     }
 }
 
-auto run_ycsb_workload(const std::string &config, int threads, const std::string &ycsb_type) -> void {
+auto report_shared_cache(const StoreClient &client) -> void {
+    auto cache = client.get_shared_cache();
+    if (cache == nullptr) {
+        return;
+    }
+
+    ReadCache::ShardStats total{0, 0, 0};
+    uint64_t hottest = 0;
+    for (const auto &s : cache->shard_stats()) {
+        total.hits += s.hits;
+        total.misses += s.misses;
+        total.evictions += s.evictions;
+        hottest = std::max(hottest, s.hits + s.misses);
+    }
+    std::cout << ">> Shared cache: hit ratio " << cache->hit_ratio() << ", " << total.hits << " hits, "
+              << total.misses << " misses, " << total.evictions << " evictions, hottest shard takes "
+              << double(hottest) / (total.hits + total.misses) << " of the lookups\n";
+}
+
+auto run_ycsb_workload(const std::string &config, int threads, const std::string &ycsb_type, bool one_sided,
+                       bool shared_cache, bool negative_cache, bool backup_reads) -> void {
     auto client = StoreClient::make_client(config);
+    if (one_sided) {
+        client->enable_one_sided_search();
+    }
+    if (shared_cache) {
+        // the budget of the private caches of all threads
+        client->enable_shared_cache(ReadCache::Constants::uCACHE_SIZE * threads);
+    }
+    if (negative_cache) {
+        client->enable_negative_cache();
+    }
+    if (backup_reads) {
+        client->enable_backup_reads();
+    }
     client->launch();
 
     std::vector<std::thread> clients;
@@ -117,10 +155,25 @@ auto run_ycsb_workload(const std::string &config, int threads, const std::string
                   << "\n";
         std::cout << "---->> cache hit ratio " << stats[i].cache_hit_ratio << "\n";
     }
+    report_shared_cache(*client);
 }
 
-auto run_simple_workload(const std::string &config, int threads, int batch) -> void {
+auto run_simple_workload(const std::string &config, int threads, int batch, bool one_sided, bool shared_cache,
+                         bool negative_cache, bool backup_reads) -> void
+{
     auto client = StoreClient::make_client(config);
+    if (one_sided) {
+        client->enable_one_sided_search();
+    }
+    if (shared_cache) {
+        client->enable_shared_cache(ReadCache::Constants::uCACHE_SIZE * threads);
+    }
+    if (negative_cache) {
+        client->enable_negative_cache();
+    }
+    if (backup_reads) {
+        client->enable_backup_reads();
+    }
     client->launch();
 
     std::vector<std::thread> clients;
@@ -179,15 +232,20 @@ auto run_simple_workload(const std::string &config, int threads, int batch) -> v
                   << "\n";
         std::cout << "---->> cache hit ratio " << stats[i].cache_hit_ratio << "\n";
     }
+    report_shared_cache(*client);
 }
 
 auto run_client(const std::string &config, int threads, CmdParser::Parser &parser) -> void {
     auto ycsb = parser.get_as<std::string>("--ycsb");
+    auto one_sided = parser.get_as<bool>("--one_sided").value();
+    auto shared_cache = parser.get_as<bool>("--shared_cache").value();
+    auto negative_cache = parser.get_as<bool>("--negative_cache").value();
+    auto backup_reads = parser.get_as<bool>("--backup_reads").value();
     if (ycsb.has_value()) {
-        run_ycsb_workload(config, threads, ycsb.value());
+        run_ycsb_workload(config, threads, ycsb.value(), one_sided, shared_cache, negative_cache, backup_reads);
     } else {
         auto batch = parser.get_as<int>("--size").value();
-        run_simple_workload(config, threads, batch);
+        run_simple_workload(config, threads, batch, one_sided, shared_cache, negative_cache, backup_reads);
     }
 }
 
@@ -199,6 +257,10 @@ auto main(int argc, char *argv[]) -> int {
     parser.add_option<int>("--size", "-s", 100000);
     parser.add_option<int>("--multithread", "-m", 1);
     parser.add_option("--ycsb", "-y");
+    parser.add_switch("--one_sided", "-o", false);
+    parser.add_switch("--shared_cache", "-S", false);
+    parser.add_switch("--negative_cache", "-N", false);
+    parser.add_switch("--backup_reads", "-B", false);
 
     if (argc < 2) {
         return -1;
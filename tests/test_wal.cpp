@@ -1,7 +1,9 @@
 #include "wal/wal.hpp"
 #include "memory_manager/memory_manager.hpp"
+#include "remote_memory/remote_memory.hpp"
 
 #include <iostream>
+#include <chrono>
 
 using namespace Hill;
 using namespace Hill::WAL;
@@ -10,7 +12,7 @@ using namespace Hill::Memory;
 
 // 2020.8.19: More test to go
 int main() {
-    byte_ptr_t region = new byte_t[1024 * 1024 * 64];
+    byte_ptr_t region = new byte_t[LogRegions::size_of(WAL::Constants::uREGION_CAPACITY)];
 
     byte_ptr_t memory = new byte_t[1024 * 1024 * 128];
     auto logger = Logger::make_unique_logger(region);
@@ -31,7 +33,154 @@ int main() {
     for (size_t i = 0; i < Hill::WAL::Constants::uBATCH_SIZE; i++) {
         auto &addr = logger->make_log(log_id, WAL::Enums::Ops::Insert);
         alloc->allocate(mem_id , 16, addr);
+        logger->seal(log_id);
         *((size_t *)addr) = i;
         std::cout << ">> reading " << *((size_t *)addr) << "\n";
     }
+
+    /*
+     * Group commit throughput, each operation logs one allocation, seals and commits. With PM, an operation
+     * pays a single fence in seal and a batch two more in checkpoint, the fences are counted to make sure.
+     */
+    constexpr size_t uOPS = 1000000;
+    static size_t fences;
+    Util::crash_point = []() { ++fences; };
+    for (auto batch : {1UL, 8UL, 64UL, 512UL}) {
+        logger->set_group_commit(batch, WAL::Constants::tGROUP_COMMIT_TIMEOUT);
+        fences = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < uOPS; i++) {
+            auto &a = logger->make_log(log_id, WAL::Enums::Ops::Insert);
+            a = memory + (i % 1024) * 16;
+            logger->seal(log_id);
+            logger->commit(log_id);
+        }
+        logger->checkpoint(log_id);
+        auto end = std::chrono::steady_clock::now();
+        double period = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+        std::cout << ">> batch " << batch << ": " << uOPS / period << " Mops/s, "
+                  << double(fences) / uOPS << " fences/op\n";
+#ifdef __HILL_PMEM__
+        if (fences > uOPS + 2 * (uOPS / batch + 1)) {
+            std::cout << "An operation should pay a single fence, a batch two more\n";
+            return -1;
+        }
+#endif
+
+        if (logger->regions->get_region(log_id).head != logger->cursors[log_id].tail) {
+            std::cout << "Checkpoint should commit every entry\n";
+            return -1;
+        }
+    }
+    Util::crash_point = nullptr;
+
+    // a partially filled batch is closed by tick after the timeout
+    logger->set_group_commit(WAL::Constants::uREGION_CAPACITY, WAL::Constants::tGROUP_COMMIT_TIMEOUT);
+    auto &addr = logger->make_log(log_id, WAL::Enums::Ops::Insert);
+    addr = memory;
+    logger->commit(log_id);
+    auto &r = logger->regions->get_region(log_id);
+    auto &entry = r.entry_of(logger->cursors[log_id].tail - 1);
+    logger->tick(log_id);
+    if (r.head == logger->cursors[log_id].tail) {
+        std::cout << "Batch should not be closed before timeout\n";
+        return -1;
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + WAL::Constants::tGROUP_COMMIT_TIMEOUT;
+    while (std::chrono::steady_clock::now() < deadline);
+    logger->tick(log_id);
+    if (r.head != logger->cursors[log_id].tail || entry.get_address() != memory ||
+        entry.get_op() != WAL::Enums::Ops::Insert) {
+        std::cout << "Batch should be closed after timeout\n";
+        return -1;
+    }
+
+    // a small ring wraps around many times and a batch larger than the ring is closed early
+    constexpr size_t uSMALL_CAPACITY = 64;
+    byte_ptr_t small_region = new byte_t[LogRegions::size_of(uSMALL_CAPACITY)];
+    auto small = Logger::make_unique_logger(small_region, uSMALL_CAPACITY);
+    small->set_group_commit(uSMALL_CAPACITY * 4, WAL::Constants::tGROUP_COMMIT_TIMEOUT);
+    for (size_t i = 0; i < uSMALL_CAPACITY * 10 + 3; i++) {
+        auto &a = small->make_log(0, WAL::Enums::Ops::Update);
+        a = memory + i;
+        small->commit(0);
+        if (small->cursors[0].tail - small->regions->get_region(0).head > uSMALL_CAPACITY) {
+            std::cout << "Ring should never overflow\n";
+            return -1;
+        }
+    }
+
+    // a stale entry of the lap before, or a zeroed one, is never taken for one of this lap
+    for (size_t seq = 0; seq < uSMALL_CAPACITY * 40; seq += uSMALL_CAPACITY) {
+        auto lap = LogRegion::lap_of(seq, uSMALL_CAPACITY);
+        if (lap == 0 || (seq != 0 && lap == LogRegion::lap_of(seq - 1, uSMALL_CAPACITY))) {
+            std::cout << "Lap " << lap << " of entry " << seq << " is ambiguous\n";
+            return -1;
+        }
+    }
+
+    // an entry is in the ring as soon as it is made, its address once it is sealed
+    for (size_t i = 0; i < 3; i++) {
+        auto &a = small->make_log(0, WAL::Enums::Ops::Insert);
+        auto &made = small->regions->get_region(0).entry_of(small->cursors[0].tail - 1);
+        if (!made.is_valid() || made.get_op() != WAL::Enums::Ops::Insert || made.get_address() != nullptr) {
+            std::cout << "An entry should be written when it is made\n";
+            return -1;
+        }
+        alloc->allocate(mem_id, 16, a);
+        small->seal(0);
+        if (made.get_address() != a) {
+            std::cout << "A sealed entry should hold its address\n";
+            return -1;
+        }
+    }
+
+    // uncommitted entries, including remote pointers, survive in the ring until recovery
+    auto remote_copy = RemotePointer::make_remote_pointer(5, memory).raw_ptr();
+    small->make_log(0, WAL::Enums::Ops::RemoteMemory, remote_copy);
+    auto &r_entry = small->regions->get_region(0).entry_of(small->cursors[0].tail - 1);
+    if (r_entry.get_address() != remote_copy || r_entry.get_op() != WAL::Enums::Ops::RemoteMemory) {
+        std::cout << "Remote pointer should be packed losslessly\n";
+        return -1;
+    }
+    // drop the remote entry, recovery of remote memory is done by its owner
+    r_entry.set_address(nullptr);
+
+    size_t replayed = 0;
+    auto recovered = Logger::recover_unique_logger(small_region, [&](LogEntry &e) {
+        if (e.get_op() == WAL::Enums::Ops::Insert) {
+            ++replayed;
+        }
+        return true;
+    }, uSMALL_CAPACITY);
+    if (replayed != 3) {
+        std::cout << "Recovery should replay 3 uncommitted entries, but replayed " << replayed << "\n";
+        return -1;
+    }
+
+    // parallel recovery replays every region and reports what it did
+    auto parallel = Logger::make_unique_logger(small_region, uSMALL_CAPACITY);
+    for (int id = 0; id < WAL::Constants::iREGION_NUM; id++) {
+        for (int i = 0; i < id % 4; i++) {
+            auto &a = parallel->make_log(id, WAL::Enums::Ops::Insert);
+            alloc->allocate(mem_id, 16, a);
+            parallel->seal(id);
+        }
+    }
+
+    std::atomic_size_t parallel_replayed(0);
+    auto recovered_parallel = Logger::recover_unique_logger(small_region, [&](LogEntry &) {
+        ++parallel_replayed;
+        return true;
+    }, uSMALL_CAPACITY, 4, {alloc});
+    auto &stats = recovered_parallel->get_recovery_stats();
+    auto expected = (0 + 1 + 2 + 3) * WAL::Constants::iREGION_NUM / 4;
+    if (stats.entries != size_t(expected) || parallel_replayed != size_t(expected) || stats.threads != 4) {
+        std::cout << "Parallel recovery should replay " << expected << " entries, but replayed "
+                  << stats.entries << "\n";
+        return -1;
+    }
+
+    std::cout << "Tests passed\n";
 }
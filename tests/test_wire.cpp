@@ -0,0 +1,202 @@
+#include "store/wire_format/wire_format.hpp"
+
+#include <iostream>
+#include <chrono>
+#include <memory>
+#include <algorithm>
+
+using namespace Hill;
+using namespace Hill::Store::Wire;
+
+// mirrors the client requests of StoreServer
+using WriteRequest = Layout<uint64_t, String, String>;
+using RangeRequest = Layout<uint64_t, String, uint64_t>;
+
+constexpr uint8_t uINSERT = 0;
+constexpr int iROUNDS = 5;
+constexpr int iPARSES = 2000000;
+constexpr int iTRIES = 3;
+
+// the parse every handler did before messages were framed, out of line like view_parse so both pay a call
+__attribute__((noinline)) static auto legacy_parse(byte_t *buf, uint64_t &since, KVPair::HillString *&key, KVPair::HillString *&value) -> uint8_t {
+    auto op = *reinterpret_cast<uint8_t *>(buf);
+    buf += sizeof(uint8_t);
+    since = *reinterpret_cast<uint64_t *>(buf);
+    buf += sizeof(uint64_t);
+    key = reinterpret_cast<KVPair::HillString *>(buf);
+    buf += key->object_size();
+    value = reinterpret_cast<KVPair::HillString *>(buf);
+    return op;
+}
+
+__attribute__((noinline)) static auto view_parse(byte_t *buf, size_t size, uint64_t &since, KVPair::HillString *&key,
+                       KVPair::HillString *&value) -> uint8_t
+{
+    Reader reader(buf, size);
+    MessageHeader header;
+    if (!reader.open(header) || !WriteRequest::decode(reader, since, key, value) || !reader.finished()) {
+        return 0xff;
+    }
+    return header.op;
+}
+
+// a handler parses a freshly received buffer, nothing is kept in registers across parses
+static inline auto clobber() -> void {
+    asm volatile("" : : : "memory");
+}
+
+template<typename F>
+static auto best_of(F &&f) -> double {
+    auto best = 1e18;
+    for (int r = 0; r < iROUNDS; r++) {
+        auto start = std::chrono::steady_clock::now();
+        f();
+        auto end = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double, std::nano>(end - start).count() / iPARSES);
+    }
+    return best;
+}
+
+int main() {
+    auto buf = std::make_unique<byte_t[]>(1024);
+    Writer writer(buf.get(), 512);
+
+    writer.begin(uINSERT, 42);
+    WriteRequest::encode(writer, 7, "user1000", "value of user1000");
+    auto size = writer.finish();
+    if (size != sizeof(MessageHeader) + WriteRequest::size_of(7, "user1000", "value of user1000")) {
+        std::cout << "Message of " << size << " bytes is of a wrong size\n";
+        return -1;
+    }
+
+    {
+        uint64_t since = 0;
+        KVPair::HillString *key = nullptr, *value = nullptr;
+        Reader reader(buf.get(), size);
+        MessageHeader header;
+        if (!reader.open(header) || header.op != uINSERT || header.request_id != 42 ||
+            !WriteRequest::decode(reader, since, key, value) || !reader.finished()) {
+            std::cout << "A well formed message is refused\n";
+            return -1;
+        }
+        if (since != 7 || key->to_string() != "user1000" || value->to_string() != "value of user1000" ||
+            reinterpret_cast<byte_t *>(key) < buf.get() || reinterpret_cast<byte_t *>(value) >= buf.get() + size) {
+            std::cout << "Fields are not decoded in place\n";
+            return -1;
+        }
+    }
+
+    // every cut of a message is refused, none is read past
+    for (size_t cut = 0; cut < size; cut++) {
+        uint64_t since;
+        KVPair::HillString *key, *value;
+        if (view_parse(buf.get(), cut, since, key, value) != 0xff) {
+            std::cout << "A message cut to " << cut << " bytes is taken\n";
+            return -1;
+        }
+    }
+
+    // a string running past the message, another version, and a length not matching the buffer
+    {
+        auto header = reinterpret_cast<MessageHeader *>(buf.get());
+        auto key = reinterpret_cast<KVPair::HillString *>(buf.get() + sizeof(MessageHeader) + sizeof(uint64_t));
+        auto length = key->header.length;
+        key->header.length = 1000;
+        uint64_t since;
+        KVPair::HillString *k, *v;
+        if (view_parse(buf.get(), size, since, k, v) != 0xff) {
+            std::cout << "An oversized string is taken\n";
+            return -1;
+        }
+        key->header.length = length;
+
+        header->version = Constants::uVERSION + 1;
+        if (view_parse(buf.get(), size, since, k, v) != 0xff) {
+            std::cout << "A message of another version is taken\n";
+            return -1;
+        }
+        header->version = Constants::uVERSION;
+
+        header->length += 1;
+        if (view_parse(buf.get(), size + 1, since, k, v) != 0xff) {
+            std::cout << "A message with trailing bytes is taken\n";
+            return -1;
+        }
+        header->length -= 1;
+        if (view_parse(buf.get(), size + 1, since, k, v) != 0xff) {
+            std::cout << "A message shorter than its buffer is taken\n";
+            return -1;
+        }
+    }
+
+    // a request that does not fit is refused by the sender
+    {
+        Writer small(buf.get(), 32);
+        small.begin(uINSERT, 1);
+        if (small.put<uint64_t, String>(0, "a key longer than what is left") || small.finish() != 0) {
+            std::cout << "An overflowing message is finished\n";
+            return -1;
+        }
+        Writer large(buf.get(), 1024);
+        large.begin(uINSERT, 1);
+        if (large.put<String>(std::string(Constants::uMAX_STRING_SIZE + 1, 'x').c_str()) || large.finish() != 0) {
+            std::cout << "A string too long for a HillString is encoded\n";
+            return -1;
+        }
+
+        large.begin(uINSERT + 3, 9);
+        RangeRequest::encode(large, 1, "user1", 100);
+        auto range_size = large.finish();
+        uint64_t since = 0, num = 0;
+        KVPair::HillString *key = nullptr;
+        Reader reader(buf.get(), range_size);
+        MessageHeader header;
+        if (!reader.open(header) || !RangeRequest::decode(reader, since, key, num) || !reader.finished() ||
+            num != 100 || key->to_string() != "user1") {
+            std::cout << "A range request is not decoded\n";
+            return -1;
+        }
+    }
+
+    /*
+     * Past the fixed part checked once, the view parse adds a compare per string and the header checks to the
+     * loads of the casts. Timings are noisy, so the best ratio of a few tries must be within 1.5x and 1 ns
+     */
+    writer.begin(uINSERT, 42);
+    WriteRequest::encode(writer, 7, "user1000", "value of user1000");
+    size = writer.finish();
+    auto legacy = std::make_unique<byte_t[]>(1024);
+    legacy[0] = uINSERT;
+    memcpy(legacy.get() + 1, buf.get() + sizeof(MessageHeader), size - sizeof(MessageHeader));
+
+    volatile uint64_t sink = 0;
+    auto fast_enough = false;
+    for (int t = 0; t < iTRIES && !fast_enough; t++) {
+        auto legacy_ns = best_of([&]() {
+            for (int i = 0; i < iPARSES; i++) {
+                uint64_t since;
+                KVPair::HillString *key, *value;
+                auto op = legacy_parse(legacy.get(), since, key, value);
+                sink = sink + op + since + key->size() + value->size();
+                clobber();
+            }
+        });
+        auto view_ns = best_of([&]() {
+            for (int i = 0; i < iPARSES; i++) {
+                uint64_t since;
+                KVPair::HillString *key, *value;
+                auto op = view_parse(buf.get(), size, since, key, value);
+                sink = sink + op + since + key->size() + value->size();
+                clobber();
+            }
+        });
+        std::cout << "Legacy parse: " << legacy_ns << " ns/op, validated view parse: " << view_ns << " ns/op\n";
+        fast_enough = view_ns <= legacy_ns * 1.5 + 1;
+    }
+    if (!fast_enough) {
+        std::cout << "Validated parse is too slow\n";
+        return -1;
+    }
+
+    std::cout << "Tests passed\n";
+}